@@ -1,6 +1,7 @@
 #ifndef FPARSER_COMMON_H
 #define	FPARSER_COMMON_H
 
+#include <algorithm>
 #include <cstdlib>
 #include <memory>
 #include <string>
@@ -72,4 +73,26 @@ class Timer {
 
 static constexpr uint64_t kMillion = 1000000;
 
+// The memory the heap really takes for a block of the given size. glibc's
+// malloc puts an 8 byte header before each block, rounds up to 16 bytes and
+// never hands out less than 32.
+inline size_t HeapBlockSize(size_t size) {
+  return std::max<size_t>(32, (size + 8 + 15) & ~size_t(15));
+}
+
+// Mixes the bits of a value so that each bit of the result depends on all bits
+// of the value. The finalizer of SplitMix64.
+inline uint64_t Mix64(uint64_t value) {
+  value += 0x9e3779b97f4a7c15ULL;
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+  return value ^ (value >> 31);
+}
+
+// Microseconds since the epoch, like the timestamps of live packets.
+inline uint64_t WallTimeMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
 #endif	/* FPARSER_COMMON_H */
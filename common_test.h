@@ -32,7 +32,7 @@ class TCPPktGen {
   }
 
   pcap::SniffIp GenerateIpHeader(uint32_t src_ip, uint32_t dst_ip) {
-    pcap::SniffIp ip_header;
+    pcap::SniffIp ip_header = pcap::SniffIp();
 
     ip_header.ip_src.s_addr = htonl(src_ip);
     ip_header.ip_dst.s_addr = htonl(dst_ip);
@@ -58,7 +58,7 @@ class TCPPktGen {
   }
 
   pcap::SniffTcp GenerateTCPHeader(uint16_t sport, uint16_t dport) {
-    pcap::SniffTcp tcp_header;
+    pcap::SniffTcp tcp_header = pcap::SniffTcp();
 
     tcp_header.th_sport = htons(sport);
     tcp_header.th_dport = htons(dport);
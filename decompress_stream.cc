@@ -0,0 +1,466 @@
+#include "decompress_stream.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+namespace flowparser {
+
+// Magic numbers at the start of each format.
+static const uint8_t kGzipMagic[] = { 0x1f, 0x8b };
+static const uint8_t kZstdMagic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+static const uint8_t kLz4Magic[] = { 0x04, 0x22, 0x4d, 0x18 };
+
+// Enough bytes to tell all formats apart.
+static constexpr size_t kMaxMagicSize = 4;
+
+template<size_t N>
+static bool StartsWith(const uint8_t* data, size_t size,
+                       const uint8_t (&magic)[N]) {
+  return size >= N && memcmp(data, magic, N) == 0;
+}
+
+Compression DetectCompression(const uint8_t* data, size_t size) {
+  if (StartsWith(data, size, kGzipMagic)) {
+    return COMPRESSION_GZIP;
+  }
+
+  if (StartsWith(data, size, kZstdMagic)) {
+    return COMPRESSION_ZSTD;
+  }
+
+  if (StartsWith(data, size, kLz4Magic)) {
+    return COMPRESSION_LZ4;
+  }
+
+  return COMPRESSION_NONE;
+}
+
+Compression DetectFileCompression(const std::string& filename) {
+  std::ifstream in(filename, std::ios::binary);
+  char magic[kMaxMagicSize];
+  in.read(magic, kMaxMagicSize);
+
+  return DetectCompression(reinterpret_cast<const uint8_t*>(magic),
+                           in.gcount());
+}
+
+#ifdef HAVE_LIBZ
+// Decompresses gzip files, including ones with more than one member.
+class GzipDecompressor : public Decompressor {
+ public:
+  GzipDecompressor()
+      : in_member_(false) {
+    memset(&stream_, 0, sizeof(stream_));
+
+    // 16 tells zlib to expect a gzip header.
+    if (inflateInit2(&stream_, 16 + MAX_WBITS) != Z_OK) {
+      throw std::runtime_error("Could not initialize zlib");
+    }
+  }
+
+  ~GzipDecompressor() {
+    inflateEnd(&stream_);
+  }
+
+  size_t Decompress(const uint8_t** in, const uint8_t* in_end, uint8_t* out,
+                    size_t out_len) override {
+    size_t out_avail = std::min<size_t>(out_len, UINT_MAX);
+
+    while (true) {
+      if (!in_member_) {
+        if (*in == in_end) {
+          return 0;
+        }
+
+        inflateReset(&stream_);
+        in_member_ = true;
+      }
+
+      stream_.next_in = const_cast<Bytef*>(*in);
+      stream_.avail_in = std::min<size_t>(in_end - *in, UINT_MAX);
+      stream_.next_out = out;
+      stream_.avail_out = out_avail;
+
+      int ret = inflate(&stream_, Z_NO_FLUSH);
+      *in = stream_.next_in;
+      size_t produced = out_avail - stream_.avail_out;
+
+      if (ret == Z_STREAM_END) {
+        in_member_ = false;
+      } else if (ret == Z_BUF_ERROR) {
+        // No progress is possible -- all input was offered and there is room
+        // for output, so the input must have ended early.
+        if (produced == 0) {
+          throw std::runtime_error("Truncated gzip stream");
+        }
+      } else if (ret != Z_OK) {
+        throw std::runtime_error(
+            "Bad gzip stream: "
+                + std::string(stream_.msg ? stream_.msg : "unknown error"));
+      }
+
+      if (produced > 0) {
+        return produced;
+      }
+    }
+  }
+
+ private:
+  z_stream stream_;
+
+  // True if a member has been started, but not finished.
+  bool in_member_;
+};
+#endif
+
+#ifdef HAVE_LIBZSTD
+class ZstdDecompressor : public Decompressor {
+ public:
+  ZstdDecompressor()
+      : stream_(ZSTD_createDStream()),
+        in_frame_(false) {
+    if (stream_ == nullptr || ZSTD_isError(ZSTD_initDStream(stream_))) {
+      ZSTD_freeDStream(stream_);
+      throw std::runtime_error("Could not initialize zstd");
+    }
+  }
+
+  ~ZstdDecompressor() {
+    ZSTD_freeDStream(stream_);
+  }
+
+  size_t Decompress(const uint8_t** in, const uint8_t* in_end, uint8_t* out,
+                    size_t out_len) override {
+    while (true) {
+      if (*in == in_end && !in_frame_) {
+        return 0;
+      }
+
+      ZSTD_inBuffer in_buffer = { *in, static_cast<size_t>(in_end - *in), 0 };
+      ZSTD_outBuffer out_buffer = { out, out_len, 0 };
+      size_t ret = ZSTD_decompressStream(stream_, &out_buffer, &in_buffer);
+      if (ZSTD_isError(ret)) {
+        throw std::runtime_error(
+            "Bad zstd stream: " + std::string(ZSTD_getErrorName(ret)));
+      }
+
+      *in += in_buffer.pos;
+
+      // 0 means that a frame was completely decoded and flushed.
+      in_frame_ = ret != 0;
+      if (out_buffer.pos > 0) {
+        return out_buffer.pos;
+      }
+
+      if (in_buffer.pos == 0 && *in == in_end && in_frame_) {
+        throw std::runtime_error("Truncated zstd stream");
+      }
+    }
+  }
+
+ private:
+  ZSTD_DStream* stream_;
+
+  // True if a frame has been started, but not finished.
+  bool in_frame_;
+};
+#endif
+
+#ifdef HAVE_LIBLZ4
+class Lz4Decompressor : public Decompressor {
+ public:
+  Lz4Decompressor()
+      : context_(nullptr),
+        in_frame_(false) {
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&context_,
+                                                     LZ4F_VERSION))) {
+      throw std::runtime_error("Could not initialize lz4");
+    }
+  }
+
+  ~Lz4Decompressor() {
+    LZ4F_freeDecompressionContext(context_);
+  }
+
+  size_t Decompress(const uint8_t** in, const uint8_t* in_end, uint8_t* out,
+                    size_t out_len) override {
+    while (true) {
+      if (*in == in_end && !in_frame_) {
+        return 0;
+      }
+
+      size_t in_len = in_end - *in;
+      size_t produced = out_len;
+      size_t ret = LZ4F_decompress(context_, out, &produced, *in, &in_len,
+                                   nullptr);
+      if (LZ4F_isError(ret)) {
+        throw std::runtime_error(
+            "Bad lz4 stream: " + std::string(LZ4F_getErrorName(ret)));
+      }
+
+      *in += in_len;
+
+      // 0 means that a frame was completely decoded and flushed.
+      in_frame_ = ret != 0;
+      if (produced > 0) {
+        return produced;
+      }
+
+      if (in_len == 0 && *in == in_end && in_frame_) {
+        throw std::runtime_error("Truncated lz4 stream");
+      }
+    }
+  }
+
+ private:
+  LZ4F_decompressionContext_t context_;
+
+  // True if a frame has been started, but not finished.
+  bool in_frame_;
+};
+#endif
+
+std::unique_ptr<Decompressor> NewDecompressor(Compression compression) {
+  switch (compression) {
+    case COMPRESSION_GZIP:
+#ifdef HAVE_LIBZ
+      return std::make_unique<GzipDecompressor>();
+#else
+      throw std::logic_error("Not compiled with gzip support");
+#endif
+    case COMPRESSION_ZSTD:
+#ifdef HAVE_LIBZSTD
+      return std::make_unique<ZstdDecompressor>();
+#else
+      throw std::logic_error("Not compiled with zstd support");
+#endif
+    case COMPRESSION_LZ4:
+#ifdef HAVE_LIBLZ4
+      return std::make_unique<Lz4Decompressor>();
+#else
+      throw std::logic_error("Not compiled with lz4 support");
+#endif
+    default:
+      throw std::logic_error("Not a compressed format");
+  }
+}
+
+DecompressingInputStream::DecompressingInputStream(
+    std::unique_ptr<Decompressor> decompressor, const uint8_t* begin,
+    const uint8_t* end, size_t buffer_size, size_t num_buffers)
+    : decompressor_(std::move(decompressor)),
+      in_(begin),
+      in_end_(end),
+      buffer_size_(buffer_size),
+      buffers_(num_buffers, std::vector<uint8_t>(buffer_size)),
+      buffer_lens_(num_buffers, 0),
+      ready_(0),
+      done_(false),
+      stop_(false),
+      current_(0),
+      position_(0),
+      current_ready_(false),
+      scratch_position_(0) {
+  if (buffer_size == 0 || num_buffers == 0) {
+    throw std::logic_error("Need at least one non-empty buffer");
+  }
+
+  thread_ = std::thread([this] {ReadAhead();});
+}
+
+DecompressingInputStream::~DecompressingInputStream() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+  }
+
+  released_.notify_all();
+  thread_.join();
+}
+
+void DecompressingInputStream::ReadAhead() {
+  size_t index = 0;
+
+  try {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        released_.wait(lock, [this] {
+          return ready_ < buffers_.size() || stop_;
+        });
+
+        if (stop_) {
+          return;
+        }
+      }
+
+      // The buffer is not touched by the reader until it is marked ready.
+      uint8_t* buffer = buffers_[index].data();
+      size_t len = 0;
+      bool end = false;
+      while (len < buffer_size_) {
+        size_t produced = decompressor_->Decompress(&in_, in_end_,
+                                                    buffer + len,
+                                                    buffer_size_ - len);
+        if (produced == 0) {
+          end = true;
+          break;
+        }
+
+        len += produced;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (len > 0) {
+          buffer_lens_[index] = len;
+          ready_++;
+          index = (index + 1) % buffers_.size();
+        }
+
+        done_ = end;
+      }
+
+      filled_.notify_all();
+      if (end) {
+        return;
+      }
+    }
+  } catch (...) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      error_ = std::current_exception();
+      done_ = true;
+    }
+
+    filled_.notify_all();
+  }
+}
+
+bool DecompressingInputStream::EnsureCurrentBuffer() {
+  if (current_ready_ && position_ < buffer_lens_[current_]) {
+    return true;
+  }
+
+  std::unique_lock<std::mutex> lock(mu_);
+  if (current_ready_) {
+    current_ready_ = false;
+    current_ = (current_ + 1) % buffers_.size();
+    ready_--;
+    released_.notify_all();
+  }
+
+  filled_.wait(lock, [this] {return ready_ > 0 || done_;});
+  if (ready_ == 0) {
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+
+    return false;
+  }
+
+  current_ready_ = true;
+  position_ = 0;
+  return true;
+}
+
+bool DecompressingInputStream::Contiguous(size_t len, const uint8_t** data,
+                                          bool* in_scratch) {
+  if (scratch_position_ == scratch_.size()) {
+    scratch_.clear();
+    scratch_position_ = 0;
+
+    if (!EnsureCurrentBuffer()) {
+      return false;
+    }
+
+    if (buffer_lens_[current_] - position_ >= len) {
+      *data = buffers_[current_].data() + position_;
+      *in_scratch = false;
+      return true;
+    }
+  }
+
+  // The bytes cross into the next buffer (or some of them were assembled by an
+  // earlier Peek).
+  while (scratch_.size() - scratch_position_ < len) {
+    if (!EnsureCurrentBuffer()) {
+      break;
+    }
+
+    size_t wanted = len - (scratch_.size() - scratch_position_);
+    size_t copied = std::min(wanted, buffer_lens_[current_] - position_);
+    const uint8_t* from = buffers_[current_].data() + position_;
+    scratch_.insert(scratch_.end(), from, from + copied);
+    position_ += copied;
+  }
+
+  size_t available = scratch_.size() - scratch_position_;
+  if (available == 0) {
+    return false;
+  }
+
+  if (available < len) {
+    throw std::runtime_error(
+        "Stream truncated, wanted " + std::to_string(len) + " bytes, "
+            + std::to_string(available) + " left");
+  }
+
+  *data = scratch_.data() + scratch_position_;
+  *in_scratch = true;
+  return true;
+}
+
+bool DecompressingInputStream::Read(size_t len, const uint8_t** data) {
+  bool in_scratch;
+  if (!Contiguous(len, data, &in_scratch)) {
+    return false;
+  }
+
+  if (in_scratch) {
+    scratch_position_ += len;
+  } else {
+    position_ += len;
+  }
+
+  return true;
+}
+
+bool DecompressingInputStream::Peek(size_t len, const uint8_t** data) {
+  bool in_scratch;
+  return Contiguous(len, data, &in_scratch);
+}
+
+std::unique_ptr<InputStream> NewFileInputStream(const MappedFile& file,
+                                                size_t buffer_size,
+                                                size_t num_buffers) {
+  Compression compression = DetectCompression(file.data(), file.size());
+  if (compression == COMPRESSION_NONE) {
+    return std::make_unique<MappedInputStream>(file);
+  }
+
+  return std::make_unique<DecompressingInputStream>(
+      NewDecompressor(compression), file.data(), file.data() + file.size(),
+      buffer_size, num_buffers);
+}
+
+}  // namespace flowparser
@@ -0,0 +1,157 @@
+// Streams that decompress capture files on the fly. Which formats are available
+// depends on the libraries found at configure time.
+
+#ifndef FLOWPARSER_DECOMPRESS_STREAM_H
+#define FLOWPARSER_DECOMPRESS_STREAM_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "input_stream.h"
+
+namespace flowparser {
+
+enum Compression {
+  COMPRESSION_NONE,
+  COMPRESSION_GZIP,
+  COMPRESSION_ZSTD,
+  COMPRESSION_LZ4
+};
+
+// Looks at the magic number at the start of the data to tell how it is
+// compressed. Returns COMPRESSION_NONE if the format is not known.
+Compression DetectCompression(const uint8_t* data, size_t size);
+
+// Same as above, but reads the start of a file. Returns COMPRESSION_NONE if the
+// file cannot be read.
+Compression DetectFileCompression(const std::string& filename);
+
+// Decompresses a single stream in chunks.
+class Decompressor {
+ public:
+  virtual ~Decompressor() {
+  }
+
+  // Decompresses from [*in, in_end) into out, advancing *in past the input
+  // consumed. Returns the number of bytes written to out, which is only 0 once
+  // all input has been consumed and all output produced. Throws if the input
+  // is corrupt or ends in the middle of a compressed frame.
+  virtual size_t Decompress(const uint8_t** in, const uint8_t* in_end,
+                            uint8_t* out, size_t out_len) = 0;
+
+ protected:
+  Decompressor() {
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(Decompressor);
+};
+
+// Returns a decompressor for a format. Throws if support for the format was not
+// compiled in.
+std::unique_ptr<Decompressor> NewDecompressor(Compression compression);
+
+// A stream over compressed data in memory, usually a MappedFile. Data is
+// decompressed by a read-ahead thread into a ring of large buffers, so
+// decompression overlaps with whatever the reading thread does with the data.
+// Reads that fall within a buffer do not copy, reads that cross a buffer
+// boundary are assembled in a separate scratch buffer.
+class DecompressingInputStream : public InputStream {
+ public:
+  static constexpr size_t kDefaultBufferSize = 1 << 23;
+  static constexpr size_t kDefaultNumBuffers = 4;
+
+  // The range should outlive the stream. The read-ahead thread starts
+  // immediately.
+  DecompressingInputStream(std::unique_ptr<Decompressor> decompressor,
+                           const uint8_t* begin, const uint8_t* end,
+                           size_t buffer_size = kDefaultBufferSize,
+                           size_t num_buffers = kDefaultNumBuffers);
+
+  // Stops and joins the read-ahead thread.
+  ~DecompressingInputStream();
+
+  // Both rethrow errors from the read-ahead thread.
+  bool Read(size_t len, const uint8_t** data) override;
+  bool Peek(size_t len, const uint8_t** data) override;
+
+ private:
+  // The body of the read-ahead thread.
+  void ReadAhead();
+
+  // Makes sure that the current buffer has unread bytes, releasing it to the
+  // read-ahead thread and waiting for the next one if it does not. Returns
+  // false if there are no more buffers.
+  bool EnsureCurrentBuffer();
+
+  // Makes the next len bytes available at *data without consuming them. Sets
+  // *in_scratch to true if they had to be assembled in scratch_. Returns false
+  // if the stream ended before the first byte, throws if it ended before the
+  // last.
+  bool Contiguous(size_t len, const uint8_t** data, bool* in_scratch);
+
+  const std::unique_ptr<Decompressor> decompressor_;
+
+  // Compressed input not yet consumed. Only used by the read-ahead thread.
+  const uint8_t* in_;
+  const uint8_t* const in_end_;
+
+  const size_t buffer_size_;
+
+  // The ring. Buffers are filled in order by the read-ahead thread and consumed
+  // in the same order.
+  std::vector<std::vector<uint8_t>> buffers_;
+
+  // How many bytes of each buffer are valid.
+  std::vector<size_t> buffer_lens_;
+
+  // Number of filled buffers not yet released by the reader. Protected by mu_.
+  size_t ready_;
+
+  // Set by the read-ahead thread once the input is exhausted or an error
+  // occurs. Protected by mu_.
+  bool done_;
+
+  // The error that stopped the read-ahead thread, if any. Protected by mu_.
+  std::exception_ptr error_;
+
+  // Set by the destructor to stop the read-ahead thread. Protected by mu_.
+  bool stop_;
+
+  // Index of the buffer the reader is consuming and the position in it. The
+  // reader holds no buffer if current_ready_ is false.
+  size_t current_;
+  size_t position_;
+  bool current_ready_;
+
+  // Bytes assembled for a read that crosses buffers. Bytes before
+  // scratch_position_ have already been read.
+  std::vector<uint8_t> scratch_;
+  size_t scratch_position_;
+
+  std::mutex mu_;
+  std::condition_variable filled_;
+  std::condition_variable released_;
+
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(DecompressingInputStream);
+};
+
+// Returns a stream over a mapped file, decompressing it if it is compressed.
+// The buffer size and count are only used for compressed files.
+std::unique_ptr<InputStream> NewFileInputStream(
+    const MappedFile& file,
+    size_t buffer_size = DecompressingInputStream::kDefaultBufferSize,
+    size_t num_buffers = DecompressingInputStream::kDefaultNumBuffers);
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_DECOMPRESS_STREAM_H */
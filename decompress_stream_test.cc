@@ -0,0 +1,259 @@
+#include "gtest/gtest.h"
+#include "decompress_stream.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+namespace flowparser {
+namespace test {
+
+// Compressible data -- runs of random bytes.
+static std::vector<uint8_t> GenerateData(size_t size) {
+  std::default_random_engine e(1);
+  std::vector<uint8_t> data;
+  while (data.size() < size) {
+    data.insert(data.end(), e() % 100, e());
+  }
+
+  data.resize(size);
+  return data;
+}
+
+// Reads size bytes from the stream in pieces of different sizes, some of which
+// cross buffer boundaries. The stream should end after that.
+static std::vector<uint8_t> ReadAll(InputStream* stream, size_t size) {
+  std::default_random_engine e(2);
+  std::vector<uint8_t> out;
+
+  const uint8_t* data;
+  while (out.size() < size) {
+    size_t len = std::min<size_t>(1 + e() % 5000, size - out.size());
+    EXPECT_TRUE(stream->Read(len, &data));
+    out.insert(out.end(), data, data + len);
+  }
+
+  EXPECT_FALSE(stream->Read(1, &data));
+  return out;
+}
+
+// Does not decompress, copies a few bytes at a time.
+class CopyDecompressor : public Decompressor {
+ public:
+  size_t Decompress(const uint8_t** in, const uint8_t* in_end, uint8_t* out,
+                    size_t out_len) override {
+    size_t len = std::min<size_t>(std::min<size_t>(in_end - *in, out_len), 777);
+    memcpy(out, *in, len);
+    *in += len;
+    return len;
+  }
+};
+
+TEST(DecompressStream, Ring) {
+  std::vector<uint8_t> data = GenerateData(1 << 20);
+
+  DecompressingInputStream stream(std::make_unique<CopyDecompressor>(),
+                                  data.data(), data.data() + data.size(), 4096,
+                                  3);
+  ASSERT_EQ(data, ReadAll(&stream, data.size()));
+}
+
+TEST(DecompressStream, Empty) {
+  std::vector<uint8_t> data;
+
+  DecompressingInputStream stream(std::make_unique<CopyDecompressor>(),
+                                  data.data(), data.data(), 4096, 3);
+  const uint8_t* read;
+  ASSERT_FALSE(stream.Peek(1, &read));
+  ASSERT_FALSE(stream.Read(1, &read));
+}
+
+TEST(DecompressStream, Peek) {
+  std::vector<uint8_t> data = GenerateData(10000);
+
+  DecompressingInputStream stream(std::make_unique<CopyDecompressor>(),
+                                  data.data(), data.data() + data.size(), 1000,
+                                  2);
+
+  const uint8_t* peeked;
+  const uint8_t* read;
+  ASSERT_TRUE(stream.Read(990, &read));
+
+  // Crosses into the second buffer.
+  ASSERT_TRUE(stream.Peek(20, &peeked));
+  ASSERT_EQ(0, memcmp(peeked, data.data() + 990, 20));
+  ASSERT_TRUE(stream.Read(30, &read));
+  ASSERT_EQ(0, memcmp(read, data.data() + 990, 30));
+}
+
+TEST(DecompressStream, DestroyWithoutReading) {
+  std::vector<uint8_t> data = GenerateData(10000);
+
+  // The read-ahead thread fills both buffers and blocks.
+  DecompressingInputStream stream(std::make_unique<CopyDecompressor>(),
+                                  data.data(), data.data() + data.size(), 1000,
+                                  2);
+}
+
+TEST(DecompressStream, DetectCompression) {
+  const uint8_t gzip[] = { 0x1f, 0x8b, 0x08, 0x00 };
+  const uint8_t zstd[] = { 0x28, 0xb5, 0x2f, 0xfd };
+  const uint8_t lz4[] = { 0x04, 0x22, 0x4d, 0x18 };
+  const uint8_t pcap[] = { 0xd4, 0xc3, 0xb2, 0xa1 };
+
+  ASSERT_EQ(COMPRESSION_GZIP, DetectCompression(gzip, sizeof(gzip)));
+  ASSERT_EQ(COMPRESSION_ZSTD, DetectCompression(zstd, sizeof(zstd)));
+  ASSERT_EQ(COMPRESSION_LZ4, DetectCompression(lz4, sizeof(lz4)));
+  ASSERT_EQ(COMPRESSION_NONE, DetectCompression(pcap, sizeof(pcap)));
+  ASSERT_EQ(COMPRESSION_NONE, DetectCompression(zstd, 2));
+  ASSERT_EQ(COMPRESSION_NONE,
+            DetectFileCompression("test_data/some_missing_dummy_file"));
+}
+
+TEST(DecompressStream, NotCompressed) {
+  ASSERT_THROW(NewDecompressor(COMPRESSION_NONE), std::exception);
+}
+
+#ifdef HAVE_LIBZ
+static std::vector<uint8_t> Gzip(const std::vector<uint8_t>& data) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+               Z_DEFAULT_STRATEGY);
+
+  std::vector<uint8_t> out(deflateBound(&stream, data.size()));
+  stream.next_in = const_cast<Bytef*>(data.data());
+  stream.avail_in = data.size();
+  stream.next_out = out.data();
+  stream.avail_out = out.size();
+  deflate(&stream, Z_FINISH);
+
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+TEST(DecompressStream, Gzip) {
+  std::vector<uint8_t> data = GenerateData(1 << 20);
+  std::vector<uint8_t> compressed = Gzip(data);
+
+  DecompressingInputStream stream(
+      NewDecompressor(COMPRESSION_GZIP), compressed.data(),
+      compressed.data() + compressed.size(), 4096, 3);
+  ASSERT_EQ(data, ReadAll(&stream, data.size()));
+}
+
+TEST(DecompressStream, GzipMultipleMembers) {
+  std::vector<uint8_t> first = GenerateData(10000);
+  std::vector<uint8_t> second(5000, 7);
+
+  std::vector<uint8_t> compressed = Gzip(first);
+  std::vector<uint8_t> compressed_second = Gzip(second);
+  compressed.insert(compressed.end(), compressed_second.begin(),
+                    compressed_second.end());
+
+  DecompressingInputStream stream(
+      NewDecompressor(COMPRESSION_GZIP), compressed.data(),
+      compressed.data() + compressed.size(), 4096, 2);
+
+  first.insert(first.end(), second.begin(), second.end());
+  ASSERT_EQ(first, ReadAll(&stream, first.size()));
+}
+
+TEST(DecompressStream, GzipTruncated) {
+  std::vector<uint8_t> compressed = Gzip(GenerateData(100000));
+  compressed.resize(compressed.size() / 2);
+
+  DecompressingInputStream stream(
+      NewDecompressor(COMPRESSION_GZIP), compressed.data(),
+      compressed.data() + compressed.size(), 4096, 2);
+  ASSERT_THROW(ReadAll(&stream, 100000), std::runtime_error);
+}
+
+TEST(DecompressStream, GzipCorrupt) {
+  std::vector<uint8_t> compressed = Gzip(GenerateData(100000));
+  for (size_t i = 100; i < 200; ++i) {
+    compressed[i] = 0xff;
+  }
+
+  DecompressingInputStream stream(
+      NewDecompressor(COMPRESSION_GZIP), compressed.data(),
+      compressed.data() + compressed.size(), 4096, 2);
+  ASSERT_THROW(ReadAll(&stream, 100000), std::runtime_error);
+}
+
+#endif
+
+#ifdef HAVE_LIBZSTD
+TEST(DecompressStream, Zstd) {
+  std::vector<uint8_t> data = GenerateData(1 << 20);
+  std::vector<uint8_t> compressed(ZSTD_compressBound(data.size()));
+  compressed.resize(ZSTD_compress(compressed.data(), compressed.size(),
+                                  data.data(), data.size(), 1));
+
+  DecompressingInputStream stream(
+      NewDecompressor(COMPRESSION_ZSTD), compressed.data(),
+      compressed.data() + compressed.size(), 4096, 3);
+  ASSERT_EQ(data, ReadAll(&stream, data.size()));
+}
+
+TEST(DecompressStream, ZstdTruncated) {
+  std::vector<uint8_t> data = GenerateData(100000);
+  std::vector<uint8_t> compressed(ZSTD_compressBound(data.size()));
+  compressed.resize(ZSTD_compress(compressed.data(), compressed.size(),
+                                  data.data(), data.size(), 1) / 2);
+
+  DecompressingInputStream stream(
+      NewDecompressor(COMPRESSION_ZSTD), compressed.data(),
+      compressed.data() + compressed.size(), 4096, 2);
+  ASSERT_THROW(ReadAll(&stream, data.size()), std::runtime_error);
+}
+#endif
+
+#ifdef HAVE_LIBLZ4
+TEST(DecompressStream, Lz4) {
+  std::vector<uint8_t> data = GenerateData(1 << 20);
+  std::vector<uint8_t> compressed(LZ4F_compressFrameBound(data.size(),
+                                                          nullptr));
+  compressed.resize(LZ4F_compressFrame(compressed.data(), compressed.size(),
+                                       data.data(), data.size(), nullptr));
+
+  DecompressingInputStream stream(
+      NewDecompressor(COMPRESSION_LZ4), compressed.data(),
+      compressed.data() + compressed.size(), 4096, 3);
+  ASSERT_EQ(data, ReadAll(&stream, data.size()));
+}
+
+TEST(DecompressStream, Lz4Truncated) {
+  std::vector<uint8_t> data = GenerateData(100000);
+  std::vector<uint8_t> compressed(LZ4F_compressFrameBound(data.size(),
+                                                          nullptr));
+  compressed.resize(LZ4F_compressFrame(compressed.data(), compressed.size(),
+                                       data.data(), data.size(), nullptr) / 2);
+
+  DecompressingInputStream stream(
+      NewDecompressor(COMPRESSION_LZ4), compressed.data(),
+      compressed.data() + compressed.size(), 4096, 2);
+  ASSERT_THROW(ReadAll(&stream, data.size()), std::runtime_error);
+}
+#endif
+
+}  // namespace test
+}  // namespace flowparser
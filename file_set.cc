@@ -0,0 +1,239 @@
+#include "file_set.h"
+
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "decompress_stream.h"
+
+namespace flowparser {
+
+// Compressed files are decompressed into buffers this large when looking for
+// their first packet. The default buffers are much larger than needed.
+static constexpr size_t kProbeBufferSize = 1 << 16;
+
+static bool IsRegularFile(const std::string& filename) {
+  struct stat file_stat;
+  return stat(filename.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+}
+
+static bool IsDirectory(const std::string& filename) {
+  struct stat file_stat;
+  return stat(filename.c_str(), &file_stat) == 0 && S_ISDIR(file_stat.st_mode);
+}
+
+// Milliseconds since the file was last modified. Returns 0 if the file cannot
+// be stat-ed.
+static uint64_t MillisSinceModified(const std::string& filename) {
+  struct stat file_stat;
+  if (stat(filename.c_str(), &file_stat) != 0) {
+    return 0;
+  }
+
+  // Only whole seconds, st_mtim is not available everywhere.
+  auto modified = std::chrono::system_clock::from_time_t(file_stat.st_mtime);
+  auto now = std::chrono::system_clock::now();
+  if (now < modified) {
+    return 0;
+  }
+
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      now - modified).count();
+}
+
+std::vector<std::string> ListCaptureFiles(const std::string& pattern) {
+  std::vector<std::string> candidates;
+  if (IsDirectory(pattern)) {
+    DIR* dir = opendir(pattern.c_str());
+    if (dir == nullptr) {
+      throw std::logic_error(
+          "Could not open directory " + pattern + ": "
+              + std::string(strerror(errno)));
+    }
+
+    std::string prefix = pattern;
+    if (prefix.back() != '/') {
+      prefix += '/';
+    }
+
+    while (dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        candidates.push_back(prefix + entry->d_name);
+      }
+    }
+
+    closedir(dir);
+  } else {
+    glob_t glob_result;
+    if (glob(pattern.c_str(), 0, nullptr, &glob_result) == 0) {
+      for (size_t i = 0; i < glob_result.gl_pathc; ++i) {
+        candidates.push_back(glob_result.gl_pathv[i]);
+      }
+    }
+
+    globfree(&glob_result);
+  }
+
+  std::vector<std::string> files;
+  for (const std::string& candidate : candidates) {
+    if (IsRegularFile(candidate)) {
+      files.push_back(candidate);
+    }
+  }
+
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+bool FirstPacketTimestamp(const std::string& filename, uint64_t* timestamp) {
+  MappedFile file(filename);
+  std::unique_ptr<PacketSource> source = NewPacketSource(
+      NewFileInputStream(file, kProbeBufferSize, 2));
+
+  PacketRecord record;
+  if (!source->Next(&record)) {
+    return false;
+  }
+
+  *timestamp = record.timestamp;
+  return true;
+}
+
+FileSetSource::FileSetSource(const std::string& pattern, const Config& config,
+                             ErrorCallback error_callback)
+    : pattern_(pattern),
+      config_(config),
+      error_callback_(error_callback),
+      files_read_(0) {
+  Scan();
+  if (pending_.empty() && !config_.tail) {
+    throw std::logic_error("No capture files in " + pattern_);
+  }
+
+  StartPrefetch();
+}
+
+FileSetSource::~FileSetSource() {
+  if (prefetch_.valid()) {
+    prefetch_.wait();
+  }
+}
+
+std::unique_ptr<FileSetSource::OpenFile> FileSetSource::Open(
+    const std::string& filename) {
+  auto open_file = std::make_unique<OpenFile>();
+  open_file->filename = filename;
+  open_file->file = std::make_unique<MappedFile>(filename);
+  open_file->file->Prefetch();
+  open_file->source = NewPacketSource(NewFileInputStream(*open_file->file));
+  return open_file;
+}
+
+void FileSetSource::Scan() {
+  std::vector<std::pair<uint64_t, std::string>> new_files;
+  for (const std::string& filename : ListCaptureFiles(pattern_)) {
+    if (seen_.count(filename)) {
+      continue;
+    }
+
+    if (config_.tail && MillisSinceModified(filename) < config_.quiet_ms) {
+      continue;
+    }
+
+    seen_.insert(filename);
+
+    uint64_t timestamp;
+    try {
+      if (!FirstPacketTimestamp(filename, &timestamp)) {
+        continue;
+      }
+    } catch (std::exception& ex) {
+      error_callback_("Skipping " + filename + ": " + ex.what());
+      continue;
+    }
+
+    new_files.emplace_back(timestamp, filename);
+  }
+
+  // Files from the same scan are ordered by their first packets. Files from a
+  // later scan always come after them.
+  std::sort(new_files.begin(), new_files.end());
+  for (const auto& timestamp_and_filename : new_files) {
+    pending_.push_back(timestamp_and_filename.second);
+  }
+}
+
+void FileSetSource::StartPrefetch() {
+  if (pending_.empty()) {
+    return;
+  }
+
+  prefetch_filename_ = pending_.front();
+  pending_.pop_front();
+  prefetch_ = std::async(std::launch::async, &FileSetSource::Open,
+                         prefetch_filename_);
+}
+
+bool FileSetSource::NextFile() {
+  current_.reset();
+
+  while (true) {
+    if (prefetch_.valid()) {
+      try {
+        current_ = prefetch_.get();
+      } catch (std::exception& ex) {
+        error_callback_("Skipping " + prefetch_filename_ + ": " + ex.what());
+      }
+
+      // Opening the next file overlaps with reading this one.
+      if (pending_.empty() && config_.tail) {
+        Scan();
+      }
+
+      StartPrefetch();
+      if (current_) {
+        current_filename_ = current_->filename;
+        ++files_read_;
+        return true;
+      }
+
+      continue;
+    }
+
+    if (!config_.tail) {
+      return false;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(config_.poll_ms));
+    Scan();
+    StartPrefetch();
+  }
+}
+
+bool FileSetSource::Next(PacketRecord* record) {
+  while (true) {
+    if (current_) {
+      try {
+        if (current_->source->Next(record)) {
+          return true;
+        }
+      } catch (std::exception& ex) {
+        error_callback_("Error while reading from " + current_filename_ + ": "
+                        + ex.what());
+      }
+    }
+
+    if (!NextFile()) {
+      return false;
+    }
+  }
+}
+
+}  // namespace flowparser
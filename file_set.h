@@ -0,0 +1,127 @@
+// Reading a set of capture files, usually the rotated output of a sensor, as a
+// single stream of packets.
+
+#ifndef FLOWPARSER_FILE_SET_H
+#define FLOWPARSER_FILE_SET_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "input_stream.h"
+#include "pcap_reader.h"
+
+namespace flowparser {
+
+// Returns the files that make up a set. If the pattern is a directory those are
+// all regular files in it, except for hidden ones, otherwise the pattern is
+// expanded as a shell glob. The files are sorted by name. Throws if the pattern
+// is a directory that cannot be read.
+std::vector<std::string> ListCaptureFiles(const std::string& pattern);
+
+// Reads the timestamp of the first packet in a capture file. Returns false if
+// the file has no packets. Throws if the file cannot be read.
+bool FirstPacketTimestamp(const std::string& filename, uint64_t* timestamp);
+
+// A PacketSource over a set of capture files. The files are read one after the
+// other, ordered by the timestamps of their first packets. While a file is
+// being read the next one is mapped and opened on a background thread, for
+// compressed files that also starts decompression. Each file can have a
+// different format and datalink.
+//
+// If tailing, once all files are read the set is checked again for new files
+// every poll_ms and Next blocks until one shows up. Files that were modified in
+// the last quiet_ms are considered still being written and are left for a
+// later check.
+class FileSetSource : public PacketSource {
+ public:
+  typedef std::function<void(const std::string& error)> ErrorCallback;
+
+  struct Config {
+    // Keep checking for new files once all files have been read.
+    bool tail = false;
+
+    // How often to check for new files when tailing.
+    uint64_t poll_ms = 1000;
+
+    // How long a file has to stay unmodified before it is read when tailing.
+    uint64_t quiet_ms = 5000;
+  };
+
+  // Errors in individual files (files that cannot be opened or that end in the
+  // middle of a record) are reported to the callback and the file is skipped
+  // or the rest of it is. Throws if not tailing and no files match the
+  // pattern.
+  FileSetSource(const std::string& pattern, const Config& config,
+                ErrorCallback error_callback);
+
+  // Waits for the file being prefetched, if any.
+  ~FileSetSource();
+
+  bool Next(PacketRecord* record) override;
+
+  // The name of the file the last packet came from.
+  const std::string& current_filename() const {
+    return current_filename_;
+  }
+
+  // Number of files started so far, including the current one.
+  size_t files_read() const {
+    return files_read_;
+  }
+
+ private:
+  // A file and a reader over it. The reader points into the file, so it is
+  // declared after it and destroyed before it.
+  struct OpenFile {
+    std::string filename;
+    std::unique_ptr<MappedFile> file;
+    std::unique_ptr<PacketSource> source;
+  };
+
+  // Maps and opens a file. Runs on the prefetch thread.
+  static std::unique_ptr<OpenFile> Open(const std::string& filename);
+
+  // Adds files that were not seen before to pending_, in order of their first
+  // packets. In tail mode files that were recently modified are left for the
+  // next scan.
+  void Scan();
+
+  // Starts opening the first pending file in the background. Does nothing if
+  // there are no pending files.
+  void StartPrefetch();
+
+  // Makes the next file current. Returns false if there are no more files,
+  // which only happens if not tailing.
+  bool NextFile();
+
+  const std::string pattern_;
+  const Config config_;
+  const ErrorCallback error_callback_;
+
+  // Files that have been scanned and will not be looked at again.
+  std::set<std::string> seen_;
+
+  // Files waiting to be read, in order.
+  std::deque<std::string> pending_;
+
+  // The file being opened in the background. Not valid if there is none.
+  std::future<std::unique_ptr<OpenFile>> prefetch_;
+  std::string prefetch_filename_;
+
+  std::unique_ptr<OpenFile> current_;
+  std::string current_filename_;
+  size_t files_read_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileSetSource);
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_FILE_SET_H */
@@ -0,0 +1,190 @@
+#include "gtest/gtest.h"
+#include "file_set.h"
+
+#include <pcap/bpf.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace flowparser {
+namespace test {
+
+// A temporary directory that is removed along with its files at the end of the
+// test.
+class FileSetFixture : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char dir[] = "/tmp/file_set_test_XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    dir_ = dir;
+  }
+
+  void TearDown() override {
+    for (const std::string& filename : created_) {
+      remove(filename.c_str());
+    }
+
+    rmdir(dir_.c_str());
+  }
+
+  // Writes a pcap file with one 20 byte record per timestamp (in seconds).
+  std::string WritePcap(const std::string& name,
+                        const std::vector<uint32_t>& timestamps) {
+    std::vector<uint32_t> words = { 0xa1b2c3d4, 0x00040002, 0, 0, 65535, 101 };
+    for (uint32_t timestamp : timestamps) {
+      words.insert(words.end(), { timestamp, 0, 20, 20, 0, 0, 0, 0, 0 });
+    }
+
+    std::string data(reinterpret_cast<const char*>(words.data()),
+                     words.size() * sizeof(uint32_t));
+    return WriteFile(name, data);
+  }
+
+  std::string WriteFile(const std::string& name, const std::string& data) {
+    std::string filename = dir_ + "/" + name;
+    std::ofstream out(filename, std::ios::binary);
+    out.write(data.data(), data.size());
+    created_.push_back(filename);
+    return filename;
+  }
+
+  // Reads all packets from the source, returns their timestamps in seconds.
+  static std::vector<uint64_t> ReadAll(FileSetSource* source) {
+    std::vector<uint64_t> timestamps;
+    PacketRecord record;
+    while (source->Next(&record)) {
+      timestamps.push_back(record.timestamp / kMillion);
+    }
+
+    return timestamps;
+  }
+
+  std::string dir_;
+  std::vector<std::string> created_;
+  std::vector<std::string> errors_;
+
+  FileSetSource::ErrorCallback error_callback_ =
+      [this](const std::string& error) {errors_.push_back(error);};
+};
+
+TEST_F(FileSetFixture, ListDirectory) {
+  std::string a = WritePcap("a", { 1 });
+  std::string b = WritePcap("b", { 2 });
+  WritePcap(".hidden", { 3 });
+  std::string subdir = dir_ + "/subdir";
+  ASSERT_EQ(0, mkdir(subdir.c_str(), 0700));
+
+  std::vector<std::string> model = { a, b };
+  ASSERT_EQ(model, ListCaptureFiles(dir_));
+  ASSERT_EQ(model, ListCaptureFiles(dir_ + "/"));
+  rmdir(subdir.c_str());
+}
+
+TEST_F(FileSetFixture, ListGlob) {
+  std::string a = WritePcap("a.pcap", { 1 });
+  WritePcap("b.pcapng", { 2 });
+  std::string c = WritePcap("c.pcap", { 3 });
+
+  std::vector<std::string> model = { a, c };
+  ASSERT_EQ(model, ListCaptureFiles(dir_ + "/*.pcap"));
+  ASSERT_TRUE(ListCaptureFiles(dir_ + "/*.missing").empty());
+}
+
+TEST_F(FileSetFixture, FirstPacketTimestamp) {
+  uint64_t timestamp = 0;
+  ASSERT_TRUE(FirstPacketTimestamp(WritePcap("a", { 5, 6 }), &timestamp));
+  ASSERT_EQ(5 * kMillion, timestamp);
+  ASSERT_FALSE(FirstPacketTimestamp(WritePcap("b", { }), &timestamp));
+  ASSERT_THROW(FirstPacketTimestamp(dir_ + "/missing", &timestamp),
+               std::logic_error);
+}
+
+TEST_F(FileSetFixture, NoFiles) {
+  ASSERT_THROW(FileSetSource(dir_, FileSetSource::Config(), error_callback_),
+               std::logic_error);
+}
+
+TEST_F(FileSetFixture, OrderedByFirstPacket) {
+  // Names are in the opposite order of the packets.
+  WritePcap("a", { 30, 31 });
+  WritePcap("b", { 20, 21, 22 });
+  WritePcap("c", { 10 });
+  WritePcap("d", { });
+
+  FileSetSource source(dir_, FileSetSource::Config(), error_callback_);
+  PacketRecord record;
+  ASSERT_TRUE(source.Next(&record));
+  ASSERT_EQ(dir_ + "/c", source.current_filename());
+  ASSERT_EQ(DLT_RAW, record.datalink);
+  ASSERT_EQ(20, record.caplen);
+
+  std::vector<uint64_t> model = { 20, 21, 22, 30, 31 };
+  ASSERT_EQ(model, ReadAll(&source));
+  ASSERT_EQ(dir_ + "/a", source.current_filename());
+  ASSERT_EQ(3, source.files_read());
+  ASSERT_TRUE(errors_.empty());
+}
+
+TEST_F(FileSetFixture, BadFiles) {
+  WritePcap("a", { 10, 11 });
+  WriteFile("b", "not a capture file");
+
+  // Ends in the middle of the second record.
+  std::string truncated = WritePcap("c", { 20, 21 });
+  ASSERT_EQ(0, truncate(truncated.c_str(), 24 + 36 + 10));
+  WritePcap("d", { 30 });
+
+  FileSetSource source(dir_, FileSetSource::Config(), error_callback_);
+  std::vector<uint64_t> model = { 10, 11, 20, 30 };
+  ASSERT_EQ(model, ReadAll(&source));
+  ASSERT_EQ(2, errors_.size());
+}
+
+TEST_F(FileSetFixture, Tail) {
+  WritePcap("a", { 10, 11 });
+
+  FileSetSource::Config config;
+  config.tail = true;
+  config.poll_ms = 10;
+  config.quiet_ms = 0;
+  FileSetSource source(dir_, config, error_callback_);
+
+  PacketRecord record;
+  ASSERT_TRUE(source.Next(&record));
+  ASSERT_EQ(10, record.timestamp / kMillion);
+  ASSERT_TRUE(source.Next(&record));
+  ASSERT_EQ(11, record.timestamp / kMillion);
+
+  // The next call blocks until a new file shows up. The file is written
+  // hidden, so it is not read while incomplete.
+  std::string hidden = WritePcap(".b", { 20 });
+  created_.push_back(dir_ + "/b");
+  std::thread writer([this, hidden] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    rename(hidden.c_str(), (dir_ + "/b").c_str());
+  });
+
+  ASSERT_TRUE(source.Next(&record));
+  writer.join();
+  ASSERT_EQ(20, record.timestamp / kMillion);
+  ASSERT_EQ(dir_ + "/b", source.current_filename());
+}
+
+TEST_F(FileSetFixture, TailSkipsRecentlyModified) {
+  WritePcap("a", { 10 });
+
+  FileSetSource::Config config;
+  config.tail = true;
+  config.quiet_ms = 60 * 60 * 1000;
+  FileSetSource source(dir_, config, error_callback_);
+  ASSERT_EQ(0, source.files_read());
+}
+
+}  // namespace test
+}  // namespace flowparser
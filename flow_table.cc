@@ -0,0 +1,253 @@
+#include "flow_table.h"
+
+#include <utility>
+
+namespace flowparser {
+
+// The table grows when it is more than this full, in 1/8ths.
+static constexpr uint32_t kMaxLoadEighths = 7;
+
+FlowTable::FlowTable()
+    : capacity_(kInitialCapacity),
+      size_(0),
+      slots_(new Slot[kInitialCapacity]),
+      entries_(new Entry[kInitialCapacity]),
+      head_(kNone),
+      tail_(kNone),
+      free_(0) {
+  for (uint32_t i = 0; i < capacity_; ++i) {
+    slots_[i].entry = kNone;
+    entries_[i].flow = nullptr;
+    entries_[i].next = i + 1 < capacity_ ? i + 1 : kNone;
+  }
+}
+
+FlowTable::~FlowTable() {
+  while (!empty()) {
+    PopLeastRecent();
+  }
+}
+
+uint32_t FlowTable::Hash(const FlowKey& key) {
+  // FlowKey::hash is not well mixed in its low bits, which are the ones that
+  // pick a slot. This is the finalizer of MurmurHash3.
+  uint64_t hash = key.hash();
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return static_cast<uint32_t>(hash);
+}
+
+uint32_t FlowTable::FindSlot(const FlowKey& key, uint32_t hash) const {
+  uint32_t mask = capacity_ - 1;
+  uint32_t pos = hash & mask;
+  for (uint32_t distance = 0;; ++distance, pos = (pos + 1) & mask) {
+    const Slot& slot = slots_[pos];
+    if (slot.entry == kNone) {
+      return kNone;
+    }
+
+    // Had the key been here it would have displaced this slot's entry.
+    if (ProbeDistance(pos, slot.hash) < distance) {
+      return kNone;
+    }
+
+    if (slot.hash == hash && entries_[slot.entry].key() == key) {
+      return pos;
+    }
+  }
+}
+
+uint32_t FlowTable::SlotOfEntry(uint32_t entry) const {
+  uint32_t mask = capacity_ - 1;
+  uint32_t pos = entries_[entry].hash & mask;
+  while (slots_[pos].entry != entry) {
+    pos = (pos + 1) & mask;
+  }
+
+  return pos;
+}
+
+void FlowTable::InsertSlot(uint32_t hash, uint32_t entry) {
+  uint32_t mask = capacity_ - 1;
+  uint32_t pos = hash & mask;
+  Slot to_insert = { hash, entry };
+  for (uint32_t distance = 0;; ++distance, pos = (pos + 1) & mask) {
+    Slot& slot = slots_[pos];
+    if (slot.entry == kNone) {
+      slot = to_insert;
+      return;
+    }
+
+    // Take the slot from an entry closer to its home, and go on inserting that
+    // entry instead.
+    uint32_t slot_distance = ProbeDistance(pos, slot.hash);
+    if (slot_distance < distance) {
+      std::swap(slot, to_insert);
+      distance = slot_distance;
+    }
+  }
+}
+
+std::unique_ptr<Flow> FlowTable::RemoveSlot(uint32_t pos) {
+  uint32_t entry_index = slots_[pos].entry;
+
+  // Shift the following slots back until one that is empty or already in its
+  // home slot, so that no probe sequence has a hole in it.
+  uint32_t mask = capacity_ - 1;
+  uint32_t next = (pos + 1) & mask;
+  while (slots_[next].entry != kNone
+      && ProbeDistance(next, slots_[next].hash) != 0) {
+    slots_[pos] = slots_[next];
+    pos = next;
+    next = (next + 1) & mask;
+  }
+  slots_[pos].entry = kNone;
+
+  Unlink(entry_index);
+  Entry& entry = entries_[entry_index];
+  std::unique_ptr<Flow> flow(entry.flow);
+  entry.key().~FlowKey();
+  entry.flow = nullptr;
+  entry.next = free_;
+  free_ = entry_index;
+  --size_;
+  return flow;
+}
+
+void FlowTable::Grow() {
+  uint32_t old_capacity = capacity_;
+  std::unique_ptr<Entry[]> old_entries = std::move(entries_);
+
+  capacity_ = old_capacity * 2;
+  slots_.reset(new Slot[capacity_]);
+  entries_.reset(new Entry[capacity_]);
+  for (uint32_t i = 0; i < capacity_; ++i) {
+    slots_[i].entry = kNone;
+  }
+
+  // Entries keep their indices, so the LRU list stays as it is. The free list
+  // is rebuilt from the ones not in use.
+  free_ = kNone;
+  for (uint32_t i = capacity_; i-- > 0;) {
+    Entry& entry = entries_[i];
+    if (i >= old_capacity || old_entries[i].flow == nullptr) {
+      entry.flow = nullptr;
+      entry.next = free_;
+      free_ = i;
+      continue;
+    }
+
+    Entry& old_entry = old_entries[i];
+    entry.flow = old_entry.flow;
+    entry.hash = old_entry.hash;
+    entry.prev = old_entry.prev;
+    entry.next = old_entry.next;
+    new (&entry.key_storage) FlowKey(old_entry.key());
+    old_entry.key().~FlowKey();
+    InsertSlot(entry.hash, i);
+  }
+}
+
+void FlowTable::LinkFront(uint32_t entry) {
+  entries_[entry].prev = kNone;
+  entries_[entry].next = head_;
+  if (head_ != kNone) {
+    entries_[head_].prev = entry;
+  } else {
+    tail_ = entry;
+  }
+  head_ = entry;
+}
+
+void FlowTable::Unlink(uint32_t entry) {
+  uint32_t prev = entries_[entry].prev;
+  uint32_t next = entries_[entry].next;
+  if (prev != kNone) {
+    entries_[prev].next = next;
+  } else {
+    head_ = next;
+  }
+
+  if (next != kNone) {
+    entries_[next].prev = prev;
+  } else {
+    tail_ = prev;
+  }
+}
+
+Flow* FlowTable::FindAndTouch(const FlowKey& key, uint32_t* index) {
+  uint32_t pos = FindSlot(key, Hash(key));
+  if (pos == kNone) {
+    return nullptr;
+  }
+
+  uint32_t entry = slots_[pos].entry;
+  if (entry != head_) {
+    Unlink(entry);
+    LinkFront(entry);
+  }
+
+  if (index != nullptr) {
+    *index = entry;
+  }
+
+  return entries_[entry].flow;
+}
+
+Flow* FlowTable::Find(const FlowKey& key, uint32_t* index) const {
+  uint32_t pos = FindSlot(key, Hash(key));
+  if (pos == kNone) {
+    return nullptr;
+  }
+
+  uint32_t entry = slots_[pos].entry;
+  if (index != nullptr) {
+    *index = entry;
+  }
+
+  return entries_[entry].flow;
+}
+
+Flow* FlowTable::Insert(std::unique_ptr<Flow> flow, uint32_t* index) {
+  if ((size_ + 1) * 8 > capacity_ * kMaxLoadEighths) {
+    Grow();
+  }
+
+  uint32_t entry_index = free_;
+  Entry& entry = entries_[entry_index];
+  free_ = entry.next;
+
+  entry.flow = flow.release();
+  entry.hash = Hash(entry.flow->key());
+  new (&entry.key_storage) FlowKey(entry.flow->key());
+  InsertSlot(entry.hash, entry_index);
+  LinkFront(entry_index);
+  ++size_;
+  if (index != nullptr) {
+    *index = entry_index;
+  }
+
+  return entry.flow;
+}
+
+std::unique_ptr<Flow> FlowTable::PopLeastRecent() {
+  if (tail_ == kNone) {
+    return std::unique_ptr<Flow>();
+  }
+
+  return RemoveSlot(SlotOfEntry(tail_));
+}
+
+std::unique_ptr<Flow> FlowTable::Remove(const FlowKey& key) {
+  uint32_t pos = FindSlot(key, Hash(key));
+  if (pos == kNone) {
+    return std::unique_ptr<Flow>();
+  }
+
+  return RemoveSlot(pos);
+}
+
+}  // namespace flowparser
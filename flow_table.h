@@ -0,0 +1,186 @@
+// An open-addressing table of flows, kept in LRU order.
+
+#ifndef FLOWPARSER_FLOW_TABLE_H
+#define FLOWPARSER_FLOW_TABLE_H
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+
+#include "common.h"
+#include "flows.h"
+
+namespace flowparser {
+
+// Owns flows and finds them by key. This replaces a std::list of flows indexed
+// by a std::unordered_map, where a lookup chased a bucket, a map node, a list
+// node and then the flow.
+//
+// The index is a power of 2 sized array of 8 byte slots, each holding the hash
+// of a key and the index of an entry, with Robin Hood linear probing and
+// backward shift deletion. Probe sequences are short and contiguous and only
+// entries whose full 32 bit hash matches are looked at. Entries are in a
+// separate array and do not move when slots do. Each one holds a copy of its
+// flow's key, so comparing keys does not touch the flow, and the links of an
+// intrusive LRU list that uses entry indices instead of pointers. Not
+// thread-safe.
+class FlowTable {
+ public:
+  FlowTable();
+
+  ~FlowTable();
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  // Returns the flow with the given key and makes it the most recently used
+  // one. Returns null if there is no such flow. If index is not null and the
+  // flow is found it is set to the index of the flow's entry.
+  Flow* FindAndTouch(const FlowKey& key, uint32_t* index = nullptr);
+
+  // Returns the flow with the given key without changing the LRU order, or
+  // null if there is no such flow. If index is not null and the flow is found
+  // it is set to the index of the flow's entry.
+  Flow* Find(const FlowKey& key, uint32_t* index = nullptr) const;
+
+  // Adds a flow as the most recently used one. There should be no flow with
+  // the same key in the table. If index is not null it is set to the index of
+  // the flow's entry, which stays the same for as long as the flow is in the
+  // table and is reused once it leaves. Indices are below 2^32 - 1.
+  Flow* Insert(std::unique_ptr<Flow> flow, uint32_t* index = nullptr);
+
+  // Returns the flow at an index, or null if there is no flow there.
+  Flow* At(uint32_t index) const {
+    return index < capacity_ ? entries_[index].flow : nullptr;
+  }
+
+  // Removes and returns the flow at an index. There should be one.
+  std::unique_ptr<Flow> RemoveAt(uint32_t index) {
+    return RemoveSlot(SlotOfEntry(index));
+  }
+
+  // Removes and returns the least recently used flow. Returns null if the
+  // table is empty.
+  std::unique_ptr<Flow> PopLeastRecent();
+
+  // Removes and returns the flow with the given key. Returns null if there is
+  // no such flow.
+  std::unique_ptr<Flow> Remove(const FlowKey& key);
+
+  // Walks the flows from the most recently used one to the least recently used
+  // one. The table should not be modified during the walk.
+  class Iterator {
+   public:
+    explicit Iterator(const FlowTable& table)
+        : table_(table),
+          entry_(table.head_) {
+    }
+
+    // Returns null after the last flow.
+    const Flow* Next() {
+      if (entry_ == kNone) {
+        return nullptr;
+      }
+
+      const Entry& entry = table_.entries_[entry_];
+      entry_ = entry.next;
+      return entry.flow;
+    }
+
+   private:
+    const FlowTable& table_;
+    uint32_t entry_;
+
+    DISALLOW_COPY_AND_ASSIGN(Iterator);
+  };
+
+  // A well mixed 32 bit hash of a key.
+  static uint32_t Hash(const FlowKey& key);
+
+  // Memory allocated for the index and the entries, not counting the flows.
+  size_t SizeBytes() const {
+    return HeapBlockSize(capacity_ * sizeof(Slot))
+        + HeapBlockSize(capacity_ * sizeof(Entry));
+  }
+
+ private:
+  static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+  // Number of slots the table starts with.
+  static constexpr uint32_t kInitialCapacity = 1 << 10;
+
+  struct Slot {
+    uint32_t hash;
+
+    // kNone if the slot is empty.
+    uint32_t entry;
+  };
+
+  struct Entry {
+    // Null if the entry is free.
+    Flow* flow;
+    uint32_t hash;
+
+    // Towards the most and the least recently used flows. Free entries are
+    // linked through next.
+    uint32_t prev;
+    uint32_t next;
+
+    // The key, constructed in place while the entry is in use.
+    std::aligned_storage<sizeof(FlowKey), alignof(FlowKey)>::type key_storage;
+
+    const FlowKey& key() const {
+      return *reinterpret_cast<const FlowKey*>(&key_storage);
+    }
+  };
+
+  // Distance of the entry in a slot from the slot it hashes to.
+  uint32_t ProbeDistance(uint32_t pos, uint32_t hash) const {
+    return (pos - hash) & (capacity_ - 1);
+  }
+
+  // Returns the slot with the key, or kNone.
+  uint32_t FindSlot(const FlowKey& key, uint32_t hash) const;
+
+  // Returns the slot that points to the entry.
+  uint32_t SlotOfEntry(uint32_t entry) const;
+
+  // Puts an entry in the index.
+  void InsertSlot(uint32_t hash, uint32_t entry);
+
+  // Removes a slot from the index and frees its entry. Returns the entry's
+  // flow.
+  std::unique_ptr<Flow> RemoveSlot(uint32_t pos);
+
+  // Doubles the number of slots and entries.
+  void Grow();
+
+  void LinkFront(uint32_t entry);
+  void Unlink(uint32_t entry);
+
+  // Number of slots and entries, a power of 2.
+  uint32_t capacity_;
+  uint32_t size_;
+
+  std::unique_ptr<Slot[]> slots_;
+  std::unique_ptr<Entry[]> entries_;
+
+  // Most and least recently used entries.
+  uint32_t head_;
+  uint32_t tail_;
+
+  // First free entry.
+  uint32_t free_;
+
+  DISALLOW_COPY_AND_ASSIGN(FlowTable);
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_FLOW_TABLE_H */
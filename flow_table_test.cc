@@ -0,0 +1,162 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <random>
+#include <vector>
+
+#include "flow_table.h"
+
+namespace flowparser {
+namespace test {
+
+class FlowTableFixture : public ::testing::Test {
+ protected:
+  // A TCP flow key, different for each id.
+  static FlowKey Key(uint32_t id) {
+    pcap::SniffIp ip_header;
+    memset(&ip_header, 0, sizeof(ip_header));
+    ip_header.ip_p = IPPROTO_TCP;
+    ip_header.ip_src.s_addr = id;
+    ip_header.ip_dst.s_addr = 1;
+    return FlowKey(ip_header, id >> 16, 80);
+  }
+
+  std::unique_ptr<Flow> NewFlow(uint32_t id) {
+    return std::make_unique<Flow>(id, Key(id), flow_cfg_);
+  }
+
+  // The first_rx of each flow, which is its id, in iteration order.
+  static std::vector<uint32_t> Ids(const FlowTable& table) {
+    std::vector<uint32_t> ids;
+    FlowTable::Iterator it(table);
+    while (const Flow* flow = it.Next()) {
+      ids.push_back(flow->first_rx());
+    }
+
+    return ids;
+  }
+
+  FlowConfig flow_cfg_;
+};
+
+TEST_F(FlowTableFixture, Empty) {
+  FlowTable table;
+  ASSERT_TRUE(table.empty());
+  ASSERT_EQ(nullptr, table.FindAndTouch(Key(1)));
+  ASSERT_EQ(nullptr, table.PopLeastRecent());
+  ASSERT_EQ(nullptr, table.Remove(Key(1)));
+  ASSERT_TRUE(Ids(table).empty());
+}
+
+TEST_F(FlowTableFixture, InsertFind) {
+  FlowTable table;
+  Flow* one = table.Insert(NewFlow(1));
+  Flow* two = table.Insert(NewFlow(2));
+  ASSERT_EQ(2, table.size());
+  ASSERT_EQ(one, table.FindAndTouch(Key(1)));
+  ASSERT_EQ(two, table.FindAndTouch(Key(2)));
+  ASSERT_EQ(nullptr, table.FindAndTouch(Key(3)));
+}
+
+TEST_F(FlowTableFixture, LruOrder) {
+  FlowTable table;
+  for (uint32_t id = 1; id <= 4; ++id) {
+    table.Insert(NewFlow(id));
+  }
+
+  ASSERT_EQ(std::vector<uint32_t>( { 4, 3, 2, 1 }), Ids(table));
+  table.FindAndTouch(Key(2));
+  table.FindAndTouch(Key(4));
+  ASSERT_EQ(std::vector<uint32_t>( { 4, 2, 3, 1 }), Ids(table));
+
+  ASSERT_EQ(1, table.PopLeastRecent()->first_rx());
+  ASSERT_EQ(3, table.PopLeastRecent()->first_rx());
+  ASSERT_EQ(std::vector<uint32_t>( { 4, 2 }), Ids(table));
+}
+
+TEST_F(FlowTableFixture, Remove) {
+  FlowTable table;
+  for (uint32_t id = 1; id <= 3; ++id) {
+    table.Insert(NewFlow(id));
+  }
+
+  std::unique_ptr<Flow> flow = table.Remove(Key(2));
+  ASSERT_EQ(2, flow->first_rx());
+  ASSERT_EQ(nullptr, table.Remove(Key(2)));
+  ASSERT_EQ(nullptr, table.FindAndTouch(Key(2)));
+  ASSERT_EQ(std::vector<uint32_t>( { 3, 1 }), Ids(table));
+
+  // Can be added back.
+  table.Insert(std::move(flow));
+  ASSERT_EQ(std::vector<uint32_t>( { 2, 3, 1 }), Ids(table));
+}
+
+TEST_F(FlowTableFixture, Grow) {
+  FlowTable table;
+  size_t initial_size_bytes = table.SizeBytes();
+
+  constexpr uint32_t kNumFlows = 100000;
+  for (uint32_t id = 0; id < kNumFlows; ++id) {
+    table.Insert(NewFlow(id));
+  }
+
+  ASSERT_EQ(kNumFlows, table.size());
+  ASSERT_LT(initial_size_bytes, table.SizeBytes());
+  for (uint32_t id = 0; id < kNumFlows; ++id) {
+    Flow* flow = table.FindAndTouch(Key(id));
+    ASSERT_NE(nullptr, flow);
+    ASSERT_EQ(id, flow->first_rx());
+  }
+
+  // The LRU order survives growing.
+  for (uint32_t id = 0; id < kNumFlows; ++id) {
+    ASSERT_EQ(id, table.PopLeastRecent()->first_rx());
+  }
+  ASSERT_TRUE(table.empty());
+}
+
+// Random operations, checked against a list in LRU order. Removals shift
+// slots back, so this also checks that probe sequences stay intact.
+TEST_F(FlowTableFixture, Random) {
+  FlowTable table;
+  std::list<uint32_t> model;
+
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<uint32_t> id_dist(0, 5000);
+  std::uniform_int_distribution<int> op_dist(0, 9);
+  for (size_t i = 0; i < 200000; ++i) {
+    uint32_t id = id_dist(rnd);
+    auto it = std::find(model.begin(), model.end(), id);
+    int op = op_dist(rnd);
+    if (op < 6) {
+      Flow* flow = table.FindAndTouch(Key(id));
+      if (it == model.end()) {
+        ASSERT_EQ(nullptr, flow);
+        table.Insert(NewFlow(id));
+      } else {
+        ASSERT_NE(nullptr, flow);
+        ASSERT_EQ(id, flow->first_rx());
+        model.erase(it);
+      }
+      model.push_front(id);
+    } else if (op < 9) {
+      std::unique_ptr<Flow> flow = table.Remove(Key(id));
+      ASSERT_EQ(it == model.end(), flow == nullptr);
+      if (it != model.end()) {
+        model.erase(it);
+      }
+    } else if (!model.empty()) {
+      ASSERT_EQ(model.back(), table.PopLeastRecent()->first_rx());
+      model.pop_back();
+    }
+
+    ASSERT_EQ(model.size(), table.size());
+  }
+
+  ASSERT_EQ(std::vector<uint32_t>(model.begin(), model.end()), Ids(table));
+}
+
+}  // namespace test
+}  // namespace flowparser
@@ -5,11 +5,15 @@
 #include <pcap/pcap.h>
 #include <poll.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cstdint>
 #include <functional>
 #include <iostream>
+#include <set>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 namespace flowparser {
 
@@ -35,15 +39,7 @@ void FlowParser::PcapOpen() {
             + std::string(errbuf));
   }
 
-  int datalink = pcap_datalink(pcap_handle_);
-  if (datalink == DLT_EN10MB) {
-    datalink_offset_ = pcap::kSizeEthernet;
-  } else if (datalink == DLT_RAW) {
-    datalink_offset_ = 0;
-  } else {
-    throw std::logic_error(
-        "Unknown datalink " + std::string(pcap_datalink_val_to_name(datalink)));
-  }
+  SetDatalink(pcap_datalink(pcap_handle_));
 
   if (!config_.offline_) {
     if (pcap_lookupnet(source, &net, &mask, errbuf) == -1) {
@@ -78,86 +74,353 @@ void FlowParser::PcapOpen() {
   pcap_freecode(&fp);
 }
 
+CompiledFilter::CompiledFilter(const std::string& filter, int datalink,
+                               size_t snapshot_len) {
+  pcap_t* dead_handle = pcap_open_dead(datalink, snapshot_len);
+  if (pcap_compile(dead_handle, &program_, filter.c_str(), 0,
+                   PCAP_NETMASK_UNKNOWN) == -1) {
+    std::string error = pcap_geterr(dead_handle);
+    pcap_close(dead_handle);
+    throw std::logic_error(
+        "Could not parse filter " + filter + ", pcap said: " + error);
+  }
+
+  pcap_close(dead_handle);
+}
+
+void FlowParser::SetDatalink(int datalink) {
+  if (!LinkDecoder::Supported(datalink)) {
+    throw std::logic_error(
+        "Unknown datalink " + std::string(pcap_datalink_val_to_name(datalink)));
+  }
+
+  decoder_ = std::make_unique<LinkDecoder>(datalink, config_.decoder_config_);
+}
+
+const CompiledFilter* FlowParser::GetFilter(int datalink) {
+  if (config_.bpf_filter_.empty()) {
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(filters_mu_);
+  std::unique_ptr<CompiledFilter>& filter = filters_[datalink];
+  if (!filter) {
+    filter = std::make_unique<CompiledFilter>(config_.bpf_filter_, datalink,
+                                              PcapReader::kMaxRecordSize);
+  }
+
+  return filter.get();
+}
+
+void FlowParser::RingOpen() {
+  RingConfig ring_config = config_.ring_config_;
+  if (IsFanout() && ring_config.fanout_group == 0) {
+    ring_config.fanout_group = getpid() & 0xffff;
+  }
+
+  for (size_t i = 0; i < parsers_.size(); ++i) {
+    rings_.push_back(
+        std::make_unique<RingCapture>(config_.source_, ring_config));
+  }
+
+  SetDatalink(rings_.front()->datalink());
+
+  // There is no pcap handle to compile the filter against. The filter is
+  // attached before the rings start receiving, so that no packet gets in
+  // unfiltered.
+  CompiledFilter filter(config_.bpf_filter_, rings_.front()->datalink(),
+                        config_.snapshot_len_);
+  for (const auto& ring_ptr : rings_) {
+    ring_ptr->SetFilter(filter.program());
+    ring_ptr->Start();
+  }
+}
+
+void FlowParser::ReaderOpen() {
+  if (config_.file_set_) {
+    readers_.push_back(std::make_unique<FileSetSource>(
+        config_.source_, config_.file_set_config_,
+        [this](const std::string& error) {SendErrorToCallback(error);}));
+    return;
+  }
+
+  mapped_file_ = std::make_unique<MappedFile>(config_.source_);
+  bool compressed = DetectCompression(mapped_file_->data(),
+                                      mapped_file_->size()) != COMPRESSION_NONE;
+  std::unique_ptr<PacketSource> source = NewPacketSource(
+      NewFileInputStream(*mapped_file_));
+
+  // All packets in a pcap file have the same datalink, so problems with it or
+  // with the filter can be reported before reading.
+  PcapReader* reader = dynamic_cast<PcapReader*>(source.get());
+  if (reader != nullptr) {
+    SetDatalink(reader->datalink());
+    GetFilter(reader->datalink());
+  }
+
+  if (reader == nullptr || compressed || parsers_.size() == 1) {
+    if (parsers_.size() > 1) {
+      config_.log_callback_(
+          LogSeverity::INFO,
+          config_.source_ + " cannot be split, will read it with 1 thread");
+    }
+
+    readers_.push_back(std::move(source));
+    return;
+  }
+
+  // Splits the records into parts of roughly the same size. Part i ends where
+  // part i + 1 starts.
+  const uint8_t* begin = mapped_file_->data() + PcapReader::kFileHeaderSize;
+  const uint8_t* end = mapped_file_->data() + mapped_file_->size();
+  size_t total = end - begin;
+
+  PacketRecord first_record;
+  uint32_t min_ts_sec = 0;
+  if (reader->Next(&first_record)) {
+    min_ts_sec = first_record.timestamp / kMillion;
+  }
+
+  std::vector<const uint8_t*> boundaries = { begin };
+  for (size_t i = 1; i < parsers_.size(); ++i) {
+    const uint8_t* split = begin + total / parsers_.size() * i;
+    boundaries.push_back(reader->FindRecord(
+        std::max(split, boundaries.back()), end, min_ts_sec));
+  }
+
+  boundaries.push_back(end);
+  JoinBadParts(*reader, &boundaries);
+  for (size_t i = 0; i + 1 < boundaries.size(); ++i) {
+    readers_.push_back(std::make_unique<PcapReader>(
+        std::make_unique<MappedInputStream>(boundaries[i], boundaries[i + 1]),
+        *reader));
+  }
+}
+
+// True if the records of a pcap file that start at begin end exactly at end.
+static bool RecordsEndAt(const PcapReader& format, const uint8_t* begin,
+                         const uint8_t* end) {
+  PcapReader part(std::make_unique<MappedInputStream>(begin, end), format);
+  PacketRecord record;
+  try {
+    while (part.Next(&record)) {
+    }
+  } catch (std::exception&) {
+    return false;
+  }
+
+  return true;
+}
+
+void FlowParser::JoinBadParts(const PcapReader& format,
+                              std::vector<const uint8_t*>* boundaries) const {
+  // Parts that have been walked and end at their boundary. The last part ends
+  // at the end of the file, if it does not the file is bad and that is
+  // reported when it is read.
+  std::vector<bool> checked(boundaries->size() - 1, false);
+  checked.back() = true;
+
+  while (true) {
+    size_t num_parts = boundaries->size() - 1;
+    std::vector<uint8_t> ends_at_boundary(num_parts, 1);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_parts; ++i) {
+      if (!checked[i]) {
+        threads.push_back(std::thread([&format, boundaries,
+                                       &ends_at_boundary, i] {
+          ends_at_boundary[i] = RecordsEndAt(format, (*boundaries)[i],
+                                             (*boundaries)[i + 1]);
+        }));
+      }
+    }
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    // From the back, so that erasing does not move the parts still to be
+    // looked at.
+    bool joined = false;
+    for (size_t i = num_parts - 1; i-- > 0;) {
+      if (ends_at_boundary[i]) {
+        checked[i] = true;
+        continue;
+      }
+
+      config_.log_callback_(
+          LogSeverity::INFO,
+          "Part " + std::to_string(i) + " of " + config_.source_
+              + " does not end at a record, joining it with the next part");
+      boundaries->erase(boundaries->begin() + i + 1);
+      checked.erase(checked.begin() + i + 1);
+      checked[i] = i + 1 == checked.size();
+      joined = true;
+    }
+
+    if (!joined) {
+      return;
+    }
+  }
+}
+
+// Throws if a transport header of header_len bytes after the IP header was not
+// captured.
+static void CheckTransportLen(const char* protocol, size_t size_ip,
+                              size_t header_len, size_t len) {
+  if (size_ip + header_len > len) {
+    throw std::logic_error(
+        std::string(protocol) + " header truncated, captured len: "
+            + std::to_string(len) + ", IP header len: "
+            + std::to_string(size_ip));
+  }
+}
+
 void FlowParser::HandleTcp(uint64_t timestamp, size_t size_ip,
-                           const pcap::SniffIp& ip_header, const uint8_t* pkt) {
+                           const IpHeader& ip_header, const uint8_t* pkt,
+                           size_t len, Parser* parser) {
+  CheckTransportLen("TCP", size_ip, sizeof(pcap::SniffTcp), len);
   const pcap::SniffTcp* tcp_header = reinterpret_cast<const pcap::SniffTcp*>(pkt
-      + datalink_offset_ + size_ip);
+      + size_ip);
 
   size_t size_tcp = tcp_header->th_off * 4;
   if (size_tcp < 20) {
     throw std::logic_error("TCP header too short");
   }
 
-  parser_.TCPIpRx(ip_header, *tcp_header, timestamp);
+  parser->TCPIpRx(ip_header, *tcp_header, timestamp);
 }
 
 void FlowParser::HandleUdp(const uint64_t timestamp, size_t size_ip,
-                           const pcap::SniffIp& ip_header, const uint8_t* pkt) {
+                           const IpHeader& ip_header, const uint8_t* pkt,
+                           size_t len, Parser* parser) {
+  CheckTransportLen("UDP", size_ip, sizeof(pcap::SniffUdp), len);
   const pcap::SniffUdp* udp_header = reinterpret_cast<const pcap::SniffUdp*>(pkt
-      + datalink_offset_ + size_ip);
+      + size_ip);
 
-  parser_.UDPIpRx(ip_header, *udp_header, timestamp);
+  parser->UDPIpRx(ip_header, *udp_header, timestamp);
 }
 
 void FlowParser::HandleIcmp(const uint64_t timestamp, size_t size_ip,
-                            const pcap::SniffIp& ip_header,
-                            const uint8_t* pkt) {
+                            const IpHeader& ip_header, const uint8_t* pkt,
+                            size_t len, Parser* parser) {
+  CheckTransportLen("ICMP", size_ip, pcap::kSizeICMP, len);
   const pcap::SniffIcmp* icmp_header =
-      reinterpret_cast<const pcap::SniffIcmp*>(pkt + datalink_offset_ + size_ip);
+      reinterpret_cast<const pcap::SniffIcmp*>(pkt + size_ip);
 
-  parser_.ICMPIpRx(ip_header, *icmp_header, timestamp);
+  parser->ICMPIpRx(ip_header, *icmp_header, timestamp);
 }
 
 void FlowParser::HandleUnknown(const uint64_t timestamp,
-                               const pcap::SniffIp& ip_header) {
-  parser_.UnknownIpRx(ip_header, timestamp);
+                               const IpHeader& ip_header,
+                               Parser* parser) {
+  parser->UnknownIpRx(ip_header, timestamp);
 }
 
-// Called to handle a single packet. Will dispatch it to HandleTcp or
-// HandleUdp.This is in a free function because the pcap library expects an
-// unbound function pointer
-static void HandlePkt(u_char* flow_parser, const struct pcap_pkthdr* header,
-                      const u_char* packet) {
-  FlowParser* fparser = reinterpret_cast<FlowParser*>(flow_parser);
-
-  uint64_t timestamp = static_cast<uint64_t>(header->ts.tv_sec) * kMillion
-      + static_cast<uint64_t>(header->ts.tv_usec);
+FragmentTracker* FlowParser::TrackerFor(const Parser* parser) const {
+  for (size_t i = 0; i < parsers_.size(); ++i) {
+    if (parsers_[i].get() == parser) {
+      return fragment_trackers_[i].get();
+    }
+  }
 
-  const pcap::SniffIp* ip_header = reinterpret_cast<const pcap::SniffIp*>(packet
-      + fparser->datalink_offset());
+  throw std::logic_error("Parser not owned by this FlowParser");
+}
 
-  uint16_t off = ntohs(ip_header->ip_off);
-  if (off && !(off & IP_DF)) {
-    // Don't know how to deal with fragments yet.
+void FlowParser::HandleIpPacket(uint64_t timestamp, const uint8_t* pkt,
+                                size_t len, const Segment& segment,
+                                Parser* parser) {
+  // Packets too short for their IPv4 header are reported when dispatched.
+  const pcap::SniffIp* ip_header = reinterpret_cast<const pcap::SniffIp*>(pkt);
+  if (len < sizeof(pcap::SniffIp) || ip_header->ip_v == 6
+      || static_cast<size_t>(ip_header->ip_hl * 4) > len
+      || !FragmentTracker::IsFragment(*ip_header)) {
+    DispatchIpPacket(timestamp, pkt, len, segment, parser);
     return;
   }
 
+  TrackerFor(parser)->Add(
+      timestamp, pkt, len, segment,
+      [this, parser](uint64_t fragment_ts, const uint8_t* fragment,
+                     size_t fragment_len, const Segment& fragment_segment) {
+        DispatchIpPacket(fragment_ts, fragment, fragment_len, fragment_segment,
+                         parser);
+      });
+}
+
+void FlowParser::DispatchIpPacket(uint64_t timestamp, const uint8_t* pkt,
+                                  size_t len, const Segment& segment,
+                                  Parser* parser) {
   try {
+    // An empty packet fails the IPv4 length check below.
+    if (len > 0 && (pkt[0] >> 4) == 6) {
+      IpHeader ip6_header = IpHeader::ParseIpv6(pkt, len);
+      if (ip6_header.later_fragment) {
+        // IPv6 fragments are not tracked, and without a transport header these
+        // cannot be attributed to a flow.
+        return;
+      }
+
+      ip6_header.segment = segment;
+      DispatchTransport(timestamp, ip6_header, pkt, len, parser);
+      return;
+    }
+
+    if (len < sizeof(pcap::SniffIp)) {
+      throw std::logic_error(
+          "IP header truncated, captured len: " + std::to_string(len));
+    }
+
+    const pcap::SniffIp* ip_header =
+        reinterpret_cast<const pcap::SniffIp*>(pkt);
     size_t size_ip = ip_header->ip_hl * 4;
-    if (size_ip < 20) {
+    if (size_ip < 20 || size_ip > len) {
       throw std::logic_error(
           "Invalid IP header length: " + std::to_string(size_ip)
-              + " bytes, pcap header len: " + std::to_string(header->len));
+              + " bytes, captured len: " + std::to_string(len));
     }
 
-    switch (ip_header->ip_p) {
-      case IPPROTO_TCP:
-        fparser->HandleTcp(timestamp, size_ip, *ip_header, packet);
-        break;
-      case IPPROTO_UDP:
-        fparser->HandleUdp(timestamp, size_ip, *ip_header, packet);
-        break;
-      case IPPROTO_ICMP:
-        fparser->HandleIcmp(timestamp, size_ip, *ip_header, packet);
-        break;
-      default:
-        fparser->HandleUnknown(timestamp, *ip_header);
-    }
+    IpHeader ip4_header(*ip_header);
+    ip4_header.segment = segment;
+    DispatchTransport(timestamp, ip4_header, pkt, len, parser);
   } catch (std::exception& ex) {
-    fparser->SendErrorToCallback(ex.what());
+    SendErrorToCallback(ex.what());
+  }
+}
+
+void FlowParser::DispatchTransport(uint64_t timestamp,
+                                   const IpHeader& ip_header,
+                                   const uint8_t* pkt, size_t len,
+                                   Parser* parser) {
+  size_t size_ip = ip_header.header_len;
+  switch (ip_header.protocol) {
+    case IPPROTO_TCP:
+      HandleTcp(timestamp, size_ip, ip_header, pkt, len, parser);
+      break;
+    case IPPROTO_UDP:
+      HandleUdp(timestamp, size_ip, ip_header, pkt, len, parser);
+      break;
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+      HandleIcmp(timestamp, size_ip, ip_header, pkt, len, parser);
+      break;
+    default:
+      HandleUnknown(timestamp, ip_header, parser);
   }
 }
 
+// Called to handle a single packet. Will dispatch it to
+// FlowParser::HandlePacket. This is in a free function because the pcap library
+// expects an unbound function pointer
+static void HandlePkt(u_char* flow_parser, const struct pcap_pkthdr* header,
+                      const u_char* packet) {
+  FlowParser* fparser = reinterpret_cast<FlowParser*>(flow_parser);
+
+  uint64_t timestamp = static_cast<uint64_t>(header->ts.tv_sec) * kMillion
+      + static_cast<uint64_t>(header->ts.tv_usec);
+
+  fparser->HandlePacket(timestamp, packet, header->caplen);
+}
+
 void FlowParser::PcapLoop() {
   int ret;
 
@@ -199,6 +462,9 @@ void FlowParser::PcapLoop() {
             pcap_dispatch(pcap_handle_, -1, HandlePkt,
                           reinterpret_cast<u_char*>(this));
         }
+
+        // Flows time out even if no packets arrive.
+        parsers_.front()->ExpireFlows(WallTimeMicros());
       }
     }
   } catch (std::exception& ex) {
@@ -206,4 +472,88 @@ void FlowParser::PcapLoop() {
   }
 }
 
+void FlowParser::RingLoop(size_t index) {
+  RingCapture* ring = rings_[index].get();
+  Parser* parser = parsers_[index].get();
+
+  try {
+    config_.log_callback_(LogSeverity::INFO,
+                          "Will start listening on " + config_.source_
+                              + " using TPACKET_V3 ring "
+                              + std::to_string(index));
+
+    while (true) {
+      ring->Dispatch(
+          1000,
+          [this, parser](uint64_t timestamp, const uint8_t* pkt, size_t caplen,
+                         size_t len) {
+            Unused(len);
+            HandlePacket(timestamp, pkt, caplen, parser);
+          });
+
+      // Flows time out even if no packets arrive.
+      parser->ExpireFlows(WallTimeMicros());
+    }
+  } catch (std::exception& ex) {
+    config_.log_callback_(LogSeverity::ERROR, ex.what());
+  }
+}
+
+void FlowParser::ReaderLoop(size_t index) {
+  PacketSource* reader = readers_[index].get();
+  Parser* parser = parsers_[index].get();
+  PacketRecord record;
+
+  // Datalinks that have already been reported as not supported.
+  std::set<int> unsupported_datalinks;
+
+  std::string source = config_.source_;
+  if (readers_.size() > 1) {
+    source += " (part " + std::to_string(index) + ")";
+  }
+
+  try {
+    config_.log_callback_(LogSeverity::INFO,
+                          "Will start reading from " + source);
+
+    // The datalink can change from packet to packet, but rarely does.
+    int datalink = -1;
+    std::unique_ptr<LinkDecoder> decoder;
+    const CompiledFilter* filter = nullptr;
+
+    while (reader->Next(&record)) {
+      if (record.datalink != datalink) {
+        datalink = record.datalink;
+        decoder.reset();
+        if (LinkDecoder::Supported(datalink)) {
+          decoder = std::make_unique<LinkDecoder>(datalink,
+                                                  config_.decoder_config_);
+          filter = GetFilter(datalink);
+        } else if (unsupported_datalinks.insert(datalink).second) {
+          SendErrorToCallback(
+              "Skipping packets with unknown datalink "
+                  + std::string(pcap_datalink_val_to_name(datalink)));
+        }
+      }
+
+      if (!decoder) {
+        continue;
+      }
+
+      if (filter && !filter->Matches(record.data, record.caplen, record.len)) {
+        continue;
+      }
+
+      HandleDecodedPacket(record.timestamp, *decoder, record.data,
+                          record.caplen, parser);
+    }
+
+    config_.log_callback_(LogSeverity::INFO, "Done reading from " + source);
+  } catch (std::exception& ex) {
+    config_.log_callback_(
+        LogSeverity::ERROR,
+        "Error while reading from " + source + ": " + ex.what());
+  }
+}
+
 }
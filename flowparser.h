@@ -4,12 +4,24 @@
 #include <pcap/pcap.h>
 #include <cstdint>
 #include <exception>
+#include <stdexcept>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
-
+#include <thread>
+#include <vector>
+
+#include "decompress_stream.h"
+#include "file_set.h"
+#include "fragment_tracker.h"
+#include "input_stream.h"
+#include "link_decoder.h"
 #include "parser.h"
+#include "pcap_reader.h"
+#include "ring_capture.h"
 #include "sniff.h"
 
 namespace flowparser {
@@ -19,24 +31,93 @@ enum LogSeverity {
   INFO
 };
 
+// A BPF program compiled without an open pcap handle. Used to filter packets
+// that do not come from pcap.
+class CompiledFilter {
+ public:
+  // Compiles the filter for the given datalink. Throws if the filter is
+  // invalid.
+  CompiledFilter(const std::string& filter, int datalink, size_t snapshot_len);
+
+  ~CompiledFilter() {
+    pcap_freecode(&program_);
+  }
+
+  const bpf_program& program() const {
+    return program_;
+  }
+
+  // Runs the filter on a packet.
+  bool Matches(const uint8_t* pkt, uint32_t caplen, uint32_t len) const {
+    pcap_pkthdr header;
+    header.ts.tv_sec = 0;
+    header.ts.tv_usec = 0;
+    header.caplen = caplen;
+    header.len = len;
+
+    return pcap_offline_filter(&program_, &header, pkt) != 0;
+  }
+
+ private:
+  bpf_program program_;
+
+  DISALLOW_COPY_AND_ASSIGN(CompiledFilter);
+};
+
 class FlowParserConfig {
  public:
   typedef std::function<void(LogSeverity level, std::string what)> LogCallback;
 
+  // How packets are read from a live device.
+  enum LiveBackend {
+    // libpcap's pcap_open_live and pcap_dispatch.
+    LIVE_PCAP,
+    // A memory-mapped AF_PACKET TPACKET_V3 block ring (Linux only).
+    LIVE_TPACKET_V3
+  };
+
+  // How packets are read from a file.
+  enum OfflineReader {
+    // libpcap's pcap_open_offline and pcap_loop.
+    OFFLINE_PCAP,
+    // The file is mapped into memory and records are read in place. Files
+    // compressed with gzip, zstd or lz4 (if support for them was compiled in)
+    // are decompressed on a read-ahead thread. Compressed files are always
+    // read this way.
+    OFFLINE_MMAP
+  };
+
   FlowParserConfig()
       : offline_(false),
+        file_set_(false),
+        offline_reader_(OFFLINE_PCAP),
+        live_backend_(LIVE_PCAP),
+        fanout_threads_(1),
+        offline_threads_(1),
         snapshot_len_(100),
-        bpf_filter_("ip") {
+        bpf_filter_("") {
   }
 
   void OfflineTrace(const std::string& filename) {
     source_ = filename;
     offline_ = true;
+    file_set_ = false;
+  }
+
+  // Reads all capture files in a directory, or all files matching a glob
+  // pattern, as a single trace. Files are read in order of their first packets
+  // into the same parser, so flows continue from one file to the next. Files
+  // are always read by the native reader, with a single thread.
+  void OfflineTraceSet(const std::string& pattern) {
+    source_ = pattern;
+    offline_ = true;
+    file_set_ = true;
   }
 
   void OnlineTrace(const std::string& iface) {
     source_ = iface;
     offline_ = false;
+    file_set_ = false;
   }
 
   void FlowQueue(std::shared_ptr<Parser::FlowQueue> flow_queue) {
@@ -51,6 +132,61 @@ class FlowParserConfig {
     bpf_filter_ = filter;
   }
 
+  void SetOfflineReader(OfflineReader offline_reader) {
+    offline_reader_ = offline_reader;
+  }
+
+  void SetLiveBackend(LiveBackend live_backend) {
+    live_backend_ = live_backend;
+  }
+
+  RingConfig* MutableRingConfig() {
+    return &ring_config_;
+  }
+
+  // How VLAN tags, MPLS labels and tunnels in front of the IP header are
+  // handled.
+  DecoderConfig* MutableDecoderConfig() {
+    return &decoder_config_;
+  }
+
+  // How IPv4 fragments are tracked. Each parser has its own tracker.
+  FragmentConfig* MutableFragmentConfig() {
+    return &fragment_config_;
+  }
+
+  // Only used with OfflineTraceSet. If tailing is enabled RunTrace does not
+  // return, it keeps waiting for new files like it would for packets from a
+  // live device.
+  FileSetSource::Config* MutableFileSetConfig() {
+    return &file_set_config_;
+  }
+
+  // Number of capture threads when capturing with LIVE_TPACKET_V3. If more
+  // than 1 that many sockets are opened in the same PACKET_FANOUT group and
+  // each one is read by its own thread into its own Parser. All parsers
+  // produce to the same flow queue. The soft memory limit, the low watermark,
+  // the micro-flow table and the sketch-only rate of the parser config are
+  // split evenly between the parsers, so that they hold for all of them
+  // together. Periodic callbacks are called by each parser, concurrently.
+  void SetFanoutThreads(size_t fanout_threads) {
+    fanout_threads_ = fanout_threads;
+  }
+
+  // Number of threads to read a file with when reading with OFFLINE_MMAP. If
+  // more than 1 the file is split into that many parts, each one is parsed by
+  // its own thread into its own Parser and at the end the parsers are merged.
+  // Flows that are collected at the end are the same as with a single thread,
+  // but each parser gets an equal part of the soft memory limit, the low
+  // watermark and the micro-flow table, and flows that are collected early
+  // because of the limit, or because they time out, are not merged. Periodic
+  // callbacks are called by each parser, concurrently and in the packet time
+  // of its own part. Only classic pcap files can be split and undersampling is
+  // not supported.
+  void SetOfflineThreads(size_t offline_threads) {
+    offline_threads_ = offline_threads;
+  }
+
   ParserConfig* MutableParserConfig() {
     return &parser_config_;
   }
@@ -63,10 +199,41 @@ class FlowParserConfig {
   // If the source is a filename offline_ should be set to true.
   bool offline_;
 
+  // If the source is a directory or glob pattern file_set_ should be set to
+  // true.
+  bool file_set_;
+
+  // How the files of a set are read. Only used if file_set_ is true.
+  FileSetSource::Config file_set_config_;
+
+  // The reader used when the source is a file.
+  OfflineReader offline_reader_;
+
+  // The backend used when capturing from a live device.
+  LiveBackend live_backend_;
+
+  // Configuration of the packet ring. Only used with LIVE_TPACKET_V3.
+  RingConfig ring_config_;
+
+  // Configuration of the datalink decoders.
+  DecoderConfig decoder_config_;
+
+  // Configuration of the fragment trackers.
+  FragmentConfig fragment_config_;
+
+  // Number of capture threads (and parsers). Only used with LIVE_TPACKET_V3.
+  size_t fanout_threads_;
+
+  // Number of threads (and parsers) to read a file with. Only used with
+  // OFFLINE_MMAP.
+  size_t offline_threads_;
+
   // Snapshot length passed to pcap. Only used if capturing from a live device.
   size_t snapshot_len_;
 
-  // The BPF filter to use when capturing.
+  // The BPF filter to use when capturing. Empty by default -- packets that are
+  // not IP are skipped by the decoder anyway, and a filter like "ip" would not
+  // match VLAN-tagged or MPLS packets.
   std::string bpf_filter_;
 
   // Each parser will be constructed with this config.
@@ -87,9 +254,37 @@ class FlowParser {
  public:
   FlowParser(const FlowParserConfig& config)
       : config_(config),
-        pcap_handle_(nullptr),
-        datalink_offset_(0),
-        parser_(config.parser_config_, config.flow_queue_) {
+        pcap_handle_(nullptr) {
+    size_t num_parsers = 1;
+    if (IsFanout()) {
+      num_parsers = config_.fanout_threads_;
+    } else if (IsParallelOffline()) {
+      if (config_.parser_config_.undersample_skip_count() != 1) {
+        throw std::logic_error(
+            "Cannot undersample when reading a file with more than one thread");
+      }
+
+      num_parsers = config_.offline_threads_;
+    }
+
+    ParserConfig parser_config = config_.parser_config_;
+    if (num_parsers > 1) {
+      parser_config = config_.parser_config_.Split(num_parsers);
+    }
+
+    // Each part of a file is all packets of its stretch of time, so it comes
+    // at the full rate.
+    if (IsParallelOffline()) {
+      parser_config.set_sketch_only_pkts_per_sec(
+          config_.parser_config_.sketch_only_pkts_per_sec());
+    }
+
+    for (size_t i = 0; i < num_parsers; ++i) {
+      parsers_.push_back(
+          std::make_unique<Parser>(parser_config, config_.flow_queue_));
+      fragment_trackers_.push_back(
+          std::make_unique<FragmentTracker>(config.fragment_config_));
+    }
   }
 
   ~FlowParser() {
@@ -99,59 +294,323 @@ class FlowParser {
   }
 
   // Handles a single TCP packet. This function will do the appropriate casting
-  // and send the packet to the TCPFlowParser.
+  // and send the packet to the parser. In this and the methods below pkt points
+  // to the start of the IP header and len bytes of it were captured. Throws if
+  // the transport header was not captured.
   void HandleTcp(uint64_t timestamp, size_t size_ip,
-                 const pcap::SniffIp& ip_header, const uint8_t* pkt);
+                 const IpHeader& ip_header, const uint8_t* pkt, size_t len,
+                 Parser* parser);
 
   // Handles a single UDP packet.
   void HandleUdp(const uint64_t timestamp, size_t size_ip,
-                 const pcap::SniffIp& ip_header, const uint8_t* pkt);
+                 const IpHeader& ip_header, const uint8_t* pkt, size_t len,
+                 Parser* parser);
 
   // Handles a single ICMP packet.
   void HandleIcmp(const uint64_t timestamp, size_t size_ip,
-                  const pcap::SniffIp& ip_header, const uint8_t* pkt);
+                  const IpHeader& ip_header, const uint8_t* pkt, size_t len,
+                  Parser* parser);
 
   // Handles a single packet from an unknown transport protocol.
-  void HandleUnknown(const uint64_t timestamp, const pcap::SniffIp& ip_header);
+  void HandleUnknown(const uint64_t timestamp, const IpHeader& ip_header,
+                     Parser* parser);
+
+  // Handles a single packet that starts with an IPv4 or IPv6 header, len bytes
+  // of which were captured. Will dispatch it to one of the methods above. IPv4
+  // fragments go through the parser's fragment tracker first.
+  void HandleIpPacket(uint64_t timestamp, const uint8_t* pkt, size_t len,
+                      const Segment& segment, Parser* parser);
+
+  // Handles a single packet that starts with a datalink header of the type the
+  // source was opened with. Packets that do not carry IP are skipped.
+  void HandlePacket(uint64_t timestamp, const uint8_t* packet, size_t caplen,
+                    Parser* parser) {
+    HandleDecodedPacket(timestamp, *decoder_, packet, caplen, parser);
+  }
 
-  size_t datalink_offset() const {
-    return datalink_offset_;
+  // Same as above, but sends the packet to the first parser.
+  void HandlePacket(uint64_t timestamp, const uint8_t* packet, size_t caplen) {
+    HandlePacket(timestamp, packet, caplen, parsers_.front().get());
   }
 
+  // The first (and unless capturing with more than one fanout thread, only)
+  // parser. When reading a file with more than one thread all flows end up in
+  // this parser once RunTrace returns.
   const Parser& parser() const {
-    return parser_;
+    return *parsers_.front();
+  }
+
+  // Number of parsers. Each fanout or offline thread has its own parser.
+  size_t num_parsers() const {
+    return parsers_.size();
+  }
+
+  const Parser& parser(size_t index) const {
+    return *parsers_.at(index);
+  }
+
+  // Returns the info of all parsers added together.
+  ParserInfo GetInfo() const {
+    ParserInfo info;
+    for (const auto& parser_ptr : parsers_) {
+      auto lock = parser_ptr->GetLock();
+      info.Add(parser_ptr->GetInfoNoLock());
+    }
+
+    return info;
+  }
+
+  // Returns the heavy hitters of all parsers merged. Throws if heavy hitters
+  // are not enabled.
+  HeavyHitters GetHeavyHitters(bool clear = false) const {
+    HeavyHitters heavy_hitters = parsers_.front()->GetHeavyHitters(clear);
+    for (size_t i = 1; i < parsers_.size(); ++i) {
+      heavy_hitters.Merge(parsers_[i]->GetHeavyHitters(clear));
+    }
+
+    return heavy_hitters;
+  }
+
+  // Returns the spread sketches of all parsers merged. Throws if they are not
+  // enabled.
+  Spreaders GetSpreaders(bool clear = false) const {
+    Spreaders spreaders = parsers_.front()->GetSpreaders(clear);
+    for (size_t i = 1; i < parsers_.size(); ++i) {
+      spreaders.Merge(parsers_[i]->GetSpreaders(clear));
+    }
+
+    return spreaders;
+  }
+
+  // Switches all parsers in or out of sketch-only mode, for example when an
+  // attack starts and ends. Throws if the traffic sketch is not enabled.
+  void SetSketchOnly(bool sketch_only) {
+    for (const auto& parser_ptr : parsers_) {
+      parser_ptr->SetSketchOnly(sketch_only);
+    }
+  }
+
+  // Returns the traffic sketches of all parsers merged. Throws if they are not
+  // enabled.
+  TrafficSketch GetTrafficSketch(bool clear = false) const {
+    TrafficSketch traffic_sketch = parsers_.front()->GetTrafficSketch(clear);
+    for (size_t i = 1; i < parsers_.size(); ++i) {
+      traffic_sketch.Merge(parsers_[i]->GetTrafficSketch(clear));
+    }
+
+    return traffic_sketch;
   }
 
   void SendErrorToCallback(const std::string& error) const {
     config_.log_callback_(LogSeverity::ERROR, error);
   }
 
+  // Returns the counters of the fragment trackers, added together.
+  FragmentStats GetFragmentStats() const {
+    FragmentStats total;
+    for (const auto& tracker_ptr : fragment_trackers_) {
+      FragmentStats stats = tracker_ptr->GetStats();
+      total.fragments += stats.fragments;
+      total.held += stats.held;
+      total.expired += stats.expired;
+      total.evicted += stats.evicted;
+      total.datagrams_in_mem += stats.datagrams_in_mem;
+      total.mem_usage_bytes += stats.mem_usage_bytes;
+    }
+
+    return total;
+  }
+
+  // Returns the drop counters of the packet rings, added together. All
+  // counters are 0 unless capturing with LIVE_TPACKET_V3.
+  RingStats GetRingStats() const {
+    RingStats total;
+    for (const auto& ring_ptr : rings_) {
+      RingStats stats = ring_ptr->GetStats();
+      total.packets += stats.packets;
+      total.drops += stats.drops;
+      total.freeze_queue_count += stats.freeze_queue_count;
+    }
+
+    return total;
+  }
+
   void RunTrace() {
-    PcapOpen();
-    PcapLoop();
+    if (!config_.offline_
+        && config_.live_backend_ == FlowParserConfig::LIVE_TPACKET_V3) {
+      RingOpen();
+
+      // The calling thread reads from the first ring.
+      std::vector<std::thread> threads;
+      for (size_t i = 1; i < rings_.size(); ++i) {
+        threads.push_back(std::thread([this, i] {RingLoop(i);}));
+      }
+
+      RingLoop(0);
+      for (auto& thread : threads) {
+        thread.join();
+      }
+    } else if (UseNativeReader()) {
+      ReaderOpen();
+
+      // The calling thread reads the first part of the file.
+      std::vector<std::thread> threads;
+      for (size_t i = 1; i < readers_.size(); ++i) {
+        threads.push_back(std::thread([this, i] {ReaderLoop(i);}));
+      }
+
+      ReaderLoop(0);
+      for (auto& thread : threads) {
+        thread.join();
+      }
+
+      // Each part of the file comes after the previous one, so merging in order
+      // gives the same flows as reading the file with a single parser.
+      for (size_t i = 1; i < parsers_.size(); ++i) {
+        parsers_.front()->MergeFrom(parsers_[i].get());
+      }
+    } else {
+      PcapOpen();
+      PcapLoop();
+    }
+
     config_.log_callback_(LogSeverity::INFO, "Done parsing PCAP file");
 
-    parser_.CollectAllFlows();
+    for (const auto& tracker_ptr : fragment_trackers_) {
+      tracker_ptr->ExpireAll();
+    }
+
+    for (const auto& parser_ptr : parsers_) {
+      parser_ptr->FlushAllFlows();
+    }
+
+    if (config_.flow_queue_) {
+      config_.flow_queue_->Close();
+    }
   }
 
  private:
+  // True if more than one ring should be opened in a fanout group.
+  bool IsFanout() const {
+    return !config_.offline_
+        && config_.live_backend_ == FlowParserConfig::LIVE_TPACKET_V3
+        && config_.fanout_threads_ > 1;
+  }
+
   // Opens the source, compiles the filter provided (if any) and checks that the
   // datalink is supported.
   void PcapOpen();
 
   void PcapLoop();
 
+  // Same as PcapOpen, but sets up one TPACKET_V3 ring per parser instead of a
+  // pcap handle.
+  void RingOpen();
+
+  // Reads packets from a single ring into the parser with the same index.
+  void RingLoop(size_t index);
+
+  // Decodes a packet that starts with a datalink header and handles it if it
+  // carries IP.
+  void HandleDecodedPacket(uint64_t timestamp, const LinkDecoder& decoder,
+                           const uint8_t* packet, size_t caplen,
+                           Parser* parser) {
+    DecodedPacket decoded;
+    if (decoder.Decode(packet, caplen, &decoded)) {
+      HandleIpPacket(timestamp, packet + decoded.offset,
+                     caplen - decoded.offset, decoded.segment, parser);
+    }
+  }
+
+  // Handles a packet that starts with an IP header and is either not a
+  // fragment or has been passed on by a fragment tracker. Packets too short
+  // for their headers are reported to the log callback and skipped.
+  void DispatchIpPacket(uint64_t timestamp, const uint8_t* pkt, size_t len,
+                        const Segment& segment, Parser* parser);
+
+  // Calls the handler for the transport protocol of a packet, len bytes of
+  // which were captured.
+  void DispatchTransport(uint64_t timestamp, const IpHeader& ip_header,
+                         const uint8_t* pkt, size_t len, Parser* parser);
+
+  // The fragment tracker used for packets that go to a parser.
+  FragmentTracker* TrackerFor(const Parser* parser) const;
+
+  // True if the source is a file that should be read by a native reader
+  // instead of libpcap.
+  bool UseNativeReader() const {
+    return config_.offline_
+        && (config_.file_set_
+            || config_.offline_reader_ == FlowParserConfig::OFFLINE_MMAP
+            || DetectFileCompression(config_.source_) != COMPRESSION_NONE);
+  }
+
+  // True if a file should be split into parts read by different threads.
+  bool IsParallelOffline() const {
+    return config_.offline_
+        && !config_.file_set_
+        && config_.offline_reader_ == FlowParserConfig::OFFLINE_MMAP
+        && config_.offline_threads_ > 1;
+  }
+
+  // Same as PcapOpen, but maps the file and sets up one native reader per
+  // parser. Each reader reads a different part of the file. Files that cannot
+  // be split (all but uncompressed classic pcap) are read by a single reader,
+  // as are file sets.
+  void ReaderOpen();
+
+  // A part boundary that is not a real record boundary is crossed by the
+  // record before it, and the part after it starts in the middle of a record.
+  // Before any packet is handled the record headers of each part are walked,
+  // in parallel, and a part that does not end exactly at its boundary is
+  // joined with the next one, until all parts do. Walking the headers is cheap
+  // compared to handling the packets, and brings the file into memory.
+  void JoinBadParts(const PcapReader& format,
+                    std::vector<const uint8_t*>* boundaries) const;
+
+  // Reads packets from a single reader into the parser with the same index.
+  void ReaderLoop(size_t index);
+
+  // Sets decoder_ based on a pcap DLT_ value. Throws if the datalink is not
+  // supported.
+  void SetDatalink(int datalink);
+
+  // Returns the filter compiled for a datalink, compiling it if needed. Returns
+  // null if there is no filter. Can be called from more than one thread.
+  const CompiledFilter* GetFilter(int datalink);
+
   // The configuration to be used.
   const FlowParserConfig config_;
 
   // A raw pointer to pcap. Will be cleaned up in destructor.
   pcap_t* pcap_handle_;
 
-  // Depending on the data link the ip+tcp/udp headers may be at different
-  // offsets. This is set in PcapOpen.
-  size_t datalink_offset_;
+  // The packet rings. Only set if capturing with LIVE_TPACKET_V3. Ring i is
+  // read into parser i.
+  std::vector<std::unique_ptr<RingCapture>> rings_;
+
+  // The mapped file and the readers over it. Only set if reading with
+  // OFFLINE_MMAP. Reader i is read into parser i. A file set maps its own
+  // files.
+  std::unique_ptr<MappedFile> mapped_file_;
+  std::vector<std::unique_ptr<PacketSource>> readers_;
+
+  // Filters for packets that do not come from pcap, by datalink. A capture
+  // file can have packets with different datalinks. Protected by filters_mu_.
+  std::map<int, std::unique_ptr<CompiledFilter>> filters_;
+  std::mutex filters_mu_;
+
+  // Finds the IP headers of packets from pcap or the rings. This is set in
+  // PcapOpen and RingOpen. Packets from native readers carry their own
+  // datalink and each reader has its own decoder.
+  std::unique_ptr<LinkDecoder> decoder_;
+
+  // The parsers. There is more than one only when capturing with more than one
+  // fanout thread or when reading a file with more than one thread.
+  std::vector<std::unique_ptr<Parser>> parsers_;
 
-  Parser parser_;
+  // Fragment tracker i is used for packets that go to parser i.
+  std::vector<std::unique_ptr<FragmentTracker>> fragment_trackers_;
 };
 
 }
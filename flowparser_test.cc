@@ -1,5 +1,7 @@
 // This file contains only various end-to-end test of the tool.
 
+#include <unistd.h>
+#include <cstdio>
 #include <random>
 #include <fstream>
 #include <streambuf>
@@ -9,6 +11,14 @@
 #include "gtest/gtest.h"
 #include "flowparser.h"
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
 namespace flowparser {
 namespace test {
 
@@ -57,6 +67,11 @@ static void ParseSummary(const string filename, SummaryMap* map) {
 
 static void AddToSummary(const FlowKey& key, const FlowInfo& info,
                          SummaryMap* map) {
+  // The summary only lists IPv4 conversations.
+  if (key.ipv6()) {
+    return;
+  }
+
   uint32_t src = key.src();
   uint32_t dst = key.dst();
 
@@ -79,6 +94,48 @@ static size_t CountPkts(const Flow& flow) {
   return count;
 }
 
+// Writes a pcap file of Ethernet packets, each captured up to its size, and
+// returns its name.
+static string WritePcap(const std::vector<std::vector<uint8_t>>& pkts) {
+  std::vector<uint32_t> words = { 0xa1b2c3d4, 2 | (4 << 16), 0, 0, 65535, 1 };
+  std::string data(reinterpret_cast<const char*>(words.data()),
+                   words.size() * sizeof(uint32_t));
+  for (size_t i = 0; i < pkts.size(); ++i) {
+    std::vector<uint32_t> header = { 1, static_cast<uint32_t>(i),
+        static_cast<uint32_t>(pkts[i].size()), 1500 };
+    data.append(reinterpret_cast<const char*>(header.data()),
+                header.size() * sizeof(uint32_t));
+    data.append(pkts[i].begin(), pkts[i].end());
+  }
+
+  char filename[] = "/tmp/flowparser_test_XXXXXX";
+  int fd = mkstemp(filename);
+  if (fd != -1) {
+    close(fd);
+  }
+
+  std::ofstream out(filename, std::ios::binary);
+  out.write(data.data(), data.size());
+  return filename;
+}
+
+// An Ethernet packet with an IPv4 header of the given protocol and a 20 byte
+// transport header after it.
+static std::vector<uint8_t> Ipv4Packet(uint8_t protocol) {
+  std::vector<uint8_t> pkt(14 + 20 + 20);
+  pkt[12] = 0x08;
+  pkt[14] = 0x45;
+  pkt[17] = 40;
+  pkt[23] = protocol;
+  pkt[26] = 10;
+  pkt[30] = 10;
+  pkt[31] = 1;
+
+  // The TCP data offset.
+  pkt[14 + 20 + 12] = 5 << 4;
+  return pkt;
+}
+
 // A fixture that sets up a FlowParserConfig for tests.
 class FlowParserFixture : public ::testing::Test {
  protected:
@@ -103,6 +160,16 @@ TEST_F(FlowParserFixture, BadFileOpen) {
   ASSERT_THROW(fp.RunTrace(), std::exception);
 }
 
+// Tests that opening a ring on a missing device fails.
+TEST_F(FlowParserFixture, BadRingDeviceOpen) {
+  cfg_.OnlineTrace("some_missing_dummy_device");
+  cfg_.SetLiveBackend(FlowParserConfig::LIVE_TPACKET_V3);
+
+  FlowParser fp(cfg_);
+  ASSERT_THROW(fp.RunTrace(), std::exception);
+  ASSERT_EQ(0, fp.GetRingStats().drops);
+}
+
 TEST_F(FlowParserFixture, FirstLastTimestamps) {
   FlowParser fp(cfg_);
   fp.RunTrace();
@@ -169,9 +236,264 @@ TEST_F(FlowParserFixture, IteratorPacketCount) {
   fp.RunTrace();
   th.join();
 
-  // The trace also has 24 IPv6 packets that we are not seeing - the default
-  // BPF filter is "ip"
-  ASSERT_EQ(9976, count);
+  // The trace has 24 IPv6 and 9976 IPv4 packets. Of the IPv4 packets 18 are
+  // fragments, but only 3 of those are first fragments. The other 15 belong to
+  // datagrams whose first fragment was not captured, so they cannot be
+  // attributed to a flow.
+  ASSERT_EQ(9985, count);
+}
+
+// Same as above, but the trace is read by the native pcapng reader.
+TEST_F(FlowParserFixture, MmapIteratorPacketCount) {
+  size_t count = 0;
+
+  auto queue_ptr = std::make_shared<Parser::FlowQueue>();
+  cfg_.FlowQueue(queue_ptr);
+  cfg_.SetOfflineReader(FlowParserConfig::OFFLINE_MMAP);
+
+  FlowParser fp(cfg_);
+
+  std::thread th([&queue_ptr, &count] {
+    while (true) {
+      std::unique_ptr<Flow> flow_ptr = queue_ptr->ConsumeOrBlock();
+      if (!flow_ptr) {
+        break;
+      }
+
+      count += CountPkts(*flow_ptr);
+    }
+  });
+
+  fp.RunTrace();
+  th.join();
+
+  ASSERT_EQ(9985, count);
+  ASSERT_EQ(1369832230607047UL, fp.parser().GetInfoNoLock().first_rx);
+  ASSERT_EQ(1369832230644311UL, fp.parser().GetInfoNoLock().last_rx);
+
+  FragmentStats stats = fp.GetFragmentStats();
+  ASSERT_EQ(18, stats.fragments);
+  ASSERT_EQ(15, stats.held);
+  ASSERT_EQ(15, stats.expired);
+  ASSERT_EQ(0, stats.datagrams_in_mem);
+}
+
+#ifdef HAVE_LIBZ
+// Same as above, but the trace is compressed. Compressed files are read by the
+// native reader even if OFFLINE_PCAP is set.
+TEST_F(FlowParserFixture, GzipIteratorPacketCount) {
+  std::ifstream in("test_data/output_dump", std::ios::binary);
+  std::string trace((std::istreambuf_iterator<char>(in)),
+                    std::istreambuf_iterator<char>());
+
+  char filename[] = "/tmp/flowparser_test_XXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT_NE(-1, fd);
+  gzFile out = gzdopen(fd, "wb");
+  ASSERT_EQ(trace.size(), gzwrite(out, trace.data(), trace.size()));
+  gzclose(out);
+
+  size_t count = 0;
+  auto queue_ptr = std::make_shared<Parser::FlowQueue>();
+  cfg_.FlowQueue(queue_ptr);
+  cfg_.OfflineTrace(filename);
+
+  FlowParser fp(cfg_);
+
+  std::thread th([&queue_ptr, &count] {
+    while (true) {
+      std::unique_ptr<Flow> flow_ptr = queue_ptr->ConsumeOrBlock();
+      if (!flow_ptr) {
+        break;
+      }
+
+      count += CountPkts(*flow_ptr);
+    }
+  });
+
+  fp.RunTrace();
+  th.join();
+  remove(filename);
+
+  ASSERT_EQ(9985, count);
+}
+#endif
+
+// Same as MmapIteratorPacketCount, but the trace is read as a set of files
+// that has only one file in it.
+TEST_F(FlowParserFixture, TraceSetPacketCount) {
+  size_t count = 0;
+
+  auto queue_ptr = std::make_shared<Parser::FlowQueue>();
+  cfg_.FlowQueue(queue_ptr);
+  cfg_.OfflineTraceSet("test_data/output_*");
+
+  FlowParser fp(cfg_);
+
+  std::thread th([&queue_ptr, &count] {
+    while (true) {
+      std::unique_ptr<Flow> flow_ptr = queue_ptr->ConsumeOrBlock();
+      if (!flow_ptr) {
+        break;
+      }
+
+      count += CountPkts(*flow_ptr);
+    }
+  });
+
+  fp.RunTrace();
+  th.join();
+
+  ASSERT_EQ(9985, count);
+}
+
+// Tests that packets too short for their IP or transport headers are reported
+// and skipped.
+TEST_F(FlowParserFixture, TruncatedPackets) {
+  std::vector<std::vector<uint8_t>> pkts;
+  pkts.push_back(Ipv4Packet(IPPROTO_TCP));
+
+  // Part of an IP header.
+  pkts.push_back(Ipv4Packet(IPPROTO_TCP));
+  pkts.back().resize(14 + 10);
+
+  // An IP header longer than what was captured.
+  pkts.push_back(Ipv4Packet(IPPROTO_TCP));
+  pkts.back()[14] = 0x4f;
+
+  // Part of each transport header.
+  pkts.push_back(Ipv4Packet(IPPROTO_TCP));
+  pkts.back().resize(14 + 20 + 19);
+  pkts.push_back(Ipv4Packet(IPPROTO_UDP));
+  pkts.back().resize(14 + 20 + 7);
+  pkts.push_back(Ipv4Packet(IPPROTO_ICMP));
+  pkts.back().resize(14 + 20 + 4);
+
+  // Part of an IPv6 header, at the end of the file.
+  pkts.push_back(std::vector<uint8_t>(14 + 30));
+  pkts.back()[12] = 0x86;
+  pkts.back()[13] = 0xdd;
+  pkts.back()[14] = 0x60;
+
+  string filename = WritePcap(pkts);
+  std::vector<string> errors;
+  cfg_.OfflineTrace(filename);
+  cfg_.SetOfflineReader(FlowParserConfig::OFFLINE_MMAP);
+  cfg_.SetLogCallback([&errors](LogSeverity level, std::string what) {
+    if (level == LogSeverity::ERROR) {
+      errors.push_back(what);
+    }
+  });
+
+  auto queue_ptr = std::make_shared<Parser::FlowQueue>();
+  cfg_.FlowQueue(queue_ptr);
+
+  FlowParser fp(cfg_);
+  fp.RunTrace();
+  remove(filename.c_str());
+
+  ASSERT_EQ(6, errors.size());
+  ASSERT_EQ(1, fp.parser().GetInfoNoLock().total_pkts_seen);
+}
+
+// Reads a pcap file with the given number of threads and returns the number of
+// packets seen. Errors are added to errors.
+static uint64_t PktsSeen(const string& filename, size_t threads,
+                         std::vector<string>* errors) {
+  FlowParserConfig cfg;
+  std::mutex errors_mu;
+  cfg.OfflineTrace(filename);
+  cfg.SetOfflineReader(FlowParserConfig::OFFLINE_MMAP);
+  cfg.SetOfflineThreads(threads);
+  cfg.SetLogCallback([&errors_mu, errors](LogSeverity level, std::string what) {
+    if (level == LogSeverity::ERROR) {
+      std::lock_guard<std::mutex> lock(errors_mu);
+      errors->push_back(what);
+    }
+  });
+
+  auto queue_ptr = std::make_shared<Parser::FlowQueue>();
+  cfg.FlowQueue(queue_ptr);
+
+  FlowParser fp(cfg);
+  fp.RunTrace();
+  return fp.parser().GetInfoNoLock().total_pkts_seen;
+}
+
+// Tests that a file split where a packet's payload looks like records is read
+// the same as with a single thread.
+TEST_F(FlowParserFixture, BadSplit) {
+  std::vector<std::vector<uint8_t>> pkts;
+  for (uint8_t i = 0; i < 4; ++i) {
+    pkts.push_back(Ipv4Packet(IPPROTO_TCP));
+    pkts.back()[33] = i;
+  }
+
+  // The payload of the second packet is a chain of records, each with a 16 byte
+  // header and 16 zero bytes, that ends where the packet does. The split in
+  // the middle of the file finds them.
+  std::vector<uint32_t> fake_header = { 1, 0, 16, 16 };
+  for (size_t i = 0; i < 100; ++i) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(fake_header.data());
+    pkts[1].insert(pkts[1].end(), bytes, bytes + 16);
+    pkts[1].resize(pkts[1].size() + 16);
+  }
+
+  string filename = WritePcap(pkts);
+  std::vector<string> errors;
+  uint64_t serial = PktsSeen(filename, 1, &errors);
+  uint64_t split = PktsSeen(filename, 2, &errors);
+  remove(filename.c_str());
+
+  ASSERT_TRUE(errors.empty());
+  ASSERT_EQ(4, serial);
+  ASSERT_EQ(serial, split);
+}
+
+// Tests that the limits of the parser config hold for all parsers together.
+TEST_F(FlowParserFixture, ParallelParserConfig) {
+  ParserConfig* parser_config = cfg_.MutableParserConfig();
+  parser_config->set_soft_mem_limit(4000000);
+  parser_config->set_micro_flow_table_size(1024);
+  parser_config->set_traffic_sketch_width(64);
+  parser_config->set_sketch_only_pkts_per_sec(400);
+  parser_config->set_inactive_timeout(1234);
+  parser_config->add_periodic_callback([](const Parser& parser) {
+    Unused(parser);
+  });
+
+  cfg_.OnlineTrace("some_dummy_device");
+  cfg_.SetLiveBackend(FlowParserConfig::LIVE_TPACKET_V3);
+  cfg_.SetFanoutThreads(4);
+  FlowParser fanout(cfg_);
+  ASSERT_EQ(4, fanout.num_parsers());
+  for (size_t i = 0; i < fanout.num_parsers(); ++i) {
+    const ParserConfig& config = fanout.parser(i).parser_config();
+    ASSERT_EQ(1000000, config.soft_mem_limit());
+    ASSERT_EQ(256, config.micro_flow_table_size());
+    ASSERT_EQ(100, config.sketch_only_pkts_per_sec());
+    ASSERT_EQ(1234, config.inactive_timeout());
+
+    // Each parser calls the periodic callbacks with its own packets.
+    ASSERT_EQ(1, config.periodic_callbacks().size());
+  }
+
+  // Each part of a file sees all packets of its stretch of time.
+  cfg_.OfflineTrace("test_data/output_dump");
+  cfg_.SetOfflineReader(FlowParserConfig::OFFLINE_MMAP);
+  cfg_.SetOfflineThreads(4);
+  FlowParser offline(cfg_);
+  ASSERT_EQ(4, offline.num_parsers());
+  for (size_t i = 0; i < offline.num_parsers(); ++i) {
+    const ParserConfig& config = offline.parser(i).parser_config();
+    ASSERT_EQ(1000000, config.soft_mem_limit());
+    ASSERT_EQ(256, config.micro_flow_table_size());
+    ASSERT_EQ(400, config.sketch_only_pkts_per_sec());
+  }
+
+  cfg_.SetOfflineThreads(1);
+  FlowParser single(cfg_);
+  ASSERT_EQ(4000000, single.parser().parser_config().soft_mem_limit());
 }
 
 // Reconstruct the headers of a single TCP flow from the trace
@@ -1,27 +1,140 @@
 #include "flows.h"
 
+#include <algorithm>
+#include <limits>
+
 namespace flowparser {
 
-uint16_t Flow::TCPIpRx(const pcap::SniffIp& ip_header,
-                       const pcap::SniffTcp& tcp_header, uint64_t timestamp,
-                       size_t* bytes) {
-  size_t bytes_before = curr_size_bytes_;
-  IpRx(ip_header, timestamp);
+IpHeader::IpHeader(const pcap::SniffIp6& ip6_header, uint8_t protocol,
+                   uint16_t header_len, uint16_t id, bool later_fragment)
+    : protocol(protocol),
+      len(std::min(sizeof(pcap::SniffIp6) + ntohs(ip6_header.ip6_plen),
+                   static_cast<size_t>(std::numeric_limits<uint16_t>::max()))),
+      header_len(header_len),
+      id(id),
+      ttl(ip6_header.ip6_hlim),
+      later_fragment(later_fragment),
+      src(0),
+      dst(0),
+      ipv6(reinterpret_cast<const Ipv6Addresses*>(&ip6_header.ip6_src)) {
+}
+
+IpHeader IpHeader::ParseIpv6(const uint8_t* pkt, size_t len) {
+  static constexpr size_t kMaxExtensionHeaders = 8;
+  static constexpr uint8_t kMobilityHeader = 135;
+
+  if (len < sizeof(pcap::SniffIp6)) {
+    throw std::logic_error(
+        "IPv6 packet too short: " + std::to_string(len) + " bytes");
+  }
+
+  const pcap::SniffIp6* ip6_header =
+      reinterpret_cast<const pcap::SniffIp6*>(pkt);
+  uint8_t next_header = ip6_header->ip6_nxt;
+  size_t offset = sizeof(pcap::SniffIp6);
+  uint16_t id = 0;
+  bool later_fragment = false;
+
+  // Extension headers are walked until a header that is not one is found, so
+  // ESP and "no next header" end up as the transport protocol.
+  for (size_t i = 0; i <= kMaxExtensionHeaders; ++i) {
+    // Headers with a length field get a length of 2 if the field itself is
+    // missing, which is then caught by the check below.
+    size_t header_len;
+    switch (next_header) {
+      case IPPROTO_HOPOPTS:
+      case IPPROTO_ROUTING:
+      case IPPROTO_DSTOPTS:
+      case kMobilityHeader:
+        header_len = offset + 2 <= len ? (pkt[offset + 1] + 1) * 8 : 2;
+        break;
+      case IPPROTO_AH:
+        header_len = offset + 2 <= len ? (pkt[offset + 1] + 2) * 4 : 2;
+        break;
+      case IPPROTO_FRAGMENT:
+        header_len = sizeof(ip6_frag);
+        break;
+      default:
+        if (offset > sizeof(pcap::SniffIp6) + ntohs(ip6_header->ip6_plen)) {
+          throw std::logic_error(
+              "IPv6 headers longer than payload length "
+                  + std::to_string(ntohs(ip6_header->ip6_plen)));
+        }
+
+        return IpHeader(*ip6_header, next_header, offset, id, later_fragment);
+    }
+
+    if (offset + header_len > len) {
+      throw std::logic_error(
+          "IPv6 extension header " + std::to_string(next_header)
+              + " does not fit in packet of " + std::to_string(len)
+              + " bytes");
+    }
+
+    if (next_header == IPPROTO_FRAGMENT) {
+      const ip6_frag* fragment_header =
+          reinterpret_cast<const ip6_frag*>(pkt + offset);
+      id = ntohl(fragment_header->ip6f_ident);
+      later_fragment = (fragment_header->ip6f_offlg & IP6F_OFF_MASK) != 0;
+    }
+
+    next_header = pkt[offset];
+    offset += header_len;
+  }
+
+  throw std::logic_error("Too many IPv6 extension headers");
+}
 
-  uint32_t headers_size = (ip_header.ip_hl + tcp_header.th_off) * 4;
-  uint16_t ip_len = ntohs(ip_header.ip_len);
+uint16_t Flow::PayloadSize(const IpHeader& ip_header,
+                           uint32_t transport_header_size,
+                           const char* protocol_name, const FlowKey& key) {
+  // Fragments of a datagram other than the first one carry no transport
+  // header, all of their IP payload is transport payload.
+  uint32_t headers_size = ip_header.header_len
+      + (ip_header.later_fragment ? 0 : transport_header_size);
+  uint16_t ip_len = ip_header.len;
   if (headers_size > ip_len) {
     throw std::logic_error(
-        "Wrong TCP header size estimate -- ip_len: " + std::to_string(ip_len)
+        std::string("Wrong ") + protocol_name
+            + " header size estimate -- ip_len: " + std::to_string(ip_len)
             + ", headers_size: " + std::to_string(headers_size) + ", key: "
-            + key().ToString());
+            + key.ToString());
+  }
+
+  return ip_len - headers_size;
+}
+
+// The state a TCP packet with the given flags moves its side of the connection
+// to, if it is not there yet.
+static TcpState StateAfter(uint8_t flags) {
+  if (flags & TH_RST) {
+    return TCP_CLOSED;
+  }
+
+  if (flags & TH_FIN) {
+    return TCP_FIN;
   }
 
-  uint16_t payload_size = ip_len - headers_size;
+  return (flags & TH_SYN) ? TCP_SYN : TCP_ESTABLISHED;
+}
+
+uint16_t Flow::TCPIpRx(const IpHeader& ip_header,
+                       const pcap::SniffTcp& tcp_header, uint64_t timestamp,
+                       size_t* bytes) {
+  size_t bytes_before = curr_size_bytes_;
+  IpRx(ip_header, timestamp);
+
+  uint16_t payload_size = PayloadSize(ip_header, tcp_header.th_off * 4, "TCP",
+                                      key_);
   total_payload_seen_ += payload_size;
   uint32_t seq = ntohl(tcp_header.th_seq);
 
+  if (pkts_seen_ == 1) {
+    first_tcp_flags_ = tcp_header.th_flags;
+  }
+
   tcp_flags_or_ |= tcp_header.th_flags;
+  tcp_state_ = std::max(tcp_state_, StateAfter(tcp_header.th_flags));
 
   if (flow_config_.fields_to_track_ & FlowConfig::HF_PAYLOAD_SIZE) {
     payload_size_.Append(payload_size, &curr_size_bytes_);
@@ -49,22 +162,13 @@ uint16_t Flow::TCPIpRx(const pcap::SniffIp& ip_header,
   return payload_size;
 }
 
-uint16_t Flow::UDPIpRx(const pcap::SniffIp& ip_header,
+uint16_t Flow::UDPIpRx(const IpHeader& ip_header,
                        const pcap::SniffUdp& udp_header, uint64_t timestamp,
                        size_t* bytes) {
   Unused(udp_header);
   size_t bytes_before = curr_size_bytes_;
 
-  uint32_t headers_size = ip_header.ip_hl * 4 + pcap::kSizeUDP;
-  uint16_t ip_len = ntohs(ip_header.ip_len);
-  if (headers_size > ip_len) {
-    throw std::logic_error(
-        "Wrong UDP header size estimate -- ip_len: " + std::to_string(ip_len)
-            + ", headers_size: " + std::to_string(headers_size) + ", key: "
-            + key().ToString());
-  }
-
-  uint16_t payload_size = ip_len - headers_size;
+  uint16_t payload_size = PayloadSize(ip_header, pcap::kSizeUDP, "UDP", key_);
   total_payload_seen_ += payload_size;
   if (flow_config_.fields_to_track_ & FlowConfig::HF_PAYLOAD_SIZE) {
     payload_size_.Append(payload_size, &curr_size_bytes_);
@@ -77,22 +181,14 @@ uint16_t Flow::UDPIpRx(const pcap::SniffIp& ip_header,
   return payload_size;
 }
 
-uint16_t Flow::ICMPIpRx(const pcap::SniffIp& ip_header,
+uint16_t Flow::ICMPIpRx(const IpHeader& ip_header,
                         const pcap::SniffIcmp& icmp_header, uint64_t timestamp,
                         size_t* bytes) {
   size_t bytes_before = curr_size_bytes_;
   IpRx(ip_header, timestamp);
 
-  uint32_t headers_size = ip_header.ip_hl * 4 + pcap::kSizeICMP;
-  uint16_t ip_len = ntohs(ip_header.ip_len);
-  if (headers_size > ip_len) {
-    throw std::logic_error(
-        "Wrong ICMP header size estimate -- ip_len: " + std::to_string(ip_len)
-            + ", headers_size: " + std::to_string(headers_size) + ", key: "
-            + key().ToString());
-  }
-
-  uint16_t payload_size = ip_len - headers_size;
+  uint16_t payload_size = PayloadSize(ip_header, pcap::kSizeICMP, "ICMP",
+                                      key_);
   total_payload_seen_ += payload_size;
   if (flow_config_.fields_to_track_ & FlowConfig::HF_PAYLOAD_SIZE) {
     payload_size_.Append(payload_size, &curr_size_bytes_);
@@ -112,13 +208,13 @@ uint16_t Flow::ICMPIpRx(const pcap::SniffIp& ip_header,
   return payload_size;
 }
 
-uint16_t Flow::UnknownIpRx(const pcap::SniffIp& ip_header, uint64_t timestamp,
+uint16_t Flow::UnknownIpRx(const IpHeader& ip_header, uint64_t timestamp,
                            size_t* bytes) {
   size_t bytes_before = curr_size_bytes_;
   IpRx(ip_header, timestamp);
 
   // This will be off, but we don't know what the protocol is.
-  uint16_t payload_size = ntohs(ip_header.ip_len) - ip_header.ip_hl * 4;
+  uint16_t payload_size = ip_header.len - ip_header.header_len;
   total_payload_seen_ += payload_size;
   if (flow_config_.fields_to_track_ & FlowConfig::HF_PAYLOAD_SIZE) {
     payload_size_.Append(payload_size, &curr_size_bytes_);
@@ -130,14 +226,52 @@ uint16_t Flow::UnknownIpRx(const pcap::SniffIp& ip_header, uint64_t timestamp,
   return payload_size;
 }
 
-void Flow::IpRx(const pcap::SniffIp& ip_header, uint64_t timestamp) {
-  if (ip_header.ip_p != key_.protocol()) {
+void Flow::Merge(const Flow& other, size_t* bytes) {
+  if (!(other.key_ == key_)) {
+    throw std::logic_error("Cannot merge flows with different keys");
+  }
+
+  if (other.pkts_seen_ == 0) {
+    return;
+  }
+
+  if (pkts_seen_ != 0 && other.first_rx_time_ < last_rx_time_) {
+    throw std::logic_error("Cannot merge flows, other flow starts too early");
+  }
+
+  size_t bytes_before = curr_size_bytes_;
+
+  timestamps_.Append(other.timestamps_, &curr_size_bytes_);
+  ip_id_.Append(other.ip_id_, &curr_size_bytes_);
+  ip_len_.Append(other.ip_len_, &curr_size_bytes_);
+  payload_size_.Append(other.payload_size_, &curr_size_bytes_);
+  ip_ttl_.Append(other.ip_ttl_, &curr_size_bytes_);
+  tcp_flags_.Append(other.tcp_flags_, &curr_size_bytes_);
+  tcp_seq_.Append(other.tcp_seq_, &curr_size_bytes_);
+  tcp_ack_.Append(other.tcp_ack_, &curr_size_bytes_);
+  tcp_win_.Append(other.tcp_win_, &curr_size_bytes_);
+  icmp_type_.Append(other.icmp_type_, &curr_size_bytes_);
+  icmp_code_.Append(other.icmp_code_, &curr_size_bytes_);
+
+  pkts_seen_ += other.pkts_seen_;
+  total_ip_len_seen_ += other.total_ip_len_seen_;
+  total_payload_seen_ += other.total_payload_seen_;
+  estimated_ip_len_missed_ += other.estimated_ip_len_missed_;
+  tcp_flags_or_ |= other.tcp_flags_or_;
+  tcp_state_ = std::max(tcp_state_, other.tcp_state_);
+  last_rx_time_ = other.last_rx_time_;
+
+  *bytes += (curr_size_bytes_ - bytes_before);
+}
+
+void Flow::IpRx(const IpHeader& ip_header, uint64_t timestamp) {
+  if (ip_header.protocol != key_.protocol()) {
     throw std::runtime_error("Wrong proto type in PacketRx");
   }
 
   timestamps_.Append(timestamp, &curr_size_bytes_);
 
-  uint16_t ip_len = ntohs(ip_header.ip_len);
+  uint16_t ip_len = ip_header.len;
   total_ip_len_seen_ += ip_len;
 
   if (flow_config_.fields_to_track_ & FlowConfig::HF_IP_LEN) {
@@ -145,11 +279,11 @@ void Flow::IpRx(const pcap::SniffIp& ip_header, uint64_t timestamp) {
   }
 
   if (flow_config_.fields_to_track_ & FlowConfig::HF_IP_ID) {
-    ip_id_.Append(ntohs(ip_header.ip_id), &curr_size_bytes_);
+    ip_id_.Append(ip_header.id, &curr_size_bytes_);
   }
 
   if (flow_config_.fields_to_track_ & FlowConfig::HF_IP_TTL) {
-    ip_ttl_.Append(ip_header.ip_ttl, &curr_size_bytes_);
+    ip_ttl_.Append(ip_header.ttl, &curr_size_bytes_);
   }
 
   pkts_seen_++;
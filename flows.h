@@ -2,36 +2,144 @@
 #define FPARSER_FLOWS_H
 
 #include <atomic>
+#include <cstring>
 #include <mutex>
+#include <stdexcept>
 
 #include "packer.h"
 #include "sniff.h"
 
 namespace flowparser {
 
+// The source and destination addresses of an IPv6 packet, laid out as they are
+// in the IPv6 header.
+struct Ipv6Addresses {
+  in6_addr src;
+  in6_addr dst;
+};
+
+// The VLAN and VXLAN segment a packet was seen in. Fields that are not known or
+// not tracked are 0.
+struct Segment {
+  uint16_t vlan = 0;
+  uint32_t vni = 0;
+};
+
+// The fields of an IPv4 or IPv6 header that flows look at. Constructing one
+// from an IPv4 header is cheap, so it can be passed wherever an IpHeader is
+// expected. For IPv6 packets the protocol is the one after all extension
+// headers, and the header length includes them.
+struct IpHeader {
+  IpHeader(const pcap::SniffIp& ip_header)
+      : protocol(ip_header.ip_p),
+        len(ntohs(ip_header.ip_len)),
+        header_len(ip_header.ip_hl * 4),
+        id(ntohs(ip_header.ip_id)),
+        ttl(ip_header.ip_ttl),
+        later_fragment((ntohs(ip_header.ip_off) & IP_OFFMASK) != 0),
+        src(ip_header.ip_src.s_addr),
+        dst(ip_header.ip_dst.s_addr),
+        ipv6(nullptr) {
+  }
+
+  IpHeader(const pcap::SniffIp6& ip6_header, uint8_t protocol,
+           uint16_t header_len, uint16_t id, bool later_fragment);
+
+  // Parses an IPv6 packet of len bytes, walking its extension headers to find
+  // the transport protocol. Throws if the headers do not fit in the packet.
+  static IpHeader ParseIpv6(const uint8_t* pkt, size_t len);
+
+  // The transport protocol.
+  uint8_t protocol;
+
+  // Length of the packet, including the IP header. IPv6 jumbograms are capped
+  // at 65535.
+  uint16_t len;
+
+  // Length of the IP header, including any IPv6 extension headers.
+  uint16_t header_len;
+
+  // The IPv4 id, or the low 16 bits of the identification from an IPv6
+  // fragment header. 0 for unfragmented IPv6 packets.
+  uint16_t id;
+
+  // The IPv4 TTL or the IPv6 hop limit.
+  uint8_t ttl;
+
+  // True if the packet is a fragment other than the first one, and so carries
+  // no transport header.
+  bool later_fragment;
+
+  // IPv4 addresses in network byte order. 0 for IPv6 packets.
+  uint32_t src;
+  uint32_t dst;
+
+  // The addresses of an IPv6 packet, in the packet. Null for IPv4 packets.
+  const Ipv6Addresses* ipv6;
+
+  // Where the packet was seen. Set by the caller, 0s by default.
+  Segment segment;
+};
+
 // Each flow is indexed by this value. Note that it does not contain a flow
-// type.
+// type. If enabled, the VLAN id and the VXLAN network identifier are part of
+// the key too.
+//
+// IPv4 addresses are stored inline. IPv6 addresses are kept out of line so
+// that IPv4 keys stay small -- the inline fields then hold a 32 bit fold of
+// each address, which is what is hashed and compared first. A key constructed
+// from a packet points to the addresses in the packet, copies of it share a
+// reference-counted copy of the addresses, so looking up a flow does not
+// allocate but keys stored in flows outlive the packet.
 class FlowKey {
  public:
   FlowKey(const FlowKey& other)
       : ip_proto_(other.ip_proto_),
+        owns_ipv6_(other.ipv6_ != nullptr),
+        vlan_(other.vlan_),
         src_(other.src_),
         dst_(other.dst_),
         sport_(other.sport_),
-        dport_(other.dport_) {
+        dport_(other.dport_),
+        vni_(other.vni_),
+        ipv6_(other.ipv6_) {
+    if (ipv6_ == nullptr) {
+      return;
+    }
+
+    if (other.owns_ipv6_) {
+      ++SharedOf(ipv6_)->refs;
+    } else {
+      SharedIpv6Addresses* shared = new SharedIpv6Addresses();
+      shared->addresses = *other.ipv6_;
+      shared->refs = 1;
+      ipv6_ = &shared->addresses;
+    }
   }
 
-  FlowKey(const pcap::SniffIp& ip_header, uint16_t sport, uint16_t dport)
-      : ip_proto_(ip_header.ip_p),
-        src_(ip_header.ip_src.s_addr),
-        dst_(ip_header.ip_dst.s_addr),
+  FlowKey(const IpHeader& ip_header, uint16_t sport, uint16_t dport)
+      : ip_proto_(ip_header.protocol),
+        owns_ipv6_(false),
+        vlan_(ip_header.segment.vlan),
+        src_(ip_header.ipv6 ? Fold(ip_header.ipv6->src) : ip_header.src),
+        dst_(ip_header.ipv6 ? Fold(ip_header.ipv6->dst) : ip_header.dst),
         sport_(sport),
-        dport_(dport) {
+        dport_(dport),
+        vni_(ip_header.segment.vni),
+        ipv6_(ip_header.ipv6) {
+  }
+
+  ~FlowKey() {
+    if (owns_ipv6_ && --SharedOf(ipv6_)->refs == 0) {
+      delete SharedOf(ipv6_);
+    }
   }
 
   bool operator==(const FlowKey &other) const {
     return (src_ == other.src_ && dst_ == other.dst_ && sport_ == other.sport_
-        && dport_ == other.dport_ && ip_proto_ == other.ip_proto_);
+        && dport_ == other.dport_ && ip_proto_ == other.ip_proto_
+        && vlan_ == other.vlan_ && vni_ == other.vni_)
+        && (ipv6_ == other.ipv6_ || SameIpv6Addresses(other));
   }
 
   bool operator!=(const FlowKey& other) const {
@@ -39,35 +147,70 @@ class FlowKey {
   }
 
   std::string ToString() const {
-    return "(src='" + IPToString(src_) + "', dst='" + IPToString(dst_)
+    std::string segment;
+    if (vlan_ != 0) {
+      segment += ", vlan=" + std::to_string(vlan_);
+    }
+
+    if (vni_ != 0) {
+      segment += ", vni=" + std::to_string(vni_);
+    }
+
+    return "(src='" + SrcToString() + "', dst='" + DstToString()
         + "', src_port=" + std::to_string(src_port()) + ", dst_port="
         + std::to_string(dst_port()) + ", proto=" + std::to_string(ip_proto_)
-        + ")";
+        + segment + ")";
   }
 
-  // The source IP address of the flow (in host byte order)
+  // True if the flow is IPv6.
+  bool ipv6() const {
+    return ipv6_ != nullptr;
+  }
+
+  // The source IP address of the flow (in host byte order). For IPv6 flows
+  // this is a 32 bit fold of the address.
   uint32_t src() const {
     return ntohl(src_);
   }
 
-  // The destination IP address of the flow (in host byte order)
+  // The destination IP address of the flow (in host byte order). For IPv6
+  // flows this is a 32 bit fold of the address.
   uint32_t dst() const {
     return ntohl(dst_);
   }
 
+  // The IPv6 addresses of the flow. Throws if the flow is not IPv6.
+  const in6_addr& src6() const {
+    return Ipv6OrThrow().src;
+  }
+
+  const in6_addr& dst6() const {
+    return Ipv6OrThrow().dst;
+  }
+
   // The IP protocol
   uint8_t protocol() const {
     return ip_proto_;
   }
 
+  // The VLAN id, 0 unless VLAN ids are part of the key.
+  uint16_t vlan() const {
+    return vlan_;
+  }
+
+  // The VXLAN network identifier, 0 unless VNIs are part of the key.
+  uint32_t vni() const {
+    return vni_;
+  }
+
   // A string representation of the source address.
   std::string SrcToString() const {
-    return IPToString(src_);
+    return ipv6_ ? IPv6ToString(ipv6_->src) : IPToString(src_);
   }
 
   // A string representation of the destination address.
   std::string DstToString() const {
-    return IPToString(dst_);
+    return ipv6_ ? IPv6ToString(ipv6_->dst) : IPToString(dst_);
   }
 
   // The source port of the flow (in host byte order)
@@ -87,15 +230,71 @@ class FlowKey {
     result = 37 * result + dst_;
     result = 37 * result + sport_;
     result = 37 * result + dport_;
+    result = 37 * result + vlan_;
+    result = 37 * result + vni_;
     return result;
   }
 
+  // A well mixed 64 bit hash, for sketches that use all of its bits.
+  uint64_t hash64() const {
+    uint64_t hash = Mix64((static_cast<uint64_t>(src_) << 32) | dst_);
+    hash = Mix64(hash ^ ((static_cast<uint64_t>(ip_proto_) << 32)
+        | (static_cast<uint64_t>(sport_) << 16) | dport_));
+    return Mix64(hash ^ ((static_cast<uint64_t>(vlan_) << 32) | vni_));
+  }
+
+  // Memory allocated by the key outside of the key itself.
+  size_t ExtraSizeBytes() const {
+    return ipv6_ ? HeapBlockSize(sizeof(SharedIpv6Addresses)) : 0;
+  }
+
  private:
+  // The copy of the addresses shared by copies of a key.
+  struct SharedIpv6Addresses {
+    Ipv6Addresses addresses;
+    std::atomic<uint32_t> refs;
+  };
+
+  static SharedIpv6Addresses* SharedOf(const Ipv6Addresses* addresses) {
+    return reinterpret_cast<SharedIpv6Addresses*>(
+        const_cast<Ipv6Addresses*>(addresses));
+  }
+
+  static uint32_t Fold(const in6_addr& address) {
+    uint32_t words[4];
+    memcpy(words, &address, sizeof(words));
+    return words[0] ^ words[1] ^ words[2] ^ words[3];
+  }
+
+  // Only called if the inline fields are equal, so folds are.
+  bool SameIpv6Addresses(const FlowKey& other) const {
+    return ipv6_ != nullptr && other.ipv6_ != nullptr
+        && memcmp(ipv6_, other.ipv6_, sizeof(Ipv6Addresses)) == 0;
+  }
+
+  const Ipv6Addresses& Ipv6OrThrow() const {
+    if (ipv6_ == nullptr) {
+      throw std::logic_error("Not an IPv6 flow");
+    }
+
+    return *ipv6_;
+  }
+
   const uint8_t ip_proto_;
+
+  // True if ipv6_ points to a SharedIpv6Addresses this key holds a reference
+  // to, false if it points into a packet.
+  const bool owns_ipv6_;
+
+  const uint16_t vlan_;
   const uint32_t src_;
   const uint32_t dst_;
   const uint16_t sport_;
   const uint16_t dport_;
+  const uint32_t vni_;
+
+  // Null for IPv4 keys.
+  const Ipv6Addresses* ipv6_;
 
   friend class FlowIterator;
 };
@@ -217,20 +416,79 @@ struct FlowInfo {
   uint64_t first_rx = 0;
   uint64_t last_rx = 0;
   uint64_t inmem_size_bytes = 0;
+  // With sample-and-hold, an estimate of the ip_len of the packets the flow
+  // had before it was caught. 0 otherwise.
+  uint64_t estimated_ip_len_missed = 0;
 };
 
-// The main (and only) flow class.
+// The state of a TCP connection as seen by the flow of one of its directions.
+// States only move forward, in this order, so two states can be combined by
+// taking the later one.
+enum TcpState : uint8_t {
+  // Not TCP, or no packets seen yet.
+  TCP_NONE,
+  // This side sent a SYN.
+  TCP_SYN,
+  // This side sent packets other than a SYN, either after a SYN or in a
+  // connection that was already open when the flow was first seen.
+  TCP_ESTABLISHED,
+  // This side sent a FIN.
+  TCP_FIN,
+  // The connection is closed -- either side sent an RST, or both sent a FIN.
+  // Only the flow itself can know about the RST it sent, the rest is known
+  // only to the parser, which sees both directions.
+  TCP_CLOSED
+};
+
+// The main (and only) flow class. Flows and their fields are allocated from a
+// SlabPool: new (pool) Flow(..., pool) takes both from the given pool, a plain
+// new from the default one.
 class Flow {
  public:
-  Flow(uint64_t timestamp, const FlowKey& key, const FlowConfig& flow_config)
+  Flow(uint64_t timestamp, const FlowKey& key, const FlowConfig& flow_config,
+       SlabPool* pool = nullptr)
       : flow_config_(flow_config),
         first_rx_time_(timestamp),
         key_(key),
-        curr_size_bytes_(sizeof(Flow)),
+        curr_size_bytes_(SlabPool::RoundUp(sizeof(Flow))
+            + key.ExtraSizeBytes()),
+        timestamps_(pool),
+        ip_id_(pool),
+        ip_len_(pool),
+        payload_size_(pool),
+        ip_ttl_(pool),
+        tcp_flags_(pool),
+        tcp_seq_(pool),
+        tcp_ack_(pool),
+        tcp_win_(pool),
+        icmp_type_(pool),
+        icmp_code_(pool),
         pkts_seen_(0),
         total_ip_len_seen_(0),
         total_payload_seen_(0),
-        tcp_flags_or_(0) {
+        estimated_ip_len_missed_(0),
+        tcp_flags_or_(0),
+        first_tcp_flags_(0),
+        tcp_state_(TCP_NONE) {
+  }
+
+  static void* operator new(size_t size, SlabPool* pool) {
+    return (pool != nullptr ? pool : SlabPool::Default())->Allocate(size);
+  }
+
+  static void* operator new(size_t size) {
+    return SlabPool::Default()->Allocate(size);
+  }
+
+  // A flow can be deleted from any thread, whatever pool it came from.
+  static void operator delete(void* ptr, size_t size) {
+    SlabPool::Free(ptr, size);
+  }
+
+  // Only called if the constructor throws.
+  static void operator delete(void* ptr, SlabPool* pool) {
+    Unused(pool);
+    SlabPool::Free(ptr, sizeof(Flow));
   }
 
   uint64_t last_rx() const {
@@ -257,6 +515,27 @@ class Flow {
     return tcp_flags_or_;
   }
 
+  uint8_t first_tcp_flags() const {
+    return first_tcp_flags_;
+  }
+
+  TcpState tcp_state() const {
+    return tcp_state_;
+  }
+
+  uint64_t estimated_ip_len_missed() const {
+    return estimated_ip_len_missed_;
+  }
+
+  void set_estimated_ip_len_missed(uint64_t estimated_ip_len_missed) {
+    estimated_ip_len_missed_ = estimated_ip_len_missed;
+  }
+
+  // Marks the connection as closed, because of what the other direction saw.
+  void CloseTcp() {
+    tcp_state_ = TCP_CLOSED;
+  }
+
   FlowInfo GetInfo() const {
     FlowInfo info;
 
@@ -266,6 +545,7 @@ class Flow {
     info.first_rx = first_rx_time_;
     info.last_rx = last_rx_time_;
     info.inmem_size_bytes = curr_size_bytes_;
+    info.estimated_ip_len_missed = estimated_ip_len_missed_;
 
     return info;
   }
@@ -291,35 +571,49 @@ class Flow {
     return return_string;
   }
 
+  // Memory allocated for the flow, its fields and its key.
   size_t SizeBytes() const {
     return curr_size_bytes_;
   }
 
   // Updates the flow with a new TCP packet. Should only be called if the
   // flow is TCP. Returns the payload of the packet.
-  uint16_t TCPIpRx(const pcap::SniffIp& ip_header,
+  uint16_t TCPIpRx(const IpHeader& ip_header,
                    const pcap::SniffTcp& tcp_header, uint64_t timestamp,
                    size_t* bytes);
 
   // Updates the flow with a new UDP packet. Should only be called if the
   // flow is UDP. Returns the payload of the packet.
-  uint16_t UDPIpRx(const pcap::SniffIp& ip_header,
+  uint16_t UDPIpRx(const IpHeader& ip_header,
                    const pcap::SniffUdp& udp_header, uint64_t timestamp,
                    size_t* bytes);
 
   // Updates the flow with a new ICMP packet. Should only be called if the
   // flow is ICMP. Returns the payload of the packet.
-  uint16_t ICMPIpRx(const pcap::SniffIp& ip_header,
+  uint16_t ICMPIpRx(const IpHeader& ip_header,
                     const pcap::SniffIcmp& icmp_header, uint64_t timestamp,
                     size_t* bytes);
 
   // Updates the flow with a new IP packet from an unknown transport protocol.
   // Returns the payload of the packet.
-  uint16_t UnknownIpRx(const pcap::SniffIp& ip_header, uint64_t timestamp,
+  uint16_t UnknownIpRx(const IpHeader& ip_header, uint64_t timestamp,
                        size_t* bytes);
 
+  // The transport payload of a packet with a transport header of the given
+  // size. Throws if the headers do not fit in the packet -- the protocol name
+  // and the key are only used in the message.
+  static uint16_t PayloadSize(const IpHeader& ip_header,
+                              uint32_t transport_header_size,
+                              const char* protocol_name, const FlowKey& key);
+
+  // Appends all packets of another flow with the same key to this one. The
+  // other flow's first packet should not have been received before this flow's
+  // last one. The result is the same as if all packets were received by this
+  // flow.
+  void Merge(const Flow& other, size_t* bytes);
+
  private:
-  void IpRx(const pcap::SniffIp& ip_header, uint64_t timestamp);
+  void IpRx(const IpHeader& ip_header, uint64_t timestamp);
 
   // The original flow config
   const FlowConfig& flow_config_;
@@ -378,10 +672,19 @@ class Flow {
   // Sum of payload (ip_len - headers) of all packets seen by this flow.
   uint64_t total_payload_seen_;
 
+  // Sum of ip_len of the packets of this flow that were not seen, if known.
+  uint64_t estimated_ip_len_missed_;
+
   // The value of the flag fields of all packets OR-ed together. 0 if this flow
   // is not TCP.
   uint8_t tcp_flags_or_;
 
+  // The flags of the first packet. 0 if this flow is not TCP.
+  uint8_t first_tcp_flags_;
+
+  // TCP_NONE if this flow is not TCP.
+  TcpState tcp_state_;
+
   friend class FlowIterator;
 
   DISALLOW_COPY_AND_ASSIGN(Flow);
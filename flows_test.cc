@@ -1,6 +1,8 @@
 #include "gtest/gtest.h"
 
 #include <random>
+#include <utility>
+#include <vector>
 
 #include "flows.h"
 #include "common_test.h"
@@ -85,6 +87,63 @@ TEST_F(FlowFixture, InfoTotals) {
   ASSERT_EQ(100, info.pkts_seen);
 }
 
+TEST_F(FlowFixture, InfoTotalsLaterFragment) {
+  Flow flow(kInitTimestamp, *key_, flow_cfg_);
+
+  pcap::SniffIp ip_header = gen_.GenerateIpHeader();
+  pcap::SniffTcp tcp_header = gen_.GenerateTCPHeader();
+  ip_header.ip_hl = 5;
+  ip_header.ip_p = IPPROTO_TCP;
+  ip_header.ip_len = htons(1500);
+  ip_header.ip_off = htons(IP_MF);
+  tcp_header.th_off = 5;
+
+  size_t dummy = 0;
+  flow.TCPIpRx(ip_header, tcp_header, kInitTimestamp, &dummy);
+
+  // The second fragment has no TCP header of its own.
+  ip_header.ip_len = htons(30);
+  ip_header.ip_off = htons(185);
+  flow.TCPIpRx(ip_header, tcp_header, kInitTimestamp, &dummy);
+
+  auto info = flow.GetInfo();
+  ASSERT_EQ(1530, info.total_ip_len_seen);
+  ASSERT_EQ(1460 + 10, info.total_payload_seen);
+  ASSERT_EQ(2, info.pkts_seen);
+}
+
+TEST_F(FlowFixture, TcpState) {
+  Flow flow(kInitTimestamp, *key_, flow_cfg_);
+  ASSERT_EQ(TCP_NONE, flow.tcp_state());
+
+  pcap::SniffIp ip_header = gen_.GenerateIpHeader();
+  pcap::SniffTcp tcp_header = gen_.GenerateTCPHeader();
+  ip_header.ip_p = IPPROTO_TCP;
+
+  // States only move forward, whatever order the packets come in.
+  std::vector<std::pair<uint8_t, TcpState>> flags_and_states = {
+      { TH_SYN, TCP_SYN }, { TH_ACK, TCP_ESTABLISHED },
+      { TH_SYN, TCP_ESTABLISHED }, { TH_FIN | TH_ACK, TCP_FIN },
+      { TH_ACK, TCP_FIN }, { TH_RST, TCP_CLOSED }, { TH_ACK, TCP_CLOSED } };
+  size_t dummy = 0;
+  for (const auto& flags_and_state : flags_and_states) {
+    tcp_header.th_flags = flags_and_state.first;
+    flow.TCPIpRx(ip_header, tcp_header, kInitTimestamp, &dummy);
+    ASSERT_EQ(flags_and_state.second, flow.tcp_state());
+  }
+
+  // Merging keeps the later state.
+  Flow other(kInitTimestamp, *key_, flow_cfg_);
+  tcp_header.th_flags = TH_ACK;
+  other.TCPIpRx(ip_header, tcp_header, kInitTimestamp, &dummy);
+  other.Merge(flow, &dummy);
+  ASSERT_EQ(TCP_CLOSED, other.tcp_state());
+
+  Flow closed(kInitTimestamp, *key_, flow_cfg_);
+  closed.CloseTcp();
+  ASSERT_EQ(TCP_CLOSED, closed.tcp_state());
+}
+
 TEST_F(FlowFixture, InfoFirstLastRx) {
   Flow flow(kInitTimestamp, *key_, flow_cfg_);
 
@@ -103,6 +162,113 @@ TEST_F(FlowFixture, InfoFirstLastRx) {
   ASSERT_EQ(kInitTimestamp + 5 * 99, info.last_rx);
 }
 
+// Builds an IPv6 packet with the given extension headers, each given as its
+// type and its bytes after the next header field, followed by 20 bytes of
+// transport header.
+static std::vector<uint8_t> Ipv6Packet(
+    uint8_t protocol,
+    const std::vector<std::pair<uint8_t, std::vector<uint8_t>>>& extensions) {
+  std::vector<uint8_t> pkt(sizeof(pcap::SniffIp6));
+  for (const auto& extension : extensions) {
+    pkt.push_back(0);
+    pkt.insert(pkt.end(), extension.second.begin(), extension.second.end());
+  }
+
+  pkt.resize(pkt.size() + 20);
+
+  // Chain the next header fields.
+  size_t offset = sizeof(pcap::SniffIp6);
+  uint8_t* next_header = &pkt[6];
+  for (const auto& extension : extensions) {
+    *next_header = extension.first;
+    next_header = &pkt[offset];
+    offset += 1 + extension.second.size();
+  }
+  *next_header = protocol;
+
+  pcap::SniffIp6* ip6_header = reinterpret_cast<pcap::SniffIp6*>(pkt.data());
+  ip6_header->ip6_vfc = 6 << 4;
+  ip6_header->ip6_plen = htons(pkt.size() - sizeof(pcap::SniffIp6));
+  ip6_header->ip6_hlim = 64;
+  ip6_header->ip6_src.s6_addr[15] = 1;
+  ip6_header->ip6_dst.s6_addr[15] = 2;
+  return pkt;
+}
+
+TEST(IpHeader, ParseIpv6NoExtensions) {
+  std::vector<uint8_t> pkt = Ipv6Packet(IPPROTO_TCP, { });
+  IpHeader ip_header = IpHeader::ParseIpv6(pkt.data(), pkt.size());
+
+  ASSERT_EQ(IPPROTO_TCP, ip_header.protocol);
+  ASSERT_EQ(60, ip_header.len);
+  ASSERT_EQ(40, ip_header.header_len);
+  ASSERT_EQ(64, ip_header.ttl);
+  ASSERT_FALSE(ip_header.later_fragment);
+  ASSERT_EQ(reinterpret_cast<const Ipv6Addresses*>(pkt.data() + 8),
+            ip_header.ipv6);
+
+  FlowKey key(ip_header, htons(5), htons(6));
+  ASSERT_TRUE(key.ipv6());
+  ASSERT_EQ("(src='::1', dst='::2', src_port=5, dst_port=6, proto=6)",
+            key.ToString());
+}
+
+TEST(IpHeader, ParseIpv6Extensions) {
+  // Hop-by-hop options (8 bytes), routing (16 bytes), a first fragment and AH
+  // (12 bytes).
+  std::vector<uint8_t> pkt = Ipv6Packet(
+      IPPROTO_UDP, { { IPPROTO_HOPOPTS, std::vector<uint8_t>(7) }, {
+          IPPROTO_ROUTING, { 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } }, {
+          IPPROTO_FRAGMENT, { 0, 0, 1, 0x12, 0x34, 0x56, 0x78 } }, {
+          IPPROTO_AH, { 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } } });
+  IpHeader ip_header = IpHeader::ParseIpv6(pkt.data(), pkt.size());
+
+  ASSERT_EQ(IPPROTO_UDP, ip_header.protocol);
+  ASSERT_EQ(40 + 8 + 16 + 8 + 12, ip_header.header_len);
+  ASSERT_EQ(0x5678, ip_header.id);
+  ASSERT_FALSE(ip_header.later_fragment);
+}
+
+TEST(IpHeader, ParseIpv6LaterFragment) {
+  std::vector<uint8_t> pkt = Ipv6Packet(
+      IPPROTO_TCP, { { IPPROTO_FRAGMENT, { 0, 0x05, 0x00, 0, 0, 0, 1 } } });
+  IpHeader ip_header = IpHeader::ParseIpv6(pkt.data(), pkt.size());
+
+  ASSERT_TRUE(ip_header.later_fragment);
+  ASSERT_EQ(1, ip_header.id);
+}
+
+TEST(IpHeader, ParseIpv6Esp) {
+  // Nothing after ESP can be parsed.
+  std::vector<uint8_t> pkt = Ipv6Packet(
+      IPPROTO_TCP, { { IPPROTO_DSTOPTS, std::vector<uint8_t>(7) }, {
+          IPPROTO_ESP, std::vector<uint8_t>(7) } });
+  IpHeader ip_header = IpHeader::ParseIpv6(pkt.data(), pkt.size());
+
+  ASSERT_EQ(IPPROTO_ESP, ip_header.protocol);
+  ASSERT_EQ(48, ip_header.header_len);
+}
+
+TEST(IpHeader, ParseIpv6Truncated) {
+  std::vector<uint8_t> pkt = Ipv6Packet(
+      IPPROTO_TCP, { { IPPROTO_HOPOPTS, std::vector<uint8_t>(7) } });
+  ASSERT_THROW(IpHeader::ParseIpv6(pkt.data(), 39), std::logic_error);
+  ASSERT_THROW(IpHeader::ParseIpv6(pkt.data(), 41), std::logic_error);
+  ASSERT_THROW(IpHeader::ParseIpv6(pkt.data(), 47), std::logic_error);
+  ASSERT_NO_THROW(IpHeader::ParseIpv6(pkt.data(), 48));
+
+  // An extension header that claims to be longer than the packet.
+  pkt[41] = 100;
+  ASSERT_THROW(IpHeader::ParseIpv6(pkt.data(), pkt.size()), std::logic_error);
+}
+
+TEST(IpHeader, ParseIpv6TooManyExtensions) {
+  std::vector<std::pair<uint8_t, std::vector<uint8_t>>> extensions(
+      20, { IPPROTO_DSTOPTS, std::vector<uint8_t>(7) });
+  std::vector<uint8_t> pkt = Ipv6Packet(IPPROTO_TCP, extensions);
+  ASSERT_THROW(IpHeader::ParseIpv6(pkt.data(), pkt.size()), std::logic_error);
+}
+
 TEST_F(FlowFixture, 1MIter) {
   flow_cfg_.SetField(FlowConfig::HF_IP_ID);
   flow_cfg_.SetField(FlowConfig::HF_IP_TTL);
@@ -0,0 +1,194 @@
+#include "fragment_tracker.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace flowparser {
+
+// Per-datagram overhead of the list and the hash table, roughly.
+static constexpr size_t kEntryOverheadBytes = 6 * sizeof(void*);
+
+FragmentTracker::FragmentTracker(const FragmentConfig& config)
+    : config_(config),
+      mem_usage_(0),
+      fragments_(0),
+      held_(0),
+      expired_(0),
+      evicted_(0),
+      datagrams_in_mem_(0),
+      mem_usage_bytes_(0) {
+}
+
+size_t FragmentTracker::SizeBytes(const Datagram& datagram) {
+  return sizeof(Datagram) + kEntryOverheadBytes
+      + datagram.held.size() * sizeof(HeldFragment);
+}
+
+void FragmentTracker::PassOn(uint64_t timestamp, const uint8_t* ip_header,
+                             size_t ip_header_len, const Segment& segment,
+                             const Datagram& datagram,
+                             const PacketCallback& callback) {
+  uint8_t pkt[sizeof(HeldFragment::ip_header) + kMaxTransportHeaderSize];
+  memcpy(pkt, ip_header, ip_header_len);
+  memcpy(pkt + ip_header_len, datagram.transport_header.data(),
+         datagram.transport_header_len);
+  callback(timestamp, pkt, ip_header_len + datagram.transport_header_len,
+           segment);
+}
+
+void FragmentTracker::RemoveOldest(bool expired) {
+  const Datagram& datagram = datagrams_.front();
+  if (expired) {
+    expired_ += datagram.held.size();
+  } else {
+    evicted_ += datagram.held.size();
+  }
+
+  mem_usage_ -= SizeBytes(datagram);
+  datagrams_table_.erase(datagram.key);
+  datagrams_.pop_front();
+}
+
+void FragmentTracker::Expire(uint64_t timestamp) {
+  while (!datagrams_.empty()
+      && datagrams_.front().first_seen + config_.timeout < timestamp) {
+    RemoveOldest(true);
+  }
+}
+
+void FragmentTracker::ExpireAll() {
+  while (!datagrams_.empty()) {
+    RemoveOldest(true);
+  }
+
+  datagrams_in_mem_ = 0;
+  mem_usage_bytes_ = 0;
+}
+
+bool FragmentTracker::MakeRoom(size_t additional_bytes) {
+  if (additional_bytes > config_.mem_limit) {
+    return false;
+  }
+
+  while (!datagrams_.empty()
+      && mem_usage_ + additional_bytes > config_.mem_limit) {
+    RemoveOldest(false);
+  }
+
+  return true;
+}
+
+void FragmentTracker::Add(uint64_t timestamp, const uint8_t* pkt, size_t len,
+                          const Segment& segment,
+                          const PacketCallback& callback) {
+  ++fragments_;
+  if (len < sizeof(pcap::SniffIp)) {
+    callback(timestamp, pkt, len, segment);
+    return;
+  }
+
+  const pcap::SniffIp* ip_header = reinterpret_cast<const pcap::SniffIp*>(pkt);
+  uint8_t proto = ip_header->ip_p;
+  size_t size_ip = ip_header->ip_hl * 4;
+  uint16_t ip_len = ntohs(ip_header->ip_len);
+  if (size_ip < 20 || size_ip > len || size_ip > ip_len
+      || (proto != IPPROTO_TCP && proto != IPPROTO_UDP
+          && proto != IPPROTO_ICMP)) {
+    // Nothing to attribute, the callback will deal with it.
+    callback(timestamp, pkt, len, segment);
+    return;
+  }
+
+  Expire(timestamp);
+
+  bool later = IsLaterFragment(*ip_header);
+  size_t new_bytes = later ? sizeof(HeldFragment) : 0;
+  if (!MakeRoom(sizeof(Datagram) + kEntryOverheadBytes + new_bytes)) {
+    if (later) {
+      ++evicted_;
+    } else {
+      callback(timestamp, pkt, len, segment);
+    }
+
+    return;
+  }
+
+  Key key = { ip_header->ip_src.s_addr, ip_header->ip_dst.s_addr,
+      ntohs(ip_header->ip_id), proto };
+  auto it = datagrams_table_.find(key);
+  if (it == datagrams_table_.end()) {
+    Datagram datagram;
+    datagram.key = key;
+    datagram.first_seen = timestamp;
+
+    datagrams_.push_back(std::move(datagram));
+    it = datagrams_table_.insert(
+        std::make_pair(key, std::prev(datagrams_.end()))).first;
+    mem_usage_ += SizeBytes(datagrams_.back());
+  }
+
+  Datagram& datagram = *it->second;
+  size_t size_before = SizeBytes(datagram);
+
+  size_t payload = ip_len - size_ip;
+  datagram.bytes_seen += payload;
+  uint16_t off = ntohs(ip_header->ip_off);
+  if (!(off & IP_MF)) {
+    datagram.total_bytes = (off & IP_OFFMASK) * 8 + payload;
+  }
+
+  if (!later) {
+    datagram.transport_header_len = std::min(
+        std::min(len, static_cast<size_t>(ip_len)) - size_ip,
+        kMaxTransportHeaderSize);
+    memcpy(datagram.transport_header.data(), pkt + size_ip,
+           datagram.transport_header_len);
+
+    callback(timestamp, pkt, len, segment);
+    for (const HeldFragment& held : datagram.held) {
+      const pcap::SniffIp* held_ip_header =
+          reinterpret_cast<const pcap::SniffIp*>(held.ip_header.data());
+      PassOn(timestamp, held.ip_header.data(), held_ip_header->ip_hl * 4,
+             held.segment, datagram, callback);
+    }
+
+    datagram.held.clear();
+    datagram.held.shrink_to_fit();
+  } else if (datagram.transport_header_len != 0) {
+    PassOn(timestamp, pkt, size_ip, segment, datagram, callback);
+  } else {
+    HeldFragment held;
+    memcpy(held.ip_header.data(), pkt, size_ip);
+    held.segment = segment;
+    datagram.held.push_back(held);
+    ++held_;
+  }
+
+  mem_usage_ = mem_usage_ - size_before + SizeBytes(datagram);
+
+  // Once all fragments are seen the datagram does not need to be tracked.
+  // Duplicate fragments can make this happen early, the remaining fragments
+  // will then be held until they expire.
+  if (datagram.transport_header_len != 0 && datagram.total_bytes != 0
+      && datagram.bytes_seen >= datagram.total_bytes) {
+    mem_usage_ -= SizeBytes(datagram);
+    datagrams_.erase(it->second);
+    datagrams_table_.erase(it);
+  }
+
+  datagrams_in_mem_ = datagrams_.size();
+  mem_usage_bytes_ = mem_usage_;
+}
+
+FragmentStats FragmentTracker::GetStats() const {
+  FragmentStats stats;
+  stats.fragments = fragments_;
+  stats.held = held_;
+  stats.expired = expired_;
+  stats.evicted = evicted_;
+  stats.datagrams_in_mem = datagrams_in_mem_;
+  stats.mem_usage_bytes = mem_usage_bytes_;
+  return stats;
+}
+
+}  // namespace flowparser
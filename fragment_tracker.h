@@ -0,0 +1,194 @@
+// Attributes IPv4 fragments to the flows of the datagrams they are part of.
+
+#ifndef FLOWPARSER_FRAGMENT_TRACKER_H
+#define FLOWPARSER_FRAGMENT_TRACKER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "flows.h"
+#include "sniff.h"
+
+namespace flowparser {
+
+struct FragmentConfig {
+  // Hard limit on the memory used to track datagrams. When it is reached the
+  // oldest datagrams are forgotten.
+  uint64_t mem_limit = 1 << 22;
+
+  // Datagrams are forgotten this long (in microseconds) after their first
+  // fragment is seen, whether or not all fragments have arrived.
+  uint64_t timeout = 30 * kMillion;
+};
+
+struct FragmentStats {
+  // Number of fragments seen.
+  uint64_t fragments = 0;
+
+  // Number of fragments that arrived before the first fragment of their
+  // datagram and had to be held back.
+  uint64_t held = 0;
+
+  // Number of held fragments dropped because the first fragment did not
+  // arrive before the timeout.
+  uint64_t expired = 0;
+
+  // Number of held fragments dropped because of the memory limit.
+  uint64_t evicted = 0;
+
+  // Number of datagrams tracked and the memory they use.
+  uint64_t datagrams_in_mem = 0;
+  uint64_t mem_usage_bytes = 0;
+};
+
+// Fragments of a datagram after the first one carry no transport header, so on
+// their own they cannot be attributed to a flow. The tracker remembers the
+// transport header of the first fragment of each datagram, keyed by (src, dst,
+// id, proto), and passes on all other fragments as if they had the same
+// header. Fragments that arrive before the first one are held back until it
+// does. Only TCP, UDP and ICMP datagrams are tracked, fragments of other
+// protocols are passed on as they are. Not thread-safe, apart from GetStats.
+class FragmentTracker {
+ public:
+  // Called with each fragment that is passed on. The packet starts with the IP
+  // header of the fragment and is followed by the transport header of the first
+  // fragment, so the transport header is found where it would be in an
+  // unfragmented packet. len bytes of it can be read, and segment is the one
+  // the fragment was seen in -- both its own, even if it was held back.
+  typedef std::function<void(uint64_t timestamp, const uint8_t* pkt,
+                             size_t len, const Segment& segment)>
+      PacketCallback;
+
+  // Enough to cover the TCP, UDP and ICMP headers that flows look at.
+  static constexpr size_t kMaxTransportHeaderSize = 20;
+
+  explicit FragmentTracker(const FragmentConfig& config);
+
+  // True if the packet is a fragment, either the first one or a later one.
+  static bool IsFragment(const pcap::SniffIp& ip_header) {
+    return (ntohs(ip_header.ip_off) & (IP_MF | IP_OFFMASK)) != 0;
+  }
+
+  // True if the packet is a fragment other than the first one, and so has no
+  // transport header.
+  static bool IsLaterFragment(const pcap::SniffIp& ip_header) {
+    return (ntohs(ip_header.ip_off) & IP_OFFMASK) != 0;
+  }
+
+  // Adds a fragment seen in a segment. pkt points to the IP header, len is the
+  // captured length of the packet starting from there. The callback is called
+  // for the fragment if it can be passed on right away -- and for all
+  // fragments held back waiting for it if it is the first fragment. Held
+  // fragments are passed on with the timestamp of the first fragment, so that
+  // timestamps do not go backwards. Timestamps are also used to expire
+  // datagrams.
+  void Add(uint64_t timestamp, const uint8_t* pkt, size_t len,
+           const Segment& segment, const PacketCallback& callback);
+
+  // Forgets all datagrams, counting held fragments as expired. Called at the
+  // end of a trace.
+  void ExpireAll();
+
+  FragmentStats GetStats() const;
+
+ private:
+  struct Key {
+    uint32_t src;
+    uint32_t dst;
+    uint16_t id;
+    uint8_t proto;
+
+    bool operator==(const Key& other) const {
+      return src == other.src && dst == other.dst && id == other.id
+          && proto == other.proto;
+    }
+  };
+
+  struct KeyHasher {
+    size_t operator()(const Key& key) const {
+      size_t hash = 37;
+      hash = hash * 1009 + key.src;
+      hash = hash * 1009 + key.dst;
+      hash = hash * 1009 + key.id;
+      hash = hash * 1009 + key.proto;
+      return hash;
+    }
+  };
+
+  // A fragment waiting for the first fragment of its datagram. Only the IP
+  // header is kept, with the segment it was seen in.
+  struct HeldFragment {
+    std::array<uint8_t, 60> ip_header;
+    Segment segment;
+  };
+
+  struct Datagram {
+    Key key;
+
+    // When the first of the datagram's fragments (not necessarily the one with
+    // offset 0) was seen.
+    uint64_t first_seen = 0;
+
+    // The transport header of the first fragment. Empty until it arrives.
+    std::array<uint8_t, kMaxTransportHeaderSize> transport_header = { };
+    size_t transport_header_len = 0;
+
+    std::vector<HeldFragment> held;
+
+    // Payload bytes seen so far and the total payload of the datagram, which
+    // is only known once the last fragment arrives.
+    size_t bytes_seen = 0;
+    size_t total_bytes = 0;
+  };
+
+  typedef std::list<Datagram> DatagramList;
+  typedef std::unordered_map<Key, DatagramList::iterator, KeyHasher>
+      DatagramMap;
+
+  // Memory used to track a datagram.
+  static size_t SizeBytes(const Datagram& datagram);
+
+  // Passes on a fragment with the transport header of its datagram.
+  static void PassOn(uint64_t timestamp, const uint8_t* ip_header,
+                     size_t ip_header_len, const Segment& segment,
+                     const Datagram& datagram, const PacketCallback& callback);
+
+  // Forgets the oldest datagram, counting its held fragments as expired or
+  // evicted.
+  void RemoveOldest(bool expired);
+
+  // Forgets datagrams that have timed out.
+  void Expire(uint64_t timestamp);
+
+  // Forgets the oldest datagrams until additional_bytes more would fit in the
+  // memory limit. Returns false if they would not fit even with no datagrams.
+  bool MakeRoom(size_t additional_bytes);
+
+  const FragmentConfig config_;
+
+  // Datagrams in the order they were first seen.
+  DatagramList datagrams_;
+  DatagramMap datagrams_table_;
+
+  uint64_t mem_usage_;
+
+  // Counters, read by GetStats from other threads.
+  std::atomic<uint64_t> fragments_;
+  std::atomic<uint64_t> held_;
+  std::atomic<uint64_t> expired_;
+  std::atomic<uint64_t> evicted_;
+  std::atomic<uint64_t> datagrams_in_mem_;
+  std::atomic<uint64_t> mem_usage_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(FragmentTracker);
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_FRAGMENT_TRACKER_H */
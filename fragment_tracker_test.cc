@@ -0,0 +1,232 @@
+#include "gtest/gtest.h"
+#include "fragment_tracker.h"
+
+#include <cstring>
+#include <vector>
+
+namespace flowparser {
+namespace test {
+
+// A fragment as passed on by the tracker.
+struct PassedOn {
+  uint64_t timestamp;
+  uint16_t ip_id;
+  uint16_t offset;
+  uint16_t sport;
+  uint16_t dport;
+  size_t len;
+  uint16_t vlan;
+};
+
+class FragmentTrackerFixture : public ::testing::Test {
+ protected:
+  FragmentTrackerFixture()
+      : callback_([this](uint64_t timestamp, const uint8_t* pkt, size_t len,
+                         const Segment& segment) {
+          const pcap::SniffIp* ip_header =
+              reinterpret_cast<const pcap::SniffIp*>(pkt);
+          const pcap::SniffUdp* udp_header =
+              reinterpret_cast<const pcap::SniffUdp*>(pkt + 20);
+          passed_on_.push_back( { timestamp, ntohs(ip_header->ip_id),
+              static_cast<uint16_t>(ntohs(ip_header->ip_off) & IP_OFFMASK),
+              ntohs(udp_header->uh_sport), ntohs(udp_header->uh_dport), len,
+              segment.vlan });
+        }) {
+  }
+
+  // Builds a UDP fragment with an 8 byte aligned payload. The offset is in 8
+  // byte units, the first fragment gets a UDP header.
+  static std::vector<uint8_t> Fragment(uint16_t id, uint16_t offset,
+                                       bool more_fragments,
+                                       uint16_t payload, uint8_t proto =
+                                           IPPROTO_UDP) {
+    std::vector<uint8_t> pkt(20 + payload);
+    pcap::SniffIp* ip_header = reinterpret_cast<pcap::SniffIp*>(pkt.data());
+    ip_header->ip_hl = 5;
+    ip_header->ip_v = 4;
+    ip_header->ip_len = htons(20 + payload);
+    ip_header->ip_id = htons(id);
+    ip_header->ip_off = htons(offset | (more_fragments ? IP_MF : 0));
+    ip_header->ip_p = proto;
+    ip_header->ip_src.s_addr = htonl(1);
+    ip_header->ip_dst.s_addr = htonl(2);
+
+    if (offset == 0) {
+      pcap::SniffUdp* udp_header =
+          reinterpret_cast<pcap::SniffUdp*>(pkt.data() + 20);
+      udp_header->uh_sport = htons(53);
+      udp_header->uh_dport = htons(4000);
+    }
+
+    return pkt;
+  }
+
+  void Add(FragmentTracker* tracker, uint64_t timestamp,
+           const std::vector<uint8_t>& pkt, uint16_t vlan = 0) {
+    Segment segment;
+    segment.vlan = vlan;
+    tracker->Add(timestamp, pkt.data(), pkt.size(), segment, callback_);
+  }
+
+  FragmentConfig config_;
+  std::vector<PassedOn> passed_on_;
+  FragmentTracker::PacketCallback callback_;
+};
+
+TEST(FragmentTracker, IsFragment) {
+  pcap::SniffIp ip_header;
+  memset(&ip_header, 0, sizeof(ip_header));
+  ASSERT_FALSE(FragmentTracker::IsFragment(ip_header));
+
+  ip_header.ip_off = htons(IP_DF);
+  ASSERT_FALSE(FragmentTracker::IsFragment(ip_header));
+
+  ip_header.ip_off = htons(IP_MF);
+  ASSERT_TRUE(FragmentTracker::IsFragment(ip_header));
+  ASSERT_FALSE(FragmentTracker::IsLaterFragment(ip_header));
+
+  ip_header.ip_off = htons(10);
+  ASSERT_TRUE(FragmentTracker::IsFragment(ip_header));
+  ASSERT_TRUE(FragmentTracker::IsLaterFragment(ip_header));
+}
+
+TEST_F(FragmentTrackerFixture, InOrder) {
+  FragmentTracker tracker(config_);
+  Add(&tracker, 10, Fragment(1, 0, true, 1480));
+  Add(&tracker, 11, Fragment(1, 185, true, 1480));
+  ASSERT_EQ(1, tracker.GetStats().datagrams_in_mem);
+  Add(&tracker, 12, Fragment(1, 370, false, 100));
+
+  ASSERT_EQ(3, passed_on_.size());
+  for (size_t i = 0; i < passed_on_.size(); ++i) {
+    ASSERT_EQ(10 + i, passed_on_[i].timestamp);
+    ASSERT_EQ(53, passed_on_[i].sport);
+    ASSERT_EQ(4000, passed_on_[i].dport);
+  }
+
+  ASSERT_EQ(370, passed_on_[2].offset);
+
+  FragmentStats stats = tracker.GetStats();
+  ASSERT_EQ(3, stats.fragments);
+  ASSERT_EQ(0, stats.held);
+  ASSERT_EQ(0, stats.datagrams_in_mem);
+  ASSERT_EQ(0, stats.mem_usage_bytes);
+}
+
+TEST_F(FragmentTrackerFixture, FirstArrivesLast) {
+  FragmentTracker tracker(config_);
+  Add(&tracker, 10, Fragment(1, 370, false, 100));
+  Add(&tracker, 11, Fragment(1, 185, true, 1480));
+  ASSERT_TRUE(passed_on_.empty());
+  ASSERT_EQ(2, tracker.GetStats().held);
+  ASSERT_LT(0, tracker.GetStats().mem_usage_bytes);
+
+  Add(&tracker, 12, Fragment(1, 0, true, 1480));
+  ASSERT_EQ(3, passed_on_.size());
+
+  // Held fragments are passed on in the order they arrived, after the first
+  // one and with its timestamp.
+  ASSERT_EQ(0, passed_on_[0].offset);
+  ASSERT_EQ(370, passed_on_[1].offset);
+  ASSERT_EQ(185, passed_on_[2].offset);
+  for (const PassedOn& fragment : passed_on_) {
+    ASSERT_EQ(12, fragment.timestamp);
+    ASSERT_EQ(53, fragment.sport);
+  }
+
+  ASSERT_EQ(0, tracker.GetStats().datagrams_in_mem);
+}
+
+TEST_F(FragmentTrackerFixture, HeldKeepTheirOwn) {
+  FragmentTracker tracker(config_);
+  Add(&tracker, 10, Fragment(1, 370, false, 100), 7);
+  Add(&tracker, 11, Fragment(1, 0, true, 1480), 8);
+  Add(&tracker, 12, Fragment(1, 185, true, 1480), 9);
+  ASSERT_EQ(3, passed_on_.size());
+
+  // The first fragment as it was captured, the others with the IP header and
+  // the part of the transport header that was kept.
+  ASSERT_EQ(8, passed_on_[0].vlan);
+  ASSERT_EQ(20 + 1480, passed_on_[0].len);
+  ASSERT_EQ(7, passed_on_[1].vlan);
+  ASSERT_EQ(20 + FragmentTracker::kMaxTransportHeaderSize, passed_on_[1].len);
+  ASSERT_EQ(9, passed_on_[2].vlan);
+  ASSERT_EQ(20 + FragmentTracker::kMaxTransportHeaderSize, passed_on_[2].len);
+}
+
+TEST_F(FragmentTrackerFixture, TooShort) {
+  FragmentTracker tracker(config_);
+  std::vector<uint8_t> pkt = Fragment(1, 185, false, 100);
+  tracker.Add(10, pkt.data(), 19, Segment(), callback_);
+  ASSERT_EQ(1, passed_on_.size());
+  ASSERT_EQ(19, passed_on_[0].len);
+  ASSERT_EQ(0, tracker.GetStats().datagrams_in_mem);
+}
+
+TEST_F(FragmentTrackerFixture, DifferentDatagrams) {
+  FragmentTracker tracker(config_);
+  Add(&tracker, 10, Fragment(2, 185, false, 100));
+  Add(&tracker, 11, Fragment(1, 0, true, 1480));
+  Add(&tracker, 12, Fragment(1, 185, false, 100));
+  ASSERT_EQ(2, passed_on_.size());
+  ASSERT_EQ(1, passed_on_[1].ip_id);
+  ASSERT_EQ(1, tracker.GetStats().datagrams_in_mem);
+}
+
+TEST_F(FragmentTrackerFixture, Expire) {
+  config_.timeout = 100;
+  FragmentTracker tracker(config_);
+  Add(&tracker, 10, Fragment(1, 185, false, 100));
+  Add(&tracker, 50, Fragment(2, 185, false, 100));
+  Add(&tracker, 111, Fragment(3, 0, true, 1480));
+
+  FragmentStats stats = tracker.GetStats();
+  ASSERT_EQ(1, stats.expired);
+  ASSERT_EQ(2, stats.datagrams_in_mem);
+
+  // The first fragment of datagram 1 is too late.
+  Add(&tracker, 112, Fragment(1, 0, true, 1480));
+  ASSERT_EQ(2, passed_on_.size());
+  ASSERT_EQ(3, passed_on_[0].ip_id);
+  ASSERT_EQ(1, passed_on_[1].ip_id);
+  ASSERT_EQ(0, passed_on_[1].offset);
+}
+
+TEST_F(FragmentTrackerFixture, MemoryLimit) {
+  config_.mem_limit = 2000;
+  FragmentTracker tracker(config_);
+  for (uint16_t id = 0; id < 100; ++id) {
+    Add(&tracker, id, Fragment(id, 185, false, 100));
+    ASSERT_GE(config_.mem_limit, tracker.GetStats().mem_usage_bytes);
+  }
+
+  FragmentStats stats = tracker.GetStats();
+  ASSERT_EQ(100, stats.held);
+  ASSERT_LT(0, stats.evicted);
+  ASSERT_EQ(100, stats.evicted + stats.datagrams_in_mem);
+
+  // The newest datagram is still there.
+  Add(&tracker, 100, Fragment(99, 0, true, 1480));
+  ASSERT_EQ(2, passed_on_.size());
+}
+
+TEST_F(FragmentTrackerFixture, MemoryLimitTooLow) {
+  config_.mem_limit = 10;
+  FragmentTracker tracker(config_);
+  Add(&tracker, 10, Fragment(1, 0, true, 1480));
+  Add(&tracker, 11, Fragment(1, 185, false, 100));
+
+  // The first fragment still goes through.
+  ASSERT_EQ(1, passed_on_.size());
+  ASSERT_EQ(1, tracker.GetStats().evicted);
+}
+
+TEST_F(FragmentTrackerFixture, OtherProtocol) {
+  FragmentTracker tracker(config_);
+  Add(&tracker, 10, Fragment(1, 185, false, 100, IPPROTO_GRE));
+  ASSERT_EQ(1, passed_on_.size());
+  ASSERT_EQ(0, tracker.GetStats().datagrams_in_mem);
+}
+
+}  // namespace test
+}  // namespace flowparser
@@ -0,0 +1,286 @@
+#include "heavy_hitters.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "flow_table.h"
+
+namespace flowparser {
+
+constexpr uint32_t SpaceSaving::kNone;
+
+HeavyHitters::HeavyHitters(size_t capacity, uint64_t total_bytes,
+                           const std::vector<HeavyHitter>& entries)
+    : capacity_(capacity),
+      total_bytes_(total_bytes) {
+  // Keys cannot be assigned, so the entries are copied in order.
+  std::vector<size_t> order(entries.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+
+  std::sort(order.begin(), order.end(), [&entries](size_t a, size_t b) {
+    return entries[a].bytes > entries[b].bytes;
+  });
+
+  entries_.reserve(std::min(capacity_, order.size()));
+  for (size_t i = 0; i < order.size() && i < capacity_; ++i) {
+    entries_.push_back(entries[order[i]]);
+  }
+}
+
+std::vector<HeavyHitter> HeavyHitters::Top(size_t k) const {
+  return std::vector<HeavyHitter>(
+      entries_.begin(), entries_.begin() + std::min(k, entries_.size()));
+}
+
+void HeavyHitters::Merge(const HeavyHitters& other) {
+  uint64_t missing = max_missing_bytes();
+  uint64_t other_missing = other.max_missing_bytes();
+
+  std::unordered_map<FlowKey, size_t, KeyHasher> other_indices;
+  for (size_t i = 0; i < other.entries_.size(); ++i) {
+    other_indices.emplace(other.entries_[i].key, i);
+  }
+
+  std::vector<HeavyHitter> merged;
+  std::vector<bool> other_merged(other.entries_.size(), false);
+  for (const HeavyHitter& entry : entries_) {
+    auto it = other_indices.find(entry.key);
+    if (it == other_indices.end()) {
+      merged.emplace_back(entry.key, entry.bytes + other_missing,
+                          entry.error + other_missing);
+      continue;
+    }
+
+    const HeavyHitter& other_entry = other.entries_[it->second];
+    merged.emplace_back(entry.key, entry.bytes + other_entry.bytes,
+                        entry.error + other_entry.error);
+    other_merged[it->second] = true;
+  }
+
+  for (size_t i = 0; i < other.entries_.size(); ++i) {
+    if (!other_merged[i]) {
+      const HeavyHitter& other_entry = other.entries_[i];
+      merged.emplace_back(other_entry.key, other_entry.bytes + missing,
+                          other_entry.error + missing);
+    }
+  }
+
+  HeavyHitters sorted(std::max(capacity_, other.capacity_),
+                      total_bytes_ + other.total_bytes_, merged);
+  capacity_ = sorted.capacity_;
+  total_bytes_ = sorted.total_bytes_;
+  entries_.swap(sorted.entries_);
+}
+
+// Rounds up to a power of 2 at least twice the capacity, or throws.
+static uint32_t NumSlots(size_t capacity) {
+  if (capacity == 0) {
+    throw std::logic_error("SpaceSaving cannot have 0 counters");
+  }
+
+  if (capacity > (1 << 30)) {
+    throw std::logic_error("Too many SpaceSaving counters");
+  }
+
+  uint32_t num_slots = 2;
+  while (num_slots < 2 * capacity) {
+    num_slots *= 2;
+  }
+
+  return num_slots;
+}
+
+SpaceSaving::SpaceSaving(size_t capacity)
+    : capacity_(capacity),
+      num_slots_(NumSlots(capacity)),
+      size_(0),
+      total_bytes_(0),
+      keys_extra_bytes_(0),
+      counters_(new Counter[capacity]),
+      heap_(new uint32_t[capacity]),
+      slots_(new uint32_t[num_slots_]) {
+  std::fill(slots_.get(), slots_.get() + num_slots_, kNone);
+}
+
+SpaceSaving::~SpaceSaving() {
+  Clear();
+}
+
+uint32_t SpaceSaving::FindSlot(const FlowKey& key, uint32_t hash) const {
+  uint32_t mask = num_slots_ - 1;
+  for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    uint32_t counter = slots_[slot];
+    if (counter == kNone) {
+      return kNone;
+    }
+
+    if (counters_[counter].hash == hash && counters_[counter].key() == key) {
+      return slot;
+    }
+  }
+}
+
+void SpaceSaving::InsertSlot(uint32_t counter) {
+  uint32_t mask = num_slots_ - 1;
+  uint32_t slot = counters_[counter].hash & mask;
+  while (slots_[slot] != kNone) {
+    slot = (slot + 1) & mask;
+  }
+
+  slots_[slot] = counter;
+}
+
+void SpaceSaving::RemoveSlot(uint32_t slot) {
+  uint32_t mask = num_slots_ - 1;
+  uint32_t next = slot;
+  while (true) {
+    next = (next + 1) & mask;
+    uint32_t counter = slots_[next];
+    if (counter == kNone) {
+      break;
+    }
+
+    // A counter can only move back to a slot between its home and itself.
+    uint32_t home = counters_[counter].hash & mask;
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      slots_[slot] = counter;
+      slot = next;
+    }
+  }
+
+  slots_[slot] = kNone;
+}
+
+void SpaceSaving::SetKey(uint32_t counter, const FlowKey& key, uint32_t hash) {
+  Counter& entry = counters_[counter];
+  new (&entry.storage) FlowKey(key);
+  entry.hash = hash;
+  keys_extra_bytes_ += entry.key().ExtraSizeBytes();
+  InsertSlot(counter);
+}
+
+void SpaceSaving::Add(const FlowKey& key, uint64_t bytes) {
+  total_bytes_ += bytes;
+  uint32_t hash = FlowTable::Hash(key);
+  uint32_t slot = FindSlot(key, hash);
+  if (slot != kNone) {
+    Counter& counter = counters_[slots_[slot]];
+    counter.bytes += bytes;
+    SiftDown(counter.heap_index);
+    return;
+  }
+
+  if (size_ < capacity_) {
+    uint32_t index = size_++;
+    Counter& counter = counters_[index];
+    counter.bytes = bytes;
+    counter.error = 0;
+    counter.heap_index = index;
+    heap_[index] = index;
+    SetKey(index, key, hash);
+    SiftUp(index);
+    return;
+  }
+
+  // Takes the counter with the fewest bytes.
+  uint32_t index = heap_[0];
+  Counter& counter = counters_[index];
+  RemoveSlot(FindSlot(counter.key(), counter.hash));
+  keys_extra_bytes_ -= counter.key().ExtraSizeBytes();
+  counter.key().~FlowKey();
+
+  counter.error = counter.bytes;
+  counter.bytes += bytes;
+  SetKey(index, key, hash);
+  SiftDown(0);
+}
+
+std::vector<HeavyHitter> SpaceSaving::Counters() const {
+  std::vector<HeavyHitter> counters;
+  counters.reserve(size_);
+  for (size_t i = 0; i < size_; ++i) {
+    const Counter& counter = counters_[i];
+    counters.emplace_back(counter.key(), counter.bytes, counter.error);
+  }
+
+  return counters;
+}
+
+void SpaceSaving::Clear() {
+  for (size_t i = 0; i < size_; ++i) {
+    counters_[i].key().~FlowKey();
+  }
+
+  std::fill(slots_.get(), slots_.get() + num_slots_, kNone);
+  size_ = 0;
+  total_bytes_ = 0;
+  keys_extra_bytes_ = 0;
+}
+
+void SpaceSaving::Reset(const HeavyHitters& heavy_hitters) {
+  if (heavy_hitters.entries().size() > capacity_) {
+    throw std::logic_error("Too many heavy hitters for SpaceSaving");
+  }
+
+  Clear();
+  for (const HeavyHitter& entry : heavy_hitters.entries()) {
+    uint32_t index = size_++;
+    Counter& counter = counters_[index];
+    counter.bytes = entry.bytes;
+    counter.error = entry.error;
+    counter.heap_index = index;
+    heap_[index] = index;
+    SetKey(index, entry.key, FlowTable::Hash(entry.key));
+    SiftUp(index);
+  }
+
+  total_bytes_ = heavy_hitters.total_bytes();
+}
+
+size_t SpaceSaving::SizeBytes() const {
+  return HeapBlockSize(capacity_ * sizeof(Counter))
+      + HeapBlockSize(capacity_ * sizeof(uint32_t))
+      + HeapBlockSize(num_slots_ * sizeof(uint32_t)) + keys_extra_bytes_;
+}
+
+void SpaceSaving::SwapHeap(uint32_t a, uint32_t b) {
+  std::swap(heap_[a], heap_[b]);
+  counters_[heap_[a]].heap_index = a;
+  counters_[heap_[b]].heap_index = b;
+}
+
+void SpaceSaving::SiftUp(uint32_t heap_index) {
+  while (heap_index > 0) {
+    uint32_t parent = (heap_index - 1) / 2;
+    if (counters_[heap_[parent]].bytes <= counters_[heap_[heap_index]].bytes) {
+      return;
+    }
+
+    SwapHeap(parent, heap_index);
+    heap_index = parent;
+  }
+}
+
+void SpaceSaving::SiftDown(uint32_t heap_index) {
+  while (true) {
+    uint32_t smallest = heap_index;
+    for (uint32_t child = 2 * heap_index + 1;
+        child <= 2 * heap_index + 2 && child < size_; ++child) {
+      if (counters_[heap_[child]].bytes < counters_[heap_[smallest]].bytes) {
+        smallest = child;
+      }
+    }
+
+    if (smallest == heap_index) {
+      return;
+    }
+
+    SwapHeap(heap_index, smallest);
+    heap_index = smallest;
+  }
+}
+
+}  // namespace flowparser
@@ -0,0 +1,185 @@
+// The flows with the most bytes, counted in fixed memory.
+
+#ifndef FLOWPARSER_HEAVY_HITTERS_H
+#define FLOWPARSER_HEAVY_HITTERS_H
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "common.h"
+#include "flows.h"
+
+namespace flowparser {
+
+// A flow and an estimate of its bytes. The flow had at least bytes - error
+// and at most bytes bytes.
+struct HeavyHitter {
+  HeavyHitter(const FlowKey& key, uint64_t bytes, uint64_t error)
+      : key(key),
+        bytes(bytes),
+        error(error) {
+  }
+
+  FlowKey key;
+  uint64_t bytes;
+  uint64_t error;
+};
+
+// A copy of the counters of a SpaceSaving, or of several merged together.
+// Entries are largest first.
+class HeavyHitters {
+ public:
+  // Sorts the entries and keeps the capacity largest.
+  HeavyHitters(size_t capacity, uint64_t total_bytes,
+               const std::vector<HeavyHitter>& entries);
+
+  // The k largest entries, or all if there are fewer.
+  std::vector<HeavyHitter> Top(size_t k) const;
+
+  const std::vector<HeavyHitter>& entries() const {
+    return entries_;
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  // Bytes of all flows counted.
+  uint64_t total_bytes() const {
+    return total_bytes_;
+  }
+
+  // A flow that is not among the entries had at most this many bytes. 0 if
+  // there is room for more entries, since then all flows are among them.
+  uint64_t max_missing_bytes() const {
+    return entries_.size() < capacity_ ? 0 : entries_.back().bytes;
+  }
+
+  // Adds the counts of another set of heavy hitters that counted other packets
+  // -- of other shards, or of an earlier period. A flow in only one of them
+  // gets the other's max_missing_bytes on top of its count and its error. The
+  // largest capacity entries are kept, and the error of each is still at most
+  // total_bytes / capacity.
+  void Merge(const HeavyHitters& other);
+
+ private:
+  size_t capacity_;
+  uint64_t total_bytes_;
+  std::vector<HeavyHitter> entries_;
+};
+
+// The SpaceSaving algorithm: a fixed number of counters, each of a flow. A
+// flow that has a counter adds its bytes to it, a flow that does not takes the
+// counter with the fewest bytes, adds its bytes to them and remembers them as
+// its error. Each count is then at most total_bytes / capacity over the real
+// one, and every flow with more bytes than that has a counter. Counters are
+// kept in a min-heap by bytes and found through an open addressing table, so
+// adding a packet is O(log capacity) and nothing is allocated after
+// construction other than the addresses of IPv6 keys. Not thread-safe.
+class SpaceSaving {
+ public:
+  // Throws if capacity is 0.
+  explicit SpaceSaving(size_t capacity);
+
+  ~SpaceSaving();
+
+  void Add(const FlowKey& key, uint64_t bytes);
+
+  // Copies the counters, in no particular order. O(capacity).
+  std::vector<HeavyHitter> Counters() const;
+
+  // The counters, sorted.
+  HeavyHitters Snapshot() const {
+    return HeavyHitters(capacity_, total_bytes_, Counters());
+  }
+
+  // Removes all counters.
+  void Clear();
+
+  // Replaces the counters with those of heavy hitters with no more entries
+  // than the capacity, for example a snapshot merged with another one.
+  void Reset(const HeavyHitters& heavy_hitters);
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  uint64_t total_bytes() const {
+    return total_bytes_;
+  }
+
+  // Memory allocated for the counters and their keys.
+  size_t SizeBytes() const;
+
+ private:
+  struct Counter {
+    uint64_t bytes;
+    uint64_t error;
+    uint32_t hash;
+
+    // Where the counter is in the heap.
+    uint32_t heap_index;
+
+    // Constructed in place while the counter is used.
+    std::aligned_storage<sizeof(FlowKey), alignof(FlowKey)>::type storage;
+
+    FlowKey& key() {
+      return *reinterpret_cast<FlowKey*>(&storage);
+    }
+
+    const FlowKey& key() const {
+      return *reinterpret_cast<const FlowKey*>(&storage);
+    }
+  };
+
+  static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+  // The slot of the counter of a key, or kNone.
+  uint32_t FindSlot(const FlowKey& key, uint32_t hash) const;
+
+  void InsertSlot(uint32_t counter);
+
+  // Empties a slot, moving back the counters after it that can be.
+  void RemoveSlot(uint32_t slot);
+
+  // Sets the key of an unused counter and adds it to the table.
+  void SetKey(uint32_t counter, const FlowKey& key, uint32_t hash);
+
+  // Moves the counter at a heap index towards the root or the leaves.
+  void SiftUp(uint32_t heap_index);
+  void SiftDown(uint32_t heap_index);
+  void SwapHeap(uint32_t a, uint32_t b);
+
+  const size_t capacity_;
+
+  // A power of 2, at least twice the capacity.
+  const uint32_t num_slots_;
+
+  size_t size_;
+  uint64_t total_bytes_;
+
+  // Memory allocated by the keys of the counters.
+  size_t keys_extra_bytes_;
+
+  // The first size_ are used.
+  std::unique_ptr<Counter[]> counters_;
+
+  // Indices of counters, a min-heap by bytes.
+  std::unique_ptr<uint32_t[]> heap_;
+
+  // Indices of counters, by the hash of their key.
+  std::unique_ptr<uint32_t[]> slots_;
+
+  DISALLOW_COPY_AND_ASSIGN(SpaceSaving);
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_HEAVY_HITTERS_H */
@@ -0,0 +1,215 @@
+#include "gtest/gtest.h"
+
+#include <cstring>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "heavy_hitters.h"
+
+namespace flowparser {
+namespace test {
+
+class HeavyHittersFixture : public ::testing::Test {
+ protected:
+  // A TCP flow key, different for each id.
+  static FlowKey Key(uint32_t id) {
+    pcap::SniffIp ip_header;
+    memset(&ip_header, 0, sizeof(ip_header));
+    ip_header.ip_p = IPPROTO_TCP;
+    ip_header.ip_src.s_addr = htonl(id);
+    ip_header.ip_dst.s_addr = htonl(1);
+    return FlowKey(ip_header, 1000, 80);
+  }
+
+  // Adds packets of random sizes to a few large flows and many small ones.
+  // Returns the bytes of each flow, by id.
+  static std::map<uint32_t, uint64_t> AddPackets(SpaceSaving* space_saving,
+                                                 size_t num_pkts,
+                                                 uint32_t seed) {
+    std::mt19937 rnd(seed);
+    std::map<uint32_t, uint64_t> bytes;
+    for (size_t i = 0; i < num_pkts; ++i) {
+      uint32_t id = i % 4 == 0 ? rnd() % 10 : 10 + rnd() % 10000;
+      uint64_t size = 40 + rnd() % 1460;
+      space_saving->Add(Key(id), size);
+      bytes[id] += size;
+    }
+
+    return bytes;
+  }
+
+  // Checks that the bytes of each entry are within its error of the real
+  // bytes, that no error is above the bound, and that all flows above the
+  // bound are in.
+  static void AssertBounds(const HeavyHitters& heavy_hitters,
+                           const std::map<uint32_t, uint64_t>& bytes) {
+    uint64_t total_bytes = 0;
+    for (const auto& id_and_bytes : bytes) {
+      total_bytes += id_and_bytes.second;
+    }
+
+    ASSERT_EQ(total_bytes, heavy_hitters.total_bytes());
+    uint64_t bound = total_bytes / heavy_hitters.capacity();
+    std::set<uint32_t> ids;
+    for (const HeavyHitter& entry : heavy_hitters.entries()) {
+      uint64_t real_bytes = bytes.at(entry.key.src());
+      ASSERT_LE(real_bytes, entry.bytes);
+      ASSERT_GE(real_bytes, entry.bytes - entry.error);
+      ASSERT_LE(entry.error, bound);
+      ASSERT_TRUE(ids.insert(entry.key.src()).second);
+    }
+
+    for (const auto& id_and_bytes : bytes) {
+      if (id_and_bytes.second > bound) {
+        ASSERT_EQ(1, ids.count(id_and_bytes.first));
+      }
+
+      if (ids.count(id_and_bytes.first) == 0) {
+        ASSERT_GE(heavy_hitters.max_missing_bytes(), id_and_bytes.second);
+      }
+    }
+  }
+};
+
+TEST_F(HeavyHittersFixture, Init) {
+  ASSERT_THROW(SpaceSaving(0), std::logic_error);
+
+  SpaceSaving space_saving(10);
+  ASSERT_EQ(0, space_saving.size());
+  ASSERT_EQ(10, space_saving.capacity());
+  ASSERT_LT(10 * sizeof(FlowKey), space_saving.SizeBytes());
+
+  HeavyHitters heavy_hitters = space_saving.Snapshot();
+  ASSERT_TRUE(heavy_hitters.entries().empty());
+  ASSERT_EQ(0, heavy_hitters.max_missing_bytes());
+}
+
+TEST_F(HeavyHittersFixture, Exact) {
+  // As long as there are counters for all flows, counts are exact.
+  SpaceSaving space_saving(10);
+  for (uint32_t id = 0; id < 10; ++id) {
+    for (uint32_t i = 0; i <= id; ++i) {
+      space_saving.Add(Key(id), 100);
+    }
+  }
+
+  HeavyHitters heavy_hitters = space_saving.Snapshot();
+  ASSERT_EQ(5500, heavy_hitters.total_bytes());
+  ASSERT_EQ(10, heavy_hitters.entries().size());
+  for (uint32_t i = 0; i < 10; ++i) {
+    const HeavyHitter& entry = heavy_hitters.entries()[i];
+    ASSERT_EQ(9 - i, entry.key.src());
+    ASSERT_EQ((10 - i) * 100, entry.bytes);
+    ASSERT_EQ(0, entry.error);
+  }
+
+  std::vector<HeavyHitter> top = heavy_hitters.Top(3);
+  ASSERT_EQ(3, top.size());
+  ASSERT_EQ(9, top[0].key.src());
+  ASSERT_EQ(7, top[2].key.src());
+  ASSERT_EQ(10, heavy_hitters.Top(100).size());
+}
+
+TEST_F(HeavyHittersFixture, Replace) {
+  SpaceSaving space_saving(2);
+  space_saving.Add(Key(1), 100);
+  space_saving.Add(Key(2), 50);
+
+  // Takes the counter of flow 2.
+  space_saving.Add(Key(3), 10);
+  HeavyHitters heavy_hitters = space_saving.Snapshot();
+  ASSERT_EQ(2, heavy_hitters.entries().size());
+  ASSERT_EQ(1, heavy_hitters.entries()[0].key.src());
+  ASSERT_EQ(3, heavy_hitters.entries()[1].key.src());
+  ASSERT_EQ(60, heavy_hitters.entries()[1].bytes);
+  ASSERT_EQ(50, heavy_hitters.entries()[1].error);
+  ASSERT_EQ(60, heavy_hitters.max_missing_bytes());
+}
+
+TEST_F(HeavyHittersFixture, Bounds) {
+  SpaceSaving space_saving(100);
+  std::map<uint32_t, uint64_t> bytes = AddPackets(&space_saving, 100000, 1);
+  ASSERT_EQ(100, space_saving.size());
+
+  // Counts always add up to the total.
+  HeavyHitters heavy_hitters = space_saving.Snapshot();
+  uint64_t sum = 0;
+  for (const HeavyHitter& entry : heavy_hitters.entries()) {
+    sum += entry.bytes;
+  }
+
+  ASSERT_EQ(space_saving.total_bytes(), sum);
+  AssertBounds(heavy_hitters, bytes);
+
+  // The large flows are the top ones.
+  std::set<uint32_t> top_ids;
+  for (const HeavyHitter& entry : heavy_hitters.Top(10)) {
+    top_ids.insert(entry.key.src());
+  }
+
+  ASSERT_EQ(10, top_ids.size());
+  ASSERT_EQ(0, *top_ids.begin());
+  ASSERT_EQ(9, *top_ids.rbegin());
+}
+
+TEST_F(HeavyHittersFixture, Merge) {
+  SpaceSaving first(100);
+  SpaceSaving second(100);
+  std::map<uint32_t, uint64_t> bytes = AddPackets(&first, 50000, 1);
+  for (const auto& id_and_bytes : AddPackets(&second, 50000, 2)) {
+    bytes[id_and_bytes.first] += id_and_bytes.second;
+  }
+
+  HeavyHitters heavy_hitters = first.Snapshot();
+  heavy_hitters.Merge(second.Snapshot());
+  ASSERT_EQ(100, heavy_hitters.entries().size());
+  AssertBounds(heavy_hitters, bytes);
+
+  // The merge can be loaded back and counted further.
+  first.Reset(heavy_hitters);
+  for (const auto& id_and_bytes : AddPackets(&first, 10000, 3)) {
+    bytes[id_and_bytes.first] += id_and_bytes.second;
+  }
+
+  AssertBounds(first.Snapshot(), bytes);
+}
+
+TEST_F(HeavyHittersFixture, MergeExact) {
+  SpaceSaving first(10);
+  SpaceSaving second(10);
+  first.Add(Key(1), 100);
+  first.Add(Key(2), 200);
+  second.Add(Key(2), 300);
+  second.Add(Key(3), 50);
+
+  HeavyHitters heavy_hitters = first.Snapshot();
+  heavy_hitters.Merge(second.Snapshot());
+  ASSERT_EQ(650, heavy_hitters.total_bytes());
+  ASSERT_EQ(3, heavy_hitters.entries().size());
+  ASSERT_EQ(2, heavy_hitters.entries()[0].key.src());
+  ASSERT_EQ(500, heavy_hitters.entries()[0].bytes);
+  ASSERT_EQ(0, heavy_hitters.entries()[0].error);
+  ASSERT_EQ(3, heavy_hitters.entries()[2].key.src());
+  ASSERT_EQ(0, heavy_hitters.entries()[2].error);
+}
+
+TEST_F(HeavyHittersFixture, Clear) {
+  SpaceSaving space_saving(10);
+  AddPackets(&space_saving, 1000, 1);
+  size_t size_bytes = space_saving.SizeBytes();
+
+  space_saving.Clear();
+  ASSERT_EQ(0, space_saving.size());
+  ASSERT_EQ(0, space_saving.total_bytes());
+  ASSERT_EQ(size_bytes, space_saving.SizeBytes());
+
+  space_saving.Add(Key(1), 10);
+  ASSERT_EQ(1, space_saving.size());
+  ASSERT_THROW(space_saving.Reset(HeavyHitters(11, 0, std::vector<HeavyHitter>(
+      11, HeavyHitter(Key(1), 1, 0)))), std::logic_error);
+}
+
+}  // namespace test
+}  // namespace flowparser
@@ -0,0 +1,98 @@
+#include "hyperloglog.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace flowparser {
+
+constexpr uint8_t HyperLogLog::kMinPrecision;
+constexpr uint8_t HyperLogLog::kMaxPrecision;
+
+HyperLogLog::HyperLogLog()
+    : precision_(0) {
+  histogram_.fill(0);
+}
+
+HyperLogLog::HyperLogLog(uint8_t precision)
+    : precision_(precision) {
+  if (precision < kMinPrecision || precision > kMaxPrecision) {
+    throw std::logic_error("HyperLogLog precision out of range");
+  }
+
+  registers_.resize(size_t(1) << precision, 0);
+  histogram_.fill(0);
+  histogram_[0] = registers_.size();
+}
+
+uint64_t HyperLogLog::Estimate() const {
+  if (registers_.empty()) {
+    return 0;
+  }
+
+  double inverse_sum = 0;
+  for (size_t rank = 0; rank < histogram_.size(); ++rank) {
+    inverse_sum += std::ldexp(histogram_[rank], -static_cast<int>(rank));
+  }
+
+  return EstimateOf(registers_.size(), inverse_sum, histogram_[0]);
+}
+
+uint64_t HyperLogLog::EstimateOf(size_t num_registers, double inverse_sum,
+                                 size_t zeros) {
+  double alpha;
+  switch (num_registers) {
+    case 16:
+      alpha = 0.673;
+      break;
+    case 32:
+      alpha = 0.697;
+      break;
+    case 64:
+      alpha = 0.709;
+      break;
+    default:
+      alpha = 0.7213 / (1 + 1.079 / num_registers);
+  }
+
+  double registers = num_registers;
+  double estimate = alpha * registers * registers / inverse_sum;
+
+  // Small sets leave registers empty, linear counting is better for them.
+  if (estimate <= 2.5 * registers && zeros != 0) {
+    estimate = registers * std::log(registers / zeros);
+  }
+
+  return estimate + 0.5;
+}
+
+void HyperLogLog::Merge(const HyperLogLog& other) {
+  if (other.registers_.empty()) {
+    return;
+  }
+
+  if (registers_.empty()) {
+    *this = other;
+    return;
+  }
+
+  if (other.precision_ != precision_) {
+    throw std::logic_error("Cannot merge HyperLogLogs of different precision");
+  }
+
+  for (size_t i = 0; i < registers_.size(); ++i) {
+    if (other.registers_[i] > registers_[i]) {
+      --histogram_[registers_[i]];
+      ++histogram_[other.registers_[i]];
+      registers_[i] = other.registers_[i];
+    }
+  }
+}
+
+void HyperLogLog::Clear() {
+  std::fill(registers_.begin(), registers_.end(), 0);
+  histogram_.fill(0);
+  histogram_[0] = registers_.size();
+}
+
+}  // namespace flowparser
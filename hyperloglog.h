@@ -0,0 +1,90 @@
+// Estimates of the number of distinct values, in fixed memory.
+
+#ifndef FLOWPARSER_HYPERLOGLOG_H
+#define FLOWPARSER_HYPERLOGLOG_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+
+namespace flowparser {
+
+// A HyperLogLog sketch of a set of 64 bit hashes. The top precision bits of a
+// hash pick one of 2^precision registers, which keeps the longest run of
+// leading zeros seen in the rest of the bits. The standard error of the
+// estimate is about 1.04 / sqrt(2^precision) -- 1.6% with a precision of 12,
+// in 4KB. The number of registers with each value is kept as registers change,
+// so estimating is O(1) in the number of registers. Sketches of the same
+// precision can be merged, the result is the sketch of the union of their sets.
+// Not thread-safe.
+class HyperLogLog {
+ public:
+  static constexpr uint8_t kMinPrecision = 4;
+  static constexpr uint8_t kMaxPrecision = 18;
+
+  // A sketch with no registers, which ignores hashes and estimates 0. Merging
+  // a sketch into it makes it a copy of that sketch.
+  HyperLogLog();
+
+  // Throws if precision is out of [kMinPrecision, kMaxPrecision].
+  explicit HyperLogLog(uint8_t precision);
+
+  // Hashes should be well mixed, all their bits are used.
+  void Add(uint64_t hash) {
+    if (registers_.empty()) {
+      return;
+    }
+
+    uint64_t rest = (hash << precision_) | (uint64_t(1) << (precision_ - 1));
+    uint8_t rank = __builtin_clzll(rest) + 1;
+    uint8_t& reg = registers_[hash >> (64 - precision_)];
+    if (rank > reg) {
+      --histogram_[reg];
+      ++histogram_[rank];
+      reg = rank;
+    }
+  }
+
+  // The estimated number of distinct hashes added.
+  uint64_t Estimate() const;
+
+  // The estimate of a sketch with the given number of registers, a power of 2,
+  // from the sum of 2^-register over all registers and the number of them that
+  // are 0. For sketches that keep their registers elsewhere.
+  static uint64_t EstimateOf(size_t num_registers, double inverse_sum,
+                             size_t zeros);
+
+  // Adds the hashes of another sketch. Throws if both have registers and their
+  // precisions differ.
+  void Merge(const HyperLogLog& other);
+
+  // Forgets all hashes.
+  void Clear();
+
+  // 0 if the sketch has no registers.
+  uint8_t precision() const {
+    return precision_;
+  }
+
+  bool enabled() const {
+    return !registers_.empty();
+  }
+
+  // Memory allocated for the registers.
+  size_t SizeBytes() const {
+    return registers_.empty() ? 0 : HeapBlockSize(registers_.size());
+  }
+
+ private:
+  uint8_t precision_;
+  std::vector<uint8_t> registers_;
+
+  // Number of registers with each value. A register is at most 65 - precision.
+  std::array<uint32_t, 66> histogram_;
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_HYPERLOGLOG_H */
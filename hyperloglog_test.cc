@@ -0,0 +1,93 @@
+#include "gtest/gtest.h"
+
+#include <cmath>
+
+#include "hyperloglog.h"
+
+namespace flowparser {
+namespace test {
+
+// Checks that an estimate is within a number of standard errors of the real
+// value.
+static void AssertClose(uint64_t expected, uint64_t estimate,
+                        uint8_t precision) {
+  double error = 1.04 / std::sqrt(double(1 << precision));
+  ASSERT_NEAR(expected, estimate, 4 * error * expected + 1);
+}
+
+TEST(HyperLogLog, Init) {
+  ASSERT_THROW(HyperLogLog(3), std::logic_error);
+  ASSERT_THROW(HyperLogLog(19), std::logic_error);
+
+  HyperLogLog disabled;
+  ASSERT_FALSE(disabled.enabled());
+  disabled.Add(Mix64(1));
+  ASSERT_EQ(0, disabled.Estimate());
+  ASSERT_EQ(0, disabled.SizeBytes());
+
+  HyperLogLog sketch(12);
+  ASSERT_TRUE(sketch.enabled());
+  ASSERT_EQ(0, sketch.Estimate());
+  ASSERT_LE(4096, sketch.SizeBytes());
+}
+
+TEST(HyperLogLog, Estimate) {
+  for (uint8_t precision : { 4, 10, 12, 14 }) {
+    HyperLogLog sketch(precision);
+    uint64_t added = 0;
+    for (uint64_t count : { 10, 100, 1000, 10000, 100000, 1000000 }) {
+      for (; added < count; ++added) {
+        // Each value twice, duplicates do not count.
+        sketch.Add(Mix64(added));
+        sketch.Add(Mix64(added));
+      }
+
+      AssertClose(count, sketch.Estimate(), precision);
+    }
+  }
+}
+
+TEST(HyperLogLog, Small) {
+  // Linear counting is close to exact while most registers are empty.
+  HyperLogLog sketch(12);
+  for (uint64_t i = 0; i < 10; ++i) {
+    sketch.Add(Mix64(i));
+  }
+
+  ASSERT_EQ(10, sketch.Estimate());
+}
+
+TEST(HyperLogLog, Merge) {
+  HyperLogLog first(12);
+  HyperLogLog second(12);
+  HyperLogLog both(12);
+  for (uint64_t i = 0; i < 100000; ++i) {
+    first.Add(Mix64(i));
+    both.Add(Mix64(i));
+  }
+
+  // Half of them are the same.
+  for (uint64_t i = 50000; i < 150000; ++i) {
+    second.Add(Mix64(i));
+    both.Add(Mix64(i));
+  }
+
+  first.Merge(second);
+  ASSERT_EQ(both.Estimate(), first.Estimate());
+  AssertClose(150000, first.Estimate(), 12);
+
+  // Into one with no registers.
+  HyperLogLog disabled;
+  disabled.Merge(first);
+  ASSERT_EQ(first.Estimate(), disabled.Estimate());
+  first.Merge(HyperLogLog());
+  ASSERT_EQ(both.Estimate(), first.Estimate());
+
+  ASSERT_THROW(first.Merge(HyperLogLog(10)), std::logic_error);
+
+  first.Clear();
+  ASSERT_EQ(0, first.Estimate());
+}
+
+}  // namespace test
+}  // namespace flowparser
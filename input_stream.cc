@@ -0,0 +1,64 @@
+#include "input_stream.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace flowparser {
+
+MappedFile::MappedFile(const std::string& filename)
+    : filename_(filename),
+      data_(nullptr),
+      size_(0) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::logic_error(
+        "Could not open " + filename + ": " + std::string(strerror(errno)));
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    close(fd);
+    throw std::logic_error(
+        "Could not stat " + filename + ": " + std::string(strerror(errno)));
+  }
+
+  size_ = file_stat.st_size;
+  if (size_ == 0) {
+    close(fd);
+    return;
+  }
+
+  void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    throw std::logic_error(
+        "Could not map " + filename + ": " + std::string(strerror(errno)));
+  }
+
+  // These are only hints, failures are not important.
+  madvise(mapping, size_, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise(mapping, size_, MADV_HUGEPAGE);
+#endif
+
+  data_ = static_cast<const uint8_t*>(mapping);
+}
+
+void MappedFile::Prefetch() const {
+  if (data_ != nullptr) {
+    madvise(const_cast<uint8_t*>(data_), size_, MADV_WILLNEED);
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+  }
+}
+
+}  // namespace flowparser
@@ -0,0 +1,126 @@
+// Byte streams that capture file readers are built on top of.
+
+#ifndef FLOWPARSER_INPUT_STREAM_H
+#define FLOWPARSER_INPUT_STREAM_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include "common.h"
+
+namespace flowparser {
+
+// A sequential stream of bytes.
+class InputStream {
+ public:
+  virtual ~InputStream() {
+  }
+
+  // Makes the next len bytes of the stream available at *data. The pointer is
+  // only valid until the next call. Returns false if the stream ended before
+  // the first byte, throws if it ended after the first but before the last
+  // byte.
+  virtual bool Read(size_t len, const uint8_t** data) = 0;
+
+  // Same as Read, but the bytes will be returned again by the next call.
+  virtual bool Peek(size_t len, const uint8_t** data) = 0;
+
+ protected:
+  InputStream() {
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(InputStream);
+};
+
+// A file mapped read-only into memory.
+class MappedFile {
+ public:
+  // Maps the entire file. The kernel is advised that the file will be read
+  // sequentially and that huge pages should be used where possible. Throws if
+  // the file cannot be opened or mapped.
+  explicit MappedFile(const std::string& filename);
+
+  ~MappedFile();
+
+  const uint8_t* data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  const std::string& filename() const {
+    return filename_;
+  }
+
+  // Asks the kernel to start reading the file in the background.
+  void Prefetch() const;
+
+ private:
+  const std::string filename_;
+
+  // Start of the mapping. Null if the file is empty.
+  const uint8_t* data_;
+
+  // Size of the mapping and the file.
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedFile);
+};
+
+// A stream over a range of memory, usually a part of a MappedFile. Reads do not
+// copy -- the pointers returned point into the range.
+class MappedInputStream : public InputStream {
+ public:
+  MappedInputStream(const uint8_t* begin, const uint8_t* end)
+      : next_(begin),
+        end_(end) {
+  }
+
+  explicit MappedInputStream(const MappedFile& file)
+      : MappedInputStream(file.data(), file.data() + file.size()) {
+  }
+
+  bool Read(size_t len, const uint8_t** data) override {
+    if (!Peek(len, data)) {
+      return false;
+    }
+
+    next_ += len;
+    return true;
+  }
+
+  bool Peek(size_t len, const uint8_t** data) override {
+    if (next_ == end_) {
+      return false;
+    }
+
+    if (static_cast<size_t>(end_ - next_) < len) {
+      throw std::runtime_error(
+          "Stream truncated, wanted " + std::to_string(len) + " bytes, "
+              + std::to_string(end_ - next_) + " left");
+    }
+
+    *data = next_;
+    return true;
+  }
+
+  // Where the next read will start.
+  const uint8_t* position() const {
+    return next_;
+  }
+
+ private:
+  // The next byte to be read.
+  const uint8_t* next_;
+
+  // One past the last byte of the range.
+  const uint8_t* const end_;
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_INPUT_STREAM_H */
@@ -0,0 +1,287 @@
+#include "link_decoder.h"
+
+#include <pcap/bpf.h>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace flowparser {
+
+// Headers nested deeper than this are not decoded.
+static constexpr size_t kMaxLayers = 16;
+
+static constexpr uint8_t kIpprotoGre = 47;
+
+// GRE flags, in the first byte of the GRE header.
+static constexpr uint8_t kGreChecksum = 0x80;
+static constexpr uint8_t kGreRouting = 0x40;
+static constexpr uint8_t kGreKey = 0x20;
+static constexpr uint8_t kGreSequence = 0x10;
+
+// The VXLAN header is 8 bytes, the I flag says the VNI is valid.
+static constexpr size_t kVxlanHeaderSize = 8;
+static constexpr uint8_t kVxlanValidVni = 0x08;
+
+// The bottom of stack bit of an MPLS label, in its third byte.
+static constexpr uint8_t kMplsBottomOfStack = 0x01;
+
+// Address families used for IPv4 and IPv6 by DLT_NULL and DLT_LOOP. IPv6 has a
+// different value on each BSD.
+static constexpr uint32_t kFamilyInet = 2;
+static constexpr uint32_t kFamilyInet6Linux = 10;
+static constexpr uint32_t kFamilyInet6NetBSD = 24;
+static constexpr uint32_t kFamilyInet6FreeBSD = 28;
+static constexpr uint32_t kFamilyInet6Darwin = 30;
+
+#ifndef DLT_LINUX_SLL2
+#define DLT_LINUX_SLL2 276
+#endif
+
+const LinkDecoder::LinkType LinkDecoder::kLinkTypes[] = {
+    { DLT_EN10MB, 14, 12, TYPE_ETHERTYPE },
+    { DLT_RAW, 0, 0, TYPE_NONE },
+    { DLT_LINUX_SLL, 16, 14, TYPE_ETHERTYPE },
+    { DLT_LINUX_SLL2, 20, 0, TYPE_ETHERTYPE },
+    { DLT_NULL, 4, 0, TYPE_FAMILY },
+    { DLT_LOOP, 4, 0, TYPE_FAMILY } };
+
+// The most common ethertypes come first.
+const LinkDecoder::EthertypeLayer LinkDecoder::kEthertypes[] = {
+    { 0x0800, LAYER_IP },  // IPv4
+    { 0x86dd, LAYER_IP },  // IPv6
+    { 0x8100, LAYER_VLAN },  // 802.1Q
+    { 0x88a8, LAYER_VLAN },  // 802.1ad (QinQ)
+    { 0x9100, LAYER_VLAN },  // Pre-standard QinQ
+    { 0x8847, LAYER_MPLS },  // MPLS unicast
+    { 0x8848, LAYER_MPLS },  // MPLS multicast
+    { 0x6558, LAYER_ETHERNET } };  // Transparent Ethernet bridging (GRE)
+
+static uint16_t ReadUint16(const uint8_t* data) {
+  return (data[0] << 8) | data[1];
+}
+
+static uint32_t ReadUint24(const uint8_t* data) {
+  return (data[0] << 16) | (data[1] << 8) | data[2];
+}
+
+static uint32_t SwapUint32(uint32_t value) {
+  return (value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000)
+      | (value << 24);
+}
+
+const LinkDecoder::LinkType* LinkDecoder::FindLinkType(int datalink) {
+  for (const LinkType& link_type : kLinkTypes) {
+    if (link_type.datalink == datalink) {
+      return &link_type;
+    }
+  }
+
+  return nullptr;
+}
+
+LinkDecoder::Layer LinkDecoder::LayerOf(uint16_t ethertype) {
+  for (const EthertypeLayer& ethertype_layer : kEthertypes) {
+    if (ethertype_layer.ethertype == ethertype) {
+      return ethertype_layer.layer;
+    }
+  }
+
+  return LAYER_NONE;
+}
+
+bool LinkDecoder::Supported(int datalink) {
+  return FindLinkType(datalink) != nullptr;
+}
+
+LinkDecoder::LinkDecoder(int datalink, const DecoderConfig& config)
+    : datalink_(datalink),
+      link_type_(FindLinkType(datalink)),
+      config_(config) {
+  if (link_type_ == nullptr) {
+    throw std::logic_error(
+        "Unsupported datalink " + std::to_string(datalink));
+  }
+}
+
+LinkDecoder::Layer LinkDecoder::Tunnel(const uint8_t* pkt, size_t caplen,
+                                       size_t* offset, Segment* segment) const {
+  const uint8_t* ip = pkt + *offset;
+  size_t remaining = caplen - *offset;
+
+  uint8_t protocol;
+  size_t header_len;
+  if ((ip[0] >> 4) == 4) {
+    if (remaining < sizeof(pcap::SniffIp)) {
+      return LAYER_NONE;
+    }
+
+    const pcap::SniffIp* ip_header = reinterpret_cast<const pcap::SniffIp*>(ip);
+    if ((ntohs(ip_header->ip_off) & IP_OFFMASK) != 0) {
+      return LAYER_NONE;
+    }
+
+    protocol = ip_header->ip_p;
+    header_len = ip_header->ip_hl * 4;
+    if (header_len < sizeof(pcap::SniffIp)) {
+      return LAYER_NONE;
+    }
+  } else {
+    // Malformed IPv6 headers are reported when the packet is dispatched.
+    try {
+      IpHeader ip_header = IpHeader::ParseIpv6(ip, remaining);
+      if (ip_header.later_fragment) {
+        return LAYER_NONE;
+      }
+
+      protocol = ip_header.protocol;
+      header_len = ip_header.header_len;
+    } catch (std::exception&) {
+      return LAYER_NONE;
+    }
+  }
+
+  if (protocol == kIpprotoGre) {
+    const uint8_t* gre = ip + header_len;
+    if (header_len + 4 > remaining) {
+      return LAYER_NONE;
+    }
+
+    // Only version 0 GRE without source routing.
+    uint8_t flags = gre[0];
+    if ((flags & kGreRouting) || (gre[1] & 0x07) != 0) {
+      return LAYER_NONE;
+    }
+
+    size_t gre_len = 4 + ((flags & kGreChecksum) ? 4 : 0)
+        + ((flags & kGreKey) ? 4 : 0) + ((flags & kGreSequence) ? 4 : 0);
+    Layer layer = LayerOf(ReadUint16(gre + 2));
+    if (layer == LAYER_NONE || header_len + gre_len > remaining) {
+      return LAYER_NONE;
+    }
+
+    *offset += header_len + gre_len;
+    return layer;
+  }
+
+  if (protocol == IPPROTO_UDP) {
+    const uint8_t* udp = ip + header_len;
+    if (header_len + 8 + kVxlanHeaderSize > remaining
+        || ReadUint16(udp + 2) != config_.vxlan_port) {
+      return LAYER_NONE;
+    }
+
+    const uint8_t* vxlan = udp + 8;
+    if (!(vxlan[0] & kVxlanValidVni)) {
+      return LAYER_NONE;
+    }
+
+    segment->vni = ReadUint24(vxlan + 4);
+    *offset += header_len + 8 + kVxlanHeaderSize;
+    return LAYER_ETHERNET;
+  }
+
+  return LAYER_NONE;
+}
+
+bool LinkDecoder::Decode(const uint8_t* pkt, size_t caplen,
+                         DecodedPacket* decoded) const {
+  size_t offset = link_type_->header_len;
+  if (offset > caplen) {
+    return false;
+  }
+
+  Layer layer;
+  switch (link_type_->type_field) {
+    case TYPE_NONE:
+      layer = LAYER_IP;
+      break;
+    case TYPE_ETHERTYPE:
+      layer = LayerOf(ReadUint16(pkt + link_type_->type_offset));
+      break;
+    case TYPE_FAMILY: {
+      // DLT_NULL is in the byte order of the capturing host, DLT_LOOP in
+      // network byte order. Families are small, so either can be told apart.
+      uint32_t family;
+      memcpy(&family, pkt + link_type_->type_offset, sizeof(family));
+      if (family > 0xffff) {
+        family = SwapUint32(family);
+      }
+
+      layer = (family == kFamilyInet || family == kFamilyInet6Linux
+          || family == kFamilyInet6NetBSD || family == kFamilyInet6FreeBSD
+          || family == kFamilyInet6Darwin) ? LAYER_IP : LAYER_NONE;
+      break;
+    }
+    default:
+      layer = LAYER_NONE;
+  }
+
+  // The last IP header seen, in case a tunnel's payload cannot be decoded.
+  bool have_ip = false;
+  DecodedPacket last_ip;
+
+  Segment segment;
+  for (size_t depth = 0; layer != LAYER_NONE && depth < kMaxLayers; ++depth) {
+    switch (layer) {
+      case LAYER_IP: {
+        uint8_t version = offset < caplen ? pkt[offset] >> 4 : 0;
+        if (version != 4 && version != 6) {
+          layer = LAYER_NONE;
+          break;
+        }
+
+        have_ip = true;
+        last_ip.offset = offset;
+        last_ip.segment = segment;
+        layer = config_.decapsulate_tunnels ?
+            Tunnel(pkt, caplen, &offset, &segment) : LAYER_NONE;
+        break;
+      }
+      case LAYER_ETHERNET:
+        if (offset + pcap::kSizeEthernet > caplen) {
+          layer = LAYER_NONE;
+          break;
+        }
+
+        layer = LayerOf(ReadUint16(pkt + offset + 12));
+        offset += pcap::kSizeEthernet;
+        break;
+      case LAYER_VLAN:
+        if (offset + 4 > caplen) {
+          layer = LAYER_NONE;
+          break;
+        }
+
+        segment.vlan = ReadUint16(pkt + offset) & 0x0fff;
+        layer = LayerOf(ReadUint16(pkt + offset + 2));
+        offset += 4;
+        break;
+      case LAYER_MPLS: {
+        // Labels up to the bottom of the stack. What follows has no type, IP
+        // is recognized by its version.
+        bool bottom = false;
+        while (!bottom && offset + 4 <= caplen) {
+          bottom = (pkt[offset + 2] & kMplsBottomOfStack) != 0;
+          offset += 4;
+        }
+
+        layer = bottom ? LAYER_IP : LAYER_NONE;
+        break;
+      }
+      default:
+        layer = LAYER_NONE;
+    }
+  }
+
+  // Headers nested too deeply are ignored, the last IP header found is used.
+  if (!have_ip) {
+    return false;
+  }
+
+  decoded->offset = last_ip.offset;
+  decoded->segment.vlan = config_.vlan_in_key ? last_ip.segment.vlan : 0;
+  decoded->segment.vni = config_.vni_in_key ? last_ip.segment.vni : 0;
+  return true;
+}
+
+}  // namespace flowparser
@@ -0,0 +1,118 @@
+// Finds the IP header of a packet behind its datalink header, VLAN tags, MPLS
+// labels and GRE or VXLAN tunnels.
+
+#ifndef FLOWPARSER_LINK_DECODER_H
+#define FLOWPARSER_LINK_DECODER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "common.h"
+#include "flows.h"
+
+namespace flowparser {
+
+struct DecoderConfig {
+  // If true packets in GRE and VXLAN tunnels are attributed to the flows
+  // inside the tunnels, otherwise to the flows of the tunnels themselves.
+  bool decapsulate_tunnels = true;
+
+  // The UDP destination port VXLAN is recognized on.
+  uint16_t vxlan_port = 4789;
+
+  // If true the VLAN id of the innermost VLAN tag is part of the flow key, so
+  // the same flow on different VLANs is tracked separately.
+  bool vlan_in_key = false;
+
+  // Same as above, but for the VXLAN network identifier.
+  bool vni_in_key = false;
+};
+
+// Where a decoded packet's IP header is.
+struct DecodedPacket {
+  // Offset of the IP header from the start of the packet. If tunnels are
+  // decapsulated this is the innermost IP header.
+  size_t offset = 0;
+
+  // The segment the packet was seen in. Only the parts enabled in the config
+  // are set, the rest are 0.
+  Segment segment;
+};
+
+// Decodes packets of a single datalink. What each datalink header and each
+// ethertype is followed by is looked up in small tables, so the common case --
+// an IP packet right after the datalink header -- takes the same few branches
+// every time. Stateless, can be used from more than one thread.
+class LinkDecoder {
+ public:
+  // Throws if the datalink is not supported.
+  LinkDecoder(int datalink, const DecoderConfig& config);
+
+  // True if packets with the given pcap DLT_ value can be decoded.
+  static bool Supported(int datalink);
+
+  // Decodes a packet of caplen captured bytes. Returns false if the packet does
+  // not carry IPv4 or IPv6, or if its headers up to the first byte of the IP
+  // header were not captured. If a tunnel's payload cannot be decoded the
+  // packet is attributed to the tunnel. The rest of the IP header may not have
+  // been captured, callers check it against caplen - offset.
+  bool Decode(const uint8_t* pkt, size_t caplen, DecodedPacket* decoded) const;
+
+  int datalink() const {
+    return datalink_;
+  }
+
+ private:
+  // What a header is followed by.
+  enum Layer : uint8_t {
+    LAYER_NONE,
+    LAYER_ETHERNET,
+    LAYER_VLAN,
+    LAYER_MPLS,
+    LAYER_IP
+  };
+
+  // How the type of what follows the datalink header is encoded.
+  enum TypeField : uint8_t {
+    // Nothing, the datalink header is followed by IP.
+    TYPE_NONE,
+    // A 16 bit ethertype in network byte order.
+    TYPE_ETHERTYPE,
+    // A 32 bit BSD address family in either byte order.
+    TYPE_FAMILY
+  };
+
+  struct LinkType {
+    int datalink;
+    uint8_t header_len;
+    uint8_t type_offset;
+    TypeField type_field;
+  };
+
+  struct EthertypeLayer {
+    uint16_t ethertype;
+    Layer layer;
+  };
+
+  static const LinkType kLinkTypes[];
+  static const EthertypeLayer kEthertypes[];
+
+  // Returns null if the datalink is not supported.
+  static const LinkType* FindLinkType(int datalink);
+
+  static Layer LayerOf(uint16_t ethertype);
+
+  // Checks if the IP packet at offset is a GRE or VXLAN tunnel. If it is sets
+  // offset to the start of the tunnel's payload and returns what the payload
+  // is, otherwise returns LAYER_NONE.
+  Layer Tunnel(const uint8_t* pkt, size_t caplen, size_t* offset,
+               Segment* segment) const;
+
+  const int datalink_;
+  const LinkType* const link_type_;
+  const DecoderConfig config_;
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_LINK_DECODER_H */
@@ -0,0 +1,276 @@
+#include "gtest/gtest.h"
+#include "link_decoder.h"
+
+#include <pcap/bpf.h>
+#include <vector>
+
+namespace flowparser {
+namespace test {
+
+// Builds packets header by header.
+class PacketBuilder {
+ public:
+  PacketBuilder& Bytes(const std::vector<uint8_t>& bytes) {
+    pkt_.insert(pkt_.end(), bytes.begin(), bytes.end());
+    return *this;
+  }
+
+  PacketBuilder& Uint16(uint16_t value) {
+    return Bytes( { static_cast<uint8_t>(value >> 8),
+        static_cast<uint8_t>(value) });
+  }
+
+  PacketBuilder& Ethernet(uint16_t ethertype) {
+    pkt_.resize(pkt_.size() + 12);
+    return Uint16(ethertype);
+  }
+
+  PacketBuilder& Vlan(uint16_t vlan, uint16_t ethertype) {
+    return Uint16(vlan).Uint16(ethertype);
+  }
+
+  // A label with the given value, the bottom of stack bit is set if bottom is
+  // true.
+  PacketBuilder& Mpls(uint32_t label, bool bottom) {
+    return Bytes( { static_cast<uint8_t>(label >> 12),
+        static_cast<uint8_t>(label >> 4),
+        static_cast<uint8_t>((label << 4) | (bottom ? 1 : 0)), 64 });
+  }
+
+  // An IPv4 header with no options.
+  PacketBuilder& Ipv4(uint8_t protocol) {
+    std::vector<uint8_t> header(20);
+    header[0] = 0x45;
+    header[3] = 20;
+    header[9] = protocol;
+    return Bytes(header);
+  }
+
+  // An IPv6 header with no extension headers.
+  PacketBuilder& Ipv6(uint8_t next_header) {
+    std::vector<uint8_t> header(40);
+    header[0] = 0x60;
+    header[6] = next_header;
+    return Bytes(header);
+  }
+
+  PacketBuilder& Udp(uint16_t dport) {
+    return Uint16(1000).Uint16(dport).Uint16(8).Uint16(0);
+  }
+
+  PacketBuilder& Vxlan(uint32_t vni) {
+    return Bytes( { 0x08, 0, 0, 0, static_cast<uint8_t>(vni >> 16),
+        static_cast<uint8_t>(vni >> 8), static_cast<uint8_t>(vni), 0 });
+  }
+
+  // Marks where the IP header that should be found starts.
+  PacketBuilder& Mark() {
+    mark_ = pkt_.size();
+    return *this;
+  }
+
+  const std::vector<uint8_t>& pkt() const {
+    return pkt_;
+  }
+
+  size_t mark() const {
+    return mark_;
+  }
+
+ private:
+  std::vector<uint8_t> pkt_;
+  size_t mark_ = 0;
+};
+
+class LinkDecoderFixture : public ::testing::Test {
+ protected:
+  // Decodes the packet and checks that the IP header is where it was marked.
+  void AssertDecodes(int datalink, const PacketBuilder& builder) {
+    LinkDecoder decoder(datalink, config_);
+    ASSERT_TRUE(decoder.Decode(builder.pkt().data(), builder.pkt().size(),
+                               &decoded_));
+    ASSERT_EQ(builder.mark(), decoded_.offset);
+  }
+
+  bool Decodes(int datalink, const std::vector<uint8_t>& pkt) {
+    LinkDecoder decoder(datalink, config_);
+    return decoder.Decode(pkt.data(), pkt.size(), &decoded_);
+  }
+
+  DecoderConfig config_;
+  DecodedPacket decoded_;
+};
+
+TEST(LinkDecoder, Supported) {
+  ASSERT_TRUE(LinkDecoder::Supported(DLT_EN10MB));
+  ASSERT_TRUE(LinkDecoder::Supported(DLT_RAW));
+  ASSERT_TRUE(LinkDecoder::Supported(DLT_LINUX_SLL));
+  ASSERT_TRUE(LinkDecoder::Supported(DLT_NULL));
+  ASSERT_FALSE(LinkDecoder::Supported(DLT_IPV4));
+  ASSERT_THROW(LinkDecoder(DLT_IPV4, DecoderConfig()), std::logic_error);
+}
+
+TEST_F(LinkDecoderFixture, Ethernet) {
+  AssertDecodes(DLT_EN10MB,
+                PacketBuilder().Ethernet(0x0800).Mark().Ipv4(IPPROTO_TCP));
+  AssertDecodes(DLT_EN10MB,
+                PacketBuilder().Ethernet(0x86dd).Mark().Ipv6(IPPROTO_TCP));
+  ASSERT_EQ(0, decoded_.segment.vlan);
+}
+
+TEST_F(LinkDecoderFixture, Raw) {
+  AssertDecodes(DLT_RAW, PacketBuilder().Mark().Ipv4(IPPROTO_TCP));
+  AssertDecodes(DLT_RAW, PacketBuilder().Mark().Ipv6(IPPROTO_TCP));
+  ASSERT_FALSE(Decodes(DLT_RAW, { 0x20, 0, 0, 0 }));
+}
+
+TEST_F(LinkDecoderFixture, NotIp) {
+  // ARP.
+  ASSERT_FALSE(Decodes(DLT_EN10MB, PacketBuilder().Ethernet(0x0806).Ipv4(
+      IPPROTO_TCP).pkt()));
+
+  // An IPv4 ethertype with something else in it.
+  ASSERT_FALSE(Decodes(DLT_EN10MB, PacketBuilder().Ethernet(0x0800).Bytes( {
+      0x10, 0, 0, 0 }).pkt()));
+}
+
+TEST_F(LinkDecoderFixture, Truncated) {
+  std::vector<uint8_t> pkt = PacketBuilder().Ethernet(0x8100).Vlan(
+      5, 0x0800).Ipv4(IPPROTO_TCP).pkt();
+  LinkDecoder decoder(DLT_EN10MB, config_);
+  ASSERT_FALSE(decoder.Decode(pkt.data(), 10, &decoded_));
+  ASSERT_FALSE(decoder.Decode(pkt.data(), 16, &decoded_));
+  ASSERT_FALSE(decoder.Decode(pkt.data(), 18, &decoded_));
+  ASSERT_TRUE(decoder.Decode(pkt.data(), 19, &decoded_));
+}
+
+TEST_F(LinkDecoderFixture, VlanStack) {
+  PacketBuilder builder;
+  builder.Ethernet(0x88a8).Vlan(100, 0x8100).Vlan(0x2000 | 200, 0x0800).Mark()
+      .Ipv4(IPPROTO_UDP);
+  AssertDecodes(DLT_EN10MB, builder);
+  ASSERT_EQ(0, decoded_.segment.vlan);
+
+  // The innermost VLAN id, without the priority bits.
+  config_.vlan_in_key = true;
+  AssertDecodes(DLT_EN10MB, builder);
+  ASSERT_EQ(200, decoded_.segment.vlan);
+}
+
+TEST_F(LinkDecoderFixture, Mpls) {
+  AssertDecodes(
+      DLT_EN10MB,
+      PacketBuilder().Ethernet(0x8847).Mpls(16, false).Mpls(17, true).Mark()
+          .Ipv6(IPPROTO_TCP));
+
+  // No bottom of stack before the end of the packet.
+  ASSERT_FALSE(Decodes(
+      DLT_EN10MB,
+      PacketBuilder().Ethernet(0x8847).Mpls(16, false).Mpls(17, false).pkt()));
+}
+
+TEST_F(LinkDecoderFixture, LinuxSll) {
+  PacketBuilder sll;
+  sll.Bytes(std::vector<uint8_t>(14)).Uint16(0x0800).Mark().Ipv4(IPPROTO_TCP);
+  AssertDecodes(DLT_LINUX_SLL, sll);
+
+  PacketBuilder sll2;
+  sll2.Uint16(0x86dd).Bytes(std::vector<uint8_t>(18)).Mark().Ipv6(
+      IPPROTO_TCP);
+  AssertDecodes(DLT_LINUX_SLL2, sll2);
+}
+
+TEST_F(LinkDecoderFixture, Null) {
+  // Little and big endian AF_INET, and the Darwin AF_INET6.
+  AssertDecodes(DLT_NULL,
+                PacketBuilder().Bytes( { 2, 0, 0, 0 }).Mark().Ipv4(
+                    IPPROTO_TCP));
+  AssertDecodes(DLT_NULL,
+                PacketBuilder().Bytes( { 0, 0, 0, 2 }).Mark().Ipv4(
+                    IPPROTO_TCP));
+  AssertDecodes(DLT_LOOP,
+                PacketBuilder().Bytes( { 0, 0, 0, 30 }).Mark().Ipv6(
+                    IPPROTO_TCP));
+  ASSERT_FALSE(Decodes(DLT_NULL, PacketBuilder().Bytes( { 7, 0, 0, 0 }).Ipv4(
+      IPPROTO_TCP).pkt()));
+}
+
+TEST_F(LinkDecoderFixture, Gre) {
+  // GRE with a key, carrying IPv4.
+  PacketBuilder builder;
+  builder.Ethernet(0x0800).Ipv4(47).Bytes( { 0x20, 0 }).Uint16(0x0800).Bytes( {
+      0, 0, 0, 1 }).Mark().Ipv4(IPPROTO_TCP);
+  AssertDecodes(DLT_EN10MB, builder);
+
+  // Same, but the tunnel is the flow.
+  config_.decapsulate_tunnels = false;
+  LinkDecoder decoder(DLT_EN10MB, config_);
+  ASSERT_TRUE(decoder.Decode(builder.pkt().data(), builder.pkt().size(),
+                             &decoded_));
+  ASSERT_EQ(14, decoded_.offset);
+}
+
+TEST_F(LinkDecoderFixture, GreEthernet) {
+  AssertDecodes(
+      DLT_EN10MB,
+      PacketBuilder().Ethernet(0x86dd).Ipv6(47).Bytes( { 0, 0 }).Uint16(0x6558)
+          .Ethernet(0x8100).Vlan(7, 0x0800).Mark().Ipv4(IPPROTO_UDP));
+}
+
+TEST_F(LinkDecoderFixture, GreUnknownPayload) {
+  // The payload is not something that can be decoded, so the packet belongs
+  // to the tunnel.
+  AssertDecodes(
+      DLT_EN10MB,
+      PacketBuilder().Ethernet(0x0800).Mark().Ipv4(47).Bytes( { 0, 0 }).Uint16(
+          0x880b).Ipv4(IPPROTO_TCP));
+
+  // Same, but the payload is Ethernet with something other than IP in it.
+  AssertDecodes(
+      DLT_EN10MB,
+      PacketBuilder().Ethernet(0x0800).Mark().Ipv4(47).Bytes( { 0, 0 }).Uint16(
+          0x6558).Ethernet(0x0806));
+}
+
+TEST_F(LinkDecoderFixture, Vxlan) {
+  PacketBuilder builder;
+  builder.Ethernet(0x8100).Vlan(10, 0x0800).Ipv4(IPPROTO_UDP).Udp(4789).Vxlan(
+      0x123456).Ethernet(0x8100).Vlan(20, 0x86dd).Mark().Ipv6(IPPROTO_TCP);
+  AssertDecodes(DLT_EN10MB, builder);
+  ASSERT_EQ(0, decoded_.segment.vni);
+
+  config_.vlan_in_key = true;
+  config_.vni_in_key = true;
+  AssertDecodes(DLT_EN10MB, builder);
+  ASSERT_EQ(20, decoded_.segment.vlan);
+  ASSERT_EQ(0x123456, decoded_.segment.vni);
+
+  // On another port it is just UDP.
+  config_.vxlan_port = 8472;
+  LinkDecoder decoder(DLT_EN10MB, config_);
+  ASSERT_TRUE(decoder.Decode(builder.pkt().data(), builder.pkt().size(),
+                             &decoded_));
+  ASSERT_EQ(18, decoded_.offset);
+  ASSERT_EQ(10, decoded_.segment.vlan);
+  ASSERT_EQ(0, decoded_.segment.vni);
+}
+
+TEST_F(LinkDecoderFixture, TooDeep) {
+  // GRE in GRE, more times than are decoded. The last IP header that was found
+  // is used.
+  PacketBuilder builder;
+  builder.Ethernet(0x0800);
+  for (size_t i = 0; i < 20; ++i) {
+    builder.Ipv4(47).Bytes( { 0, 0 }).Uint16(0x0800);
+  }
+
+  builder.Ipv4(IPPROTO_TCP);
+  LinkDecoder decoder(DLT_EN10MB, config_);
+  ASSERT_TRUE(decoder.Decode(builder.pkt().data(), builder.pkt().size(),
+                             &decoded_));
+  ASSERT_LT(14, decoded_.offset);
+  ASSERT_GT(builder.pkt().size() - 20, decoded_.offset);
+}
+
+}  // namespace test
+}  // namespace flowparser
@@ -0,0 +1,209 @@
+#include "micro_flows.h"
+
+#include <stdexcept>
+
+#include "flow_table.h"
+
+namespace flowparser {
+
+constexpr size_t MicroFlow::kMaxPackets;
+constexpr size_t MicroFlowTable::kWays;
+
+MicroFlow::Packet* MicroFlow::NewPacket(const IpHeader& ip_header,
+                                        uint64_t timestamp,
+                                        Transport transport) {
+  if (!Fits(timestamp)) {
+    throw std::logic_error("Packet does not fit in micro-flow");
+  }
+
+  Packet* packet = &packets_[pkts_seen_++];
+  packet->time_offset = timestamp - first_rx_time_;
+  packet->tcp_seq = 0;
+  packet->tcp_ack = 0;
+  packet->ip_len = ip_header.len;
+  packet->ip_header_len = ip_header.header_len;
+  packet->ip_id = ip_header.id;
+  packet->tcp_win = 0;
+  packet->ip_ttl = ip_header.ttl;
+  packet->later_fragment = ip_header.later_fragment;
+  packet->transport = transport;
+  packet->flags_or_type = 0;
+  packet->offset_or_code = 0;
+  return packet;
+}
+
+uint16_t MicroFlow::TCPIpRx(const IpHeader& ip_header,
+                            const pcap::SniffTcp& tcp_header,
+                            uint64_t timestamp) {
+  uint16_t payload_size = Flow::PayloadSize(ip_header, tcp_header.th_off * 4,
+                                            "TCP", key_);
+  Packet* packet = NewPacket(ip_header, timestamp, TRANSPORT_TCP);
+  packet->tcp_seq = ntohl(tcp_header.th_seq);
+  packet->tcp_ack = ntohl(tcp_header.th_ack);
+  packet->tcp_win = ntohs(tcp_header.th_win);
+  packet->flags_or_type = tcp_header.th_flags;
+  packet->offset_or_code = tcp_header.th_off;
+  tcp_flags_or_ |= tcp_header.th_flags;
+  return payload_size;
+}
+
+uint16_t MicroFlow::UDPIpRx(const IpHeader& ip_header, uint64_t timestamp) {
+  uint16_t payload_size = Flow::PayloadSize(ip_header, pcap::kSizeUDP, "UDP",
+                                            key_);
+  NewPacket(ip_header, timestamp, TRANSPORT_UDP);
+  return payload_size;
+}
+
+uint16_t MicroFlow::ICMPIpRx(const IpHeader& ip_header,
+                             const pcap::SniffIcmp& icmp_header,
+                             uint64_t timestamp) {
+  uint16_t payload_size = Flow::PayloadSize(ip_header, pcap::kSizeICMP, "ICMP",
+                                            key_);
+  Packet* packet = NewPacket(ip_header, timestamp, TRANSPORT_ICMP);
+  packet->flags_or_type = icmp_header.icmp_type;
+  packet->offset_or_code = icmp_header.icmp_code;
+  return payload_size;
+}
+
+uint16_t MicroFlow::UnknownIpRx(const IpHeader& ip_header,
+                                uint64_t timestamp) {
+  NewPacket(ip_header, timestamp, TRANSPORT_UNKNOWN);
+  return ip_header.len - ip_header.header_len;
+}
+
+std::unique_ptr<Flow> MicroFlow::ToFlow(const FlowConfig& flow_config,
+                                        SlabPool* pool) const {
+  std::unique_ptr<Flow> flow(new (pool) Flow(first_rx_time_, key_, flow_config,
+                                             pool));
+
+  // Flow only looks at these fields of the headers.
+  pcap::SniffIp empty_ip_header;
+  memset(&empty_ip_header, 0, sizeof(empty_ip_header));
+  IpHeader ip_header(empty_ip_header);
+  ip_header.protocol = key_.protocol();
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < pkts_seen_; ++i) {
+    const Packet& packet = packets_[i];
+    uint64_t timestamp = first_rx_time_ + packet.time_offset;
+    ip_header.len = packet.ip_len;
+    ip_header.header_len = packet.ip_header_len;
+    ip_header.id = packet.ip_id;
+    ip_header.ttl = packet.ip_ttl;
+    ip_header.later_fragment = packet.later_fragment;
+
+    switch (packet.transport) {
+      case TRANSPORT_TCP: {
+        pcap::SniffTcp tcp_header;
+        memset(&tcp_header, 0, sizeof(tcp_header));
+        tcp_header.th_seq = htonl(packet.tcp_seq);
+        tcp_header.th_ack = htonl(packet.tcp_ack);
+        tcp_header.th_win = htons(packet.tcp_win);
+        tcp_header.th_flags = packet.flags_or_type;
+        tcp_header.th_off = packet.offset_or_code;
+        flow->TCPIpRx(ip_header, tcp_header, timestamp, &bytes);
+        break;
+      }
+      case TRANSPORT_UDP: {
+        pcap::SniffUdp udp_header;
+        memset(&udp_header, 0, sizeof(udp_header));
+        flow->UDPIpRx(ip_header, udp_header, timestamp, &bytes);
+        break;
+      }
+      case TRANSPORT_ICMP: {
+        pcap::SniffIcmp icmp_header;
+        memset(&icmp_header, 0, sizeof(icmp_header));
+        icmp_header.icmp_type = packet.flags_or_type;
+        icmp_header.icmp_code = packet.offset_or_code;
+        flow->ICMPIpRx(ip_header, icmp_header, timestamp, &bytes);
+        break;
+      }
+      case TRANSPORT_UNKNOWN:
+        flow->UnknownIpRx(ip_header, timestamp, &bytes);
+    }
+  }
+
+  return flow;
+}
+
+MicroFlowTable::MicroFlowTable(size_t num_records)
+    : num_sets_(1),
+      size_(0) {
+  if (num_records == 0) {
+    throw std::logic_error("Micro-flow table cannot have 0 records");
+  }
+
+  while (num_sets_ * kWays < num_records) {
+    num_sets_ *= 2;
+  }
+
+  records_.reset(new Record[capacity()]);
+  for (size_t i = 0; i < capacity(); ++i) {
+    records_[i].used = false;
+  }
+}
+
+MicroFlowTable::~MicroFlowTable() {
+  for (size_t i = 0; i < capacity(); ++i) {
+    if (records_[i].used) {
+      Remove(i);
+    }
+  }
+}
+
+MicroFlow* MicroFlowTable::Find(const FlowKey& key, uint32_t* index) {
+  uint32_t hash = FlowTable::Hash(key);
+  uint32_t start = SetStart(hash);
+  for (uint32_t i = start; i < start + kWays; ++i) {
+    Record& record = records_[i];
+    if (record.used && record.hash == hash && record.flow().key() == key) {
+      if (index != nullptr) {
+        *index = i;
+      }
+
+      return &record.flow();
+    }
+  }
+
+  return nullptr;
+}
+
+uint32_t MicroFlowTable::PlaceFor(const FlowKey& key) const {
+  uint32_t start = SetStart(FlowTable::Hash(key));
+  uint32_t oldest = start;
+  for (uint32_t i = start; i < start + kWays; ++i) {
+    const Record& record = records_[i];
+    if (!record.used) {
+      return i;
+    }
+
+    if (record.flow().last_rx() < records_[oldest].flow().last_rx()) {
+      oldest = i;
+    }
+  }
+
+  return oldest;
+}
+
+MicroFlow* MicroFlowTable::Add(uint32_t index, uint64_t timestamp,
+                               const FlowKey& key) {
+  Record& record = records_[index];
+  if (record.used) {
+    throw std::logic_error("Micro-flow record in use");
+  }
+
+  record.hash = FlowTable::Hash(key);
+  record.used = true;
+  new (&record.storage) MicroFlow(timestamp, key);
+  ++size_;
+  return &record.flow();
+}
+
+void MicroFlowTable::Remove(uint32_t index) {
+  Record& record = records_[index];
+  record.flow().~MicroFlow();
+  record.used = false;
+  --size_;
+}
+
+}  // namespace flowparser
@@ -0,0 +1,206 @@
+// Small fixed-size records for flows that have seen only a few packets.
+
+#ifndef FLOWPARSER_MICRO_FLOWS_H
+#define FLOWPARSER_MICRO_FLOWS_H
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+
+#include "common.h"
+#include "flows.h"
+
+namespace flowparser {
+
+// The first few packets of a flow, kept in a fixed-size record instead of a
+// Flow. Most flows in a scan or a SYN flood never see more than a packet or
+// two, and a Flow with all its fields is many times larger than the packets
+// themselves. A micro-flow is turned into a Flow by replaying its packets,
+// which gives the same Flow as if the packets had gone to it directly.
+class MicroFlow {
+ public:
+  // Packets a micro-flow can hold.
+  static constexpr size_t kMaxPackets = 2;
+
+  MicroFlow(uint64_t timestamp, const FlowKey& key)
+      : key_(key),
+        first_rx_time_(timestamp),
+        pkts_seen_(0),
+        tcp_flags_or_(0) {
+  }
+
+  const FlowKey& key() const {
+    return key_;
+  }
+
+  uint64_t first_rx() const {
+    return first_rx_time_;
+  }
+
+  // The same as first_rx until the first packet.
+  uint64_t last_rx() const {
+    return pkts_seen_ == 0 ? first_rx_time_
+        : first_rx_time_ + packets_[pkts_seen_ - 1].time_offset;
+  }
+
+  size_t pkts_seen() const {
+    return pkts_seen_;
+  }
+
+  uint8_t tcp_flags_or() const {
+    return tcp_flags_or_;
+  }
+
+  // True if a packet received at the given time can be added. False if the
+  // micro-flow is full, or the packet is before the micro-flow was created or
+  // too long after.
+  bool Fits(uint64_t timestamp) const {
+    return pkts_seen_ < kMaxPackets && timestamp >= first_rx_time_
+        && timestamp - first_rx_time_ <= std::numeric_limits<uint32_t>::max();
+  }
+
+  // Add a packet, like the methods of Flow with the same names. The packet
+  // should fit. Return the payload of the packet.
+  uint16_t TCPIpRx(const IpHeader& ip_header,
+                   const pcap::SniffTcp& tcp_header, uint64_t timestamp);
+  uint16_t UDPIpRx(const IpHeader& ip_header, uint64_t timestamp);
+  uint16_t ICMPIpRx(const IpHeader& ip_header,
+                    const pcap::SniffIcmp& icmp_header, uint64_t timestamp);
+  uint16_t UnknownIpRx(const IpHeader& ip_header, uint64_t timestamp);
+
+  // A Flow with the same packets, allocated from the given pool or the default
+  // one. The config should outlive the flow.
+  std::unique_ptr<Flow> ToFlow(const FlowConfig& flow_config,
+                               SlabPool* pool = nullptr) const;
+
+ private:
+  // Which of the Rx methods a packet was added with.
+  enum Transport : uint8_t {
+    TRANSPORT_TCP,
+    TRANSPORT_UDP,
+    TRANSPORT_ICMP,
+    TRANSPORT_UNKNOWN
+  };
+
+  // The fields of a packet that Flow looks at, in host byte order.
+  struct Packet {
+    // From the first packet's timestamp.
+    uint32_t time_offset;
+
+    uint32_t tcp_seq;
+    uint32_t tcp_ack;
+    uint16_t ip_len;
+    uint16_t ip_header_len;
+    uint16_t ip_id;
+    uint16_t tcp_win;
+    uint8_t ip_ttl;
+    bool later_fragment;
+    Transport transport;
+
+    // TCP flags and data offset, or ICMP type and code.
+    uint8_t flags_or_type;
+    uint8_t offset_or_code;
+  };
+
+  // Returns a new packet with its IP fields set.
+  Packet* NewPacket(const IpHeader& ip_header, uint64_t timestamp,
+                    Transport transport);
+
+  const FlowKey key_;
+  const uint64_t first_rx_time_;
+  uint8_t pkts_seen_;
+  uint8_t tcp_flags_or_;
+  Packet packets_[kMaxPackets];
+
+  DISALLOW_COPY_AND_ASSIGN(MicroFlow);
+};
+
+// A fixed number of micro-flows, found by key. Records are in sets of kWays
+// and a key can only go in one set, so adding a micro-flow to a full set means
+// taking the record of another one -- the one that has been quiet for longest.
+// Nothing is allocated after construction. Not thread-safe.
+class MicroFlowTable {
+ public:
+  static constexpr size_t kWays = 4;
+
+  // The number of records is rounded up to a power of 2 number of sets. Throws
+  // if it is 0.
+  explicit MicroFlowTable(size_t num_records);
+
+  ~MicroFlowTable();
+
+  // Number of records.
+  size_t capacity() const {
+    return num_sets_ * kWays;
+  }
+
+  // Number of micro-flows.
+  size_t size() const {
+    return size_;
+  }
+
+  // Returns the micro-flow with the given key, or null. If index is not null
+  // and the micro-flow is found it is set to the index of its record.
+  MicroFlow* Find(const FlowKey& key, uint32_t* index = nullptr);
+
+  // Returns the index of the record a micro-flow with the given key should go
+  // in -- a free record in its set, or else the one whose last packet is the
+  // oldest. The micro-flow in it should be removed before one is added.
+  uint32_t PlaceFor(const FlowKey& key) const;
+
+  // Adds a micro-flow with no packets in a free record.
+  MicroFlow* Add(uint32_t index, uint64_t timestamp, const FlowKey& key);
+
+  // Returns the micro-flow in a record, or null if the record is free.
+  MicroFlow* At(uint32_t index) {
+    return index < capacity() && records_[index].used
+        ? &records_[index].flow() : nullptr;
+  }
+
+  const MicroFlow* At(uint32_t index) const {
+    return index < capacity() && records_[index].used
+        ? &records_[index].flow() : nullptr;
+  }
+
+  // Frees a record that holds a micro-flow.
+  void Remove(uint32_t index);
+
+  // Memory allocated for the records.
+  size_t SizeBytes() const {
+    return HeapBlockSize(capacity() * sizeof(Record));
+  }
+
+ private:
+  struct Record {
+    uint32_t hash;
+    bool used;
+
+    // Constructed in place while the record is used.
+    std::aligned_storage<sizeof(MicroFlow), alignof(MicroFlow)>::type storage;
+
+    MicroFlow& flow() {
+      return *reinterpret_cast<MicroFlow*>(&storage);
+    }
+
+    const MicroFlow& flow() const {
+      return *reinterpret_cast<const MicroFlow*>(&storage);
+    }
+  };
+
+  // The first record of the set a hash goes to.
+  uint32_t SetStart(uint32_t hash) const {
+    return (hash & (num_sets_ - 1)) * kWays;
+  }
+
+  // A power of 2.
+  size_t num_sets_;
+  size_t size_;
+  std::unique_ptr<Record[]> records_;
+
+  DISALLOW_COPY_AND_ASSIGN(MicroFlowTable);
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_MICRO_FLOWS_H */
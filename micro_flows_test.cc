@@ -0,0 +1,245 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "micro_flows.h"
+
+namespace flowparser {
+namespace test {
+
+class MicroFlowFixture : public ::testing::Test {
+ protected:
+  MicroFlowFixture()
+      : rnd_(1) {
+    for (uint32_t field = FlowConfig::HF_TIMESTAMP;
+        field <= FlowConfig::HF_PAYLOAD_SIZE; field <<= 1) {
+      flow_cfg_.SetField(static_cast<FlowConfig::HeaderField>(field));
+    }
+  }
+
+  // A key of the given protocol, different for each id.
+  static FlowKey Key(uint8_t protocol, uint32_t id) {
+    pcap::SniffIp ip_header;
+    memset(&ip_header, 0, sizeof(ip_header));
+    ip_header.ip_p = protocol;
+    ip_header.ip_src.s_addr = id;
+    ip_header.ip_dst.s_addr = 1;
+    return FlowKey(ip_header, 10, 20);
+  }
+
+  // A random IP header of the given protocol that is long enough for any
+  // transport header.
+  pcap::SniffIp GenerateIpHeader(uint8_t protocol) {
+    pcap::SniffIp ip_header;
+    memset(&ip_header, 0, sizeof(ip_header));
+    ip_header.ip_p = protocol;
+    ip_header.ip_hl = 5;
+    ip_header.ip_len = htons(80 + rnd_() % 1000);
+    ip_header.ip_id = rnd_();
+    ip_header.ip_ttl = rnd_();
+    return ip_header;
+  }
+
+  pcap::SniffTcp GenerateTcpHeader() {
+    pcap::SniffTcp tcp_header;
+    memset(&tcp_header, 0, sizeof(tcp_header));
+    tcp_header.th_off = 5;
+    tcp_header.th_seq = rnd_();
+    tcp_header.th_ack = rnd_();
+    tcp_header.th_win = rnd_();
+    tcp_header.th_flags = rnd_();
+    return tcp_header;
+  }
+
+  // Checks that two flows have the same packets.
+  static void AssertSameFlow(const Flow& expected, const Flow& actual) {
+    ASSERT_EQ(expected.key(), actual.key());
+    ASSERT_EQ(expected.first_rx(), actual.first_rx());
+    ASSERT_EQ(expected.last_rx(), actual.last_rx());
+    ASSERT_EQ(expected.pkts_seen(), actual.pkts_seen());
+    ASSERT_EQ(expected.tcp_flags_or(), actual.tcp_flags_or());
+    ASSERT_EQ(expected.tcp_state(), actual.tcp_state());
+    ASSERT_EQ(expected.SizeBytes(), actual.SizeBytes());
+    ASSERT_EQ(expected.GetInfo().total_ip_len_seen,
+              actual.GetInfo().total_ip_len_seen);
+    ASSERT_EQ(expected.GetInfo().total_payload_seen,
+              actual.GetInfo().total_payload_seen);
+
+    FlowIterator expected_it(expected);
+    FlowIterator actual_it(actual);
+    while (const TrackedFields* expected_fields = expected_it.NextOrNull()) {
+      const TrackedFields* actual_fields = actual_it.NextOrNull();
+      ASSERT_NE(nullptr, actual_fields);
+      ASSERT_EQ(expected_fields->timestamp(), actual_fields->timestamp());
+      ASSERT_EQ(expected_fields->ip_len(), actual_fields->ip_len());
+      ASSERT_EQ(expected_fields->ip_id(), actual_fields->ip_id());
+      ASSERT_EQ(expected_fields->ip_ttl(), actual_fields->ip_ttl());
+      ASSERT_EQ(expected_fields->tcp_seq(), actual_fields->tcp_seq());
+      ASSERT_EQ(expected_fields->tcp_ack(), actual_fields->tcp_ack());
+      ASSERT_EQ(expected_fields->tcp_win(), actual_fields->tcp_win());
+      ASSERT_EQ(expected_fields->tcp_flags(), actual_fields->tcp_flags());
+      ASSERT_EQ(expected_fields->payload_size(),
+                actual_fields->payload_size());
+      ASSERT_EQ(expected_fields->icmp_type(), actual_fields->icmp_type());
+      ASSERT_EQ(expected_fields->icmp_code(), actual_fields->icmp_code());
+    }
+
+    ASSERT_EQ(nullptr, actual_it.NextOrNull());
+  }
+
+  FlowConfig flow_cfg_;
+  std::mt19937 rnd_;
+};
+
+TEST_F(MicroFlowFixture, Init) {
+  MicroFlow micro_flow(1000, Key(IPPROTO_TCP, 1));
+  ASSERT_EQ(0, micro_flow.pkts_seen());
+  ASSERT_EQ(1000, micro_flow.first_rx());
+  ASSERT_EQ(1000, micro_flow.last_rx());
+  ASSERT_TRUE(micro_flow.Fits(1000));
+  ASSERT_FALSE(micro_flow.Fits(999));
+
+  std::unique_ptr<Flow> flow = micro_flow.ToFlow(flow_cfg_);
+  ASSERT_EQ(0, flow->pkts_seen());
+  ASSERT_EQ(1000, flow->first_rx());
+}
+
+TEST_F(MicroFlowFixture, Fits) {
+  MicroFlow micro_flow(1000, Key(IPPROTO_UDP, 1));
+  ASSERT_FALSE(micro_flow.Fits(1000 + (uint64_t(1) << 32)));
+
+  for (size_t i = 0; i < MicroFlow::kMaxPackets; ++i) {
+    ASSERT_TRUE(micro_flow.Fits(2000));
+    micro_flow.UDPIpRx(GenerateIpHeader(IPPROTO_UDP), 2000 + i);
+  }
+
+  ASSERT_FALSE(micro_flow.Fits(2000));
+  ASSERT_EQ(MicroFlow::kMaxPackets, micro_flow.pkts_seen());
+  ASSERT_EQ(1000, micro_flow.first_rx());
+  ASSERT_EQ(2000 + MicroFlow::kMaxPackets - 1, micro_flow.last_rx());
+  ASSERT_THROW(micro_flow.UDPIpRx(GenerateIpHeader(IPPROTO_UDP), 3000),
+               std::logic_error);
+}
+
+TEST_F(MicroFlowFixture, HeadersTooLong) {
+  MicroFlow micro_flow(1000, Key(IPPROTO_TCP, 1));
+  pcap::SniffIp ip_header = GenerateIpHeader(IPPROTO_TCP);
+  ip_header.ip_len = htons(30);
+  ASSERT_THROW(micro_flow.TCPIpRx(ip_header, GenerateTcpHeader(), 1000),
+               std::logic_error);
+  ASSERT_EQ(0, micro_flow.pkts_seen());
+}
+
+TEST_F(MicroFlowFixture, SameAsFlow) {
+  for (uint8_t protocol : { IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP,
+      IPPROTO_GRE }) {
+    for (size_t num_pkts = 1; num_pkts <= MicroFlow::kMaxPackets; ++num_pkts) {
+      FlowKey key = Key(protocol, 1);
+      Flow flow(1000, key, flow_cfg_);
+      MicroFlow micro_flow(1000, key);
+
+      for (size_t i = 0; i < num_pkts; ++i) {
+        pcap::SniffIp ip_header = GenerateIpHeader(protocol);
+        if (i == 1) {
+          // A later fragment.
+          ip_header.ip_off = htons(100);
+        }
+
+        uint64_t timestamp = 1000 + i * 500;
+        size_t bytes = 0;
+        uint16_t payload;
+        uint16_t micro_payload;
+        if (protocol == IPPROTO_TCP) {
+          pcap::SniffTcp tcp_header = GenerateTcpHeader();
+          payload = flow.TCPIpRx(ip_header, tcp_header, timestamp, &bytes);
+          micro_payload = micro_flow.TCPIpRx(ip_header, tcp_header, timestamp);
+        } else if (protocol == IPPROTO_UDP) {
+          pcap::SniffUdp udp_header;
+          memset(&udp_header, 0, sizeof(udp_header));
+          payload = flow.UDPIpRx(ip_header, udp_header, timestamp, &bytes);
+          micro_payload = micro_flow.UDPIpRx(ip_header, timestamp);
+        } else if (protocol == IPPROTO_ICMP) {
+          pcap::SniffIcmp icmp_header;
+          memset(&icmp_header, 0, sizeof(icmp_header));
+          icmp_header.icmp_type = i + 3;
+          icmp_header.icmp_code = i + 7;
+          payload = flow.ICMPIpRx(ip_header, icmp_header, timestamp, &bytes);
+          micro_payload = micro_flow.ICMPIpRx(ip_header, icmp_header,
+                                              timestamp);
+        } else {
+          payload = flow.UnknownIpRx(ip_header, timestamp, &bytes);
+          micro_payload = micro_flow.UnknownIpRx(ip_header, timestamp);
+        }
+
+        ASSERT_EQ(payload, micro_payload);
+      }
+
+      ASSERT_EQ(flow.tcp_flags_or(), micro_flow.tcp_flags_or());
+      ASSERT_EQ(flow.last_rx(), micro_flow.last_rx());
+      AssertSameFlow(flow, *micro_flow.ToFlow(flow_cfg_));
+    }
+  }
+}
+
+TEST_F(MicroFlowFixture, Table) {
+  ASSERT_THROW(MicroFlowTable(0), std::logic_error);
+
+  MicroFlowTable table(1000);
+  ASSERT_EQ(1024, table.capacity());
+  ASSERT_EQ(0, table.size());
+  ASSERT_EQ(nullptr, table.Find(Key(IPPROTO_TCP, 1)));
+
+  std::vector<uint32_t> indices;
+  for (uint32_t id = 0; id < 20; ++id) {
+    FlowKey key = Key(IPPROTO_TCP, id);
+    ASSERT_EQ(nullptr, table.Find(key));
+    uint32_t index = table.PlaceFor(key);
+    ASSERT_EQ(nullptr, table.At(index));
+    MicroFlow* micro_flow = table.Add(index, id, key);
+    ASSERT_THROW(table.Add(index, id, key), std::logic_error);
+    ASSERT_EQ(micro_flow, table.At(index));
+    indices.push_back(index);
+  }
+
+  ASSERT_EQ(20, table.size());
+  for (uint32_t id = 0; id < 20; ++id) {
+    uint32_t index;
+    MicroFlow* micro_flow = table.Find(Key(IPPROTO_TCP, id), &index);
+    ASSERT_NE(nullptr, micro_flow);
+    ASSERT_EQ(id, micro_flow->first_rx());
+    ASSERT_EQ(indices[id], index);
+  }
+
+  table.Remove(indices[7]);
+  ASSERT_EQ(19, table.size());
+  ASSERT_EQ(nullptr, table.Find(Key(IPPROTO_TCP, 7)));
+  ASSERT_EQ(nullptr, table.At(indices[7]));
+  ASSERT_EQ(nullptr, table.At(table.capacity()));
+
+  // A few dozen bytes a record.
+  ASSERT_GE(128 * table.capacity(), table.SizeBytes());
+}
+
+TEST_F(MicroFlowFixture, PlaceForFullSet) {
+  // A single set.
+  MicroFlowTable table(MicroFlowTable::kWays);
+  ASSERT_EQ(MicroFlowTable::kWays, table.capacity());
+
+  // The micro-flow that has been quiet the longest is the one to go, not the
+  // one that is oldest.
+  for (uint32_t id = 0; id < MicroFlowTable::kWays; ++id) {
+    FlowKey key = Key(IPPROTO_UDP, id);
+    MicroFlow* micro_flow = table.Add(table.PlaceFor(key), id, key);
+    micro_flow->UDPIpRx(GenerateIpHeader(IPPROTO_UDP), id == 0 ? 100 : id);
+  }
+
+  uint32_t index;
+  table.Find(Key(IPPROTO_UDP, 1), &index);
+  ASSERT_EQ(index, table.PlaceFor(Key(IPPROTO_UDP, 100)));
+}
+
+}  // namespace test
+}  // namespace flowparser
@@ -14,37 +14,28 @@ void PackedUintSeq::Append(uint64_t value, size_t* bytes) {
   }
 
   const uint64_t diff = value - last_append_;
+  const size_t allocated_before = data_.AllocatedBytes();
 
   if (diff < kOneByteLimit) {
     data_.push_back(diff);
-
-    *bytes += sizeof(uint8_t);
   } else if (diff < kTwoByteLimit) {
     data_.push_back((diff >> 8) | kTwoBytesPacked);
     data_.push_back(diff);
-
-    *bytes += 2 * sizeof(uint8_t);
   } else if (diff < kThreeByteLimit) {
     data_.push_back(((diff >> 16) | kThreeBytesPacked));
     data_.push_back(diff >> 8);
     data_.push_back(diff >> 0);
-
-    *bytes += 3 * sizeof(uint8_t);
   } else if (diff < kFourByteLimit) {
     data_.push_back((diff >> 24) | kFourBytesPacked);
     data_.push_back(diff >> 16);
     data_.push_back(diff >> 8);
     data_.push_back(diff);
-
-    *bytes += 4 * sizeof(uint8_t);
   } else if (diff < kFiveByteLimit) {
     data_.push_back((diff >> 32) | kFiveBytesPacked);
     data_.push_back(diff >> 24);
     data_.push_back(diff >> 16);
     data_.push_back(diff >> 8);
     data_.push_back(diff);
-
-    *bytes += 5 * sizeof(uint8_t);
   } else if (diff < kSixByteLimit) {
     data_.push_back((diff >> 40) | kSixBytesPacked);
     data_.push_back(diff >> 32);
@@ -52,8 +43,6 @@ void PackedUintSeq::Append(uint64_t value, size_t* bytes) {
     data_.push_back(diff >> 16);
     data_.push_back(diff >> 8);
     data_.push_back(diff);
-
-    *bytes += 6 * sizeof(uint8_t);
   } else if (diff < kSevenByteLimit) {
     data_.push_back((diff >> 48) | kSevenBytesPacked);
     data_.push_back(diff >> 40);
@@ -62,8 +51,6 @@ void PackedUintSeq::Append(uint64_t value, size_t* bytes) {
     data_.push_back(diff >> 16);
     data_.push_back(diff >> 8);
     data_.push_back(diff);
-
-    *bytes += 7 * sizeof(uint8_t);
   } else if (diff < kEightByteLimit) {
     data_.push_back((diff >> 56) | kEightBytesPacked);
     data_.push_back(diff >> 48);
@@ -73,16 +60,33 @@ void PackedUintSeq::Append(uint64_t value, size_t* bytes) {
     data_.push_back(diff >> 16);
     data_.push_back(diff >> 8);
     data_.push_back(diff);
-
-    *bytes += 8 * sizeof(uint8_t);
   } else {
     throw std::runtime_error("Difference too large " + std::to_string(diff));
   }
 
+  *bytes += data_.AllocatedBytes() - allocated_before;
   len_++;
   last_append_ = value;
 }
 
+void PackedUintSeq::Append(const PackedUintSeq& other, size_t* bytes) {
+  if (other.len_ == 0) {
+    return;
+  }
+
+  // The first value of the other sequence is encoded as a difference from 0.
+  uint64_t first;
+  size_t first_size = other.DeflateSingleInteger(0, &first);
+  Append(first, bytes);
+
+  size_t allocated_before = data_.AllocatedBytes();
+  data_.Append(other.data_.begin() + first_size, other.data_.end());
+  *bytes += data_.AllocatedBytes() - allocated_before;
+
+  len_ += other.len_ - 1;
+  last_append_ = other.last_append_;
+}
+
 size_t PackedUintSeq::DeflateSingleInteger(const size_t offset,
                                            uint64_t* value) const {
   const uint8_t c = data_[offset];
@@ -8,14 +8,17 @@
 
 #include <vector>
 #include "common.h"
+#include "slab.h"
 
 namespace flowparser {
 
-// A packed sequence of unsigned integers.
+// A packed sequence of unsigned integers. The bytes are allocated from the
+// given pool, or from the default one.
 class PackedUintSeq {
  public:
-  PackedUintSeq()
-      : len_(0),
+  explicit PackedUintSeq(SlabPool* pool = nullptr)
+      : data_(pool),
+        len_(0),
         last_append_(0) {
   }
 
@@ -24,6 +27,12 @@ class PackedUintSeq {
     return data_.size() * sizeof(char);
   }
 
+  // The amount of memory (in bytes) allocated for the sequence, which is more
+  // than it occupies.
+  size_t AllocatedBytes() const {
+    return data_.AllocatedBytes();
+  }
+
   // Returns a string representing the memory footprint of this sequence.
   std::string MemString() const {
     std::string return_string;
@@ -38,8 +47,8 @@ class PackedUintSeq {
   // difference between the last value and this value is too large (larger than
   // kEightByteLimit) or if the new value is smaller than the last appended
   // value (the sequence is not incrementing). The second argument is
-  // incremented with the number of additional bytes of memory required to store
-  // the value.
+  // incremented with the number of additional bytes of memory allocated to
+  // store the value.
   void Append(uint64_t value, size_t* bytes);
 
   // Same as above, but does not care about updating total memory consumption.
@@ -48,6 +57,12 @@ class PackedUintSeq {
     Append(value, &dummy);
   }
 
+  // Appends all values from another sequence. The first value of the other
+  // sequence should not be smaller than the last value of this one. The result
+  // is the same as if the values were appended one by one, but only the first
+  // one is re-encoded.
+  void Append(const PackedUintSeq& other, size_t* bytes);
+
   // Copies out the sequence in a standard vector.
   void Restore(std::vector<uint64_t>* vector) const;
 
@@ -80,7 +95,7 @@ class PackedUintSeq {
   size_t DeflateSingleInteger(size_t offset, uint64_t* value) const;
 
   // The sequence.
-  std::vector<uint8_t> data_;
+  SlabVector<uint8_t> data_;
 
   // Length in terms of number of integers stored.
   size_t len_;
@@ -141,7 +156,8 @@ class RLEFieldIterator;
 // Compresses and decompresses a sequence of elements to a series of sequences
 // (X1, X1 + t1, X1 + 2t1, X1 + 3t1 ...), (X2, X2 + t2, X2 + 2t2, X2 + 3t2 ...),
 // ... When a new element is inserted it is first checked if it is part of the
-// current sub-sequence (stride) and if it is not a new stride is created.
+// current sub-sequence (stride) and if it is not a new stride is created. The
+// strides are allocated from the given pool, or from the default one.
 template<typename T>
 class RLEField {
  private:
@@ -163,16 +179,16 @@ class RLEField {
   };
 
  public:
-  RLEField() {
+  explicit RLEField(SlabPool* pool = nullptr)
+      : strides_(pool) {
   }
 
   // Appends a new value to the sequence. "Well-behaved" sequences will occupy
-  // less memory and will be faster to add elements. If a new element is added
-  // the pointer 'bytes' will be incremented.
+  // less memory and will be faster to add elements. If more memory is allocated
+  // the pointer 'bytes' will be incremented with it.
   void Append(T value, size_t* bytes) {
     if (strides_.empty()) {
-      strides_.push_back(Stride(value));
-      *bytes += sizeof(Stride);
+      PushStride(Stride(value), bytes);
       return;
     }
 
@@ -191,8 +207,7 @@ class RLEField {
       return;
     }
 
-    strides_.push_back(Stride(value));
-    *bytes += sizeof(Stride);
+    PushStride(Stride(value), bytes);
   }
 
   void Append(T value) {
@@ -200,11 +215,42 @@ class RLEField {
     Append(value, &dummy);
   }
 
+  // Appends all values from another sequence. The result is the same as if the
+  // values were appended one by one. Values are only appended one by one until
+  // a new stride is started where the other sequence started one -- from there
+  // on both encodings are the same and the remaining strides are copied.
+  void Append(const RLEField<T>& other, size_t* bytes) {
+    for (size_t i = 0; i < other.strides_.size(); ++i) {
+      const Stride& stride = other.strides_[i];
+
+      size_t strides_before = strides_.size();
+      Append(stride.value_, bytes);
+      if (strides_.size() != strides_before) {
+        strides_.pop_back();
+        size_t allocated_before = strides_.AllocatedBytes();
+        strides_.Append(other.strides_.begin() + i, other.strides_.end());
+        *bytes += strides_.AllocatedBytes() - allocated_before;
+        return;
+      }
+
+      for (size_t j = 1; j <= stride.len_; ++j) {
+        Append(static_cast<T>(stride.value_ + static_cast<T>(j)
+                   * stride.increment_), bytes);
+      }
+    }
+  }
+
   // The amount of memory (in terms of bytes) used to store the sequence.
   size_t SizeBytes() const {
     return strides_.size() * sizeof(Stride);
   }
 
+  // The amount of memory (in terms of bytes) allocated to store the sequence,
+  // which is more than it uses.
+  size_t AllocatedBytes() const {
+    return strides_.AllocatedBytes();
+  }
+
   // Returns a string representing the memory footprint of this sequence.
   std::string MemString() const {
     std::string return_string;
@@ -231,8 +277,14 @@ class RLEField {
   }
 
  private:
+  void PushStride(const Stride& stride, size_t* bytes) {
+    size_t allocated_before = strides_.AllocatedBytes();
+    strides_.push_back(stride);
+    *bytes += strides_.AllocatedBytes() - allocated_before;
+  }
+
   // The entire sequence is stored as a sequence of strides.
-  std::vector<Stride> strides_;
+  SlabVector<Stride> strides_;
 
   friend class RLEFieldIterator<T> ;
 
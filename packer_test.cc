@@ -109,6 +109,47 @@ TEST_F(PackerFixture, Append1MIter) {
   ASSERT_EQ(model, vec_);
 }
 
+TEST_F(PackerFixture, AppendSeq) {
+  std::default_random_engine e(3);
+  std::vector<uint64_t> model;
+
+  PackedUintSeq whole;
+  PackedUintSeq other;
+  size_t whole_bytes = 0;
+  size_t bytes = 0;
+
+  uint64_t prev = 0;
+  for (size_t i = 0; i < 10000; ++i) {
+    uint64_t val = prev + e() % 100000;
+    prev = val;
+
+    whole.Append(val, &whole_bytes);
+    if (i < 5000) {
+      seq_.Append(val, &bytes);
+    } else {
+      other.Append(val);
+    }
+
+    model.push_back(val);
+  }
+
+  seq_.Append(other, &bytes);
+  ASSERT_EQ(whole.SizeBytes(), seq_.SizeBytes());
+  ASSERT_EQ(whole_bytes, bytes);
+
+  seq_.Restore(&vec_);
+  ASSERT_EQ(model, vec_);
+}
+
+TEST_F(PackerFixture, AppendSeqNonIncrementing) {
+  PackedUintSeq other;
+  other.Append(5);
+
+  seq_.Append(10);
+  size_t bytes = 0;
+  ASSERT_THROW(seq_.Append(other, &bytes), std::logic_error);
+}
+
 TEST_F(RLEFixture, Empty) {
   seq_.Restore(&vec_);
 
@@ -177,5 +218,47 @@ TEST_F(RLEFixture, Append1MIter) {
   ASSERT_EQ(model, vec_);
 }
 
+TEST_F(RLEFixture, AppendSeq) {
+  std::default_random_engine e(4);
+
+  // Runs of values with the same increment, so that there are strides of
+  // different lengths to split.
+  std::vector<uint64_t> model;
+  uint64_t val = 0;
+  while (model.size() < 10000) {
+    uint64_t increment = e() % 3;
+    size_t run = e() % 10;
+    for (size_t i = 0; i < run; ++i) {
+      val += increment;
+      model.push_back(val);
+    }
+  }
+
+  for (size_t split = 0; split < 100; ++split) {
+    RLEField<uint64_t> whole;
+    RLEField<uint64_t> first;
+    RLEField<uint64_t> other;
+    size_t whole_bytes = 0;
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < model.size(); ++i) {
+      whole.Append(model[i], &whole_bytes);
+      if (i < split) {
+        first.Append(model[i], &bytes);
+      } else {
+        other.Append(model[i]);
+      }
+    }
+
+    first.Append(other, &bytes);
+    ASSERT_EQ(whole.SizeBytes(), first.SizeBytes());
+    ASSERT_EQ(whole_bytes, bytes);
+
+    std::vector<uint64_t> restored;
+    first.Restore(&restored);
+    ASSERT_EQ(model, restored);
+  }
+}
+
 }  // namespace test
 }  // namespace flowparser
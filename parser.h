@@ -3,16 +3,24 @@
 #ifndef FLOWPARSER_PARSER_H
 #define FLOWPARSER_PARSER_H
 
+#include <algorithm>
 #include <functional>
+#include <limits>
 #include <memory>
-#include <unordered_map>
-#include <list>
 #include <random>
+#include <vector>
 
 #include "common.h"
 #include "sniff.h"
 #include "flows.h"
+#include "flow_table.h"
+#include "heavy_hitters.h"
+#include "hyperloglog.h"
+#include "micro_flows.h"
 #include "ptr_queue.h"
+#include "spreaders.h"
+#include "traffic_sketch.h"
+#include "timer_wheel.h"
 
 namespace flowparser {
 
@@ -24,7 +32,21 @@ class ParserConfig {
 
   ParserConfig()
       : soft_mem_limit_(1 << 30),
-        undersample_skip_count_(1) {
+        soft_mem_low_watermark_(0),
+        undersample_skip_count_(1),
+        inactive_timeout_(0),
+        active_timeout_(0),
+        collect_closed_tcp_flows_(false),
+        tcp_linger_(kMillion),
+        micro_flow_table_size_(0),
+        flow_sample_rate_(1.0),
+        flow_sample_key_(0),
+        sample_and_hold_bytes_(0),
+        heavy_hitters_size_(0),
+        cardinality_precision_(0),
+        spread_sketch_width_(0),
+        traffic_sketch_width_(0),
+        sketch_only_pkts_per_sec_(0) {
   }
 
   uint64_t soft_mem_limit() const {
@@ -35,6 +57,14 @@ class ParserConfig {
     soft_mem_limit_ = soft_mem_limit;
   }
 
+  uint64_t soft_mem_low_watermark() const {
+    return soft_mem_low_watermark_;
+  }
+
+  void set_soft_mem_low_watermark(uint64_t soft_mem_low_watermark) {
+    soft_mem_low_watermark_ = soft_mem_low_watermark;
+  }
+
   FlowConfig* mutable_flow_config() {
     return &new_flow_config_;
   }
@@ -47,10 +77,20 @@ class ParserConfig {
     return periodic_callbacks_;
   }
 
+  // Adds a callback that the parser calls with itself, under its lock, every
+  // second of packet time. A ShardedParser does not call them. A FlowParser
+  // with more than one fanout or offline thread calls them from each thread,
+  // with that thread's parser and its packets only, so they can run
+  // concurrently. The info of all parsers together can be polled from another
+  // thread with FlowParser::GetInfo.
   void add_periodic_callback(PeriodicCallback callback) {
     periodic_callbacks_.push_back(callback);
   }
 
+  void clear_periodic_callbacks() {
+    periodic_callbacks_.clear();
+  }
+
   void set_undersample_skip_count(uint32_t undersample_skip_count) {
     undersample_skip_count_ = undersample_skip_count;
   }
@@ -59,11 +99,143 @@ class ParserConfig {
     return undersample_skip_count_;
   }
 
+  uint64_t inactive_timeout() const {
+    return inactive_timeout_;
+  }
+
+  void set_inactive_timeout(uint64_t inactive_timeout) {
+    inactive_timeout_ = inactive_timeout;
+  }
+
+  uint64_t active_timeout() const {
+    return active_timeout_;
+  }
+
+  void set_active_timeout(uint64_t active_timeout) {
+    active_timeout_ = active_timeout;
+  }
+
+  bool collect_closed_tcp_flows() const {
+    return collect_closed_tcp_flows_;
+  }
+
+  void set_collect_closed_tcp_flows(bool collect_closed_tcp_flows) {
+    collect_closed_tcp_flows_ = collect_closed_tcp_flows;
+  }
+
+  uint64_t tcp_linger() const {
+    return tcp_linger_;
+  }
+
+  void set_tcp_linger(uint64_t tcp_linger) {
+    tcp_linger_ = tcp_linger;
+  }
+
+  size_t micro_flow_table_size() const {
+    return micro_flow_table_size_;
+  }
+
+  void set_micro_flow_table_size(size_t micro_flow_table_size) {
+    micro_flow_table_size_ = micro_flow_table_size;
+  }
+
+  double flow_sample_rate() const {
+    return flow_sample_rate_;
+  }
+
+  void set_flow_sample_rate(double flow_sample_rate) {
+    flow_sample_rate_ = flow_sample_rate;
+  }
+
+  uint64_t flow_sample_key() const {
+    return flow_sample_key_;
+  }
+
+  void set_flow_sample_key(uint64_t flow_sample_key) {
+    flow_sample_key_ = flow_sample_key;
+  }
+
+  uint64_t sample_and_hold_bytes() const {
+    return sample_and_hold_bytes_;
+  }
+
+  void set_sample_and_hold_bytes(uint64_t sample_and_hold_bytes) {
+    sample_and_hold_bytes_ = sample_and_hold_bytes;
+  }
+
+  size_t heavy_hitters_size() const {
+    return heavy_hitters_size_;
+  }
+
+  void set_heavy_hitters_size(size_t heavy_hitters_size) {
+    heavy_hitters_size_ = heavy_hitters_size;
+  }
+
+  uint8_t cardinality_precision() const {
+    return cardinality_precision_;
+  }
+
+  void set_cardinality_precision(uint8_t cardinality_precision) {
+    cardinality_precision_ = cardinality_precision;
+  }
+
+  size_t spread_sketch_width() const {
+    return spread_sketch_width_;
+  }
+
+  void set_spread_sketch_width(size_t spread_sketch_width) {
+    spread_sketch_width_ = spread_sketch_width;
+  }
+
+  size_t traffic_sketch_width() const {
+    return traffic_sketch_width_;
+  }
+
+  void set_traffic_sketch_width(size_t traffic_sketch_width) {
+    traffic_sketch_width_ = traffic_sketch_width;
+  }
+
+  uint64_t sketch_only_pkts_per_sec() const {
+    return sketch_only_pkts_per_sec_;
+  }
+
+  void set_sketch_only_pkts_per_sec(uint64_t sketch_only_pkts_per_sec) {
+    sketch_only_pkts_per_sec_ = sketch_only_pkts_per_sec;
+  }
+
+  // The config of each of num_parts parsers that split the flows of one parser
+  // with this config between them. Settings reach the parts as they are, only
+  // the limits and rates that hold for all parts together are split evenly.
+  ParserConfig Split(size_t num_parts) const {
+    ParserConfig part = *this;
+    part.set_soft_mem_limit(soft_mem_limit_ / num_parts);
+    part.set_soft_mem_low_watermark(soft_mem_low_watermark_ / num_parts);
+    if (sketch_only_pkts_per_sec_ != 0) {
+      part.set_sketch_only_pkts_per_sec(
+          std::max<uint64_t>(1, sketch_only_pkts_per_sec_ / num_parts));
+    }
+
+    if (micro_flow_table_size_ != 0) {
+      part.set_micro_flow_table_size(
+          std::max<size_t>(1, micro_flow_table_size_ / num_parts));
+    }
+
+    return part;
+  }
+
  private:
   // Below this threshold no flows are forcibly evicted - they are kept in
-  // memory forever.
+  // memory forever. Counts all memory allocated for the flows, and for the
+  // tables and timers that keep track of them.
   uint64_t soft_mem_limit_;
 
+  // If not 0 and below the soft limit, once memory goes over the limit flows
+  // are evicted in one batch until it is back down to this, instead of one
+  // flow per packet. The batch is handed to the queue all at once, which is
+  // cheaper than a flow at a time and leaves room for the next few packets.
+  // 0 (the default) evicts one flow per packet.
+  uint64_t soft_mem_low_watermark_;
+
   // All new flows will get instantiated with this config.
   FlowConfig new_flow_config_;
 
@@ -73,6 +245,95 @@ class ParserConfig {
   // One packet will be sampled for every 'undersample_skip_count' number of
   // packets. Defaults to 1 (no undersamling).
   uint32_t undersample_skip_count_;
+
+  // A flow that has seen no packets for this long (in microseconds) is
+  // collected. Time is that of the packets, plus the wall clock when capturing
+  // live. 0 (the default) disables the timeout.
+  uint64_t inactive_timeout_;
+
+  // A flow that was first seen this long ago (in microseconds) is collected
+  // even if it is still active, so that long flows are reported in parts. A
+  // packet that arrives after that starts a new flow. 0 (the default) disables
+  // the timeout.
+  uint64_t active_timeout_;
+
+  // If true TCP flows are collected once their connection closes -- when
+  // either side sends an RST or both sides send a FIN -- instead of waiting
+  // for a timeout or for memory to run out. Both directions of the connection
+  // are collected. Off by default.
+  bool collect_closed_tcp_flows_;
+
+  // How long (in microseconds) a closed TCP flow is kept after its last
+  // packet before it is collected, so that the last ACK and retransmissions
+  // still count towards it. 0 collects closed flows right away. Defaults to 1
+  // second.
+  uint64_t tcp_linger_;
+
+  // If not 0 new flows start out as micro-flows, in a table with about this
+  // many records, and only become flows once they see more packets than a
+  // micro-flow holds. A scan or a flood then does not push other flows out of
+  // memory. Micro-flows are collected as flows when they time out, when their
+  // record is needed for another one or when all flows are collected. The
+  // table is allocated up front, its memory counts towards the limit whether
+  // its records are used or not. Micro-flows are not seen by ParserIterator
+  // and are not closed when their TCP connection closes. 0 (the default)
+  // disables micro-flows.
+  size_t micro_flow_table_size_;
+
+  // The fraction of flows to keep, in (0, 1]. Unlike undersampling, which
+  // keeps some packets of every flow, flow sampling keeps all packets of some
+  // flows and none of the others, so the flows that are kept are complete.
+  // Which flows are kept depends only on their keys and the sample key, so
+  // both directions of a connection, all shards and all parsers that use the
+  // same sample key agree. Cannot be combined with undersampling. Defaults to
+  // 1 (no flow sampling).
+  double flow_sample_rate_;
+
+  // Picks the flows flow sampling keeps. Different keys keep different flows.
+  uint64_t flow_sample_key_;
+
+  // If not 0 the parser samples and holds: a packet of a flow that is not in
+  // memory creates the flow with probability ip_len / sample_and_hold_bytes,
+  // and once the flow is in memory all its packets are counted. Large flows
+  // are then almost all caught early while most small ones are never created,
+  // so memory goes with the number of large flows. About this many bytes of a
+  // flow go by before it is caught, which is what FlowInfo reports as missed.
+  // Cannot be combined with undersampling. 0 (the default) holds all flows.
+  uint64_t sample_and_hold_bytes_;
+
+  // If not 0 the parser counts the bytes (ip_len) of each flow in a
+  // SpaceSaving with this many counters, which GetHeavyHitters returns. It
+  // sees all packets flow sampling keeps, whether their flows are in memory or
+  // not. Each shard of a sharded parser gets this many counters. 0 (the
+  // default) disables heavy hitters.
+  size_t heavy_hitters_size_;
+
+  // If not 0 the parser estimates the number of distinct flows, sources and
+  // destinations it sees with HyperLogLog sketches of this precision, 4 to 18.
+  // All packets are counted, including those undersampling or sampling skip.
+  // 12 takes 4KB a sketch for an error of about 1.6%. 0 (the default) disables
+  // the sketches.
+  uint8_t cardinality_precision_;
+
+  // If not 0 the parser tracks the sources with the most distinct destinations
+  // and the destinations with the most distinct sources in SpreadSketches of
+  // this width, which GetSpreaders returns. Like the cardinality sketches they
+  // count all packets. Each sketch takes about 290 bytes per unit of width.
+  // Each shard of a sharded parser gets sketches of this width. 0 (the
+  // default) disables them.
+  size_t spread_sketch_width_;
+
+  // If not 0 the parser has a TrafficSketch with a CountMin of this width,
+  // which counts the packets it sees in sketch-only mode (see
+  // Parser::SetSketchOnly). The sketch takes 2MB plus 64 bytes per unit of
+  // width. 0 (the default) disables it, and sketch-only mode with it.
+  size_t traffic_sketch_width_;
+
+  // If not 0 the parser goes into sketch-only mode when the average rate of
+  // packets it sees goes above this, and back to tracking flows when it goes
+  // below half of it. The rate is checked once a second. Needs the traffic
+  // sketch. Each shard of a sharded parser gets an equal part of the rate.
+  uint64_t sketch_only_pkts_per_sec_;
 };
 
 class Undersampler {
@@ -131,15 +392,127 @@ class Undersampler {
   uint64_t next_index_;
 };
 
+// Keeps or drops whole flows, by a keyed hash of their key. The hash does not
+// depend on the direction of the flow or on the host the parser runs on.
+class FlowSampler {
+ public:
+  // Keeps about rate of all flows. Throws if the rate is not in (0, 1].
+  FlowSampler(double rate, uint64_t key)
+      : rate_(rate),
+        key_(key),
+        threshold_(ThresholdOf(rate)) {
+  }
+
+  bool Keep(const FlowKey& flow_key) const {
+    return (Hash(flow_key, key_) >> 11) < threshold_;
+  }
+
+  double rate() const {
+    return rate_;
+  }
+
+  // The same for both directions of a flow. IPv6 addresses are hashed by their
+  // 32 bit folds.
+  static uint64_t Hash(const FlowKey& flow_key, uint64_t key) {
+    uint64_t a = (static_cast<uint64_t>(flow_key.src()) << 16)
+        | flow_key.src_port();
+    uint64_t b = (static_cast<uint64_t>(flow_key.dst()) << 16)
+        | flow_key.dst_port();
+    uint64_t hash = Mix64(key ^ std::min(a, b));
+    hash = Mix64(hash ^ std::max(a, b));
+    hash = Mix64(hash ^ ((static_cast<uint64_t>(flow_key.protocol()) << 48)
+        | (static_cast<uint64_t>(flow_key.vlan()) << 32) | flow_key.vni()));
+    return hash;
+  }
+
+ private:
+  // Hashes are compared with the threshold in their top 53 bits, which a
+  // double holds exactly.
+  static constexpr double kHashRange = 9007199254740992.0;
+
+  static uint64_t ThresholdOf(double rate) {
+    if (!(rate > 0 && rate <= 1)) {
+      throw std::logic_error("Flow sample rate should be in (0, 1]");
+    }
+
+    return rate * kHashRange;
+  }
+
+  const double rate_;
+  const uint64_t key_;
+  const uint64_t threshold_;
+};
+
+// Decides which packets of flows not in memory create their flow, with a
+// probability proportional to their size.
+class SampleAndHold {
+ public:
+  // Throws if bytes is 0.
+  explicit SampleAndHold(uint64_t bytes)
+      : bytes_(bytes),
+        distribution_(0, BytesOrThrow(bytes) - 1) {
+  }
+
+  // True if a packet of the given size should create its flow.
+  bool Hold(uint16_t ip_len) {
+    return distribution_(generator_) < ip_len;
+  }
+
+  // Average bytes of a flow that go by before it is held.
+  uint64_t bytes() const {
+    return bytes_;
+  }
+
+ private:
+  static uint64_t BytesOrThrow(uint64_t bytes) {
+    if (bytes == 0) {
+      throw std::logic_error("Sample and hold bytes cannot be 0");
+    }
+
+    return bytes;
+  }
+
+  const uint64_t bytes_;
+  std::default_random_engine generator_;
+  std::uniform_int_distribution<uint64_t> distribution_;
+};
+
 struct ParserInfo {
   uint64_t first_rx = 0;
   uint64_t last_rx = 0;
   uint64_t total_pkts_seen = 0;
   uint64_t total_tcp_syn_or_fin_pkts_seen = 0;
+  uint64_t tcp_flows_closed = 0;
+  uint64_t micro_flows_promoted = 0;
+  // Packets of flows that flow sampling did not keep.
+  uint64_t pkts_sampled_out = 0;
+  // Packets of flows not in memory that sample-and-hold did not hold.
+  uint64_t pkts_not_held = 0;
+  // Packets seen in sketch-only mode, and whether the parser (or any of the
+  // parsers added) is in it.
+  uint64_t pkts_sketch_only = 0;
+  bool sketch_only = false;
+  uint64_t flows_collected_mem_limit = 0;
+  uint64_t flows_collected_timeout = 0;
+  uint64_t flows_collected_tcp_close = 0;
+  uint64_t flows_collected_end = 0;
   uint64_t flow_hits = 0;
   uint64_t flow_misses = 0;
+  // Memory of the flows in memory, and of the tables and timers that keep
+  // track of them. The soft memory limit is compared with their total.
   uint64_t mem_usage_bytes = 0;
+  uint64_t flow_table_mem_bytes = 0;
+  uint64_t micro_flow_table_mem_bytes = 0;
+  uint64_t timers_mem_bytes = 0;
+  uint64_t heavy_hitters_mem_bytes = 0;
+  uint64_t cardinality_mem_bytes = 0;
+  uint64_t spreaders_mem_bytes = 0;
+  uint64_t traffic_sketch_mem_bytes = 0;
+  uint64_t total_mem_bytes = 0;
+  uint64_t slab_bytes_in_use = 0;
+  uint64_t slab_bytes_reserved = 0;
   uint64_t num_flows_in_mem = 0;
+  uint64_t micro_flows_in_mem = 0;
   uint64_t tcp_flows_in_mem = 0;
   uint64_t udp_flows_in_mem = 0;
   uint64_t icmp_flows_in_mem = 0;
@@ -147,6 +520,69 @@ struct ParserInfo {
   double ip_len_seen_per_sec = 0.0;
   double payload_seen_per_sec = 0.0;
   double tcp_payload_seen_per_sec = 0.0;
+
+  // Estimates of the number of distinct flows, sources and destinations of all
+  // packets, 0 unless cardinality sketches are enabled.
+  uint64_t distinct_flows = 0;
+  uint64_t distinct_srcs = 0;
+  uint64_t distinct_dsts = 0;
+
+  // The sketches of the estimates. Add merges them, so that the estimates of
+  // added infos are of all the parsers saw together, not of each.
+  HyperLogLog flows_sketch;
+  HyperLogLog srcs_sketch;
+  HyperLogLog dsts_sketch;
+
+  // Adds the values from another parser's info to this one. Used to aggregate
+  // the info of parsers that see disjoint sets of flows.
+  void Add(const ParserInfo& other) {
+    if (first_rx == 0 || (other.first_rx != 0 && other.first_rx < first_rx)) {
+      first_rx = other.first_rx;
+    }
+
+    last_rx = std::max(last_rx, other.last_rx);
+    total_pkts_seen += other.total_pkts_seen;
+    total_tcp_syn_or_fin_pkts_seen += other.total_tcp_syn_or_fin_pkts_seen;
+    tcp_flows_closed += other.tcp_flows_closed;
+    micro_flows_promoted += other.micro_flows_promoted;
+    pkts_sampled_out += other.pkts_sampled_out;
+    pkts_not_held += other.pkts_not_held;
+    pkts_sketch_only += other.pkts_sketch_only;
+    sketch_only = sketch_only || other.sketch_only;
+    flows_collected_mem_limit += other.flows_collected_mem_limit;
+    flows_collected_timeout += other.flows_collected_timeout;
+    flows_collected_tcp_close += other.flows_collected_tcp_close;
+    flows_collected_end += other.flows_collected_end;
+    flow_hits += other.flow_hits;
+    flow_misses += other.flow_misses;
+    mem_usage_bytes += other.mem_usage_bytes;
+    flow_table_mem_bytes += other.flow_table_mem_bytes;
+    micro_flow_table_mem_bytes += other.micro_flow_table_mem_bytes;
+    timers_mem_bytes += other.timers_mem_bytes;
+    heavy_hitters_mem_bytes += other.heavy_hitters_mem_bytes;
+    cardinality_mem_bytes += other.cardinality_mem_bytes;
+    spreaders_mem_bytes += other.spreaders_mem_bytes;
+    traffic_sketch_mem_bytes += other.traffic_sketch_mem_bytes;
+    total_mem_bytes += other.total_mem_bytes;
+    slab_bytes_in_use += other.slab_bytes_in_use;
+    slab_bytes_reserved += other.slab_bytes_reserved;
+    num_flows_in_mem += other.num_flows_in_mem;
+    micro_flows_in_mem += other.micro_flows_in_mem;
+    tcp_flows_in_mem += other.tcp_flows_in_mem;
+    udp_flows_in_mem += other.udp_flows_in_mem;
+    icmp_flows_in_mem += other.icmp_flows_in_mem;
+    pkts_seen_per_sec += other.pkts_seen_per_sec;
+    ip_len_seen_per_sec += other.ip_len_seen_per_sec;
+    payload_seen_per_sec += other.payload_seen_per_sec;
+    tcp_payload_seen_per_sec += other.tcp_payload_seen_per_sec;
+
+    flows_sketch.Merge(other.flows_sketch);
+    srcs_sketch.Merge(other.srcs_sketch);
+    dsts_sketch.Merge(other.dsts_sketch);
+    distinct_flows = flows_sketch.Estimate();
+    distinct_srcs = srcs_sketch.Estimate();
+    distinct_dsts = dsts_sketch.Estimate();
+  }
 };
 
 struct RunningAverage {
@@ -174,93 +610,216 @@ using std::unique_ptr;
 // flow instances.
 class Parser {
  public:
-  typedef PtrQueue<Flow, 1 << 10> FlowQueue;
+  // The parsers of a FlowParser with more than one thread share a queue, so
+  // it takes any number of producers (and consumers).
+  typedef MpmcPtrQueue<Flow, 1 << 10> FlowQueue;
 
   Parser(const ParserConfig& parser_config, std::shared_ptr<FlowQueue> queue)
-      : parser_config_(parser_config),
-        mem_usage_(0),
-        queue_(queue),
-        first_rx_(0),
-        last_rx_(0),
-        next_second_start_(0),
-        total_pkts_seen_(0),
-        total_tcp_syn_or_fin_pkts_seen_(0),
-        flow_hits_(0),
-        flow_misses_(0) {
-    if (parser_config_.undersample_skip_count() != 1) {
-      undersampler_ = std::make_unique<Undersampler>(
-          parser_config_.undersample_skip_count());
-    }
+      : Parser(parser_config, queue, false) {
   }
 
-  void TCPIpRx(const pcap::SniffIp& ip_header, const pcap::SniffTcp& tcp_header,
+  void TCPIpRx(const IpHeader& ip_header, const pcap::SniffTcp& tcp_header,
                uint64_t timestamp) {
     std::lock_guard<std::mutex> lock(mu_);
+    FlowKey key(ip_header, tcp_header.th_sport, tcp_header.th_dport);
+    CountDistinct(key);
+    CountSpreaders(key);
+    if (sketch_only_) {
+      if (tcp_header.th_flags & TH_SYN) {
+        total_tcp_syn_or_fin_pkts_seen_++;
+      }
+
+      SketchOnlyRx(key, ip_header, tcp_header.th_off * 4, "TCP", timestamp,
+                   true);
+      return;
+    }
+
     if (undersampler_ && undersampler_->ShouldSkip()) {
       return;
     }
 
-    Flow* flow = FindOrNewFlow(timestamp, { ip_header, tcp_header.th_sport,
-                                   tcp_header.th_dport });
-    uint16_t payload = flow->TCPIpRx(ip_header, tcp_header, timestamp,
-                                     &mem_usage_);
+    if (SampledOut(key)) {
+      return;
+    }
+
+    CountHeavyHitter(key, ip_header.len);
+
+    ExpireFlowsNoLock(timestamp);
+
+    if (parser_config_.collect_closed_tcp_flows()) {
+      CollectIfPortReused(key, tcp_header.th_flags);
+    }
+
+    uint32_t index;
+    MicroFlow* micro_flow;
+    Flow* flow = FindOrNewFlow(timestamp, key, ip_header.len, &index,
+                               &micro_flow);
+    if (flow == nullptr && micro_flow == nullptr) {
+      HandOffCollected();
+      return;
+    }
+
+    bool was_closed = flow != nullptr && flow->tcp_state() == TCP_CLOSED;
+    uint16_t payload = flow != nullptr
+        ? flow->TCPIpRx(ip_header, tcp_header, timestamp, &mem_usage_)
+        : micro_flow->TCPIpRx(ip_header, tcp_header, timestamp);
+    uint8_t flags_or = flow != nullptr ? flow->tcp_flags_or()
+        : micro_flow->tcp_flags_or();
 
     if (tcp_header.th_flags & TH_SYN) {
       total_tcp_syn_or_fin_pkts_seen_++;
-    } else if (!(flow->tcp_flags_or() & TH_SYN)
-        && (tcp_header.th_flags & TH_FIN)) {
+    } else if (!(flags_or & TH_SYN) && (tcp_header.th_flags & TH_FIN)) {
       total_tcp_syn_or_fin_pkts_seen_++;
     }
 
+    if (parser_config_.collect_closed_tcp_flows()
+        && (tcp_header.th_flags & (TH_FIN | TH_RST))) {
+      // Only flows are closed, so a micro-flow never holds a FIN or an RST.
+      if (flow == nullptr) {
+        flow = PromoteKey(key, &index);
+      }
+
+      CloseIfDone(ip_header, tcp_header, index, was_closed);
+    }
+
     CollectIfLimitExceeded();
-    UpdateStats(timestamp, ntohs(ip_header.ip_len), payload, true);
+    HandOffCollected();
+    UpdateStats(timestamp, ip_header.len, payload, true);
     CallPeriodicCallbacks();
   }
 
-  void UDPIpRx(const pcap::SniffIp& ip_header, const pcap::SniffUdp& udp_header,
+  void UDPIpRx(const IpHeader& ip_header, const pcap::SniffUdp& udp_header,
                uint64_t timestamp) {
     std::lock_guard<std::mutex> lock(mu_);
+    FlowKey key(ip_header, udp_header.uh_sport, udp_header.uh_dport);
+    CountDistinct(key);
+    CountSpreaders(key);
+    if (sketch_only_) {
+      SketchOnlyRx(key, ip_header, pcap::kSizeUDP, "UDP", timestamp, false);
+      return;
+    }
+
     if (undersampler_ && undersampler_->ShouldSkip()) {
       return;
     }
 
-    Flow* flow = FindOrNewFlow(timestamp, { ip_header, udp_header.uh_sport,
-                                   udp_header.uh_dport });
-    uint16_t payload = flow->UDPIpRx(ip_header, udp_header, timestamp,
-                                     &mem_usage_);
+    if (SampledOut(key)) {
+      return;
+    }
+
+    CountHeavyHitter(key, ip_header.len);
+
+    ExpireFlowsNoLock(timestamp);
+
+    MicroFlow* micro_flow;
+    Flow* flow = FindOrNewFlow(timestamp, key, ip_header.len, nullptr,
+                               &micro_flow);
+    if (flow == nullptr && micro_flow == nullptr) {
+      HandOffCollected();
+      return;
+    }
+
+    uint16_t payload = flow != nullptr
+        ? flow->UDPIpRx(ip_header, udp_header, timestamp, &mem_usage_)
+        : micro_flow->UDPIpRx(ip_header, timestamp);
     CollectIfLimitExceeded();
-    UpdateStats(timestamp, ntohs(ip_header.ip_len), payload, false);
+    HandOffCollected();
+    UpdateStats(timestamp, ip_header.len, payload, false);
     CallPeriodicCallbacks();
   }
 
-  void ICMPIpRx(const pcap::SniffIp& ip_header,
+  void ICMPIpRx(const IpHeader& ip_header,
                 const pcap::SniffIcmp& icmp_header, uint64_t timestamp) {
     std::lock_guard<std::mutex> lock(mu_);
+    FlowKey key(ip_header, 0, 0);
+    CountDistinct(key);
+    CountSpreaders(key);
+    if (sketch_only_) {
+      SketchOnlyRx(key, ip_header, pcap::kSizeICMP, "ICMP", timestamp, false);
+      return;
+    }
+
     if (undersampler_ && undersampler_->ShouldSkip()) {
       return;
     }
 
-    Flow* flow = FindOrNewFlow(timestamp, { ip_header, 0, 0 });
-    uint16_t payload = flow->ICMPIpRx(ip_header, icmp_header, timestamp,
-                                      &mem_usage_);
+    if (SampledOut(key)) {
+      return;
+    }
+
+    CountHeavyHitter(key, ip_header.len);
+
+    ExpireFlowsNoLock(timestamp);
+
+    MicroFlow* micro_flow;
+    Flow* flow = FindOrNewFlow(timestamp, key, ip_header.len, nullptr,
+                               &micro_flow);
+    if (flow == nullptr && micro_flow == nullptr) {
+      HandOffCollected();
+      return;
+    }
+
+    uint16_t payload = flow != nullptr
+        ? flow->ICMPIpRx(ip_header, icmp_header, timestamp, &mem_usage_)
+        : micro_flow->ICMPIpRx(ip_header, icmp_header, timestamp);
     CollectIfLimitExceeded();
-    UpdateStats(timestamp, ntohs(ip_header.ip_len), payload, false);
+    HandOffCollected();
+    UpdateStats(timestamp, ip_header.len, payload, false);
     CallPeriodicCallbacks();
   }
 
-  void UnknownIpRx(const pcap::SniffIp& ip_header, uint64_t timestamp) {
+  void UnknownIpRx(const IpHeader& ip_header, uint64_t timestamp) {
     std::lock_guard<std::mutex> lock(mu_);
+    FlowKey key(ip_header, 0, 0);
+    CountDistinct(key);
+    CountSpreaders(key);
+    if (sketch_only_) {
+      SketchOnlyRx(key, ip_header, 0, "IP", timestamp, false);
+      return;
+    }
+
     if (undersampler_ && undersampler_->ShouldSkip()) {
       return;
     }
 
-    Flow* flow = FindOrNewFlow(timestamp, { ip_header, 0, 0 });
-    uint16_t payload = flow->UnknownIpRx(ip_header, timestamp, &mem_usage_);
+    if (SampledOut(key)) {
+      return;
+    }
+
+    CountHeavyHitter(key, ip_header.len);
+
+    ExpireFlowsNoLock(timestamp);
+
+    MicroFlow* micro_flow;
+    Flow* flow = FindOrNewFlow(timestamp, key, ip_header.len, nullptr,
+                               &micro_flow);
+    if (flow == nullptr && micro_flow == nullptr) {
+      HandOffCollected();
+      return;
+    }
+
+    uint16_t payload = flow != nullptr
+        ? flow->UnknownIpRx(ip_header, timestamp, &mem_usage_)
+        : micro_flow->UnknownIpRx(ip_header, timestamp);
     CollectIfLimitExceeded();
-    UpdateStats(timestamp, ntohs(ip_header.ip_len), payload, false);
+    HandOffCollected();
+    UpdateStats(timestamp, ip_header.len, payload, false);
     CallPeriodicCallbacks();
   }
 
+  // Collects the flows that have timed out by now. Packets move time forward
+  // as they arrive, this is for when time passes with no packets, for example
+  // on a quiet live interface. Does nothing if no timeouts are configured.
+  void ExpireFlows(uint64_t now) {
+    if (!TimeoutsEnabled()) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mu_);
+    ExpireFlowsNoLock(now);
+    HandOffCollected();
+  }
+
   uint64_t last_rx() const {
     return last_rx_;
   }
@@ -277,10 +836,34 @@ class Parser {
     info.last_rx = last_rx_;
     info.total_pkts_seen = total_pkts_seen_;
     info.total_tcp_syn_or_fin_pkts_seen = total_tcp_syn_or_fin_pkts_seen_;
+    info.tcp_flows_closed = tcp_flows_closed_;
     info.flow_hits = flow_hits_;
     info.flow_misses = flow_misses_;
     info.mem_usage_bytes = mem_usage_;
-    info.num_flows_in_mem = flows_table_.size();
+    info.flow_table_mem_bytes = flows_.SizeBytes();
+    info.micro_flow_table_mem_bytes = micro_flows_ ? micro_flows_->SizeBytes()
+        : 0;
+    info.timers_mem_bytes = timers_.SizeBytes() + micro_timers_.SizeBytes();
+    info.heavy_hitters_mem_bytes = heavy_hitters_ ? heavy_hitters_->SizeBytes()
+        : 0;
+    info.cardinality_mem_bytes = CardinalityMemUsage();
+    info.spreaders_mem_bytes = spreaders_ ? spreaders_->SizeBytes() : 0;
+    info.traffic_sketch_mem_bytes = traffic_sketch_
+        ? traffic_sketch_->SizeBytes() : 0;
+    info.total_mem_bytes = mem_usage_ + TablesMemUsage();
+    info.slab_bytes_in_use = pool_->bytes_in_use();
+    info.slab_bytes_reserved = pool_->bytes_reserved();
+    info.num_flows_in_mem = flows_.size();
+    info.micro_flows_in_mem = micro_flows_ ? micro_flows_->size() : 0;
+    info.micro_flows_promoted = micro_flows_promoted_;
+    info.pkts_sampled_out = pkts_sampled_out_;
+    info.pkts_not_held = pkts_not_held_;
+    info.pkts_sketch_only = pkts_sketch_only_;
+    info.sketch_only = sketch_only_;
+    info.flows_collected_mem_limit = flows_collected_mem_limit_;
+    info.flows_collected_timeout = flows_collected_timeout_;
+    info.flows_collected_tcp_close = flows_collected_tcp_close_;
+    info.flows_collected_end = flows_collected_end_;
     info.tcp_flows_in_mem = CountFlows(IPPROTO_TCP);
     info.udp_flows_in_mem = CountFlows(IPPROTO_UDP);
     info.icmp_flows_in_mem = CountFlows(IPPROTO_ICMP);
@@ -290,50 +873,436 @@ class Parser {
     info.pkts_seen_per_sec = pkts_seen_running_avg_.average;
     info.tcp_payload_seen_per_sec = tcp_payload_seen_running_avg_.average;
 
+    info.flows_sketch = flows_sketch_;
+    info.srcs_sketch = srcs_sketch_;
+    info.dsts_sketch = dsts_sketch_;
+    info.distinct_flows = flows_sketch_.Estimate();
+    info.distinct_srcs = srcs_sketch_.Estimate();
+    info.distinct_dsts = dsts_sketch_.Estimate();
+
     return info;
   }
 
+  // The number of flows there would have been without sampling. With
+  // cardinality sketches it is their estimate of the distinct flows seen, and
+  // the skip count is ignored. Otherwise with flow sampling the flows in memory
+  // are a fair sample of all flows and the skip count is ignored too, with
+  // undersampling flows with a single SYN are assumed to be the ones whose
+  // other packets were skipped.
   uint64_t GetOriginalNumFlowsEstimate(uint32_t sample_skip_count) const {
+    if (flows_sketch_.enabled()) {
+      return flows_sketch_.Estimate();
+    }
+
+    size_t num_flows = flows_.size()
+        + (micro_flows_ ? micro_flows_->size() : 0);
+    if (flow_sampler_) {
+      return num_flows / flow_sampler_->rate() + 0.5;
+    }
+
     if (sample_skip_count < 2) {
-      return flows_table_.size();
+      return num_flows;
     }
 
     size_t syn_flows = 0;
 
-    for (const auto& flow_ptr : flows_) {
-      uint8_t flags = flow_ptr->tcp_flags_or();
-      uint64_t pkts_seen = flow_ptr->pkts_seen();
+    FlowTable::Iterator it(flows_);
+    while (const Flow* flow = it.Next()) {
+      uint8_t flags = flow->tcp_flags_or();
+      uint64_t pkts_seen = flow->pkts_seen();
 
       if ((flags & TH_SYN) && pkts_seen == 1) {
         syn_flows++;
       }
     }
 
-    size_t other_flows = flows_.size() - syn_flows;
+    for (uint32_t i = 0; micro_flows_ && i < micro_flows_->capacity(); ++i) {
+      const MicroFlow* micro_flow = micro_flows_->At(i);
+      if (micro_flow != nullptr && (micro_flow->tcp_flags_or() & TH_SYN)
+          && micro_flow->pkts_seen() == 1) {
+        syn_flows++;
+      }
+    }
+
+    size_t other_flows = num_flows - syn_flows;
 
     return syn_flows * sample_skip_count + other_flows;
   }
 
-  // Collects all flows
-  void CollectAllFlows() {
+  // The flows with the most bytes since the parser started, or since the
+  // last call that cleared them. The counters are copied under the lock and
+  // sorted after it is released. Throws if heavy hitters are not enabled.
+  HeavyHitters GetHeavyHitters(bool clear = false) {
+    std::vector<HeavyHitter> counters;
+    uint64_t total_bytes;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (!heavy_hitters_) {
+        throw std::logic_error("Heavy hitters not enabled");
+      }
+
+      counters = heavy_hitters_->Counters();
+      total_bytes = heavy_hitters_->total_bytes();
+      if (clear) {
+        heavy_hitters_->Clear();
+      }
+    }
+
+    return HeavyHitters(parser_config_.heavy_hitters_size(), total_bytes,
+                        counters);
+  }
+
+  // In sketch-only mode packets only update the traffic sketch, the
+  // cardinality and spread sketches if they are enabled, and the packet
+  // counts and rates of the info. Flows are not looked up or created, which
+  // keeps the cost of a packet low and constant when there are too many of
+  // them. Flows already in memory get no more packets, but still time out.
+  // Can be switched at any time, by the parser itself if
+  // sketch_only_pkts_per_sec is set. Throws if the traffic sketch is not
+  // enabled.
+  void SetSketchOnly(bool sketch_only) {
     std::lock_guard<std::mutex> lock(mu_);
-    while (!flows_.empty()) {
-      CollectLast();
+    if (!traffic_sketch_) {
+      throw std::logic_error("Traffic sketch not enabled");
     }
 
+    sketch_only_ = sketch_only;
+  }
+
+  bool sketch_only() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return sketch_only_;
+  }
+
+  const ParserConfig& parser_config() const {
+    return parser_config_;
+  }
+
+  // A copy of the traffic sketch, which counts the packets seen in sketch-only
+  // mode since the parser started or since the last call that cleared it.
+  // Throws if it is not enabled.
+  TrafficSketch GetTrafficSketch(bool clear = false) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!traffic_sketch_) {
+      throw std::logic_error("Traffic sketch not enabled");
+    }
+
+    TrafficSketch traffic_sketch = *traffic_sketch_;
+    if (clear) {
+      traffic_sketch_->Clear();
+    }
+
+    return traffic_sketch;
+  }
+
+  // A copy of the superspreader and fan-in sketches, which count all packets
+  // since the parser started or since the last call that cleared them. Their
+  // Top method lists the hosts with the most distinct peers. Throws if the
+  // sketches are not enabled.
+  Spreaders GetSpreaders(bool clear = false) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!spreaders_) {
+      throw std::logic_error("Spread sketches not enabled");
+    }
+
+    Spreaders spreaders = *spreaders_;
+    if (clear) {
+      spreaders_->Clear();
+    }
+
+    return spreaders;
+  }
+
+  // Collects all flows and closes the queue.
+  void CollectAllFlows() {
+    FlushAllFlows();
+
     if (queue_) {
       queue_->Close();
     }
   }
 
+  // Collects all flows, but leaves the queue open. Useful when more than one
+  // parser produces to the same queue.
+  void FlushAllFlows() {
+    std::lock_guard<std::mutex> lock(mu_);
+    while (!flows_.empty()) {
+      Collect(flows_.PopLeastRecent(), COLLECT_END);
+    }
+
+    for (uint32_t i = 0; micro_flows_ && i < micro_flows_->capacity(); ++i) {
+      if (micro_flows_->At(i) != nullptr) {
+        CollectMicroFlow(i, COLLECT_END);
+      }
+    }
+
+    HandOffCollected();
+  }
+
+  // Moves all flows from another parser to this one. The other parser should
+  // have seen packets that were received after the packets this one has seen,
+  // for example because it parsed the next part of the same trace. Flows with
+  // the same key are merged, unless this parser's flow would have timed out by
+  // the time the other's started or the other's starts a new connection on
+  // the same ports, and the result is the same as if this parser had seen all
+  // packets, with two exceptions: flows whose timestamps go backwards across
+  // the two parsers are not merged -- the older one is collected instead; and
+  // the running averages are those of this parser. Micro-flows of both parsers
+  // become flows first. No flows are collected to keep this parser under its
+  // soft memory limit, so that parsers that each had part of a limit can be
+  // merged into one of them. The other parser is left without flows and with
+  // its counters reset.
+  void MergeFrom(Parser* other) {
+    std::lock_guard<std::mutex> lock(mu_);
+    std::lock_guard<std::mutex> other_lock(other->mu_);
+
+    // Flows are merged whole, so that a key is never in both tables.
+    PromoteAllMicroFlows();
+    other->PromoteAllMicroFlows();
+
+    // Flows that would have timed out before the other parser's first packet
+    // are gone by the time a serial run gets there.
+    if (other->first_rx_ != 0) {
+      ExpireFlowsNoLock(other->first_rx_);
+    }
+
+    // Least recently accessed flows go first, so that LRU order is kept.
+    uint64_t merged = 0;
+    while (!other->flows_.empty()) {
+      std::unique_ptr<Flow> flow = other->flows_.PopLeastRecent();
+      other->mem_usage_ -= flow->SizeBytes();
+
+      uint32_t index;
+      Flow* existing = flows_.FindAndTouch(flow->key(), &index);
+      if (existing != nullptr) {
+        if (flow->first_rx() < existing->last_rx()) {
+          Collect(flows_.RemoveAt(index), COLLECT_END);
+        } else if (flow->first_rx() >= TimeoutDeadline(*existing)) {
+          // The flow's first packet would have found the existing one timed
+          // out.
+          Collect(flows_.RemoveAt(index), ExpiredReason(*existing));
+        } else if (parser_config_.collect_closed_tcp_flows()
+            && PortReused(*existing, flow->first_tcp_flags())) {
+          Collect(flows_.RemoveAt(index), COLLECT_TCP_CLOSE);
+        } else {
+          existing->Merge(*flow, &mem_usage_);
+          ScheduleTimeout(index, *existing);
+          merged++;
+          continue;
+        }
+      }
+
+      mem_usage_ += flow->SizeBytes();
+      Insert(std::move(flow));
+    }
+
+    if (first_rx_ == 0 || (other->first_rx_ != 0
+        && other->first_rx_ < first_rx_)) {
+      first_rx_ = other->first_rx_;
+    }
+
+    last_rx_ = std::max(last_rx_, other->last_rx_);
+    total_pkts_seen_ += other->total_pkts_seen_;
+    total_tcp_syn_or_fin_pkts_seen_ += other->total_tcp_syn_or_fin_pkts_seen_;
+    tcp_flows_closed_ += other->tcp_flows_closed_;
+    flows_collected_mem_limit_ += other->flows_collected_mem_limit_;
+    flows_collected_timeout_ += other->flows_collected_timeout_;
+    flows_collected_tcp_close_ += other->flows_collected_tcp_close_;
+    flows_collected_end_ += other->flows_collected_end_;
+    pkts_sampled_out_ += other->pkts_sampled_out_;
+    pkts_not_held_ += other->pkts_not_held_;
+    pkts_sketch_only_ += other->pkts_sketch_only_;
+
+    // The first packet of each merged flow was a miss for the other parser, but
+    // would have been a hit for this one.
+    flow_hits_ += other->flow_hits_ + merged;
+    flow_misses_ += other->flow_misses_ - merged;
+
+    other->first_rx_ = 0;
+    other->last_rx_ = 0;
+    other->total_pkts_seen_ = 0;
+    other->total_tcp_syn_or_fin_pkts_seen_ = 0;
+    other->tcp_flows_closed_ = 0;
+    other->flows_collected_mem_limit_ = 0;
+    other->flows_collected_timeout_ = 0;
+    other->flows_collected_tcp_close_ = 0;
+    other->flows_collected_end_ = 0;
+    other->pkts_sampled_out_ = 0;
+    other->pkts_not_held_ = 0;
+    other->pkts_sketch_only_ = 0;
+
+    flows_sketch_.Merge(other->flows_sketch_);
+    srcs_sketch_.Merge(other->srcs_sketch_);
+    dsts_sketch_.Merge(other->dsts_sketch_);
+    other->flows_sketch_.Clear();
+    other->srcs_sketch_.Clear();
+    other->dsts_sketch_.Clear();
+
+    if (spreaders_ && other->spreaders_) {
+      spreaders_->Merge(*other->spreaders_);
+      other->spreaders_->Clear();
+    }
+
+    if (traffic_sketch_ && other->traffic_sketch_) {
+      traffic_sketch_->Merge(*other->traffic_sketch_);
+      other->traffic_sketch_->Clear();
+    }
+
+    if (heavy_hitters_ && other->heavy_hitters_) {
+      HeavyHitters heavy_hitters = heavy_hitters_->Snapshot();
+      heavy_hitters.Merge(other->heavy_hitters_->Snapshot());
+      heavy_hitters_->Reset(heavy_hitters);
+      other->heavy_hitters_->Clear();
+    }
+    other->flow_hits_ = 0;
+    other->flow_misses_ = 0;
+
+    HandOffCollected();
+  }
+
  private:
-  typedef std::list<std::unique_ptr<Flow>> FlowList;
-  typedef std::unordered_map<FlowKey, typename FlowList::iterator, KeyHasher> FlowMap;
+  // True if flow sampling does not keep the flow of a packet. The packet is
+  // then counted and dropped.
+  bool SampledOut(const FlowKey& key) {
+    if (flow_sampler_ && !flow_sampler_->Keep(key)) {
+      ++pkts_sampled_out_;
+      return true;
+    }
+
+    return false;
+  }
+
+  // Adds the flow of a packet and its addresses to the cardinality sketches.
+  void CountDistinct(const FlowKey& key) {
+    if (!flows_sketch_.enabled()) {
+      return;
+    }
+
+    flows_sketch_.Add(key.hash64());
+    srcs_sketch_.Add(Mix64(key.src()));
+    dsts_sketch_.Add(Mix64(key.dst()));
+  }
+
+  void CountSpreaders(const FlowKey& key) {
+    if (spreaders_) {
+      spreaders_->Add(key.src(), key.dst());
+    }
+  }
+
+  // Handles a packet in sketch-only mode, after the cardinality and spread
+  // sketches have counted it.
+  void SketchOnlyRx(const FlowKey& key, const IpHeader& ip_header,
+                    uint32_t transport_header_size, const char* protocol_name,
+                    uint64_t timestamp, bool tcp) {
+    ++pkts_sketch_only_;
+    traffic_sketch_->Add(key, ip_header.len);
+    uint16_t payload = Flow::PayloadSize(ip_header, transport_header_size,
+                                         protocol_name, key);
+
+    ExpireFlowsNoLock(timestamp);
+    HandOffCollected();
+    UpdateStats(timestamp, ip_header.len, payload, tcp);
+    CallPeriodicCallbacks();
+  }
+
+  void CountHeavyHitter(const FlowKey& key, uint16_t ip_len) {
+    if (heavy_hitters_) {
+      heavy_hitters_->Add(key, ip_len);
+    }
+  }
+
+  // Why a flow was collected.
+  enum CollectReason {
+    COLLECT_MEM_LIMIT,
+    COLLECT_TIMEOUT,
+    COLLECT_TCP_CLOSE,
+    COLLECT_END
+  };
+
+  // Used by ShardedParser to create its shards.
+  Parser(const ParserConfig& parser_config, std::shared_ptr<FlowQueue> queue,
+         bool shard)
+      : parser_config_(parser_config),
+        shard_(shard),
+        pool_(new SlabPool()),
+        mem_usage_(0),
+        queue_(queue),
+        first_rx_(0),
+        last_rx_(0),
+        next_second_start_(0),
+        total_pkts_seen_(0),
+        total_tcp_syn_or_fin_pkts_seen_(0),
+        tcp_flows_closed_(0),
+        flows_collected_mem_limit_(0),
+        flows_collected_timeout_(0),
+        flows_collected_tcp_close_(0),
+        flows_collected_end_(0),
+        flow_hits_(0),
+        flow_misses_(0),
+        micro_flows_promoted_(0),
+        pkts_sampled_out_(0),
+        pkts_not_held_(0),
+        pkts_sketch_only_(0),
+        sketch_only_(false),
+        timers_(kTimeoutTick),
+        micro_timers_(kTimeoutTick) {
+    if (parser_config_.undersample_skip_count() != 1) {
+      undersampler_ = std::make_unique<Undersampler>(
+          parser_config_.undersample_skip_count());
+    }
+
+    if (parser_config_.flow_sample_rate() != 1.0) {
+      if (undersampler_) {
+        throw std::logic_error("Cannot undersample and sample flows");
+      }
+
+      flow_sampler_ = std::make_unique<FlowSampler>(
+          parser_config_.flow_sample_rate(), parser_config_.flow_sample_key());
+    }
+
+    if (parser_config_.sample_and_hold_bytes() != 0) {
+      if (undersampler_) {
+        throw std::logic_error("Cannot undersample and sample and hold");
+      }
+
+      sample_and_hold_ = std::make_unique<SampleAndHold>(
+          parser_config_.sample_and_hold_bytes());
+    }
+
+    if (parser_config_.cardinality_precision() != 0) {
+      flows_sketch_ = HyperLogLog(parser_config_.cardinality_precision());
+      srcs_sketch_ = HyperLogLog(parser_config_.cardinality_precision());
+      dsts_sketch_ = HyperLogLog(parser_config_.cardinality_precision());
+    }
+
+    if (parser_config_.heavy_hitters_size() != 0) {
+      heavy_hitters_ = std::make_unique<SpaceSaving>(
+          parser_config_.heavy_hitters_size());
+    }
+
+    if (parser_config_.spread_sketch_width() != 0) {
+      spreaders_ = std::make_unique<Spreaders>(
+          parser_config_.spread_sketch_width());
+    }
+
+    if (parser_config_.traffic_sketch_width() != 0) {
+      traffic_sketch_ = std::make_unique<TrafficSketch>(
+          parser_config_.traffic_sketch_width());
+    } else if (parser_config_.sketch_only_pkts_per_sec() != 0) {
+      throw std::logic_error("Sketch-only mode needs the traffic sketch");
+    }
+
+    if (parser_config_.micro_flow_table_size() != 0) {
+      micro_flows_ = std::make_unique<MicroFlowTable>(
+          parser_config_.micro_flow_table_size());
+    }
+  }
 
   uint64_t CountFlows(uint8_t ip_proto) const {
     uint64_t count = 0;
-    for (const auto& flow_ptr : flows_) {
-      if (flow_ptr->key().protocol() == ip_proto) {
+    FlowTable::Iterator it(flows_);
+    while (const Flow* flow = it.Next()) {
+      if (flow->key().protocol() == ip_proto) {
         ++count;
       }
     }
@@ -341,48 +1310,403 @@ class Parser {
     return count;
   }
 
-  // Collects the least recently accessed flow.
-  void CollectLast() {
-    if (flows_.empty()) {
-      return;
+  // Counts a collected flow under its reason.
+  void CountCollected(CollectReason reason) {
+    switch (reason) {
+      case COLLECT_MEM_LIMIT:
+        flows_collected_mem_limit_++;
+        break;
+      case COLLECT_TIMEOUT:
+        flows_collected_timeout_++;
+        break;
+      case COLLECT_TCP_CLOSE:
+        flows_collected_tcp_close_++;
+        break;
+      case COLLECT_END:
+        flows_collected_end_++;
     }
+  }
 
-    std::unique_ptr<Flow> flow = std::move(flows_.back());
-    flows_table_.erase(flow->key());
-    flows_.pop_back();
-
+  // Adds a flow that has been removed from the table to the batch that the
+  // next HandOffCollected gives to the queue.
+  void Collect(std::unique_ptr<Flow> flow, CollectReason reason) {
     mem_usage_ -= (flow->SizeBytes());
+    CountCollected(reason);
 
     if (queue_) {
-      queue_->ProduceOrBlock(std::move(flow));
+      collected_.push_back(std::move(flow));
+    }
+  }
+
+  // Hands the flows collected so far to the queue at once. Called before the
+  // lock is released by everything that can collect flows.
+  void HandOffCollected() {
+    if (!collected_.empty()) {
+      queue_->ProduceAllOrBlock(&collected_);
     }
   }
 
-  // Collects one or more flows to make sure they obey
+  // Memory allocated for everything but the flows. Does not go down when flows
+  // are collected.
+  uint64_t TablesMemUsage() const {
+    return flows_.SizeBytes()
+        + (micro_flows_ ? micro_flows_->SizeBytes() : 0)
+        + timers_.SizeBytes() + micro_timers_.SizeBytes()
+        + (heavy_hitters_ ? heavy_hitters_->SizeBytes() : 0)
+        + CardinalityMemUsage()
+        + (spreaders_ ? spreaders_->SizeBytes() : 0)
+        + (traffic_sketch_ ? traffic_sketch_->SizeBytes() : 0);
+  }
+
+  uint64_t CardinalityMemUsage() const {
+    return flows_sketch_.SizeBytes() + srcs_sketch_.SizeBytes()
+        + dsts_sketch_.SizeBytes();
+  }
+
+  // Collects least recently accessed flows to make sure they obey the soft
+  // memory limit -- one per call, or down to the low watermark if there is
+  // one.
   void CollectIfLimitExceeded() {
-    if (mem_usage_ > parser_config_.soft_mem_limit()) {
-      CollectLast();
+    uint64_t tables = TablesMemUsage();
+    if (mem_usage_ + tables <= parser_config_.soft_mem_limit()
+        || flows_.empty()) {
+      return;
+    }
+
+    Collect(flows_.PopLeastRecent(), COLLECT_MEM_LIMIT);
+
+    uint64_t low_watermark = parser_config_.soft_mem_low_watermark();
+    if (low_watermark == 0 || low_watermark >= parser_config_.soft_mem_limit()) {
+      return;
+    }
+
+    while (mem_usage_ + tables > low_watermark && !flows_.empty()) {
+      Collect(flows_.PopLeastRecent(), COLLECT_MEM_LIMIT);
+    }
+  }
+
+  bool TimeoutsEnabled() const {
+    return parser_config_.inactive_timeout() != 0
+        || parser_config_.active_timeout() != 0
+        || (parser_config_.collect_closed_tcp_flows()
+            && parser_config_.tcp_linger() != 0);
+  }
+
+  // When a flow or a micro-flow that was first and last seen at the given
+  // times reaches the inactive or the active timeout. The maximum value if
+  // neither is set.
+  uint64_t IdleOrActiveDeadline(uint64_t first_rx, uint64_t last_rx) const {
+    uint64_t deadline = std::numeric_limits<uint64_t>::max();
+    if (parser_config_.inactive_timeout() != 0) {
+      deadline = last_rx + parser_config_.inactive_timeout();
+    }
+
+    if (parser_config_.active_timeout() != 0) {
+      deadline = std::min(deadline,
+                          first_rx + parser_config_.active_timeout());
+    }
+
+    return deadline;
+  }
+
+  // When a flow times out, given what it has seen so far. A new flow has not
+  // seen its first packet yet. The maximum value if it never does.
+  uint64_t TimeoutDeadline(const Flow& flow) const {
+    uint64_t deadline = IdleOrActiveDeadline(
+        flow.first_rx(),
+        flow.pkts_seen() == 0 ? flow.first_rx() : flow.last_rx());
+
+    if (flow.tcp_state() == TCP_CLOSED) {
+      deadline = std::min(deadline,
+                          flow.last_rx() + parser_config_.tcp_linger());
+    }
+
+    return deadline;
+  }
+
+  // Sets a timer to a deadline, or cancels it if the deadline is the maximum
+  // value.
+  static void SetTimer(TimerWheel* timers, uint32_t index, uint64_t deadline) {
+    if (deadline == std::numeric_limits<uint64_t>::max()) {
+      timers->Cancel(index);
+      return;
+    }
+
+    timers->Schedule(index, deadline);
+  }
+
+  // Sets the timer of the flow at an index, if it has a deadline.
+  void ScheduleTimeout(uint32_t index, const Flow& flow) {
+    if (TimeoutsEnabled()) {
+      SetTimer(&timers_, index, TimeoutDeadline(flow));
+    }
+  }
+
+  // Sets the timer of the micro-flow at an index, if it has a deadline.
+  void ScheduleMicroTimeout(uint32_t index, const MicroFlow& micro_flow) {
+    if (TimeoutsEnabled()) {
+      SetTimer(&micro_timers_,
+               index,
+               IdleOrActiveDeadline(micro_flow.first_rx(),
+                                    micro_flow.last_rx()));
+    }
+  }
+
+  // Collects the micro-flow at an index as a flow. Micro-flows do not count
+  // towards memory usage.
+  void CollectMicroFlow(uint32_t index, CollectReason reason) {
+    CountCollected(reason);
+    if (queue_) {
+      collected_.push_back(MicroToFlow(index));
+    }
+
+    micro_flows_->Remove(index);
+  }
+
+  // A flow with the packets of the micro-flow at an index.
+  std::unique_ptr<Flow> MicroToFlow(uint32_t index) const {
+    std::unique_ptr<Flow> flow = micro_flows_->At(index)->ToFlow(
+        parser_config_.flow_config(), pool_.get());
+    SetMissed(flow.get());
+    return flow;
+  }
+
+  // Sets the estimate of what a new flow missed before it was held.
+  void SetMissed(Flow* flow) const {
+    if (sample_and_hold_) {
+      flow->set_estimated_ip_len_missed(sample_and_hold_->bytes());
+    }
+  }
+
+  // Turns the micro-flow at an index into a flow. If flow_index is not null it
+  // is set to the index of the flow.
+  Flow* Promote(uint32_t index, uint32_t* flow_index = nullptr) {
+    std::unique_ptr<Flow> flow = MicroToFlow(index);
+    micro_flows_->Remove(index);
+    micro_flows_promoted_++;
+    mem_usage_ += flow->SizeBytes();
+    return Insert(std::move(flow), flow_index);
+  }
+
+  // Turns the micro-flow of a key into a flow, if there is one. Returns the
+  // flow or null. If flow_index is not null it is set to the index of the flow.
+  Flow* PromoteKey(const FlowKey& key, uint32_t* flow_index = nullptr) {
+    uint32_t index;
+    if (!micro_flows_ || micro_flows_->Find(key, &index) == nullptr) {
+      return nullptr;
+    }
+
+    return Promote(index, flow_index);
+  }
+
+  void PromoteAllMicroFlows() {
+    for (uint32_t i = 0; micro_flows_ && i < micro_flows_->capacity(); ++i) {
+      if (micro_flows_->At(i) != nullptr) {
+        Promote(i);
+      }
+    }
+  }
+
+  // Adds a flow to the table and starts its timer. If index is not null it is
+  // set to the index of the flow in the table.
+  Flow* Insert(std::unique_ptr<Flow> flow, uint32_t* index = nullptr) {
+    uint32_t inserted_index;
+    Flow* inserted = flows_.Insert(std::move(flow), &inserted_index);
+    ScheduleTimeout(inserted_index, *inserted);
+    if (index != nullptr) {
+      *index = inserted_index;
+    }
+
+    return inserted;
+  }
+
+  // A SYN with no ACK on a flow whose connection has closed, or is closing,
+  // starts a new connection with the same ports.
+  static bool PortReused(const Flow& flow, uint8_t flags) {
+    return (flags & TH_SYN) && !(flags & TH_ACK)
+        && flow.tcp_state() >= TCP_FIN;
+  }
+
+  // Collects the flow of a key if a packet with the given flags reuses its
+  // ports, so that the two connections are not counted as one.
+  void CollectIfPortReused(const FlowKey& key, uint8_t flags) {
+    if (!(flags & TH_SYN) || (flags & TH_ACK)) {
+      return;
+    }
+
+    uint32_t index;
+    Flow* flow = flows_.Find(key, &index);
+    if (flow != nullptr && PortReused(*flow, flags)) {
+      Collect(flows_.RemoveAt(index), COLLECT_TCP_CLOSE);
+    }
+  }
+
+  // Called after a FIN or an RST has been added to the flow at an index, which
+  // was closed before it if was_closed is true. Flows are one way, so whether
+  // the connection is closed depends on the flow of the other direction too.
+  // If it is, both flows are closed, and collected once they linger. Only
+  // flows that were not closed before are counted and have their timers set,
+  // so FINs and RSTs retransmitted while a flow lingers change nothing.
+  void CloseIfDone(const IpHeader& ip_header, const pcap::SniffTcp& tcp_header,
+                   uint32_t index, bool was_closed) {
+    IpHeader reverse_header = ip_header;
+    Ipv6Addresses reverse_ipv6;
+    std::swap(reverse_header.src, reverse_header.dst);
+    if (ip_header.ipv6 != nullptr) {
+      reverse_ipv6.src = ip_header.ipv6->dst;
+      reverse_ipv6.dst = ip_header.ipv6->src;
+      reverse_header.ipv6 = &reverse_ipv6;
+    }
+
+    FlowKey reverse_key(reverse_header, tcp_header.th_dport,
+                        tcp_header.th_sport);
+    uint32_t reverse_index;
+    Flow* reverse = flows_.Find(reverse_key, &reverse_index);
+
+    // A micro-flow has seen no FIN or RST, so the other direction only needs
+    // to be a flow if an RST has closed this one.
+    Flow* flow = flows_.At(index);
+    if (reverse == nullptr && flow->tcp_state() == TCP_CLOSED) {
+      reverse = PromoteKey(reverse_key, &reverse_index);
+    }
+    if (flow->tcp_state() != TCP_CLOSED) {
+      if (reverse == nullptr || reverse->tcp_state() < TCP_FIN) {
+        return;
+      }
+
+      flow->CloseTcp();
+    }
+
+    bool reverse_closes = reverse != nullptr
+        && reverse->tcp_state() != TCP_CLOSED;
+    if (!was_closed) {
+      Closed(index);
+    }
+
+    if (reverse_closes) {
+      reverse->CloseTcp();
+      Closed(reverse_index);
+    }
+  }
+
+  // Collects the closed flow at an index, or sets it to be collected once it
+  // has lingered.
+  void Closed(uint32_t index) {
+    tcp_flows_closed_++;
+    if (parser_config_.tcp_linger() == 0) {
+      Collect(flows_.RemoveAt(index), COLLECT_TCP_CLOSE);
+      return;
     }
+
+    ScheduleTimeout(index, *flows_.At(index));
+  }
+
+  // Why a flow whose deadline has passed is collected. A closed flow that has
+  // lingered is collected because it closed, even if it would also have timed
+  // out by now.
+  CollectReason ExpiredReason(const Flow& flow) const {
+    return flow.tcp_state() == TCP_CLOSED
+        && parser_config_.collect_closed_tcp_flows() ? COLLECT_TCP_CLOSE
+        : COLLECT_TIMEOUT;
+  }
+
+  // Collects flows whose timers have fired. A flow's timer is set when the
+  // flow is added and not moved by each packet, so when it fires the flow may
+  // have seen packets since -- then the timer is set again. Timers of flows
+  // that have left the table are not cancelled. They fire on an empty entry,
+  // or on a flow that has since been added at the same index and has set its
+  // own timer, which replaced theirs.
+  void ExpireFlowsNoLock(uint64_t now) {
+    if (!TimeoutsEnabled()) {
+      return;
+    }
+
+    timers_.Advance(now, [this, now](uint32_t index) {
+      Flow* flow = flows_.At(index);
+      if (flow == nullptr) {
+        return;
+      }
+
+      uint64_t deadline = TimeoutDeadline(*flow);
+      if (deadline > now) {
+        ScheduleTimeout(index, *flow);
+        return;
+      }
+
+      Collect(flows_.RemoveAt(index), ExpiredReason(*flow));
+    });
+
+    if (!micro_flows_) {
+      return;
+    }
+
+    micro_timers_.Advance(now, [this, now](uint32_t index) {
+      const MicroFlow* micro_flow = micro_flows_->At(index);
+      if (micro_flow == nullptr) {
+        return;
+      }
+
+      if (IdleOrActiveDeadline(micro_flow->first_rx(), micro_flow->last_rx())
+          > now) {
+        ScheduleMicroTimeout(index, *micro_flow);
+        return;
+      }
+
+      CollectMicroFlow(index, COLLECT_TIMEOUT);
+    });
   }
 
-  Flow* FindOrNewFlow(uint64_t timestamp, const FlowKey& key) {
-    const auto& it = flows_table_.find(key);
-    if (it != flows_table_.end()) {
-      // Move the flow to the front of the list
-      flows_.splice(flows_.begin(), flows_, it->second);
+  // Returns the flow a packet with the given key and timestamp goes to, and
+  // creates it if there is none. If index is not null it is set to the index
+  // of the flow. With micro-flows on a new key gets a micro-flow instead, and
+  // a micro-flow the packet does not fit in is promoted. Returns null and sets
+  // micro_flow if the packet goes to a micro-flow. With sample-and-hold a
+  // packet of a new key that is not held creates nothing, both are then null.
+  Flow* FindOrNewFlow(uint64_t timestamp, const FlowKey& key, uint16_t ip_len,
+                      uint32_t* index, MicroFlow** micro_flow) {
+    Flow* flow = flows_.FindAndTouch(key, index);
+    if (flow != nullptr) {
       flow_hits_++;
+      return flow;
+    }
+
+    uint32_t micro_index;
+    if (micro_flows_) {
+      *micro_flow = micro_flows_->Find(key, &micro_index);
+      if (*micro_flow != nullptr) {
+        flow_hits_++;
+        if ((*micro_flow)->Fits(timestamp)) {
+          return nullptr;
+        }
 
-      return it->second->get();
+        return Promote(micro_index, index);
+      }
     }
 
-    auto flow_ptr = std::make_unique<Flow>(timestamp, key,
-                                           parser_config_.flow_config());
     flow_misses_++;
-    mem_usage_ += sizeof(Flow);
+    if (sample_and_hold_ && !sample_and_hold_->Hold(ip_len)) {
+      pkts_not_held_++;
+      *micro_flow = nullptr;
+      return nullptr;
+    }
+
+    if (micro_flows_) {
+      micro_index = micro_flows_->PlaceFor(key);
+      if (micro_flows_->At(micro_index) != nullptr) {
+        CollectMicroFlow(micro_index, COLLECT_MEM_LIMIT);
+      }
+
+      *micro_flow = micro_flows_->Add(micro_index, timestamp, key);
+      ScheduleMicroTimeout(micro_index, **micro_flow);
+      return nullptr;
+    }
 
-    flows_.push_front(std::move(flow_ptr));
-    flows_table_.insert(std::make_pair(key, flows_.begin()));
-    return flows_.begin()->get();
+    std::unique_ptr<Flow> flow_ptr(new (pool_.get()) Flow(
+        timestamp, key, parser_config_.flow_config(), pool_.get()));
+    SetMissed(flow_ptr.get());
+    mem_usage_ += flow_ptr->SizeBytes();
+
+    return Insert(std::move(flow_ptr), index);
   }
 
   void UpdateStats(uint64_t timestamp, uint16_t ip_len, uint16_t payload,
@@ -392,7 +1716,13 @@ class Parser {
     }
 
     if (timestamp < last_rx_) {
-      throw std::logic_error("Non-incrementing timestamps");
+      // A shard can be fed by more than one thread, so packets of different
+      // flows may arrive slightly out of order.
+      if (!shard_) {
+        throw std::logic_error("Non-incrementing timestamps");
+      }
+
+      timestamp = last_rx_;
     }
 
     last_rx_ = timestamp;
@@ -414,6 +1744,22 @@ class Parser {
     pkts_seen_running_avg_.EndSecond();
   }
 
+  // Goes into sketch-only mode if packets come faster than the configured
+  // rate, and out of it if they come at less than half of it.
+  void UpdateSketchOnly() {
+    uint64_t threshold = parser_config_.sketch_only_pkts_per_sec();
+    if (threshold == 0) {
+      return;
+    }
+
+    double pkts_per_sec = pkts_seen_running_avg_.average;
+    if (pkts_per_sec > threshold) {
+      sketch_only_ = true;
+    } else if (pkts_per_sec < threshold / 2.0) {
+      sketch_only_ = false;
+    }
+  }
+
   void CallPeriodicCallbacks() {
     if (next_second_start_ == 0) {
       next_second_start_ = last_rx_ + kMillion;
@@ -422,6 +1768,7 @@ class Parser {
 
     if (last_rx_ >= next_second_start_) {
       UpdateAverages();
+      UpdateSketchOnly();
       for (const auto& callback : parser_config_.periodic_callbacks()) {
         callback(*this);
       }
@@ -430,21 +1777,33 @@ class Parser {
     }
   }
 
+  // Flows time out up to this long (in microseconds) after their deadlines.
+  static constexpr uint64_t kTimeoutTick = kMillion / 100;
+
   // Configuration for the parser
   const ParserConfig parser_config_;
 
-  // Memory used in bytes
-  size_t mem_usage_;
+  // True if this parser is a shard of a ShardedParser.
+  const bool shard_;
+
+  // Flows and their fields are allocated from here. Declared before anything
+  // that holds flows, so that it is released after them. Flows that have been
+  // handed to the queue keep it alive until they are deleted.
+  std::unique_ptr<SlabPool, SlabPool::Releaser> pool_;
 
-  // A map to store flows.
-  FlowMap flows_table_;
+  // Memory allocated for the flows in flows_, in bytes.
+  size_t mem_usage_;
 
-  // A list of flows, in LRU order.
-  FlowList flows_;
+  // The flows, in LRU order.
+  FlowTable flows_;
 
   // When a flow is evicted it is added to this queue.
   std::shared_ptr<FlowQueue> queue_;
 
+  // Flows collected but not yet handed to the queue. Handed over before the
+  // lock is released, or if a packet throws half way, with the next one.
+  std::vector<std::unique_ptr<Flow>> collected_;
+
   // Timestamp of first packet reception.
   uint64_t first_rx_;
 
@@ -472,6 +1831,15 @@ class Parser {
   // Total number of packets seen that have the SYN bit set.
   uint64_t total_tcp_syn_or_fin_pkts_seen_;
 
+  // The number of TCP flows whose connection was seen to close.
+  uint64_t tcp_flows_closed_;
+
+  // The number of flows collected for each reason.
+  uint64_t flows_collected_mem_limit_;
+  uint64_t flows_collected_timeout_;
+  uint64_t flows_collected_tcp_close_;
+  uint64_t flows_collected_end_;
+
   // The number of times a new packet comes in and its flow is in memory.
   uint64_t flow_hits_;
 
@@ -479,40 +1847,249 @@ class Parser {
   // allocated for it.
   uint64_t flow_misses_;
 
+  // The number of micro-flows that have become flows.
+  uint64_t micro_flows_promoted_;
+  uint64_t pkts_sampled_out_;
+  uint64_t pkts_not_held_;
+  uint64_t pkts_sketch_only_;
+
+  // True if packets only update the sketches.
+  bool sketch_only_;
+
   // Only populated if the config requires it.
   std::unique_ptr<Undersampler> undersampler_;
+  std::unique_ptr<FlowSampler> flow_sampler_;
+  std::unique_ptr<SampleAndHold> sample_and_hold_;
+  std::unique_ptr<SpaceSaving> heavy_hitters_;
+  std::unique_ptr<Spreaders> spreaders_;
+  std::unique_ptr<TrafficSketch> traffic_sketch_;
+
+  // Distinct flows, sources and destinations of all packets.
+  HyperLogLog flows_sketch_;
+  HyperLogLog srcs_sketch_;
+  HyperLogLog dsts_sketch_;
+
+  // Timeouts of the flows, by their index in flows_. Only used if timeouts are
+  // enabled.
+  TimerWheel timers_;
+
+  // Only populated if micro-flows are enabled.
+  std::unique_ptr<MicroFlowTable> micro_flows_;
+
+  // Timeouts of the micro-flows, by their index in micro_flows_.
+  TimerWheel micro_timers_;
 
   // A mutex
   mutable std::mutex mu_;
 
   friend class ParserIterator;
   friend class ParserIteratorNoLock;
+  friend class ShardedParser;
 
   DISALLOW_COPY_AND_ASSIGN(Parser);
 };
 
+// A parser whose flows are split by key into shards, each one a Parser with
+// its own lock. Packets of flows in different shards are handled without
+// contending on a lock, so more than one capture or decode thread can feed the
+// same ShardedParser. Packets of the same flow should still arrive in timestamp
+// order, for example because packets are fanned out to threads by flow hash,
+// but packets of different flows may be slightly out of order. Each shard gets
+// an equal part of the soft memory limit, so that the limit holds for the
+// flows of all shards together. Periodic callbacks are not called, the info of
+// all shards can be polled with GetInfo instead.
+class ShardedParser {
+ public:
+  ShardedParser(const ParserConfig& parser_config, size_t num_shards,
+                std::shared_ptr<Parser::FlowQueue> queue)
+      : queue_(queue) {
+    if (num_shards == 0) {
+      throw std::logic_error("Need at least one shard");
+    }
+
+    ParserConfig shard_config = parser_config.Split(num_shards);
+    shard_config.clear_periodic_callbacks();
+    for (size_t i = 0; i < num_shards; ++i) {
+      shards_.push_back(
+          std::unique_ptr<Parser>(new Parser(shard_config, queue, true)));
+    }
+  }
+
+  void TCPIpRx(const IpHeader& ip_header, const pcap::SniffTcp& tcp_header,
+               uint64_t timestamp) {
+    ShardFor( { ip_header, tcp_header.th_sport, tcp_header.th_dport })
+        ->TCPIpRx(ip_header, tcp_header, timestamp);
+  }
+
+  void UDPIpRx(const IpHeader& ip_header, const pcap::SniffUdp& udp_header,
+               uint64_t timestamp) {
+    ShardFor( { ip_header, udp_header.uh_sport, udp_header.uh_dport })
+        ->UDPIpRx(ip_header, udp_header, timestamp);
+  }
+
+  void ICMPIpRx(const IpHeader& ip_header,
+                const pcap::SniffIcmp& icmp_header, uint64_t timestamp) {
+    ShardFor( { ip_header, 0, 0 })->ICMPIpRx(ip_header, icmp_header,
+                                             timestamp);
+  }
+
+  void UnknownIpRx(const IpHeader& ip_header, uint64_t timestamp) {
+    ShardFor( { ip_header, 0, 0 })->UnknownIpRx(ip_header, timestamp);
+  }
+
+  size_t num_shards() const {
+    return shards_.size();
+  }
+
+  const Parser& shard(size_t index) const {
+    return *shards_.at(index);
+  }
+
+  // Locks all shards, for example to iterate over their flows.
+  std::vector<std::unique_lock<std::mutex>> GetLocks() const {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (const auto& shard_ptr : shards_) {
+      locks.push_back(shard_ptr->GetLock());
+    }
+
+    return locks;
+  }
+
+  // Returns the info of all shards added together. Shards are locked one at a
+  // time, so the info is not a snapshot of all shards at the same instant.
+  ParserInfo GetInfo() const {
+    ParserInfo info;
+    for (const auto& shard_ptr : shards_) {
+      auto lock = shard_ptr->GetLock();
+      info.Add(shard_ptr->GetInfoNoLock());
+    }
+
+    return info;
+  }
+
+  // The heavy hitters of all shards merged.
+  HeavyHitters GetHeavyHitters(bool clear = false) const {
+    HeavyHitters heavy_hitters = shards_.front()->GetHeavyHitters(clear);
+    for (size_t i = 1; i < shards_.size(); ++i) {
+      heavy_hitters.Merge(shards_[i]->GetHeavyHitters(clear));
+    }
+
+    return heavy_hitters;
+  }
+
+  // The spread sketches of all shards merged.
+  Spreaders GetSpreaders(bool clear = false) const {
+    Spreaders spreaders = shards_.front()->GetSpreaders(clear);
+    for (size_t i = 1; i < shards_.size(); ++i) {
+      spreaders.Merge(shards_[i]->GetSpreaders(clear));
+    }
+
+    return spreaders;
+  }
+
+  // Switches all shards in or out of sketch-only mode.
+  void SetSketchOnly(bool sketch_only) {
+    for (const auto& shard_ptr : shards_) {
+      shard_ptr->SetSketchOnly(sketch_only);
+    }
+  }
+
+  // The traffic sketches of all shards merged.
+  TrafficSketch GetTrafficSketch(bool clear = false) const {
+    TrafficSketch traffic_sketch = shards_.front()->GetTrafficSketch(clear);
+    for (size_t i = 1; i < shards_.size(); ++i) {
+      traffic_sketch.Merge(shards_[i]->GetTrafficSketch(clear));
+    }
+
+    return traffic_sketch;
+  }
+
+  // Collects all flows and closes the queue.
+  void CollectAllFlows() {
+    FlushAllFlows();
+
+    if (queue_) {
+      queue_->Close();
+    }
+  }
+
+  // Collects all flows, but leaves the queue open.
+  void FlushAllFlows() {
+    for (const auto& shard_ptr : shards_) {
+      shard_ptr->FlushAllFlows();
+    }
+  }
+
+  // Collects the flows of all shards that have timed out by now.
+  void ExpireFlows(uint64_t now) {
+    for (const auto& shard_ptr : shards_) {
+      shard_ptr->ExpireFlows(now);
+    }
+  }
+
+ private:
+  // Both directions of a connection go to the same shard, so that the shard
+  // can tell when a TCP connection closes.
+  Parser* ShardFor(const FlowKey& key) const {
+    uint64_t hash = key.src() ^ key.dst();
+    hash = 37 * hash + (key.src_port() ^ key.dst_port());
+    hash = 37 * hash + key.protocol();
+    hash = 37 * hash + key.vlan();
+    hash = 37 * hash + key.vni();
+    hash *= 0x9e3779b97f4a7c15ULL;
+    return shards_[(hash >> 32) % shards_.size()].get();
+  }
+
+  std::vector<std::unique_ptr<Parser>> shards_;
+
+  // Shared by all shards.
+  std::shared_ptr<Parser::FlowQueue> queue_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShardedParser);
+};
+
+// Iterates over the flows of a parser, or over the flows of all shards of a
+// sharded parser one shard after the other. The parser, or all shards, should
+// be locked while iterating.
 class ParserIterator {
  public:
   ParserIterator(const Parser& parser)
-      : it_(parser.flows_table_.begin()),
-        end_it_(parser.flows_table_.end()) {
+      : tables_( { &parser.flows_ }),
+        next_table_(0) {
   }
 
-  const Flow* Next() {
-    if (it_ == end_it_) {
-      return nullptr;
+  ParserIterator(const ShardedParser& parser)
+      : next_table_(0) {
+    for (size_t i = 0; i < parser.num_shards(); ++i) {
+      tables_.push_back(&parser.shard(i).flows_);
     }
+  }
+
+  const Flow* Next() {
+    while (true) {
+      if (it_) {
+        const Flow* flow = it_->Next();
+        if (flow != nullptr) {
+          return flow;
+        }
+      }
 
-    return ((it_)++)->second->get();
+      if (next_table_ == tables_.size()) {
+        return nullptr;
+      }
+
+      it_ = std::make_unique<FlowTable::Iterator>(*tables_[next_table_++]);
+    }
   }
 
  private:
 
-  // Iterator into the flow table.
-  typename Parser::FlowMap::const_iterator it_;
+  // The flow tables to iterate over and the next one to start on.
+  std::vector<const FlowTable*> tables_;
+  size_t next_table_;
 
-  // The end of the flow table.
-  typename Parser::FlowMap::const_iterator end_it_;
+  // Iterator into the current flow table.
+  std::unique_ptr<FlowTable::Iterator> it_;
 
   DISALLOW_COPY_AND_ASSIGN(ParserIterator);
 };
@@ -1,7 +1,10 @@
 #include "gtest/gtest.h"
 #include "parser.h"
 
+#include <cstring>
 #include <map>
+#include <random>
+#include <set>
 #include <thread>
 
 #include "common_test.h"
@@ -28,6 +31,12 @@ class ParserTestFixtureBase : public ::testing::Test {
     return cfg;
   }
 
+  // Memory a parser with the given config takes before it sees any packets.
+  static uint64_t EmptyParserMemBytes(const ParserConfig& config) {
+    Parser parser(config, std::shared_ptr<Parser::FlowQueue>());
+    return parser.GetInfoNoLock().total_mem_bytes;
+  }
+
   ParserTestFixtureBase(uint64_t mem_limit)
       : queue_(std::make_shared<Parser::FlowQueue>()),
         pkt_gen_(1),
@@ -79,11 +88,12 @@ class NoMemParserTestFixture : public ParserTestFixtureBase {
   }
 };
 
-// A parser with memory limit set to 3/2 * sizeof(TCPFlow).
+// A parser with room for 3/2 * sizeof(Flow) on top of its empty tables.
 class LittleMemParserTestFixture : public ParserTestFixtureBase {
  protected:
   LittleMemParserTestFixture()
-      : ParserTestFixtureBase(sizeof(Flow) + sizeof(Flow) / 2) {
+      : ParserTestFixtureBase(EmptyParserMemBytes(GetConfig(0)) + sizeof(Flow)
+                              + sizeof(Flow) / 2) {
   }
 };
 
@@ -130,6 +140,120 @@ TEST_F(NoMemParserTestFixture, SinglePacket) {
   ASSERT_EQ(6, key.dst_port());
 }
 
+TEST_F(ParserTestFixture, FlushLeavesQueueOpen) {
+  parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 10);
+  parser_.FlushAllFlows();
+  ASSERT_EQ(1, queue_->size());
+
+  // The queue is still open, so another flow can be produced.
+  pcap_ip_hdr_.ip_src.s_addr = 10;
+  parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 910);
+  parser_.CollectAllFlows();
+  ASSERT_EQ(2, DrainQueue().size());
+}
+
+TEST_F(ParserTestFixture, AddInfo) {
+  parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 10);
+  parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 910);
+
+  ParserInfo info;
+  info.Add(parser_.GetInfoNoLock());
+  info.Add(parser_.GetInfoNoLock());
+
+  ASSERT_EQ(10, info.first_rx);
+  ASSERT_EQ(910, info.last_rx);
+  ASSERT_EQ(4, info.total_pkts_seen);
+  ASSERT_EQ(2, info.num_flows_in_mem);
+}
+
+TEST_F(ParserTestFixture, MergeFrom) {
+  Parser serial(parser_config_, nullptr);
+  Parser other(parser_config_, queue_);
+
+  parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 10);
+  serial.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 10);
+  other.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 910);
+  serial.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 910);
+
+  pcap_ip_hdr_.ip_src.s_addr = 10;
+  other.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 1000);
+  serial.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 1000);
+
+  parser_.MergeFrom(&other);
+
+  ParserInfo info = parser_.GetInfoNoLock();
+  ParserInfo serial_info = serial.GetInfoNoLock();
+  ASSERT_EQ(serial_info.first_rx, info.first_rx);
+  ASSERT_EQ(serial_info.last_rx, info.last_rx);
+  ASSERT_EQ(serial_info.total_pkts_seen, info.total_pkts_seen);
+  ASSERT_EQ(serial_info.flow_hits, info.flow_hits);
+  ASSERT_EQ(serial_info.flow_misses, info.flow_misses);
+  ASSERT_EQ(serial_info.mem_usage_bytes, info.mem_usage_bytes);
+  ASSERT_EQ(2, info.num_flows_in_mem);
+  ASSERT_EQ(0, other.GetInfoNoLock().num_flows_in_mem);
+  ASSERT_EQ(0, other.GetInfoNoLock().mem_usage_bytes);
+  ASSERT_EQ(0, other.GetInfoNoLock().total_pkts_seen);
+
+  parser_.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(2, flows.size());
+
+  // The least recently accessed flow is collected first.
+  ASSERT_EQ(2, flows[0]->pkts_seen());
+  ASSERT_EQ(10, flows[0]->first_rx());
+  ASSERT_EQ(910, flows[0]->last_rx());
+  ASSERT_EQ(1, flows[1]->pkts_seen());
+}
+
+TEST_F(ParserTestFixture, MergeFromEarlierFlow) {
+  Parser other(parser_config_, queue_);
+
+  parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 910);
+  other.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 10);
+
+  // The flows cannot be merged, the older one is collected.
+  parser_.MergeFrom(&other);
+  ASSERT_EQ(1, queue_->size());
+  ASSERT_EQ(1, parser_.GetInfoNoLock().num_flows_in_mem);
+
+  parser_.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(2, flows.size());
+  ASSERT_EQ(910, flows[0]->first_rx());
+  ASSERT_EQ(10, flows[1]->first_rx());
+}
+
+TEST_F(ParserTestFixture, MergeFromAcrossTimeout) {
+  parser_config_.set_inactive_timeout(kMillion);
+  Parser parser(parser_config_, queue_);
+  Parser other(parser_config_, queue_);
+  Parser serial(parser_config_, nullptr);
+
+  // The trace is split in the middle of an idle gap longer than the timeout.
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, kMillion);
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, kMillion + 100);
+  other.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 5 * kMillion);
+  serial.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, kMillion);
+  serial.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, kMillion + 100);
+  serial.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 5 * kMillion);
+
+  parser.MergeFrom(&other);
+  ParserInfo info = parser.GetInfoNoLock();
+  ParserInfo serial_info = serial.GetInfoNoLock();
+  ASSERT_EQ(1, info.flows_collected_timeout);
+  ASSERT_EQ(serial_info.flows_collected_timeout, info.flows_collected_timeout);
+  ASSERT_EQ(serial_info.flow_hits, info.flow_hits);
+  ASSERT_EQ(serial_info.flow_misses, info.flow_misses);
+  ASSERT_EQ(1, info.num_flows_in_mem);
+
+  parser.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(2, flows.size());
+  ASSERT_EQ(2, flows[0]->pkts_seen());
+  ASSERT_EQ(1, flows[1]->pkts_seen());
+  ASSERT_EQ(5 * kMillion, flows[1]->first_rx());
+}
+
 TEST_F(ParserTestFixture, TwoPacketsSameFlow) {
   parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 10);
   parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 910);
@@ -211,6 +335,1161 @@ TEST_F(ParserTestFixture, SameTime) {
   parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 10);
 }
 
+// Builds the IPv6 header of a TCP packet with 20 bytes of TCP header and no
+// payload.
+static pcap::SniffIp6 Ipv6TcpHeader(uint8_t src_last_byte,
+                                   uint8_t dst_last_byte) {
+  pcap::SniffIp6 ip6_header;
+  memset(&ip6_header, 0, sizeof(ip6_header));
+  ip6_header.ip6_vfc = 6 << 4;
+  ip6_header.ip6_plen = htons(20);
+  ip6_header.ip6_nxt = IPPROTO_TCP;
+  ip6_header.ip6_src.s6_addr[0] = 0x20;
+  ip6_header.ip6_src.s6_addr[15] = src_last_byte;
+  ip6_header.ip6_dst.s6_addr[0] = 0x20;
+  ip6_header.ip6_dst.s6_addr[15] = dst_last_byte;
+  return ip6_header;
+}
+
+TEST_F(ParserTestFixture, Ipv6SameFlow) {
+  pcap_tcp_hdr_.th_off = 5;
+
+  // The packets are in different buffers, the flow should not depend on the
+  // first one after it is gone.
+  std::unique_ptr<pcap::SniffIp6> first(
+      new pcap::SniffIp6(Ipv6TcpHeader(1, 2)));
+  parser_.TCPIpRx( { *first, IPPROTO_TCP, 40, 0, false }, pcap_tcp_hdr_, 10);
+  first.reset();
+
+  pcap::SniffIp6 second = Ipv6TcpHeader(1, 2);
+  parser_.TCPIpRx( { second, IPPROTO_TCP, 40, 0, false }, pcap_tcp_hdr_, 20);
+
+  parser_.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(1, flows.size());
+
+  const FlowKey& key = flows.at(0)->key();
+  ASSERT_TRUE(key.ipv6());
+  ASSERT_EQ("2000::1", key.SrcToString());
+  ASSERT_EQ("2000::2", key.DstToString());
+  ASSERT_EQ(2, flows.at(0)->GetInfo().pkts_seen);
+}
+
+TEST_F(ParserTestFixture, Ipv6DiffFlowSameFold) {
+  pcap_tcp_hdr_.th_off = 5;
+
+  // The addresses differ, but fold to the same 32 bits.
+  pcap::SniffIp6 first = Ipv6TcpHeader(1, 2);
+  pcap::SniffIp6 second = Ipv6TcpHeader(1, 2);
+  second.ip6_src.s6_addr[3] = 1;
+  second.ip6_src.s6_addr[7] = 1;
+  parser_.TCPIpRx( { first, IPPROTO_TCP, 40, 0, false }, pcap_tcp_hdr_, 10);
+  parser_.TCPIpRx( { second, IPPROTO_TCP, 40, 0, false }, pcap_tcp_hdr_, 20);
+
+  parser_.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(2, flows.size());
+  ASSERT_EQ(flows[0]->key().src(), flows[1]->key().src());
+  ASSERT_NE(flows[0]->key(), flows[1]->key());
+}
+
+TEST_F(ParserTestFixture, Ipv4AndIpv6DiffFlow) {
+  pcap_tcp_hdr_.th_off = 5;
+  pcap_ip_hdr_.ip_src.s_addr = 0;
+  pcap_ip_hdr_.ip_dst.s_addr = 0;
+  pcap_ip_hdr_.ip_hl = 5;
+  pcap_ip_hdr_.ip_len = htons(40);
+  pcap_ip_hdr_.ip_p = IPPROTO_TCP;
+  parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 10);
+
+  // Folds to 0 for both addresses.
+  pcap::SniffIp6 ip6_header = Ipv6TcpHeader(0, 0);
+  ip6_header.ip6_src.s6_addr[0] = 0;
+  ip6_header.ip6_dst.s6_addr[0] = 0;
+  parser_.TCPIpRx( { ip6_header, IPPROTO_TCP, 40, 0, false }, pcap_tcp_hdr_,
+                  20);
+
+  parser_.CollectAllFlows();
+  ASSERT_EQ(2, queue_->size());
+}
+
+TEST_F(ParserTestFixture, DiffFlowDiffSegment) {
+  IpHeader ip_header(pcap_ip_hdr_);
+  parser_.TCPIpRx(ip_header, pcap_tcp_hdr_, 10);
+
+  ip_header.segment.vlan = 5;
+  parser_.TCPIpRx(ip_header, pcap_tcp_hdr_, 20);
+
+  ip_header.segment.vni = 6;
+  parser_.TCPIpRx(ip_header, pcap_tcp_hdr_, 30);
+  parser_.TCPIpRx(ip_header, pcap_tcp_hdr_, 40);
+
+  parser_.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(3, flows.size());
+  ASSERT_EQ(
+      "(src='0.0.0.1', dst='0.0.0.2', src_port=5, dst_port=6, proto=0, vlan=5, "
+      "vni=6)",
+      flows[2]->key().ToString());
+  ASSERT_EQ(2, flows[2]->GetInfo().pkts_seen);
+}
+
+TEST_F(ParserTestFixture, InactiveTimeout) {
+  parser_config_.set_inactive_timeout(kMillion);
+  Parser parser(parser_config_, queue_);
+
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, kMillion);
+  pcap_ip_hdr_.ip_src.s_addr = 10;
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 1.5 * kMillion);
+  ASSERT_EQ(0, queue_->size());
+
+  // The first flow has been idle for more than a second.
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 2.1 * kMillion);
+  ASSERT_EQ(1, queue_->size());
+  ASSERT_EQ(1, parser.GetInfoNoLock().num_flows_in_mem);
+
+  // The second flow saw a packet since its timer was set, so it is still
+  // there a second after its first packet.
+  parser.ExpireFlows(2.6 * kMillion);
+  ASSERT_EQ(1, queue_->size());
+  parser.ExpireFlows(3.2 * kMillion);
+  ASSERT_EQ(2, queue_->size());
+  ASSERT_EQ(0, parser.GetInfoNoLock().num_flows_in_mem);
+  ASSERT_EQ(0, parser.GetInfoNoLock().mem_usage_bytes);
+
+  auto flows = DrainQueue();
+  ASSERT_EQ(1, flows[0]->pkts_seen());
+  ASSERT_EQ(2, flows[1]->pkts_seen());
+}
+
+TEST_F(ParserTestFixture, InactiveTimeoutNewFlow) {
+  parser_config_.set_inactive_timeout(kMillion);
+  Parser parser(parser_config_, queue_);
+
+  // After an idle gap the same key starts a new flow.
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, kMillion);
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 3 * kMillion);
+  ASSERT_EQ(1, queue_->size());
+
+  parser.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(2, flows.size());
+  ASSERT_EQ(kMillion, flows[0]->first_rx());
+  ASSERT_EQ(3 * kMillion, flows[1]->first_rx());
+}
+
+TEST_F(ParserTestFixture, ActiveTimeout) {
+  parser_config_.set_active_timeout(kMillion);
+  Parser parser(parser_config_, queue_);
+
+  // A packet every 100ms for 2.5 seconds is reported in 3 parts.
+  for (uint64_t time = kMillion; time < 3.5 * kMillion;
+      time += kMillion / 10) {
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+  }
+
+  parser.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(3, flows.size());
+  ASSERT_EQ(10, flows[0]->pkts_seen());
+  ASSERT_EQ(10, flows[1]->pkts_seen());
+  ASSERT_EQ(5, flows[2]->pkts_seen());
+  ASSERT_EQ(2 * kMillion, flows[1]->first_rx());
+}
+
+TEST_F(ParserTestFixture, CollectReasons) {
+  parser_config_.set_inactive_timeout(kMillion);
+  Parser parser(parser_config_, queue_);
+
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, kMillion);
+  pcap_ip_hdr_.ip_src.s_addr = 10;
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 2.5 * kMillion);
+  parser.CollectAllFlows();
+
+  ParserInfo info = parser.GetInfoNoLock();
+  ASSERT_EQ(0, info.flows_collected_mem_limit);
+  ASSERT_EQ(1, info.flows_collected_timeout);
+  ASSERT_EQ(0, info.flows_collected_tcp_close);
+  ASSERT_EQ(1, info.flows_collected_end);
+  ASSERT_EQ(2, DrainQueue().size());
+}
+
+TEST_F(ParserTestFixture, LowWatermark) {
+  // All flows have seen a single packet, so they are all the same size.
+  parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 1);
+  uint64_t flow_size = parser_.GetInfoNoLock().mem_usage_bytes;
+  uint64_t tables_size = EmptyParserMemBytes(parser_config_);
+
+  parser_config_.set_soft_mem_limit(tables_size + 10 * flow_size);
+  parser_config_.set_soft_mem_low_watermark(tables_size + 5 * flow_size);
+  Parser parser(parser_config_, queue_);
+  for (uint32_t src = 1; src <= 10; ++src) {
+    pcap_ip_hdr_.ip_src.s_addr = src;
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, src);
+  }
+
+  ASSERT_EQ(0, queue_->size());
+
+  // Going over the limit evicts down to the low watermark in one go, and the
+  // next few flows fit.
+  pcap_ip_hdr_.ip_src.s_addr = 11;
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 11);
+  ASSERT_EQ(6, queue_->size());
+  ASSERT_EQ(5, parser.GetInfoNoLock().num_flows_in_mem);
+
+  for (uint32_t src = 12; src <= 16; ++src) {
+    pcap_ip_hdr_.ip_src.s_addr = src;
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, src);
+  }
+
+  ASSERT_EQ(6, queue_->size());
+  ASSERT_EQ(10, parser.GetInfoNoLock().num_flows_in_mem);
+  ASSERT_EQ(6, parser.GetInfoNoLock().flows_collected_mem_limit);
+
+  // Least recently accessed go first.
+  auto flows = DrainQueue();
+  for (size_t i = 0; i < flows.size(); ++i) {
+    ASSERT_EQ(i + 1, flows[i]->first_rx());
+  }
+}
+
+TEST_F(ParserTestFixture, MemBreakdown) {
+  parser_config_.set_micro_flow_table_size(16);
+  parser_config_.set_inactive_timeout(kMillion);
+  Parser parser(parser_config_, queue_);
+
+  ParserInfo info = parser.GetInfoNoLock();
+  ASSERT_EQ(0, info.mem_usage_bytes);
+  ASSERT_LT(0, info.flow_table_mem_bytes);
+  ASSERT_LT(0, info.micro_flow_table_mem_bytes);
+  ASSERT_EQ(info.flow_table_mem_bytes + info.micro_flow_table_mem_bytes
+                + info.timers_mem_bytes, info.total_mem_bytes);
+
+  for (uint32_t src = 0; src < 100; ++src) {
+    pcap_ip_hdr_.ip_src.s_addr = src;
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, src);
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, src);
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, src);
+  }
+
+  // The flows are counted exactly, down to the blocks their fields are in.
+  info = parser.GetInfoNoLock();
+  ASSERT_EQ(100, info.num_flows_in_mem);
+  ASSERT_LT(0, info.timers_mem_bytes);
+  ASSERT_EQ(info.mem_usage_bytes + info.flow_table_mem_bytes
+                + info.micro_flow_table_mem_bytes + info.timers_mem_bytes,
+            info.total_mem_bytes);
+  ASSERT_EQ(info.mem_usage_bytes, info.slab_bytes_in_use);
+
+  // Tables keep their memory once the flows are gone.
+  parser.CollectAllFlows();
+  ParserInfo empty_info = parser.GetInfoNoLock();
+  ASSERT_EQ(0, empty_info.mem_usage_bytes);
+  ASSERT_EQ(info.total_mem_bytes - info.mem_usage_bytes,
+            empty_info.total_mem_bytes);
+  DrainQueue();
+}
+
+TEST_F(ParserTestFixture, SlabPool) {
+  for (uint32_t src = 0; src < 100; ++src) {
+    pcap_ip_hdr_.ip_src.s_addr = src;
+    parser_.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, src);
+  }
+
+  ParserInfo info = parser_.GetInfoNoLock();
+  ASSERT_LE(info.mem_usage_bytes, info.slab_bytes_in_use);
+  ASSERT_LE(info.slab_bytes_in_use, info.slab_bytes_reserved);
+
+  // Collected flows are counted until the consumer lets go of them.
+  parser_.CollectAllFlows();
+  ASSERT_EQ(info.slab_bytes_in_use, parser_.GetInfoNoLock().slab_bytes_in_use);
+  DrainQueue();
+  ASSERT_EQ(0, parser_.GetInfoNoLock().slab_bytes_in_use);
+  ASSERT_EQ(info.slab_bytes_reserved,
+            parser_.GetInfoNoLock().slab_bytes_reserved);
+}
+
+TEST_F(ParserTestFixture, FlowSamplerHash) {
+  pcap::SniffIp reverse_ip_hdr = pkt_gen_.GenerateIpHeader(2, 1);
+  FlowKey key(pcap_ip_hdr_, pcap_tcp_hdr_.th_sport, pcap_tcp_hdr_.th_dport);
+  FlowKey reverse_key(reverse_ip_hdr, pcap_tcp_hdr_.th_dport,
+                      pcap_tcp_hdr_.th_sport);
+  FlowKey other_key(pcap_ip_hdr_, pcap_tcp_hdr_.th_dport,
+                    pcap_tcp_hdr_.th_sport);
+
+  ASSERT_EQ(FlowSampler::Hash(key, 1), FlowSampler::Hash(reverse_key, 1));
+  ASSERT_NE(FlowSampler::Hash(key, 1), FlowSampler::Hash(key, 2));
+  ASSERT_NE(FlowSampler::Hash(key, 1), FlowSampler::Hash(other_key, 1));
+
+  ASSERT_THROW(FlowSampler(0, 1), std::logic_error);
+  ASSERT_THROW(FlowSampler(1.5, 1), std::logic_error);
+  ASSERT_TRUE(FlowSampler(1, 1).Keep(key));
+
+  parser_config_.set_undersample_skip_count(10);
+  parser_config_.set_flow_sample_rate(0.5);
+  ASSERT_THROW(Parser(parser_config_, queue_), std::logic_error);
+}
+
+TEST_F(ParserTestFixture, FlowSampling) {
+  parser_config_.set_flow_sample_rate(0.25);
+  parser_config_.set_flow_sample_key(42);
+  Parser parser(parser_config_, queue_);
+
+  // 400 connections, each with 3 packets in each direction.
+  pcap::SniffIp reverse_ip_hdr = pkt_gen_.GenerateIpHeader(2, 1);
+  pcap::SniffTcp reverse_tcp_hdr = pkt_gen_.GenerateTCPHeader(6, 5);
+  for (uint32_t src = 0; src < 400; ++src) {
+    pcap_ip_hdr_.ip_src.s_addr = htonl(src + 10);
+    reverse_ip_hdr.ip_dst.s_addr = htonl(src + 10);
+    for (uint64_t i = 0; i < 3; ++i) {
+      parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, src * 10 + i);
+      parser.TCPIpRx(reverse_ip_hdr, reverse_tcp_hdr, src * 10 + i);
+    }
+  }
+
+  ParserInfo info = parser.GetInfoNoLock();
+  ASSERT_EQ(2400, info.total_pkts_seen + info.pkts_sampled_out);
+  ASSERT_LT(120, info.num_flows_in_mem);
+  ASSERT_GT(280, info.num_flows_in_mem);
+  ASSERT_EQ(info.num_flows_in_mem / 0.25,
+            parser.GetOriginalNumFlowsEstimate(1));
+
+  // Both directions of a connection are kept, with all their packets.
+  parser.CollectAllFlows();
+  std::set<uint32_t> client_srcs;
+  std::set<uint32_t> server_dsts;
+  for (const auto& flow : DrainQueue()) {
+    ASSERT_EQ(3, flow->pkts_seen());
+    if (flow->key().src_port() == 5) {
+      client_srcs.insert(flow->key().src());
+    } else {
+      server_dsts.insert(flow->key().dst());
+    }
+  }
+
+  ASSERT_EQ(client_srcs, server_dsts);
+  ASSERT_EQ(info.num_flows_in_mem, 2 * client_srcs.size());
+
+  // Another parser with the same key keeps the same flows.
+  auto other_queue = std::make_shared<Parser::FlowQueue>();
+  Parser other(parser_config_, other_queue);
+  for (uint32_t src = 0; src < 400; ++src) {
+    pcap_ip_hdr_.ip_src.s_addr = htonl(src + 10);
+    other.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, src);
+  }
+
+  other.CollectAllFlows();
+  std::set<uint32_t> other_srcs;
+  while (std::unique_ptr<Flow> flow = other_queue->ConsumeOrBlock()) {
+    other_srcs.insert(flow->key().src());
+  }
+
+  ASSERT_EQ(client_srcs, other_srcs);
+}
+
+TEST_F(ParserTestFixture, SampleAndHold) {
+  parser_config_.set_sample_and_hold_bytes(10000);
+  Parser parser(parser_config_, queue_);
+
+  // A large flow of 1000 1000 byte packets, and 500 small flows of a single
+  // 100 byte packet each.
+  pcap::SniffIp small_ip_hdr = pcap_ip_hdr_;
+  small_ip_hdr.ip_len = htons(100);
+  pcap_ip_hdr_.ip_len = htons(1000);
+  for (uint32_t i = 0; i < 1000; ++i) {
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 2 * i);
+    if (i % 2 == 0) {
+      small_ip_hdr.ip_src.s_addr = htonl(i + 10);
+      parser.TCPIpRx(small_ip_hdr, pcap_tcp_hdr_, 2 * i + 1);
+    }
+  }
+
+  ParserInfo info = parser.GetInfoNoLock();
+  ASSERT_EQ(1500, info.total_pkts_seen + info.pkts_not_held);
+  ASSERT_GT(30, info.num_flows_in_mem);
+
+  parser.CollectAllFlows();
+  bool large_flow_seen = false;
+  for (const auto& flow : DrainQueue()) {
+    ASSERT_EQ(10000, flow->GetInfo().estimated_ip_len_missed);
+    if (flow->key().src() == 1) {
+      // Caught within the first few packets.
+      large_flow_seen = true;
+      ASSERT_LT(950, flow->pkts_seen());
+    } else {
+      ASSERT_EQ(1, flow->pkts_seen());
+    }
+  }
+
+  ASSERT_TRUE(large_flow_seen);
+
+  // Flows made from micro-flows get the estimate too.
+  parser_config_.set_micro_flow_table_size(16);
+  auto micro_queue = std::make_shared<Parser::FlowQueue>();
+  Parser micro_parser(parser_config_, micro_queue);
+  for (uint32_t i = 0; i < 100; ++i) {
+    micro_parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, i);
+  }
+
+  micro_parser.CollectAllFlows();
+  std::unique_ptr<Flow> flow = micro_queue->ConsumeOrBlock();
+  ASSERT_EQ(10000, flow->GetInfo().estimated_ip_len_missed);
+  ASSERT_EQ(nullptr, micro_queue->ConsumeOrBlock());
+
+  parser_config_.set_undersample_skip_count(10);
+  ASSERT_THROW(Parser(parser_config_, queue_), std::logic_error);
+}
+
+TEST_F(ParserTestFixture, HeavyHitters) {
+  ASSERT_THROW(parser_.GetHeavyHitters(), std::logic_error);
+
+  parser_config_.set_heavy_hitters_size(10);
+  parser_config_.set_soft_mem_limit(0);
+  Parser parser(parser_config_, queue_);
+
+  // Flow src gets src packets. No flows are kept in memory, but all are
+  // counted.
+  pcap_ip_hdr_.ip_len = htons(100);
+  uint64_t time = 0;
+  for (uint32_t src = 1; src <= 20; ++src) {
+    pcap_ip_hdr_.ip_src.s_addr = htonl(src);
+    for (uint32_t i = 0; i < src; ++i) {
+      parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, ++time);
+    }
+  }
+
+  ASSERT_EQ(0, parser.GetInfoNoLock().num_flows_in_mem);
+  ASSERT_LT(0, parser.GetInfoNoLock().heavy_hitters_mem_bytes);
+
+  HeavyHitters heavy_hitters = parser.GetHeavyHitters(true);
+  ASSERT_EQ(210 * 100, heavy_hitters.total_bytes());
+  std::vector<HeavyHitter> top = heavy_hitters.Top(3);
+  ASSERT_EQ(3, top.size());
+  ASSERT_EQ(20, top[0].key.src());
+  ASSERT_EQ(19, top[1].key.src());
+  ASSERT_EQ(18, top[2].key.src());
+  ASSERT_GE(heavy_hitters.total_bytes() / 10, top[0].error);
+
+  // Cleared.
+  ASSERT_EQ(0, parser.GetHeavyHitters().total_bytes());
+
+  // Merged with the parser's flows.
+  Parser other(parser_config_, queue_);
+  other.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, ++time);
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, ++time);
+  parser.MergeFrom(&other);
+  ASSERT_EQ(200, parser.GetHeavyHitters().Top(1)[0].bytes);
+  ASSERT_EQ(0, other.GetHeavyHitters().total_bytes());
+  DrainQueue();
+}
+
+TEST_F(ParserTestFixture, ShardedHeavyHitters) {
+  parser_config_.set_heavy_hitters_size(10);
+  ShardedParser sharded(parser_config_, 4, queue_);
+
+  pcap_ip_hdr_.ip_len = htons(100);
+  uint64_t time = 0;
+  for (uint32_t src = 1; src <= 20; ++src) {
+    pcap_ip_hdr_.ip_src.s_addr = htonl(src);
+    for (uint32_t i = 0; i < src; ++i) {
+      sharded.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, ++time);
+    }
+  }
+
+  HeavyHitters heavy_hitters = sharded.GetHeavyHitters();
+  ASSERT_EQ(210 * 100, heavy_hitters.total_bytes());
+  ASSERT_EQ(20, heavy_hitters.Top(1)[0].key.src());
+  ASSERT_LE(2000, heavy_hitters.Top(1)[0].bytes);
+}
+
+TEST_F(ParserTestFixture, Cardinality) {
+  ASSERT_EQ(0, parser_.GetInfoNoLock().distinct_flows);
+
+  // Undersampled packets count too.
+  parser_config_.set_cardinality_precision(12);
+  parser_config_.set_undersample_skip_count(10);
+  Parser parser(parser_config_, queue_);
+  ShardedParser sharded(parser_config_, 4, queue_);
+  uint64_t time = 0;
+  for (uint32_t src = 0; src < 500; ++src) {
+    pcap_ip_hdr_.ip_src.s_addr = htonl(src + 10);
+    for (uint16_t port = 1; port <= 2; ++port) {
+      pcap_tcp_hdr_.th_dport = htons(port);
+      parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, ++time);
+      sharded.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+    }
+  }
+
+  ParserInfo info = parser.GetInfoNoLock();
+  ASSERT_GT(200, info.num_flows_in_mem);
+  ASSERT_NEAR(1000, info.distinct_flows, 20);
+  ASSERT_NEAR(500, info.distinct_srcs, 10);
+  ASSERT_EQ(1, info.distinct_dsts);
+  ASSERT_EQ(info.distinct_flows, parser.GetOriginalNumFlowsEstimate(10));
+  ASSERT_LT(0, info.cardinality_mem_bytes);
+
+  // Shards see different flows, their sketches are merged.
+  ParserInfo sharded_info = sharded.GetInfo();
+  ASSERT_EQ(info.distinct_flows, sharded_info.distinct_flows);
+  ASSERT_EQ(info.distinct_srcs, sharded_info.distinct_srcs);
+  ASSERT_EQ(1, sharded_info.distinct_dsts);
+
+  // Adding the same info again does not count its flows twice.
+  sharded_info.Add(info);
+  ASSERT_EQ(info.distinct_flows, sharded_info.distinct_flows);
+
+  Parser other(parser_config_, queue_);
+  pcap_ip_hdr_.ip_src.s_addr = htonl(1000);
+  other.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, ++time);
+  parser.MergeFrom(&other);
+  ASSERT_NEAR(501, parser.GetInfoNoLock().distinct_srcs, 10);
+  ASSERT_EQ(0, other.GetInfoNoLock().distinct_srcs);
+
+  parser.FlushAllFlows();
+  sharded.CollectAllFlows();
+  DrainQueue();
+}
+
+TEST_F(ParserTestFixture, Spreaders) {
+  ASSERT_THROW(parser_.GetSpreaders(), std::logic_error);
+
+  // Packets flow sampling drops count too.
+  parser_config_.set_spread_sketch_width(64);
+  parser_config_.set_flow_sample_rate(0.01);
+  Parser parser(parser_config_, queue_);
+  ShardedParser sharded(parser_config_, 4, queue_);
+
+  // Source 1 scans 300 destinations, 600 sources hit destination 2.
+  auto rx = [&](uint32_t src, uint32_t dst, uint64_t time) {
+    pcap_ip_hdr_.ip_src.s_addr = htonl(src);
+    pcap_ip_hdr_.ip_dst.s_addr = htonl(dst);
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+    sharded.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+  };
+
+  uint64_t time = 0;
+  for (uint32_t dst = 100; dst < 400; ++dst) {
+    rx(1, dst, ++time);
+  }
+
+  for (uint32_t src = 1000; src < 1600; ++src) {
+    rx(src, 2, ++time);
+  }
+
+  ParserInfo info = parser.GetInfoNoLock();
+  ASSERT_GT(50, info.num_flows_in_mem);
+  ASSERT_LT(0, info.spreaders_mem_bytes);
+
+  SpreadInfo spread_info = parser.GetSpreaders().Top(1);
+  ASSERT_EQ(1, spread_info.superspreaders.size());
+  ASSERT_EQ(1, spread_info.superspreaders[0].host);
+  ASSERT_NEAR(300, spread_info.superspreaders[0].distinct, 60);
+  ASSERT_EQ(1, spread_info.fan_in.size());
+  ASSERT_EQ(2, spread_info.fan_in[0].host);
+  ASSERT_NEAR(600, spread_info.fan_in[0].distinct, 120);
+
+  // Shards see different flows, their sketches are merged.
+  SpreadInfo sharded_info = sharded.GetSpreaders().Top(1);
+  ASSERT_EQ(1, sharded_info.superspreaders[0].host);
+  ASSERT_EQ(spread_info.superspreaders[0].distinct,
+            sharded_info.superspreaders[0].distinct);
+  ASSERT_EQ(2, sharded_info.fan_in[0].host);
+  ASSERT_EQ(spread_info.fan_in[0].distinct, sharded_info.fan_in[0].distinct);
+
+  // Cleared, then merged with another parser's.
+  ASSERT_EQ(1, parser.GetSpreaders(true).Top(1).superspreaders.size());
+  ASSERT_TRUE(parser.GetSpreaders().Top(1).superspreaders.empty());
+  Parser other(parser_config_, queue_);
+  pcap_ip_hdr_.ip_src.s_addr = htonl(3);
+  other.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, ++time);
+  parser.MergeFrom(&other);
+  ASSERT_EQ(3, parser.GetSpreaders().Top(1).superspreaders[0].host);
+  ASSERT_TRUE(other.GetSpreaders().Top(1).superspreaders.empty());
+
+  parser.FlushAllFlows();
+  sharded.CollectAllFlows();
+  DrainQueue();
+}
+
+TEST_F(ParserTestFixture, SketchOnly) {
+  ASSERT_THROW(parser_.SetSketchOnly(true), std::logic_error);
+  ASSERT_THROW(parser_.GetTrafficSketch(), std::logic_error);
+  parser_config_.set_sketch_only_pkts_per_sec(1000);
+  ASSERT_THROW(Parser(parser_config_, queue_), std::logic_error);
+
+  parser_config_.set_sketch_only_pkts_per_sec(0);
+  parser_config_.set_traffic_sketch_width(1000);
+  parser_config_.set_cardinality_precision(12);
+  Parser parser(parser_config_, queue_);
+  ShardedParser sharded(parser_config_, 4, queue_);
+  parser.SetSketchOnly(true);
+  sharded.SetSketchOnly(true);
+  ASSERT_TRUE(parser.sketch_only());
+
+  // No flows, but all packets are counted.
+  pcap_ip_hdr_.ip_p = IPPROTO_TCP;
+  pcap_ip_hdr_.ip_len = htons(100);
+  uint64_t time = 0;
+  for (uint32_t src = 1; src <= 100; ++src) {
+    pcap_ip_hdr_.ip_src.s_addr = htonl(src);
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, ++time);
+    sharded.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+  }
+
+  ParserInfo info = parser.GetInfoNoLock();
+  ASSERT_TRUE(info.sketch_only);
+  ASSERT_EQ(0, info.num_flows_in_mem);
+  ASSERT_EQ(100, info.total_pkts_seen);
+  ASSERT_EQ(100, info.pkts_sketch_only);
+  ASSERT_NEAR(100, info.distinct_flows, 2);
+  ASSERT_LT(0, info.traffic_sketch_mem_bytes);
+
+  TrafficSketch traffic_sketch = parser.GetTrafficSketch(true);
+  ASSERT_EQ(100, traffic_sketch.total().pkts);
+  ASSERT_EQ(100 * 100, traffic_sketch.protocol(IPPROTO_TCP).bytes);
+  ASSERT_EQ(100, traffic_sketch.tcp_port(6).pkts);
+  ASSERT_EQ(1, traffic_sketch.EstimateFlow(FlowKey(
+      IpHeader(pcap_ip_hdr_), pcap_tcp_hdr_.th_sport,
+      pcap_tcp_hdr_.th_dport)).pkts);
+  ASSERT_EQ(0, parser.GetTrafficSketch().total().pkts);
+
+  TrafficSketch sharded_sketch = sharded.GetTrafficSketch();
+  ASSERT_EQ(100, sharded_sketch.total().pkts);
+  ASSERT_EQ(0, sharded.GetInfo().num_flows_in_mem);
+
+  // Back to tracking flows.
+  parser.SetSketchOnly(false);
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, ++time);
+  ASSERT_FALSE(parser.GetInfoNoLock().sketch_only);
+  ASSERT_EQ(1, parser.GetInfoNoLock().num_flows_in_mem);
+  ASSERT_EQ(0, parser.GetTrafficSketch().total().pkts);
+
+  parser.FlushAllFlows();
+  sharded.CollectAllFlows();
+  DrainQueue();
+}
+
+TEST_F(ParserTestFixture, SketchOnlyAboveRate) {
+  parser_config_.set_traffic_sketch_width(1000);
+  parser_config_.set_sketch_only_pkts_per_sec(1000);
+  Parser parser(parser_config_, queue_);
+
+  // 2000 packets a second, of a single flow.
+  uint64_t time = 0;
+  for (size_t i = 0; i < 4000; ++i) {
+    time += kMillion / 2000;
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+  }
+
+  ParserInfo info = parser.GetInfoNoLock();
+  ASSERT_TRUE(info.sketch_only);
+  ASSERT_EQ(1, info.num_flows_in_mem);
+  ASSERT_LT(0, info.pkts_sketch_only);
+  ASSERT_GT(4000, info.pkts_sketch_only);
+
+  // Still in it at 600 packets a second, out of it at 100.
+  for (size_t i = 0; i < 3000; ++i) {
+    time += kMillion / 600;
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+  }
+
+  ASSERT_TRUE(parser.sketch_only());
+  for (size_t i = 0; i < 300; ++i) {
+    time += kMillion / 100;
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+  }
+
+  ASSERT_FALSE(parser.sketch_only());
+  info = parser.GetInfoNoLock();
+  ASSERT_EQ(7300, info.total_pkts_seen);
+  ASSERT_EQ(info.pkts_sketch_only, parser.GetTrafficSketch().total().pkts);
+
+  parser.CollectAllFlows();
+  std::unique_ptr<Flow> flow = queue_->ConsumeOrBlock();
+  ASSERT_EQ(7300 - info.pkts_sketch_only, flow->GetInfo().pkts_seen);
+  DrainQueue();
+}
+
+// A parser that collects closed TCP flows, and a client (1:5) and a server
+// (2:6) that send packets to each other.
+class TcpCloseParserTestFixture : public ParserTestFixture {
+ protected:
+  TcpCloseParserTestFixture()
+      : server_ip_hdr_(pkt_gen_.GenerateIpHeader(2, 1)),
+        server_tcp_hdr_(pkt_gen_.GenerateTCPHeader(6, 5)) {
+    parser_config_.set_collect_closed_tcp_flows(true);
+  }
+
+  void ClientRx(Parser* parser, uint8_t flags, uint64_t timestamp) {
+    pcap_tcp_hdr_.th_flags = flags;
+    parser->TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, timestamp);
+  }
+
+  void ServerRx(Parser* parser, uint8_t flags, uint64_t timestamp) {
+    server_tcp_hdr_.th_flags = flags;
+    parser->TCPIpRx(server_ip_hdr_, server_tcp_hdr_, timestamp);
+  }
+
+  pcap::SniffIp server_ip_hdr_;
+  pcap::SniffTcp server_tcp_hdr_;
+};
+
+TEST_F(TcpCloseParserTestFixture, Fin) {
+  parser_config_.set_tcp_linger(0);
+  Parser parser(parser_config_, queue_);
+
+  ClientRx(&parser, TH_SYN, 1000);
+  ServerRx(&parser, TH_SYN | TH_ACK, 2000);
+  ClientRx(&parser, TH_ACK, 3000);
+  ClientRx(&parser, TH_FIN | TH_ACK, 4000);
+  ASSERT_EQ(0, queue_->size());
+
+  // Both directions are collected once both have sent a FIN.
+  ServerRx(&parser, TH_FIN | TH_ACK, 5000);
+  ASSERT_EQ(2, queue_->size());
+  ASSERT_EQ(0, parser.GetInfoNoLock().num_flows_in_mem);
+  ASSERT_EQ(0, parser.GetInfoNoLock().mem_usage_bytes);
+  ASSERT_EQ(2, parser.GetInfoNoLock().tcp_flows_closed);
+  ASSERT_EQ(2, parser.GetInfoNoLock().flows_collected_tcp_close);
+
+  // The flow that saw the last FIN goes first.
+  auto flows = DrainQueue();
+  ASSERT_EQ(2, flows[0]->pkts_seen());
+  ASSERT_EQ(3, flows[1]->pkts_seen());
+  ASSERT_EQ(TCP_CLOSED, flows[0]->tcp_state());
+  ASSERT_EQ(TCP_CLOSED, flows[1]->tcp_state());
+}
+
+TEST_F(TcpCloseParserTestFixture, Rst) {
+  parser_config_.set_tcp_linger(0);
+  Parser parser(parser_config_, queue_);
+
+  ClientRx(&parser, TH_SYN, 1000);
+  ServerRx(&parser, TH_RST | TH_ACK, 2000);
+  ASSERT_EQ(2, queue_->size());
+
+  // An RST with no flow in the other direction.
+  pcap_ip_hdr_.ip_src.s_addr = 10;
+  ClientRx(&parser, TH_RST, 3000);
+  ASSERT_EQ(3, queue_->size());
+}
+
+TEST_F(TcpCloseParserTestFixture, Linger) {
+  Parser parser(parser_config_, queue_);
+
+  ClientRx(&parser, TH_SYN, 1000);
+  ServerRx(&parser, TH_SYN | TH_ACK, 2000);
+  ClientRx(&parser, TH_FIN | TH_ACK, 3000);
+  ServerRx(&parser, TH_FIN | TH_ACK, 4000);
+
+  // The last ACK still counts towards the client's flow.
+  ClientRx(&parser, TH_ACK, 5000);
+  parser.ExpireFlows(kMillion);
+  ASSERT_EQ(0, queue_->size());
+
+  parser.ExpireFlows(kMillion + 10000);
+  ASSERT_EQ(2, queue_->size());
+
+  auto flows = DrainQueue();
+  ASSERT_EQ(2, flows[0]->pkts_seen());
+  ASSERT_EQ(3, flows[1]->pkts_seen());
+}
+
+TEST_F(TcpCloseParserTestFixture, RetransmitWhileLingering) {
+  Parser parser(parser_config_, queue_);
+
+  ClientRx(&parser, TH_SYN, 1000);
+  ServerRx(&parser, TH_SYN | TH_ACK, 2000);
+  ClientRx(&parser, TH_FIN | TH_ACK, 3000);
+  ServerRx(&parser, TH_FIN | TH_ACK, 4000);
+  ASSERT_EQ(2, parser.GetInfoNoLock().tcp_flows_closed);
+
+  // FINs and an RST sent again while the flows linger are not new closes.
+  ServerRx(&parser, TH_FIN | TH_ACK, 5000);
+  ClientRx(&parser, TH_FIN | TH_ACK, 6000);
+  ClientRx(&parser, TH_RST, 7000);
+  ASSERT_EQ(2, parser.GetInfoNoLock().tcp_flows_closed);
+
+  parser.ExpireFlows(kMillion + 10000);
+  ASSERT_EQ(2, queue_->size());
+  ASSERT_EQ(2, parser.GetInfoNoLock().flows_collected_tcp_close);
+
+  auto flows = DrainQueue();
+  ASSERT_EQ(7, flows[0]->pkts_seen() + flows[1]->pkts_seen());
+}
+
+TEST_F(TcpCloseParserTestFixture, PortReused) {
+  Parser parser(parser_config_, queue_);
+
+  ClientRx(&parser, TH_SYN, 1000);
+  ServerRx(&parser, TH_RST | TH_ACK, 2000);
+  ASSERT_EQ(0, queue_->size());
+
+  // A new connection from the same port does not join the lingering flow.
+  ClientRx(&parser, TH_SYN, 3000);
+  ASSERT_EQ(1, queue_->size());
+  ASSERT_EQ(2, parser.GetInfoNoLock().num_flows_in_mem);
+
+  parser.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(3, flows.size());
+  ASSERT_EQ(1000, flows[0]->first_rx());
+  ASSERT_EQ(TCP_CLOSED, flows[0]->tcp_state());
+  ASSERT_EQ(3000, flows.back()->first_rx());
+  ASSERT_EQ(TCP_SYN, flows.back()->tcp_state());
+}
+
+TEST_F(TcpCloseParserTestFixture, MergePortReused) {
+  Parser parser(parser_config_, queue_);
+  Parser other(parser_config_, queue_);
+
+  // The new connection is in the next part of the trace.
+  ClientRx(&parser, TH_SYN, 1000);
+  ServerRx(&parser, TH_RST | TH_ACK, 2000);
+  ClientRx(&other, TH_SYN, 3000);
+  parser.MergeFrom(&other);
+  ASSERT_EQ(1, queue_->size());
+  ASSERT_EQ(1, parser.GetInfoNoLock().flows_collected_tcp_close);
+  ASSERT_EQ(2, parser.GetInfoNoLock().num_flows_in_mem);
+
+  parser.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(3, flows.size());
+  ASSERT_EQ(1000, flows[0]->first_rx());
+  ASSERT_EQ(TCP_CLOSED, flows[0]->tcp_state());
+  ASSERT_EQ(3000, flows.back()->first_rx());
+  ASSERT_EQ(TCP_SYN, flows.back()->tcp_state());
+}
+
+TEST_F(TcpCloseParserTestFixture, MergeAfterLinger) {
+  Parser parser(parser_config_, queue_);
+  Parser other(parser_config_, queue_);
+
+  // A late ACK comes after the closed flows have lingered.
+  ClientRx(&parser, TH_SYN, 1000);
+  ServerRx(&parser, TH_RST | TH_ACK, 2000);
+  ClientRx(&other, TH_ACK, 2 * kMillion);
+  parser.MergeFrom(&other);
+  ASSERT_EQ(2, queue_->size());
+  ASSERT_EQ(2, parser.GetInfoNoLock().flows_collected_tcp_close);
+  ASSERT_EQ(1, parser.GetInfoNoLock().num_flows_in_mem);
+
+  parser.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(3, flows.size());
+  ASSERT_EQ(2 * kMillion, flows.back()->first_rx());
+  ASSERT_EQ(1, flows.back()->pkts_seen());
+}
+
+TEST_F(TcpCloseParserTestFixture, MicroFlows) {
+  parser_config_.set_tcp_linger(0);
+  parser_config_.set_micro_flow_table_size(1024);
+  Parser parser(parser_config_, queue_);
+
+  // The RST closes the SYN's micro-flow too.
+  ClientRx(&parser, TH_SYN, 1000);
+  ServerRx(&parser, TH_RST | TH_ACK, 2000);
+  ASSERT_EQ(2, queue_->size());
+  ASSERT_EQ(2, parser.GetInfoNoLock().tcp_flows_closed);
+  ASSERT_EQ(0, parser.GetInfoNoLock().num_flows_in_mem);
+  ASSERT_EQ(0, parser.GetInfoNoLock().micro_flows_in_mem);
+
+  ClientRx(&parser, TH_SYN, 3000);
+  parser.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(3, flows.size());
+  ASSERT_EQ(3000, flows.back()->first_rx());
+}
+
+TEST_F(TcpCloseParserTestFixture, MicroFlowsPortReused) {
+  parser_config_.set_micro_flow_table_size(1024);
+  Parser parser(parser_config_, queue_);
+
+  ClientRx(&parser, TH_SYN, 1000);
+  ServerRx(&parser, TH_RST | TH_ACK, 2000);
+  ASSERT_EQ(0, queue_->size());
+
+  // A new connection from the same port does not join the lingering flow.
+  ClientRx(&parser, TH_SYN, 3000);
+  ASSERT_EQ(1, queue_->size());
+
+  parser.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(3, flows.size());
+  ASSERT_EQ(1000, flows[0]->first_rx());
+  ASSERT_EQ(TCP_CLOSED, flows[0]->tcp_state());
+}
+
+TEST_F(TcpCloseParserTestFixture, Sharded) {
+  parser_config_.set_tcp_linger(0);
+  ShardedParser sharded(parser_config_, 4, queue_);
+
+  // Both directions of each connection end up in the same shard.
+  for (uint16_t port = 1; port <= 100; ++port) {
+    pcap_tcp_hdr_.th_sport = htons(port);
+    server_tcp_hdr_.th_dport = htons(port);
+    pcap_tcp_hdr_.th_flags = TH_FIN;
+    server_tcp_hdr_.th_flags = TH_FIN;
+    sharded.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, port);
+    sharded.TCPIpRx(server_ip_hdr_, server_tcp_hdr_, port);
+  }
+
+  ASSERT_EQ(200, queue_->size());
+  ASSERT_EQ(200, sharded.GetInfo().tcp_flows_closed);
+}
+
+TEST_F(TcpCloseParserTestFixture, Off) {
+  parser_config_.set_collect_closed_tcp_flows(false);
+  Parser parser(parser_config_, queue_);
+
+  ClientRx(&parser, TH_FIN, 1000);
+  ServerRx(&parser, TH_FIN, 2000);
+  ASSERT_EQ(0, queue_->size());
+  ASSERT_EQ(0, parser.GetInfoNoLock().tcp_flows_closed);
+}
+
+TEST_F(ParserTestFixture, MicroFlowsSameAsFlows) {
+  auto micro_queue = std::make_shared<Parser::FlowQueue>();
+  ParserConfig micro_config = parser_config_;
+  micro_config.set_micro_flow_table_size(1 << 12);
+  Parser parser(parser_config_, queue_);
+  Parser micro_parser(micro_config, micro_queue);
+
+  // Flows with 1 to 5 packets.
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<uint32_t> src_dist(0, 299);
+  for (uint64_t time = 1; time <= 1000; ++time) {
+    pcap_ip_hdr_.ip_src.s_addr = src_dist(rnd) % (time / 5 + 1);
+    pcap_tcp_hdr_.th_seq = time;
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+    micro_parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+  }
+
+  ParserInfo micro_info = micro_parser.GetInfoNoLock();
+  ASSERT_EQ(parser.GetInfoNoLock().flow_hits, micro_info.flow_hits);
+  ASSERT_EQ(parser.GetInfoNoLock().flow_misses, micro_info.flow_misses);
+  ASSERT_EQ(parser.GetInfoNoLock().num_flows_in_mem,
+            micro_info.num_flows_in_mem + micro_info.micro_flows_in_mem);
+  ASSERT_LT(0, micro_info.micro_flows_in_mem);
+  ASSERT_LT(0, micro_info.micro_flows_promoted);
+  ASSERT_LT(micro_info.mem_usage_bytes,
+            parser.GetInfoNoLock().mem_usage_bytes);
+
+  parser.CollectAllFlows();
+  micro_parser.CollectAllFlows();
+  std::map<std::string, std::unique_ptr<Flow>> flows;
+  for (auto& flow : DrainQueue()) {
+    flows[flow->key().ToString()] = std::move(flow);
+  }
+
+  size_t num_micro_flows = 0;
+  while (std::unique_ptr<Flow> flow = micro_queue->ConsumeOrBlock()) {
+    const Flow& expected = *flows.at(flow->key().ToString());
+    ASSERT_EQ(expected.first_rx(), flow->first_rx());
+    ASSERT_EQ(expected.last_rx(), flow->last_rx());
+    ASSERT_EQ(expected.pkts_seen(), flow->pkts_seen());
+    ASSERT_EQ(expected.SizeBytes(), flow->SizeBytes());
+    ++num_micro_flows;
+  }
+
+  ASSERT_EQ(flows.size(), num_micro_flows);
+}
+
+TEST_F(ParserTestFixture, MicroFlowsKeepFlowsInMemory) {
+  // Room for a few flows only, but a scan of one packet flows does not push
+  // out a flow that has seen a few packets.
+  parser_config_.set_micro_flow_table_size(16);
+  parser_config_.set_soft_mem_limit(EmptyParserMemBytes(parser_config_)
+                                    + 5 * sizeof(Flow));
+  Parser parser(parser_config_, queue_);
+
+  for (uint64_t time = 1; time <= 500; ++time) {
+    if (time <= 3 || time % 50 == 0) {
+      pcap_ip_hdr_.ip_src.s_addr = htonl(1);
+      pcap_tcp_hdr_.th_dport = htons(6);
+    } else {
+      pcap_ip_hdr_.ip_src.s_addr = htonl(2);
+      pcap_tcp_hdr_.th_dport = htons(time);
+    }
+
+    parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+  }
+
+  ParserInfo info = parser.GetInfoNoLock();
+  ASSERT_EQ(1, info.num_flows_in_mem);
+  ASSERT_EQ(16, info.micro_flows_in_mem);
+  ASSERT_EQ(1, info.micro_flows_promoted);
+  ASSERT_EQ(500 - 13 - 16, queue_->size());
+
+  // Micro-flows that have left are collected as flows.
+  auto flows = DrainQueue();
+  for (const auto& flow : flows) {
+    ASSERT_EQ(2, flow->key().src());
+    ASSERT_EQ(1, flow->pkts_seen());
+  }
+}
+
+TEST_F(ParserTestFixture, MicroFlowsTimeout) {
+  parser_config_.set_inactive_timeout(kMillion);
+  parser_config_.set_micro_flow_table_size(16);
+  Parser parser(parser_config_, queue_);
+
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, kMillion);
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 1.5 * kMillion);
+  parser.ExpireFlows(2.1 * kMillion);
+  ASSERT_EQ(0, queue_->size());
+  ASSERT_EQ(1, parser.GetInfoNoLock().micro_flows_in_mem);
+
+  parser.ExpireFlows(2.6 * kMillion);
+  ASSERT_EQ(1, queue_->size());
+  ASSERT_EQ(0, parser.GetInfoNoLock().micro_flows_in_mem);
+
+  auto flows = DrainQueue();
+  ASSERT_EQ(2, flows[0]->pkts_seen());
+  ASSERT_EQ(1.5 * kMillion, flows[0]->last_rx());
+}
+
+TEST_F(ParserTestFixture, MicroFlowsMerge) {
+  parser_config_.set_micro_flow_table_size(16);
+  Parser parser(parser_config_, queue_);
+  Parser other(parser_config_, queue_);
+
+  parser.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 1000);
+  other.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, 2000);
+  parser.MergeFrom(&other);
+
+  ParserInfo info = parser.GetInfoNoLock();
+  ASSERT_EQ(1, info.num_flows_in_mem);
+  ASSERT_EQ(0, info.micro_flows_in_mem);
+
+  parser.CollectAllFlows();
+  auto flows = DrainQueue();
+  ASSERT_EQ(1, flows.size());
+  ASSERT_EQ(2, flows[0]->pkts_seen());
+}
+
+TEST_F(ParserTestFixture, ShardedSameAsSingle) {
+  ShardedParser sharded(parser_config_, 4, queue_);
+  Parser single(parser_config_, nullptr);
+
+  uint64_t time = 0;
+  for (size_t count = 0; count < 10; ++count) {
+    for (uint32_t src = 0; src < 100; ++src) {
+      pcap_ip_hdr_.ip_src.s_addr = src;
+      sharded.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+      single.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, time);
+      time += 10;
+    }
+  }
+
+  ParserInfo info = sharded.GetInfo();
+  ParserInfo single_info = single.GetInfoNoLock();
+  ASSERT_EQ(single_info.first_rx, info.first_rx);
+  ASSERT_EQ(single_info.last_rx, info.last_rx);
+  ASSERT_EQ(single_info.total_pkts_seen, info.total_pkts_seen);
+  ASSERT_EQ(single_info.flow_hits, info.flow_hits);
+  ASSERT_EQ(single_info.flow_misses, info.flow_misses);
+  ASSERT_EQ(single_info.mem_usage_bytes, info.mem_usage_bytes);
+  ASSERT_EQ(100, info.num_flows_in_mem);
+
+  // All shards get some flows, and each flow is in exactly one of them.
+  for (size_t i = 0; i < sharded.num_shards(); ++i) {
+    ASSERT_LT(0, sharded.shard(i).GetInfoNoLock().num_flows_in_mem);
+  }
+
+  std::set<uint32_t> srcs;
+  {
+    auto locks = sharded.GetLocks();
+    ParserIterator it(sharded);
+    while (const Flow* flow = it.Next()) {
+      ASSERT_EQ(10, flow->pkts_seen());
+      ASSERT_TRUE(srcs.insert(flow->key().src()).second);
+    }
+  }
+  ASSERT_EQ(100, srcs.size());
+
+  sharded.CollectAllFlows();
+  ASSERT_EQ(100, DrainQueue().size());
+}
+
+TEST_F(ParserTestFixture, ShardedMemLimit) {
+  // Each of the 4 shards has room for a single flow.
+  ParserConfig config = GetConfig(
+      4 * (EmptyParserMemBytes(GetConfig(0)) + sizeof(Flow) + sizeof(Flow) / 2));
+  ShardedParser sharded(config, 4, queue_);
+  for (uint32_t src = 0; src < 100; ++src) {
+    pcap_ip_hdr_.ip_src.s_addr = src;
+    sharded.TCPIpRx(pcap_ip_hdr_, pcap_tcp_hdr_, src);
+  }
+
+  ParserInfo info = sharded.GetInfo();
+  ASSERT_GE(4, info.num_flows_in_mem);
+  ASSERT_GE(config.soft_mem_limit(), info.total_mem_bytes);
+  ASSERT_EQ(100 - info.num_flows_in_mem, queue_->size());
+}
+
+TEST_F(ParserTestFixture, ShardedConfig) {
+  parser_config_.set_inactive_timeout(1234);
+  parser_config_.set_tcp_linger(0);
+  parser_config_.set_heavy_hitters_size(10);
+  parser_config_.set_soft_mem_limit(4000000);
+  parser_config_.add_periodic_callback([](const Parser& parser) {
+    Unused(parser);
+  });
+
+  ShardedParser sharded(parser_config_, 4, queue_);
+  for (size_t i = 0; i < sharded.num_shards(); ++i) {
+    const ParserConfig& config = sharded.shard(i).parser_config();
+    ASSERT_EQ(1234, config.inactive_timeout());
+    ASSERT_EQ(0, config.tcp_linger());
+    ASSERT_EQ(10, config.heavy_hitters_size());
+    ASSERT_EQ(parser_config_.flow_config().fields_to_track(),
+              config.flow_config().fields_to_track());
+    ASSERT_EQ(1000000, config.soft_mem_limit());
+    ASSERT_TRUE(config.periodic_callbacks().empty());
+  }
+}
+
+TEST_F(ParserTestFixture, ShardedConcurrent) {
+  constexpr size_t kNumThreads = 4;
+  constexpr uint32_t kFlowsPerThread = 200;
+  constexpr size_t kPktsPerFlow = 50;
+
+  ShardedParser sharded(parser_config_, kNumThreads, queue_);
+
+  // Each thread has its own flows and its own clock, so shards see
+  // timestamps go back and forth.
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kNumThreads; ++i) {
+    threads.push_back(std::thread([this, i, &sharded] {
+      pcap::SniffIp ip_header = pcap_ip_hdr_;
+      uint64_t time = i;
+      for (size_t count = 0; count < kPktsPerFlow; ++count) {
+        for (uint32_t flow = 0; flow < kFlowsPerThread; ++flow) {
+          ip_header.ip_src.s_addr = i * kFlowsPerThread + flow;
+          sharded.TCPIpRx(ip_header, pcap_tcp_hdr_, time++);
+        }
+      }
+    }));
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  ParserInfo info = sharded.GetInfo();
+  ASSERT_EQ(kNumThreads * kFlowsPerThread * kPktsPerFlow,
+            info.total_pkts_seen);
+  ASSERT_EQ(kNumThreads * kFlowsPerThread, info.num_flows_in_mem);
+  ASSERT_EQ(kNumThreads * kFlowsPerThread, info.flow_misses);
+
+  auto locks = sharded.GetLocks();
+  ParserIterator it(sharded);
+  while (const Flow* flow = it.Next()) {
+    ASSERT_EQ(kPktsPerFlow, flow->pkts_seen());
+  }
+}
+
 TEST_F(ParserTestFixture, 1MPkts) {
   typedef std::pair<std::pair<uint32_t, uint32_t>, std::pair<uint16_t, uint16_t>> TestKey;
   typedef std::vector<std::pair<pcap::SniffIp, pcap::SniffTcp>> TestValue;
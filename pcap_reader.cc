@@ -0,0 +1,454 @@
+#include "pcap_reader.h"
+
+#include <pcap/bpf.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace flowparser {
+
+// Magic numbers of the pcap file header, as read on a machine with the same
+// endianness as the one that wrote the file.
+static constexpr uint32_t kPcapMagicMicros = 0xa1b2c3d4;
+static constexpr uint32_t kPcapMagicNanos = 0xa1b23c4d;
+
+// Block types and the byte-order magic of pcapng.
+static constexpr uint32_t kSectionHeaderBlock = 0x0a0d0d0a;
+static constexpr uint32_t kInterfaceDescriptionBlock = 1;
+static constexpr uint32_t kPacketBlock = 2;
+static constexpr uint32_t kSimplePacketBlock = 3;
+static constexpr uint32_t kEnhancedPacketBlock = 6;
+static constexpr uint32_t kPcapngByteOrderMagic = 0x1a2b3c4d;
+
+// Interface Description Block options.
+static constexpr uint16_t kOptionEnd = 0;
+static constexpr uint16_t kOptionTsresol = 9;
+static constexpr uint16_t kOptionTsoffset = 14;
+
+// Size of the block type and block total length fields at the start of each
+// block, and of the block total length at the end.
+static constexpr size_t kBlockHeaderSize = 8;
+static constexpr size_t kBlockTrailerSize = 4;
+
+// LINKTYPE_RAW is different from DLT_RAW.
+static constexpr uint32_t kLinktypeRaw = 101;
+
+int LinktypeToDatalink(uint32_t linktype) {
+  if (linktype == kLinktypeRaw) {
+    return DLT_RAW;
+  }
+
+  return linktype;
+}
+
+PcapReader::PcapReader(std::unique_ptr<InputStream> stream)
+    : stream_(std::move(stream)),
+      swapped_(false),
+      nanosecond_(false),
+      snaplen_(0),
+      datalink_(0) {
+  const uint8_t* header;
+  if (!stream_->Read(kFileHeaderSize, &header)) {
+    throw std::logic_error("Empty pcap file");
+  }
+
+  uint32_t magic;
+  memcpy(&magic, header, sizeof(magic));
+
+  switch (magic) {
+    case kPcapMagicMicros:
+      break;
+    case kPcapMagicNanos:
+      nanosecond_ = true;
+      break;
+    case __builtin_bswap32(kPcapMagicMicros):
+      swapped_ = true;
+      break;
+    case __builtin_bswap32(kPcapMagicNanos):
+      swapped_ = true;
+      nanosecond_ = true;
+      break;
+    default:
+      throw std::logic_error("Bad pcap magic " + std::to_string(magic));
+  }
+
+  snaplen_ = ReadUint32(header + 16);
+  datalink_ = LinktypeToDatalink(ReadUint32(header + 20));
+}
+
+PcapReader::PcapReader(std::unique_ptr<InputStream> stream,
+                       const PcapReader& format)
+    : stream_(std::move(stream)),
+      swapped_(format.swapped_),
+      nanosecond_(format.nanosecond_),
+      snaplen_(format.snaplen_),
+      datalink_(format.datalink_) {
+}
+
+bool PcapReader::IsRecordHeader(const uint8_t* data, const uint8_t* end,
+                                const uint8_t** next, uint32_t* ts_sec) const {
+  if (static_cast<size_t>(end - data) < kRecordHeaderSize) {
+    return false;
+  }
+
+  uint32_t ts_frac = ReadUint32(data + 4);
+  uint32_t caplen = ReadUint32(data + 8);
+  uint32_t len = ReadUint32(data + 12);
+
+  uint32_t max_frac = nanosecond_ ? 1000 * kMillion : kMillion;
+  if (ts_frac >= max_frac || len == 0 || len > kMaxRecordSize || caplen > len) {
+    return false;
+  }
+
+  if (snaplen_ != 0 && caplen > snaplen_) {
+    return false;
+  }
+
+  if (static_cast<size_t>(end - data) < kRecordHeaderSize + caplen) {
+    return false;
+  }
+
+  *next = data + kRecordHeaderSize + caplen;
+  *ts_sec = ReadUint32(data);
+  return true;
+}
+
+const uint8_t* PcapReader::FindRecord(const uint8_t* begin,
+                                      const uint8_t* end,
+                                      uint32_t min_ts_sec) const {
+  // How many headers in a row should look sane and how far apart their
+  // timestamps can be.
+  static constexpr size_t kChainLength = 8;
+  static constexpr uint32_t kMaxTimestampGapSec = 3600;
+
+  for (const uint8_t* candidate = begin; candidate < end; ++candidate) {
+    const uint8_t* next;
+    uint32_t prev_ts_sec;
+    if (!IsRecordHeader(candidate, end, &next, &prev_ts_sec)
+        || prev_ts_sec + kMaxTimestampGapSec < min_ts_sec) {
+      continue;
+    }
+
+    bool valid = true;
+    for (size_t i = 1; i < kChainLength && next != end; ++i) {
+      uint32_t ts_sec;
+      if (!IsRecordHeader(next, end, &next, &ts_sec)) {
+        valid = false;
+        break;
+      }
+
+      uint32_t gap = ts_sec > prev_ts_sec ? ts_sec - prev_ts_sec :
+          prev_ts_sec - ts_sec;
+      if (gap > kMaxTimestampGapSec) {
+        valid = false;
+        break;
+      }
+
+      prev_ts_sec = ts_sec;
+    }
+
+    if (valid) {
+      return candidate;
+    }
+  }
+
+  return end;
+}
+
+bool PcapReader::Next(PacketRecord* record) {
+  const uint8_t* header;
+  if (!stream_->Read(kRecordHeaderSize, &header)) {
+    return false;
+  }
+
+  uint64_t ts_sec = ReadUint32(header);
+  uint64_t ts_frac = ReadUint32(header + 4);
+  uint32_t caplen = ReadUint32(header + 8);
+  uint32_t len = ReadUint32(header + 12);
+
+  if (caplen > kMaxRecordSize) {
+    throw std::runtime_error(
+        "Bad pcap record, captured length " + std::to_string(caplen));
+  }
+
+  // The record header is not needed past this point, so it is fine if reading
+  // the data invalidates it.
+  const uint8_t* data = header + kRecordHeaderSize;
+  if (caplen != 0 && !stream_->Read(caplen, &data)) {
+    throw std::runtime_error("Truncated pcap record");
+  }
+
+  if (nanosecond_) {
+    ts_frac /= 1000;
+  }
+
+  record->timestamp = ts_sec * kMillion + ts_frac;
+  record->data = data;
+  record->caplen = caplen;
+  record->len = len;
+  record->datalink = datalink_;
+  return true;
+}
+
+uint64_t PcapngReader::Interface::ToMicros(uint64_t timestamp) const {
+  uint64_t seconds = timestamp / units_per_second;
+  uint64_t fraction = timestamp % units_per_second;
+
+  // Multiplying first is exact, but can overflow with very fine resolutions.
+  uint64_t micros;
+  if (units_per_second <= (1ULL << 44)) {
+    micros = fraction * kMillion / units_per_second;
+  } else {
+    micros = fraction / (units_per_second / kMillion);
+  }
+
+  return (seconds + offset_sec) * kMillion + micros;
+}
+
+PcapngReader::PcapngReader(std::unique_ptr<InputStream> stream)
+    : stream_(std::move(stream)),
+      swapped_(false),
+      last_timestamp_(0) {
+  const uint8_t* header;
+  if (!stream_->Read(kBlockHeaderSize, &header)) {
+    throw std::logic_error("Empty pcapng file");
+  }
+
+  uint32_t type;
+  memcpy(&type, header, sizeof(type));
+  if (type != kSectionHeaderBlock) {
+    throw std::logic_error("Bad pcapng block type " + std::to_string(type)
+                               + ", expected a section header");
+  }
+
+  uint32_t raw_total_len;
+  memcpy(&raw_total_len, header + 4, sizeof(raw_total_len));
+  ReadSectionHeader(raw_total_len);
+}
+
+void PcapngReader::ReadSectionHeader(uint32_t raw_total_len) {
+  const uint8_t* magic_data;
+  if (!stream_->Read(sizeof(uint32_t), &magic_data)) {
+    throw std::runtime_error("Truncated pcapng section header");
+  }
+
+  uint32_t magic;
+  memcpy(&magic, magic_data, sizeof(magic));
+  if (magic == kPcapngByteOrderMagic) {
+    swapped_ = false;
+  } else if (magic == __builtin_bswap32(kPcapngByteOrderMagic)) {
+    swapped_ = true;
+  } else {
+    throw std::logic_error("Bad pcapng byte-order magic "
+                               + std::to_string(magic));
+  }
+
+  uint32_t total_len = swapped_ ? __builtin_bswap32(raw_total_len) :
+      raw_total_len;
+  size_t consumed = kBlockHeaderSize + sizeof(uint32_t);
+  if (total_len < consumed + kBlockTrailerSize || total_len > kMaxBlockSize) {
+    throw std::runtime_error("Bad pcapng section header length "
+                                 + std::to_string(total_len));
+  }
+
+  // Nothing in the rest of the block is needed.
+  const uint8_t* rest;
+  if (!stream_->Read(total_len - consumed, &rest)) {
+    throw std::runtime_error("Truncated pcapng section header");
+  }
+
+  // Interface ids are local to a section.
+  interfaces_.clear();
+}
+
+void PcapngReader::ReadInterface(const uint8_t* body, size_t body_len) {
+  if (body_len < 8) {
+    throw std::runtime_error("Truncated pcapng interface description");
+  }
+
+  Interface interface;
+  interface.datalink = LinktypeToDatalink(ReadUint16(body));
+  interface.snaplen = ReadUint32(body + 4);
+
+  size_t offset = 8;
+  while (offset + 4 <= body_len) {
+    uint16_t code = ReadUint16(body + offset);
+    uint16_t len = ReadUint16(body + offset + 2);
+    offset += 4;
+
+    if (code == kOptionEnd) {
+      break;
+    }
+
+    if (offset + len > body_len) {
+      throw std::runtime_error("Truncated pcapng interface option");
+    }
+
+    if (code == kOptionTsresol && len == 1) {
+      uint8_t tsresol = body[offset];
+      uint8_t exponent = tsresol & 0x7f;
+      if (tsresol & 0x80) {
+        if (exponent > 63) {
+          throw std::runtime_error("Bad pcapng if_tsresol "
+                                       + std::to_string(tsresol));
+        }
+
+        interface.units_per_second = 1ULL << exponent;
+      } else {
+        if (exponent > 19) {
+          throw std::runtime_error("Bad pcapng if_tsresol "
+                                       + std::to_string(tsresol));
+        }
+
+        interface.units_per_second = 1;
+        for (uint8_t i = 0; i < exponent; ++i) {
+          interface.units_per_second *= 10;
+        }
+      }
+    } else if (code == kOptionTsoffset && len == 8) {
+      interface.offset_sec = static_cast<int64_t>(ReadUint64(body + offset));
+    }
+
+    // Option values are padded to 32 bits.
+    offset += (len + 3) & ~3;
+  }
+
+  interfaces_.push_back(interface);
+}
+
+void PcapngReader::FillRecord(uint32_t interface_id, uint64_t timestamp,
+                              const uint8_t* data, uint32_t caplen,
+                              uint32_t len, size_t max_caplen,
+                              PacketRecord* record) const {
+  if (interface_id >= interfaces_.size()) {
+    throw std::runtime_error("Bad pcapng interface id "
+                                 + std::to_string(interface_id));
+  }
+
+  if (caplen > max_caplen) {
+    throw std::runtime_error("Bad pcapng packet, captured length "
+                                 + std::to_string(caplen));
+  }
+
+  const Interface& interface = interfaces_[interface_id];
+  record->timestamp = interface.ToMicros(timestamp);
+  record->data = data;
+  record->caplen = caplen;
+  record->len = len;
+  record->datalink = interface.datalink;
+}
+
+void PcapngReader::ReadEnhancedPacket(const uint8_t* body, size_t body_len,
+                                      PacketRecord* record) const {
+  if (body_len < 20) {
+    throw std::runtime_error("Truncated pcapng enhanced packet");
+  }
+
+  uint64_t timestamp = (static_cast<uint64_t>(ReadUint32(body + 4)) << 32)
+      | ReadUint32(body + 8);
+  FillRecord(ReadUint32(body), timestamp, body + 20, ReadUint32(body + 12),
+             ReadUint32(body + 16), body_len - 20, record);
+}
+
+void PcapngReader::ReadPacket(const uint8_t* body, size_t body_len,
+                              PacketRecord* record) const {
+  if (body_len < 20) {
+    throw std::runtime_error("Truncated pcapng packet");
+  }
+
+  uint64_t timestamp = (static_cast<uint64_t>(ReadUint32(body + 4)) << 32)
+      | ReadUint32(body + 8);
+  FillRecord(ReadUint16(body), timestamp, body + 20, ReadUint32(body + 12),
+             ReadUint32(body + 16), body_len - 20, record);
+}
+
+void PcapngReader::ReadSimplePacket(const uint8_t* body, size_t body_len,
+                                    PacketRecord* record) const {
+  if (body_len < 4) {
+    throw std::runtime_error("Truncated pcapng simple packet");
+  }
+
+  // The captured length is not stored -- it is the smallest of the original
+  // length, the snapshot length of the first interface and what fits in the
+  // block.
+  uint32_t len = ReadUint32(body);
+  size_t caplen = std::min<size_t>(len, body_len - 4);
+  if (!interfaces_.empty() && interfaces_.front().snaplen != 0) {
+    caplen = std::min<size_t>(caplen, interfaces_.front().snaplen);
+  }
+
+  FillRecord(0, 0, body + 4, caplen, len, body_len - 4, record);
+  record->timestamp = last_timestamp_;
+}
+
+bool PcapngReader::Next(PacketRecord* record) {
+  while (true) {
+    const uint8_t* header;
+    if (!stream_->Read(kBlockHeaderSize, &header)) {
+      return false;
+    }
+
+    uint32_t type = ReadUint32(header);
+    uint32_t raw_total_len;
+    memcpy(&raw_total_len, header + 4, sizeof(raw_total_len));
+
+    if (type == kSectionHeaderBlock) {
+      ReadSectionHeader(raw_total_len);
+      continue;
+    }
+
+    uint32_t total_len = swapped_ ? __builtin_bswap32(raw_total_len) :
+        raw_total_len;
+    if (total_len < kBlockHeaderSize + kBlockTrailerSize
+        || total_len > kMaxBlockSize || total_len % 4 != 0) {
+      throw std::runtime_error("Bad pcapng block length "
+                                   + std::to_string(total_len));
+    }
+
+    // The block header is not needed past this point, so it is fine if reading
+    // the body invalidates it.
+    const uint8_t* body;
+    if (!stream_->Read(total_len - kBlockHeaderSize, &body)) {
+      throw std::runtime_error("Truncated pcapng block");
+    }
+
+    size_t body_len = total_len - kBlockHeaderSize - kBlockTrailerSize;
+    switch (type) {
+      case kInterfaceDescriptionBlock:
+        ReadInterface(body, body_len);
+        break;
+      case kEnhancedPacketBlock:
+        ReadEnhancedPacket(body, body_len, record);
+        last_timestamp_ = record->timestamp;
+        return true;
+      case kPacketBlock:
+        ReadPacket(body, body_len, record);
+        last_timestamp_ = record->timestamp;
+        return true;
+      case kSimplePacketBlock:
+        ReadSimplePacket(body, body_len, record);
+        return true;
+      default:
+        // Statistics, name resolution, custom blocks etc. are skipped.
+        break;
+    }
+  }
+}
+
+std::unique_ptr<PacketSource> NewPacketSource(
+    std::unique_ptr<InputStream> stream) {
+  const uint8_t* data;
+  if (!stream->Peek(sizeof(uint32_t), &data)) {
+    throw std::logic_error("Empty capture file");
+  }
+
+  uint32_t magic;
+  memcpy(&magic, data, sizeof(magic));
+  if (magic == kSectionHeaderBlock) {
+    return std::make_unique<PcapngReader>(std::move(stream));
+  }
+
+  return std::make_unique<PcapReader>(std::move(stream));
+}
+
+}  // namespace flowparser
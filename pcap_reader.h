@@ -0,0 +1,244 @@
+// Native readers for capture files. Unlike pcap_open_offline and pcap_loop they
+// do not copy records into a buffer and do not go through a per-record
+// callback -- records are walked in place in the underlying InputStream.
+
+#ifndef FLOWPARSER_PCAP_READER_H
+#define FLOWPARSER_PCAP_READER_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+#include "input_stream.h"
+
+namespace flowparser {
+
+// A single packet read from a capture file.
+struct PacketRecord {
+  // Timestamp in microseconds.
+  uint64_t timestamp = 0;
+
+  // The captured bytes, starting with the datalink header. This may point into
+  // a mapped file, so not even the headers can be read past caplen bytes.
+  const uint8_t* data = nullptr;
+
+  // Number of bytes captured.
+  uint32_t caplen = 0;
+
+  // Length of the packet on the wire.
+  uint32_t len = 0;
+
+  // The pcap DLT_ type of the packet.
+  int datalink = 0;
+};
+
+// Something packets can be read from.
+class PacketSource {
+ public:
+  virtual ~PacketSource() {
+  }
+
+  // Reads the next packet. Returns false if there are no more packets. The data
+  // of the record is only valid until the next call.
+  virtual bool Next(PacketRecord* record) = 0;
+
+ protected:
+  PacketSource() {
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(PacketSource);
+};
+
+// Capture files store LINKTYPE_ values, which are mostly, but not always, equal
+// to the DLT_ values used by pcap. This converts from the former to the latter.
+int LinktypeToDatalink(uint32_t linktype);
+
+// Reads from the classic pcap format. Both byte orders and both microsecond and
+// nanosecond resolution files are supported.
+class PcapReader : public PacketSource {
+ public:
+  static constexpr size_t kFileHeaderSize = 24;
+  static constexpr size_t kRecordHeaderSize = 16;
+
+  // Records that claim to be larger than this are considered corrupt.
+  static constexpr uint32_t kMaxRecordSize = 262144;
+
+  // Reads the file header from the stream. Throws if the stream does not start
+  // with a pcap file header.
+  explicit PcapReader(std::unique_ptr<InputStream> stream);
+
+  // Reads records from a stream that has no file header and starts at a record
+  // boundary, usually a part of a file. The format is taken from another reader
+  // of the same file.
+  PcapReader(std::unique_ptr<InputStream> stream, const PcapReader& format);
+
+  bool Next(PacketRecord* record) override;
+
+  // Finds the first record boundary in [begin, end), assuming that the range is
+  // part of the same file as this reader's. Since there are no markers between
+  // records a candidate header is only accepted if it and the headers that
+  // follow it look sane and their timestamps are close together and not much
+  // earlier than min_ts_sec -- usually the timestamp of the first record in the
+  // file. Returns end if no boundary is found.
+  const uint8_t* FindRecord(const uint8_t* begin, const uint8_t* end,
+                            uint32_t min_ts_sec) const;
+
+  // The pcap DLT_ type of all packets in the file.
+  int datalink() const {
+    return datalink_;
+  }
+
+  uint32_t snaplen() const {
+    return snaplen_;
+  }
+
+  // True if the timestamps in the file have nanosecond resolution.
+  bool nanosecond() const {
+    return nanosecond_;
+  }
+
+  // True if the file was written on a machine with different endianness.
+  bool swapped() const {
+    return swapped_;
+  }
+
+ private:
+  // Reads a 32 bit value from the file and converts it to host byte order.
+  uint32_t ReadUint32(const uint8_t* data) const {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return swapped_ ? __builtin_bswap32(value) : value;
+  }
+
+  // Checks if there is a plausible record header at data. If there is sets
+  // *next to where the next header should start and *ts_sec to the header's
+  // timestamp.
+  bool IsRecordHeader(const uint8_t* data, const uint8_t* end,
+                      const uint8_t** next, uint32_t* ts_sec) const;
+
+  std::unique_ptr<InputStream> stream_;
+
+  bool swapped_;
+  bool nanosecond_;
+  uint32_t snaplen_;
+  int datalink_;
+};
+
+// Reads from the pcapng format. Packets can come from Enhanced, Simple or
+// (obsolete) Packet Blocks; the link type and timestamp resolution come from
+// the Interface Description Block of the interface a packet was captured on,
+// so they can differ from packet to packet. Timestamps are converted to
+// microseconds. Files with more than one section are supported, each section
+// can have a different byte order.
+class PcapngReader : public PacketSource {
+ public:
+  // Blocks that claim to be larger than this are considered corrupt.
+  static constexpr uint32_t kMaxBlockSize = 1 << 24;
+
+  // Reads the first Section Header Block from the stream. Throws if the stream
+  // does not start with one.
+  explicit PcapngReader(std::unique_ptr<InputStream> stream);
+
+  bool Next(PacketRecord* record) override;
+
+  // Number of interfaces in the current section.
+  size_t num_interfaces() const {
+    return interfaces_.size();
+  }
+
+  // The pcap DLT_ type of packets captured on an interface.
+  int datalink(size_t interface_id) const {
+    return interfaces_.at(interface_id).datalink;
+  }
+
+  // How many timestamp units there are in a second for an interface.
+  uint64_t units_per_second(size_t interface_id) const {
+    return interfaces_.at(interface_id).units_per_second;
+  }
+
+  // True if the current section was written on a machine with different
+  // endianness.
+  bool swapped() const {
+    return swapped_;
+  }
+
+ private:
+  // An interface from an Interface Description Block.
+  struct Interface {
+    int datalink = 0;
+    uint32_t snaplen = 0;
+
+    // From the if_tsresol option, 10^6 if the option is missing.
+    uint64_t units_per_second = kMillion;
+
+    // From the if_tsoffset option, in seconds.
+    int64_t offset_sec = 0;
+
+    // Converts a timestamp in this interface's units to microseconds.
+    uint64_t ToMicros(uint64_t timestamp) const;
+  };
+
+  // Reads the rest of a Section Header Block, the block type has already been
+  // read. The byte order of the section is only known after the byte-order
+  // magic is read, so the block length is passed as it is in the file.
+  void ReadSectionHeader(uint32_t raw_total_len);
+
+  // Adds an interface from the body of an Interface Description Block.
+  void ReadInterface(const uint8_t* body, size_t body_len);
+
+  // Fills the record with the packet from an Enhanced, Simple or Packet
+  // Block.
+  void ReadEnhancedPacket(const uint8_t* body, size_t body_len,
+                          PacketRecord* record) const;
+  void ReadSimplePacket(const uint8_t* body, size_t body_len,
+                        PacketRecord* record) const;
+  void ReadPacket(const uint8_t* body, size_t body_len,
+                  PacketRecord* record) const;
+
+  // Fills the part of the record common to all packet blocks.
+  void FillRecord(uint32_t interface_id, uint64_t timestamp,
+                  const uint8_t* data, uint32_t caplen, uint32_t len,
+                  size_t max_caplen, PacketRecord* record) const;
+
+  uint16_t ReadUint16(const uint8_t* data) const {
+    uint16_t value;
+    memcpy(&value, data, sizeof(value));
+    return swapped_ ? __builtin_bswap16(value) : value;
+  }
+
+  uint32_t ReadUint32(const uint8_t* data) const {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return swapped_ ? __builtin_bswap32(value) : value;
+  }
+
+  uint64_t ReadUint64(const uint8_t* data) const {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return swapped_ ? __builtin_bswap64(value) : value;
+  }
+
+  std::unique_ptr<InputStream> stream_;
+
+  // Byte order of the current section.
+  bool swapped_;
+
+  // Interfaces of the current section, indexed by interface id.
+  std::vector<Interface> interfaces_;
+
+  // Simple Packet Blocks have no timestamp, they get the one of the last
+  // packet before them.
+  uint64_t last_timestamp_;
+};
+
+// Looks at the start of the stream and constructs the right reader for it.
+// Throws if the format is not known.
+std::unique_ptr<PacketSource> NewPacketSource(
+    std::unique_ptr<InputStream> stream);
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_PCAP_READER_H */
@@ -0,0 +1,471 @@
+#include "gtest/gtest.h"
+#include "pcap_reader.h"
+#include "link_decoder.h"
+
+#include <pcap/bpf.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <vector>
+
+namespace flowparser {
+namespace test {
+
+// Builds a pcap file in memory.
+class PcapBuilder {
+ public:
+  PcapBuilder(uint32_t magic, bool swapped)
+      : swapped_(swapped) {
+    Add32(magic);
+    Add16(2);
+    Add16(4);
+    Add32(0);
+    Add32(0);
+    Add32(65535);
+    Add32(1);  // LINKTYPE_ETHERNET
+  }
+
+  void AddRecord(uint32_t sec, uint32_t frac, uint32_t caplen, uint32_t len) {
+    Add32(sec);
+    Add32(frac);
+    Add32(caplen);
+    Add32(len);
+    for (size_t i = 0; i < caplen; ++i) {
+      data_.push_back(i);
+    }
+  }
+
+  std::unique_ptr<InputStream> Stream() const {
+    return std::make_unique<MappedInputStream>(data_.data(),
+                                               data_.data() + data_.size());
+  }
+
+  std::vector<uint8_t> data_;
+
+ private:
+  void Add16(uint16_t value) {
+    if (swapped_) {
+      value = __builtin_bswap16(value);
+    }
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    data_.insert(data_.end(), bytes, bytes + sizeof(value));
+  }
+
+  void Add32(uint32_t value) {
+    if (swapped_) {
+      value = __builtin_bswap32(value);
+    }
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    data_.insert(data_.end(), bytes, bytes + sizeof(value));
+  }
+
+  const bool swapped_;
+};
+
+// Builds a pcapng file in memory.
+class PcapngBuilder {
+ public:
+  explicit PcapngBuilder(bool swapped)
+      : swapped_(swapped) {
+    AddSection();
+  }
+
+  void AddSection() {
+    std::vector<uint8_t> body;
+    Add32(0x1a2b3c4d, &body);
+    Add16(1, &body);
+    Add16(0, &body);
+    Add32(0xffffffff, &body);  // Section length not specified
+    Add32(0xffffffff, &body);
+    AddBlock(0x0a0d0d0a, body);
+  }
+
+  // Adds an interface, tsresol is only added as an option if not 0.
+  void AddInterface(uint16_t linktype, uint8_t tsresol) {
+    std::vector<uint8_t> body;
+    Add16(linktype, &body);
+    Add16(0, &body);
+    Add32(65535, &body);
+    if (tsresol != 0) {
+      Add16(9, &body);
+      Add16(1, &body);
+      body.insert(body.end(), { tsresol, 0, 0, 0 });
+      Add16(0, &body);
+      Add16(0, &body);
+    }
+
+    AddBlock(1, body);
+  }
+
+  void AddEnhancedPacket(uint32_t interface_id, uint64_t timestamp,
+                         uint32_t caplen, uint32_t len) {
+    std::vector<uint8_t> body;
+    Add32(interface_id, &body);
+    Add32(timestamp >> 32, &body);
+    Add32(timestamp & 0xffffffff, &body);
+    Add32(caplen, &body);
+    Add32(len, &body);
+    AddData(caplen, &body);
+    AddBlock(6, body);
+  }
+
+  void AddSimplePacket(uint32_t len) {
+    std::vector<uint8_t> body;
+    Add32(len, &body);
+    AddData(len, &body);
+    AddBlock(3, body);
+  }
+
+  void AddBlock(uint32_t type, const std::vector<uint8_t>& body) {
+    Add32(type, &data_);
+    Add32(body.size() + 12, &data_);
+    data_.insert(data_.end(), body.begin(), body.end());
+    Add32(body.size() + 12, &data_);
+  }
+
+  std::unique_ptr<InputStream> Stream() const {
+    return std::make_unique<MappedInputStream>(data_.data(),
+                                               data_.data() + data_.size());
+  }
+
+  std::vector<uint8_t> data_;
+
+ private:
+  // Adds bytes 0, 1, 2 ... padded to 32 bits.
+  void AddData(uint32_t len, std::vector<uint8_t>* out) {
+    for (size_t i = 0; i < len; ++i) {
+      out->push_back(i);
+    }
+
+    out->resize((out->size() + 3) & ~3);
+  }
+
+  void Add16(uint16_t value, std::vector<uint8_t>* out) {
+    if (swapped_) {
+      value = __builtin_bswap16(value);
+    }
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out->insert(out->end(), bytes, bytes + sizeof(value));
+  }
+
+  void Add32(uint32_t value, std::vector<uint8_t>* out) {
+    if (swapped_) {
+      value = __builtin_bswap32(value);
+    }
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out->insert(out->end(), bytes, bytes + sizeof(value));
+  }
+
+  const bool swapped_;
+};
+
+static void AssertTwoRecords(const PcapBuilder& builder) {
+  PcapReader reader(builder.Stream());
+  ASSERT_EQ(DLT_EN10MB, reader.datalink());
+  ASSERT_EQ(65535, reader.snaplen());
+
+  PacketRecord record;
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_EQ(10 * kMillion + 5, record.timestamp);
+  ASSERT_EQ(60, record.caplen);
+  ASSERT_EQ(100, record.len);
+  ASSERT_EQ(59, record.data[59]);
+
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_EQ(11 * kMillion, record.timestamp);
+  ASSERT_EQ(0, record.caplen);
+
+  ASSERT_FALSE(reader.Next(&record));
+}
+
+TEST(PcapReader, Micros) {
+  PcapBuilder builder(0xa1b2c3d4, false);
+  builder.AddRecord(10, 5, 60, 100);
+  builder.AddRecord(11, 0, 0, 0);
+
+  AssertTwoRecords(builder);
+}
+
+TEST(PcapReader, MicrosSwapped) {
+  PcapBuilder builder(0xa1b2c3d4, true);
+  builder.AddRecord(10, 5, 60, 100);
+  builder.AddRecord(11, 0, 0, 0);
+
+  AssertTwoRecords(builder);
+  ASSERT_TRUE(PcapReader(builder.Stream()).swapped());
+}
+
+TEST(PcapReader, Nanos) {
+  PcapBuilder builder(0xa1b23c4d, false);
+  builder.AddRecord(10, 5999, 60, 100);
+  builder.AddRecord(11, 0, 0, 0);
+
+  AssertTwoRecords(builder);
+  ASSERT_TRUE(PcapReader(builder.Stream()).nanosecond());
+}
+
+TEST(PcapReader, NanosSwapped) {
+  PcapBuilder builder(0xa1b23c4d, true);
+  builder.AddRecord(10, 5999, 60, 100);
+  builder.AddRecord(11, 0, 0, 0);
+
+  AssertTwoRecords(builder);
+}
+
+TEST(PcapReader, BadMagic) {
+  PcapBuilder builder(0xdeadbeef, false);
+  ASSERT_THROW(PcapReader reader(builder.Stream()), std::exception);
+}
+
+TEST(PcapReader, TruncatedRecord) {
+  PcapBuilder builder(0xa1b2c3d4, false);
+  builder.AddRecord(10, 5, 60, 100);
+  builder.data_.resize(builder.data_.size() - 1);
+
+  PcapReader reader(builder.Stream());
+  PacketRecord record;
+  ASSERT_THROW(reader.Next(&record), std::exception);
+}
+
+TEST(PcapReader, FindRecord) {
+  PcapBuilder builder(0xa1b2c3d4, false);
+  std::vector<size_t> offsets;
+  for (size_t i = 0; i < 100; ++i) {
+    offsets.push_back(builder.data_.size());
+    builder.AddRecord(10 + i, i, 20 + i % 40, 100);
+  }
+
+  PcapReader reader(builder.Stream());
+  const uint8_t* begin = builder.data_.data();
+  const uint8_t* end = begin + builder.data_.size();
+
+  // From anywhere inside a record the next record is found.
+  for (size_t i = 0; i < offsets.size() - 1; ++i) {
+    for (size_t offset = offsets[i] + 1; offset <= offsets[i + 1]; ++offset) {
+      ASSERT_EQ(begin + offsets[i + 1], reader.FindRecord(begin + offset, end, 10));
+    }
+  }
+
+  ASSERT_EQ(end, reader.FindRecord(begin + offsets.back() + 1, end, 10));
+}
+
+TEST(PcapReader, NoFileHeader) {
+  PcapBuilder builder(0xa1b23c4d, true);
+  builder.AddRecord(10, 5999, 60, 100);
+  builder.AddRecord(11, 0, 0, 0);
+
+  PcapReader reader(builder.Stream());
+  const uint8_t* begin = builder.data_.data() + PcapReader::kFileHeaderSize
+      + PcapReader::kRecordHeaderSize + 60;
+  PcapReader part(
+      std::make_unique<MappedInputStream>(
+          begin, builder.data_.data() + builder.data_.size()),
+      reader);
+
+  PacketRecord record;
+  ASSERT_TRUE(part.Next(&record));
+  ASSERT_EQ(11 * kMillion, record.timestamp);
+  ASSERT_FALSE(part.Next(&record));
+}
+
+TEST(PcapReader, MappedFile) {
+  PcapBuilder builder(0xa1b2c3d4, false);
+  builder.AddRecord(10, 5, 60, 100);
+  builder.AddRecord(11, 0, 0, 0);
+
+  char filename[] = "/tmp/pcap_reader_test_XXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT_NE(-1, fd);
+  close(fd);
+
+  {
+    std::ofstream out(filename, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(builder.data_.data()),
+              builder.data_.size());
+  }
+
+  MappedFile file(filename);
+  ASSERT_EQ(builder.data_.size(), file.size());
+
+  PcapReader reader(std::make_unique<MappedInputStream>(file));
+  PacketRecord record;
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_EQ(10 * kMillion + 5, record.timestamp);
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_FALSE(reader.Next(&record));
+
+  remove(filename);
+}
+
+// The last record of a file, cut by the snaplen in the middle of the IP
+// header, ends where the mapping does. Readers of the record must stop there.
+TEST(PcapReader, ShortLastRecord) {
+  PcapBuilder builder(0xa1b2c3d4, false);
+  builder.AddRecord(10, 5, 60, 100);
+  builder.AddRecord(11, 0, 24, 100);
+
+  // An IPv4 ethertype and version.
+  size_t last = builder.data_.size() - 24;
+  builder.data_[last + 12] = 0x08;
+  builder.data_[last + 13] = 0x00;
+  builder.data_[last + 14] = 0x45;
+
+  char filename[] = "/tmp/pcap_reader_test_XXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT_NE(-1, fd);
+  close(fd);
+
+  {
+    std::ofstream out(filename, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(builder.data_.data()),
+              builder.data_.size());
+  }
+
+  MappedFile file(filename);
+  PcapReader reader(std::make_unique<MappedInputStream>(file));
+  PacketRecord record;
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_EQ(24, record.caplen);
+  ASSERT_EQ(file.data() + file.size(), record.data + record.caplen);
+  ASSERT_FALSE(reader.Next(&record));
+
+  // The IP header is found, but less than a full header is left of it.
+  LinkDecoder decoder(reader.datalink(), DecoderConfig());
+  DecodedPacket decoded;
+  ASSERT_TRUE(decoder.Decode(record.data, record.caplen, &decoded));
+  ASSERT_EQ(14, decoded.offset);
+  ASSERT_GT(20, record.caplen - decoded.offset);
+
+  remove(filename);
+}
+
+static void AssertTwoInterfaces(const PcapngBuilder& builder) {
+  PcapngReader reader(builder.Stream());
+  PacketRecord record;
+
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_EQ(2, reader.num_interfaces());
+  ASSERT_EQ(10 * kMillion + 5, record.timestamp);
+  ASSERT_EQ(DLT_EN10MB, record.datalink);
+  ASSERT_EQ(60, record.caplen);
+  ASSERT_EQ(100, record.len);
+  ASSERT_EQ(59, record.data[59]);
+
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_EQ(11 * kMillion + 500000, record.timestamp);
+  ASSERT_EQ(DLT_RAW, record.datalink);
+  ASSERT_EQ(21, record.caplen);
+
+  ASSERT_FALSE(reader.Next(&record));
+}
+
+TEST(PcapngReader, TwoInterfaces) {
+  PcapngBuilder builder(false);
+  builder.AddInterface(1, 9);  // Nanoseconds
+  builder.AddInterface(101, 0x80 | 10);  // 1/1024ths of a second
+  builder.AddEnhancedPacket(0, 10 * 1000 * kMillion + 5999, 60, 100);
+  builder.AddBlock(5, { 1, 2, 3, 4 });  // Skipped
+  builder.AddEnhancedPacket(1, 11 * 1024 + 512, 21, 21);
+
+  AssertTwoInterfaces(builder);
+}
+
+TEST(PcapngReader, TwoInterfacesSwapped) {
+  PcapngBuilder builder(true);
+  builder.AddInterface(1, 9);
+  builder.AddInterface(101, 0x80 | 10);
+  builder.AddEnhancedPacket(0, 10 * 1000 * kMillion + 5999, 60, 100);
+  builder.AddEnhancedPacket(1, 11 * 1024 + 512, 21, 21);
+
+  AssertTwoInterfaces(builder);
+  ASSERT_TRUE(PcapngReader(builder.Stream()).swapped());
+}
+
+TEST(PcapngReader, DefaultResolution) {
+  PcapngBuilder builder(false);
+  builder.AddInterface(1, 0);
+  builder.AddEnhancedPacket(0, 10 * kMillion + 5, 60, 100);
+
+  PcapngReader reader(builder.Stream());
+  PacketRecord record;
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_EQ(kMillion, reader.units_per_second(0));
+  ASSERT_EQ(10 * kMillion + 5, record.timestamp);
+}
+
+TEST(PcapngReader, SimplePacket) {
+  PcapngBuilder builder(false);
+  builder.AddInterface(1, 0);
+  builder.AddEnhancedPacket(0, 10 * kMillion + 5, 60, 100);
+  builder.AddSimplePacket(30);
+
+  PcapngReader reader(builder.Stream());
+  PacketRecord record;
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_EQ(10 * kMillion + 5, record.timestamp);
+  ASSERT_EQ(30, record.caplen);
+  ASSERT_EQ(30, record.len);
+  ASSERT_FALSE(reader.Next(&record));
+}
+
+TEST(PcapngReader, NewSection) {
+  PcapngBuilder builder(false);
+  builder.AddInterface(1, 0);
+  builder.AddInterface(1, 0);
+  builder.AddSection();
+  builder.AddInterface(101, 0);
+  builder.AddEnhancedPacket(0, 10 * kMillion, 20, 20);
+  builder.AddEnhancedPacket(1, 10 * kMillion, 20, 20);
+
+  // Interface ids start from 0 in the new section.
+  PcapngReader reader(builder.Stream());
+  PacketRecord record;
+  ASSERT_TRUE(reader.Next(&record));
+  ASSERT_EQ(1, reader.num_interfaces());
+  ASSERT_EQ(DLT_RAW, record.datalink);
+  ASSERT_THROW(reader.Next(&record), std::exception);
+}
+
+TEST(PcapngReader, TruncatedBlock) {
+  PcapngBuilder builder(false);
+  builder.AddInterface(1, 0);
+  builder.AddEnhancedPacket(0, 10 * kMillion, 60, 100);
+  builder.data_.resize(builder.data_.size() - 1);
+
+  PcapngReader reader(builder.Stream());
+  PacketRecord record;
+  ASSERT_THROW(reader.Next(&record), std::exception);
+}
+
+TEST(PcapngReader, NotPcapng) {
+  PcapBuilder builder(0xa1b2c3d4, false);
+  ASSERT_THROW(PcapngReader reader(builder.Stream()), std::exception);
+}
+
+TEST(NewPacketSource, Format) {
+  PcapBuilder pcap_builder(0xa1b2c3d4, true);
+  auto pcap_source = NewPacketSource(pcap_builder.Stream());
+  ASSERT_NE(nullptr, dynamic_cast<PcapReader*>(pcap_source.get()));
+
+  PcapngBuilder pcapng_builder(true);
+  auto pcapng_source = NewPacketSource(pcapng_builder.Stream());
+  ASSERT_NE(nullptr, dynamic_cast<PcapngReader*>(pcapng_source.get()));
+
+  PcapBuilder bad_builder(0xdeadbeef, false);
+  ASSERT_THROW(NewPacketSource(bad_builder.Stream()), std::exception);
+}
+
+TEST(PcapReader, MissingFile) {
+  ASSERT_THROW(MappedFile file("test_data/some_missing_dummy_file"),
+               std::exception);
+}
+
+}  // namespace test
+}  // namespace flowparser
@@ -3,8 +3,14 @@
 
 #include <functional>
 #include <mutex>
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <condition_variable>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include "common.h"
 
@@ -65,38 +71,88 @@ class PtrQueue {
     condition_.notify_all();
   }
 
+  // Produces all items, in order, and leaves the vector empty. The lock is
+  // taken and consumers are woken up once, or once each time the queue fills
+  // up and the producer has to wait for room. Throws like ProduceOrBlock -- if
+  // it does the items not produced yet are left in the vector.
+  void ProduceAllOrBlock(std::vector<std::unique_ptr<T>>* items) {
+    std::unique_lock<std::mutex> lock(mu_);
+    size_t produced = 0;
+    while (produced < items->size()) {
+      if (closed_) {
+        items->erase(items->begin(), items->begin() + produced);
+        throw std::logic_error("Queue already closed");
+      }
+
+      if (num_items_ == Size) {
+        condition_.notify_all();
+        condition_.wait(lock, [this] {return closed_ || num_items_ < Size;});
+        continue;
+      }
+
+      while (produced < items->size() && num_items_ < Size) {
+        queue_[producer_] = std::move((*items)[produced++]);
+        producer_ = (producer_ + 1) & kMask;
+        num_items_++;
+      }
+    }
+
+    items->clear();
+    condition_.notify_all();
+  }
+
   // Will consume. If the queue is closed and empty it will return an empty
-  // unique_ptr.
+  // unique_ptr. Invalidated items are skipped.
   std::unique_ptr<T> ConsumeOrBlock() {
     std::unique_ptr<T> return_ptr;
+    std::unique_lock<std::mutex> lock(mu_);
+    while (return_ptr.get() == nullptr) {
+      if (num_items_ == 0) {
+        condition_.notify_all();
+        condition_.wait(lock, [this] {return closed_ || num_items_ > 0;});
+        if (num_items_ == 0) {
+          return std::move(return_ptr);
+        }
+      }
 
-    {
-      std::unique_lock<std::mutex> lock(mu_);
-      while (return_ptr.get() == nullptr) {
+      return_ptr = std::move(queue_[consumer_]);
+      consumer_ = (consumer_ + 1) & kMask;
+      num_items_--;
+    }
+
+    condition_.notify_all();
+    return std::move(return_ptr);
+  }
+
+  // Appends up to max_items items to the vector, in order, blocking until
+  // there is at least one. Returns how many were appended, 0 only if the queue
+  // is closed and empty. Invalidated items are skipped.
+  size_t ConsumeAllOrBlock(std::vector<std::unique_ptr<T>>* items,
+                           size_t max_items) {
+    std::unique_lock<std::mutex> lock(mu_);
+    size_t consumed = 0;
+    while (consumed == 0 && max_items != 0) {
+      if (num_items_ == 0) {
+        condition_.notify_all();
+        condition_.wait(lock, [this] {return closed_ || num_items_ > 0;});
         if (num_items_ == 0) {
-          if (closed_) {
-            return std::move(return_ptr);
-          }
-
-          condition_.wait(lock, [this] {return closed_ || num_items_ > 0;});
-          if (closed_ && num_items_ == 0) {
-            return std::move(return_ptr);
-          }
+          return 0;
         }
+      }
 
-        return_ptr = std::move(queue_[consumer_]);
+      while (num_items_ > 0 && consumed < max_items) {
+        std::unique_ptr<T> item = std::move(queue_[consumer_]);
         consumer_ = (consumer_ + 1) & kMask;
         num_items_--;
-      }
-
-      condition_.notify_all();
-      if (return_ptr.get() != nullptr) {
-        return std::move(return_ptr);
+        if (item) {
+          items->push_back(std::move(item));
+          ++consumed;
+        }
       }
     }
 
-    // If all items were invalid we should try again.
-    return ConsumeOrBlock();
+    condition_.notify_all();
+    return consumed;
   }
 
   // Invalidates all items for which the callback evaluates to true
@@ -112,7 +168,8 @@ class PtrQueue {
     }
   }
 
-  // After this call no more items can be produced.
+  // After this call no more items can be produced. Producers that are already
+  // producing either finish, and their items are consumed, or throw.
   void Close() {
     closed_ = true;
     condition_.notify_all();
@@ -145,6 +202,476 @@ class PtrQueue {
   DISALLOW_COPY_AND_ASSIGN(PtrQueue);
 };
 
+// Tells the CPU that this is a spin-wait loop.
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Backs off in a loop that waits for another thread, yielding if it takes long
+// -- the other thread may not be running.
+inline void Backoff(size_t spins) {
+  if (spins < 64) {
+    CpuRelax();
+  } else {
+    std::this_thread::yield();
+  }
+}
+
+// Where threads of a LockFreePtrQueue park when spinning did not help. Wakers
+// only take the mutex if a thread is parked, so in the common case of nobody
+// waiting a notification is a fence and a load.
+class Parker {
+ public:
+  Parker()
+      : waiters_(0) {
+  }
+
+  // Blocks until ready returns true. The change that makes it true must be
+  // followed by a call to Notify.
+  template<typename Ready>
+  void Wait(Ready ready) {
+    std::unique_lock<std::mutex> lock(mu_);
+    waiters_.fetch_add(1);
+
+    // Pairs with the fence in Notify: either Notify sees the waiter, or the
+    // waiter sees the change that made it ready.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    condition_.wait(lock, ready);
+    waiters_.fetch_sub(1);
+  }
+
+  void Notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_relaxed) != 0) {
+      std::lock_guard<std::mutex> lock(mu_);
+      condition_.notify_all();
+    }
+  }
+
+ private:
+  std::atomic<uint32_t> waiters_;
+  std::mutex mu_;
+  std::condition_variable condition_;
+
+  DISALLOW_COPY_AND_ASSIGN(Parker);
+};
+
+// A bounded ring of pointers for a single producer thread and a single
+// consumer thread. Each side owns its index and keeps a copy of the other's,
+// which it only reloads when the copy says the ring is full (or empty), so the
+// two rarely touch the same cache line. Does not block.
+template<typename T, size_t Size>
+class SpscRing {
+ public:
+  static_assert(IsPowerOfTwo(Size), "Queue size must be a power of 2");
+
+  SpscRing()
+      : cells_(new T*[Size]),
+        head_(0),
+        cached_tail_(0),
+        tail_(0),
+        cached_head_(0) {
+  }
+
+  // Moves as many of the n items as fit, from the first one. Returns how many
+  // were moved.
+  size_t TryProduce(std::unique_ptr<T>* items, size_t n) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (Size - (tail - cached_head_) < n) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+    }
+
+    size_t count = std::min(n, Size - (tail - cached_head_));
+    for (size_t i = 0; i < count; ++i) {
+      cells_[(tail + i) & kMask] = items[i].release();
+    }
+
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  // Moves up to n items to out. Returns how many were moved.
+  size_t TryConsume(std::unique_ptr<T>* out, size_t n) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (cached_tail_ - head < n) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+    }
+
+    size_t count = std::min(n, cached_tail_ - head);
+    for (size_t i = 0; i < count; ++i) {
+      out[i].reset(cells_[(head + i) & kMask]);
+    }
+
+    head_.store(head + count, std::memory_order_release);
+    return count;
+  }
+
+  size_t size() const {
+    size_t head = head_.load(std::memory_order_acquire);
+    return tail_.load(std::memory_order_acquire) - head;
+  }
+
+ private:
+  static constexpr size_t kMask = Size - 1;
+  static constexpr size_t kCacheLine = 64;
+
+  std::unique_ptr<T*[]> cells_;
+
+  // Written by the consumer.
+  char pad0_[kCacheLine];
+  std::atomic<size_t> head_;
+  size_t cached_tail_;
+
+  // Written by the producer.
+  char pad1_[kCacheLine];
+  std::atomic<size_t> tail_;
+  size_t cached_head_;
+  char pad2_[kCacheLine];
+
+  DISALLOW_COPY_AND_ASSIGN(SpscRing);
+};
+
+// A bounded ring of pointers for any number of producer and consumer threads.
+// A thread claims a range of cells by moving the producer (or consumer) index
+// with a compare-and-swap, and then fills (or empties) them. Each cell has a
+// sequence number that says whether it holds an item and for which lap of the
+// ring, so a thread only waits on a cell whose previous owner claimed it and
+// has not finished with it yet -- a matter of a few instructions. Does not
+// block.
+template<typename T, size_t Size>
+class MpmcRing {
+ public:
+  static_assert(IsPowerOfTwo(Size), "Queue size must be a power of 2");
+
+  MpmcRing()
+      : cells_(new Cell[Size]),
+        producer_(0),
+        consumer_(0) {
+    for (size_t i = 0; i < Size; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+      cells_[i].item = nullptr;
+    }
+  }
+
+  // Moves as many of the n items as fit, from the first one. Returns how many
+  // were moved.
+  size_t TryProduce(std::unique_ptr<T>* items, size_t n) {
+    size_t pos = producer_.load(std::memory_order_relaxed);
+    size_t count = 0;
+    do {
+      // The consumer index is never ahead of the real producer index, but may
+      // be ahead of a stale copy of it.
+      size_t consumer = consumer_.load(std::memory_order_acquire);
+      if (consumer > pos) {
+        pos = producer_.load(std::memory_order_relaxed);
+        continue;
+      }
+
+      if (pos - consumer >= Size) {
+        return 0;
+      }
+
+      count = std::min(n, Size - (pos - consumer));
+      if (producer_.compare_exchange_weak(pos, pos + count,
+                                          std::memory_order_relaxed)) {
+        break;
+      }
+    } while (true);
+
+    for (size_t i = 0; i < count; ++i) {
+      Cell& cell = cells_[(pos + i) & kMask];
+      for (size_t spins = 0;
+          cell.sequence.load(std::memory_order_acquire) != pos + i; ++spins) {
+        Backoff(spins);
+      }
+
+      cell.item = items[i].release();
+      cell.sequence.store(pos + i + 1, std::memory_order_release);
+    }
+
+    return count;
+  }
+
+  // Moves up to n items to out. Returns how many were moved.
+  size_t TryConsume(std::unique_ptr<T>* out, size_t n) {
+    size_t pos = consumer_.load(std::memory_order_relaxed);
+    size_t count = 0;
+    do {
+      size_t producer = producer_.load(std::memory_order_acquire);
+      if (producer <= pos) {
+        return 0;
+      }
+
+      count = std::min(n, producer - pos);
+      if (consumer_.compare_exchange_weak(pos, pos + count,
+                                          std::memory_order_relaxed)) {
+        break;
+      }
+    } while (true);
+
+    for (size_t i = 0; i < count; ++i) {
+      Cell& cell = cells_[(pos + i) & kMask];
+      for (size_t spins = 0;
+          cell.sequence.load(std::memory_order_acquire) != pos + i + 1;
+          ++spins) {
+        Backoff(spins);
+      }
+
+      out[i].reset(cell.item);
+      cell.sequence.store(pos + i + Size, std::memory_order_release);
+    }
+
+    return count;
+  }
+
+  // Items claimed by producers and not yet by consumers.
+  size_t size() const {
+    size_t consumer = consumer_.load(std::memory_order_acquire);
+    size_t producer = producer_.load(std::memory_order_acquire);
+    return producer > consumer ? producer - consumer : 0;
+  }
+
+ private:
+  static constexpr size_t kMask = Size - 1;
+  static constexpr size_t kCacheLine = 64;
+
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T* item;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+
+  char pad0_[kCacheLine];
+  std::atomic<size_t> producer_;
+  char pad1_[kCacheLine];
+  std::atomic<size_t> consumer_;
+  char pad2_[kCacheLine];
+
+  DISALLOW_COPY_AND_ASSIGN(MpmcRing);
+};
+
+// A blocking queue for passing pointers between threads, like PtrQueue, on top
+// of a ring that takes no locks. Items are produced and consumed with atomic
+// operations only. A thread that has to wait for room or for items spins for
+// a while and then parks, and a producer or consumer only wakes parked threads
+// if there are any, so a busy queue makes no system calls. Batches of items
+// are moved with one claim of the ring. Items cannot be invalidated.
+//
+// Producers count themselves as in flight before they check whether the queue
+// is closed. A consumer that finds the queue closed and empty waits for the
+// producers in flight to finish before it reports it empty, so an item is
+// either consumed or its producer throws, even if Close races with producing.
+template<typename Ring, typename T, size_t Size>
+class LockFreePtrQueue {
+ public:
+  // The size of the queue
+  static constexpr size_t kQueueSize = Size;
+
+  LockFreePtrQueue()
+      : closed_(false),
+        producers_(0) {
+  }
+
+  ~LockFreePtrQueue() {
+    Close();
+    std::unique_ptr<T> item;
+    while (ring_.TryConsume(&item, 1) != 0) {
+      item.reset();
+    }
+  }
+
+  // Returns the number of items in the queue.
+  size_t size() const {
+    return ring_.size();
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  // Will produce. If the queue is already closed or if the produce action
+  // blocks and the queue is closed this method will throw.
+  void ProduceOrBlock(std::unique_ptr<T> item) {
+    InFlight in_flight(&producers_);
+    if (closed_.load()) {
+      throw std::logic_error("Queue already closed");
+    }
+
+    while (ring_.TryProduce(&item, 1) == 0) {
+      AwaitRoom();
+      if (closed_.load()) {
+        throw std::logic_error("Queue closed while producing");
+      }
+    }
+
+    not_empty_.Notify();
+  }
+
+  // Produces all items, in order, and leaves the vector empty. As many items
+  // as fit are moved at once. Throws like ProduceOrBlock -- if it does the
+  // items not produced yet are left in the vector.
+  void ProduceAllOrBlock(std::vector<std::unique_ptr<T>>* items) {
+    InFlight in_flight(&producers_);
+    size_t produced = 0;
+    while (produced < items->size()) {
+      if (closed_.load()) {
+        items->erase(items->begin(), items->begin() + produced);
+        throw std::logic_error("Queue already closed");
+      }
+
+      size_t count = ring_.TryProduce(items->data() + produced,
+                                      items->size() - produced);
+      if (count == 0) {
+        AwaitRoom();
+        continue;
+      }
+
+      produced += count;
+      not_empty_.Notify();
+    }
+
+    items->clear();
+  }
+
+  // Will consume. If the queue is closed and empty it will return an empty
+  // unique_ptr.
+  std::unique_ptr<T> ConsumeOrBlock() {
+    std::unique_ptr<T> item;
+    while (ring_.TryConsume(&item, 1) == 0) {
+      if (closed_.load()) {
+        // Items produced before the queue was closed are still consumed.
+        AwaitProducers();
+        if (ring_.TryConsume(&item, 1) == 0) {
+          return item;
+        }
+
+        break;
+      }
+
+      AwaitItems();
+    }
+
+    not_full_.Notify();
+    return item;
+  }
+
+  // Appends up to max_items items to the vector, in order, blocking until
+  // there is at least one. Returns how many were appended, 0 only if the queue
+  // is closed and empty.
+  size_t ConsumeAllOrBlock(std::vector<std::unique_ptr<T>>* items,
+                           size_t max_items) {
+    if (max_items == 0) {
+      return 0;
+    }
+
+    size_t old_size = items->size();
+    items->resize(old_size + max_items);
+    size_t count = ring_.TryConsume(items->data() + old_size, max_items);
+    while (count == 0) {
+      if (closed_.load()) {
+        // Items produced before the queue was closed are still consumed.
+        AwaitProducers();
+        count = ring_.TryConsume(items->data() + old_size, max_items);
+        break;
+      }
+
+      AwaitItems();
+      count = ring_.TryConsume(items->data() + old_size, max_items);
+    }
+
+    items->resize(old_size + count);
+    if (count != 0) {
+      not_full_.Notify();
+    }
+
+    return count;
+  }
+
+  // After this call no more items can be produced. Producers that are already
+  // producing either finish, and their items are consumed, or throw.
+  void Close() {
+    closed_.store(true);
+    not_empty_.Notify();
+    not_full_.Notify();
+  }
+
+ private:
+  // How many times a waiting thread checks the ring before it parks.
+  static constexpr size_t kSpins = 1 << 10;
+
+  template<typename Ready>
+  void Await(Parker* parker, Ready ready) {
+    for (size_t i = 0; i < kSpins; ++i) {
+      if (ready()) {
+        return;
+      }
+
+      CpuRelax();
+    }
+
+    parker->Wait(ready);
+  }
+
+  void AwaitRoom() {
+    Await(&not_full_, [this] {return closed_.load() || size() < Size;});
+  }
+
+  void AwaitItems() {
+    Await(&not_empty_, [this] {return closed_.load() || size() > 0;});
+  }
+
+  // Called by a consumer once it has seen the queue closed. A producer that
+  // counted itself in flight later sees it closed too and adds nothing.
+  void AwaitProducers() const {
+    while (producers_.load() != 0) {
+      std::this_thread::yield();
+    }
+  }
+
+  // Counts a producer as in flight for as long as it lives.
+  class InFlight {
+   public:
+    explicit InFlight(std::atomic<size_t>* producers)
+        : producers_(producers) {
+      producers_->fetch_add(1);
+    }
+
+    ~InFlight() {
+      producers_->fetch_sub(1);
+    }
+
+   private:
+    std::atomic<size_t>* producers_;
+
+    DISALLOW_COPY_AND_ASSIGN(InFlight);
+  };
+
+  Ring ring_;
+
+  // Can items be added to the queue
+  std::atomic<bool> closed_;
+
+  // Number of producers in ProduceOrBlock or ProduceAllOrBlock.
+  std::atomic<size_t> producers_;
+
+  // Producers wait here for room, consumers for items.
+  Parker not_full_;
+  Parker not_empty_;
+
+  DISALLOW_COPY_AND_ASSIGN(LockFreePtrQueue);
+};
+
+// A lock-free queue for one producer thread and one consumer thread.
+template<typename T, size_t Size>
+using SpscPtrQueue = LockFreePtrQueue<SpscRing<T, Size>, T, Size>;
+
+// A lock-free queue for any number of producer and consumer threads.
+template<typename T, size_t Size>
+using MpmcPtrQueue = LockFreePtrQueue<MpmcRing<T, Size>, T, Size>;
+
 }
 
 #endif  /* PATHFINDER_PTR_QUEUE_H */
@@ -1,6 +1,7 @@
 #include <atomic>
 #include <thread>
 #include <map>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "ptr_queue.h"
@@ -79,6 +80,68 @@ TEST(SmallQueue, ProduceConsumeSeq) {
   ASSERT_EQ(0, small_queue.size());
 }
 
+TEST(SmallQueue, ProduceAll) {
+  PtrQueue<int, 4> small_queue;
+
+  std::vector<std::unique_ptr<int>> items;
+  for (int i = 1; i <= 3; i++) {
+    items.push_back(std::make_unique<int>(i));
+  }
+
+  small_queue.ProduceAllOrBlock(&items);
+  ASSERT_TRUE(items.empty());
+  ASSERT_EQ(3, small_queue.size());
+
+  small_queue.ProduceAllOrBlock(&items);
+  ASSERT_EQ(3, small_queue.size());
+  for (int i = 1; i <= 3; i++) {
+    ASSERT_EQ(i, *small_queue.ConsumeOrBlock());
+  }
+}
+
+TEST(SmallQueue, ProduceAllMoreThanSize) {
+  PtrQueue<int, 2> small_queue;
+
+  std::vector<std::unique_ptr<int>> items;
+  for (int i = 1; i <= 10000; i++) {
+    items.push_back(std::make_unique<int>(i));
+  }
+
+  std::thread thread([&small_queue] {
+    for (int i = 1; i <= 10000; i++) {
+      ASSERT_EQ(i, *small_queue.ConsumeOrBlock());
+    }
+  });
+
+  small_queue.ProduceAllOrBlock(&items);
+  thread.join();
+  ASSERT_TRUE(items.empty());
+  ASSERT_EQ(0, small_queue.size());
+}
+
+TEST(SmallQueue, ProduceAllKill) {
+  PtrQueue<int, 2> small_queue;
+
+  std::thread thread([&small_queue] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    small_queue.Close();
+  });
+
+  std::vector<std::unique_ptr<int>> items;
+  for (int i = 1; i <= 5; i++) {
+    items.push_back(std::make_unique<int>(i));
+  }
+
+  // should block until the queue is closed.
+  ASSERT_THROW(small_queue.ProduceAllOrBlock(&items), std::exception);
+  thread.join();
+
+  // What did not fit is left.
+  ASSERT_EQ(2, small_queue.size());
+  ASSERT_EQ(3, items.size());
+  ASSERT_EQ(3, *items[0]);
+}
+
 TEST(SmallQueue, ProduceInvalidateConsume) {
   PtrQueue<int, 4> small_queue;
 
@@ -152,6 +215,30 @@ TEST(SmallQueue, InvalidateAllKill) {
   ASSERT_EQ(0, small_queue.size());
 }
 
+TEST(SmallQueue, ConsumeAll) {
+  PtrQueue<int, 8> small_queue;
+  for (int i = 1; i <= 5; i++) {
+    small_queue.ProduceOrBlock(std::make_unique<int>(i));
+  }
+
+  small_queue.Invalidate([](const int& value) {return value == 2;});
+
+  // Invalidated items are skipped.
+  std::vector<std::unique_ptr<int>> items;
+  ASSERT_EQ(3, small_queue.ConsumeAllOrBlock(&items, 3));
+  ASSERT_EQ(3, items.size());
+  ASSERT_EQ(1, *items[0]);
+  ASSERT_EQ(3, *items[1]);
+  ASSERT_EQ(4, *items[2]);
+
+  ASSERT_EQ(1, small_queue.ConsumeAllOrBlock(&items, 10));
+  ASSERT_EQ(5, *items[3]);
+
+  small_queue.Close();
+  ASSERT_EQ(0, small_queue.ConsumeAllOrBlock(&items, 10));
+  ASSERT_EQ(4, items.size());
+}
+
 TEST(LargeQueue, MultiProducer) {
   auto large_queue = std::make_unique<PtrQueue<int, 1 << 20>>();
 
@@ -224,5 +311,274 @@ TEST(LargeQueue, MultiProducerMultiConsumer) {
   ASSERT_EQ(0, large_queue->size());
 }
 
+// The lock-free queues behave like PtrQueue.
+template<typename Queue>
+class LockFreeQueueTest : public ::testing::Test {
+};
+
+typedef ::testing::Types<SpscPtrQueue<int, 2>, MpmcPtrQueue<int, 2>>
+    LockFreeQueues;
+TYPED_TEST_CASE(LockFreeQueueTest, LockFreeQueues);
+
+TYPED_TEST(LockFreeQueueTest, ProduceConsume) {
+  TypeParam queue;
+  ASSERT_TRUE(queue.empty());
+
+  for (int i = 1; i <= 10000; i++) {
+    queue.ProduceOrBlock(std::make_unique<int>(i));
+    if (i % 2 == 0) {
+      ASSERT_EQ(2, queue.size());
+      ASSERT_EQ(i - 1, *queue.ConsumeOrBlock());
+      ASSERT_EQ(i, *queue.ConsumeOrBlock());
+    }
+  }
+
+  ASSERT_EQ(0, queue.size());
+}
+
+TYPED_TEST(LockFreeQueueTest, ProduceAfterClose) {
+  TypeParam queue;
+  queue.ProduceOrBlock(std::make_unique<int>(1));
+  queue.Close();
+  ASSERT_THROW(queue.ProduceOrBlock(std::make_unique<int>(2)),
+               std::exception);
+
+  // What was produced before is still consumed.
+  ASSERT_EQ(1, *queue.ConsumeOrBlock());
+  ASSERT_FALSE(queue.ConsumeOrBlock());
+}
+
+TYPED_TEST(LockFreeQueueTest, ProduceKill) {
+  TypeParam queue;
+  std::thread thread([&queue] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    queue.Close();
+  });
+
+  queue.ProduceOrBlock(std::make_unique<int>(1));
+  queue.ProduceOrBlock(std::make_unique<int>(2));
+
+  // should block until the queue is closed.
+  ASSERT_THROW(queue.ProduceOrBlock(std::make_unique<int>(3)),
+               std::exception);
+  thread.join();
+  ASSERT_EQ(2, queue.size());
+}
+
+TYPED_TEST(LockFreeQueueTest, ConsumeKill) {
+  TypeParam queue;
+  std::thread thread([&queue] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    queue.Close();
+  });
+
+  // should block until the queue is closed.
+  auto result = queue.ConsumeOrBlock();
+  thread.join();
+  ASSERT_FALSE(result);
+}
+
+TYPED_TEST(LockFreeQueueTest, ProduceAllKill) {
+  TypeParam queue;
+  std::thread thread([&queue] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    queue.Close();
+  });
+
+  std::vector<std::unique_ptr<int>> items;
+  for (int i = 1; i <= 5; i++) {
+    items.push_back(std::make_unique<int>(i));
+  }
+
+  // should block until the queue is closed.
+  ASSERT_THROW(queue.ProduceAllOrBlock(&items), std::exception);
+  thread.join();
+
+  // What did not fit is left.
+  ASSERT_EQ(2, queue.size());
+  ASSERT_EQ(3, items.size());
+  ASSERT_EQ(3, *items[0]);
+}
+
+TYPED_TEST(LockFreeQueueTest, Batches) {
+  TypeParam queue;
+  const int kItems = 100000;
+  std::thread thread([&queue] {
+    std::vector<std::unique_ptr<int>> items;
+    for (int i = 1; i <= kItems; i++) {
+      items.push_back(std::make_unique<int>(i));
+      if (items.size() == 7) {
+        queue.ProduceAllOrBlock(&items);
+      }
+    }
+
+    queue.ProduceAllOrBlock(&items);
+    queue.Close();
+  });
+
+  // In order, at most as many at a time as asked for.
+  std::vector<std::unique_ptr<int>> items;
+  size_t count;
+  while ((count = queue.ConsumeAllOrBlock(&items, 3)) != 0) {
+    ASSERT_GE(3, count);
+  }
+
+  thread.join();
+  ASSERT_EQ(kItems, items.size());
+  for (int i = 0; i < kItems; i++) {
+    ASSERT_EQ(i + 1, *items[i]);
+  }
+}
+
+TYPED_TEST(LockFreeQueueTest, DeletesLeftItems) {
+  std::shared_ptr<int> counted = std::make_shared<int>(1);
+  {
+    typedef typename std::conditional<
+        std::is_same<TypeParam, SpscPtrQueue<int, 2>>::value,
+        SpscPtrQueue<std::shared_ptr<int>, 4>,
+        MpmcPtrQueue<std::shared_ptr<int>, 4>>::type Queue;
+    Queue queue;
+    queue.ProduceOrBlock(std::make_unique<std::shared_ptr<int>>(counted));
+    queue.ProduceOrBlock(std::make_unique<std::shared_ptr<int>>(counted));
+    ASSERT_EQ(3, counted.use_count());
+  }
+
+  ASSERT_EQ(1, counted.use_count());
+}
+
+TEST(LockFreeQueue, MultiProducerMultiConsumer) {
+  auto queue = std::make_unique<MpmcPtrQueue<uint64_t, 1 << 6>>();
+
+  std::vector<std::thread> producer_threads;
+  std::vector<std::thread> consumer_threads;
+  const size_t kPerThread = (1 << 20) / 16;
+
+  for (size_t thread_num = 0; thread_num < 8; thread_num++) {
+    producer_threads.push_back(std::thread([&queue, kPerThread] {
+      for (size_t count = 0; count < kPerThread; count++) {
+        queue->ProduceOrBlock(std::make_unique<uint64_t>(count));
+      }
+    }));
+  }
+
+  // Half of them in batches.
+  for (size_t thread_num = 0; thread_num < 8; thread_num++) {
+    producer_threads.push_back(std::thread([&queue, kPerThread] {
+      std::vector<std::unique_ptr<uint64_t>> items;
+      for (size_t count = 0; count < kPerThread; count++) {
+        items.push_back(std::make_unique<uint64_t>(count));
+        if (items.size() == 100) {
+          queue->ProduceAllOrBlock(&items);
+        }
+      }
+
+      queue->ProduceAllOrBlock(&items);
+    }));
+  }
+
+  std::atomic<uint64_t> sum(0);
+  std::atomic<uint64_t> num_items(0);
+  for (size_t thread_num = 0; thread_num < 8; thread_num++) {
+    consumer_threads.push_back(std::thread([&queue, &sum, &num_items,
+                                            thread_num] {
+      std::vector<std::unique_ptr<uint64_t>> items;
+      while (true) {
+        if (thread_num % 2 == 0) {
+          auto result = queue->ConsumeOrBlock();
+          if (!result) {
+            break;
+          }
+
+          std::atomic_fetch_add(&sum, *result);
+          std::atomic_fetch_add(&num_items, uint64_t(1));
+          continue;
+        }
+
+        items.clear();
+        if (queue->ConsumeAllOrBlock(&items, 50) == 0) {
+          break;
+        }
+
+        for (const auto& item : items) {
+          std::atomic_fetch_add(&sum, *item);
+          std::atomic_fetch_add(&num_items, uint64_t(1));
+        }
+      }
+    }));
+  }
+
+  for (auto& thread : producer_threads) {
+    thread.join();
+  }
+
+  queue->Close();
+  for (auto& thread : consumer_threads) {
+    thread.join();
+  }
+
+  // n * (n - 1) / 2 for each of the 16 threads
+  ASSERT_EQ(16 * kPerThread, num_items);
+  ASSERT_EQ(kPerThread * (kPerThread - 1) * 8, sum);
+  ASSERT_EQ(0, queue->size());
+}
+
+// Items produced while the queue is being closed are either consumed or their
+// producers throw.
+TEST(LockFreeQueue, CloseWhileProducing) {
+  for (size_t round = 0; round < 20; round++) {
+    auto queue = std::make_unique<MpmcPtrQueue<uint64_t, 1 << 6>>();
+    std::atomic<uint64_t> produced(0);
+    std::atomic<uint64_t> consumed(0);
+
+    std::vector<std::thread> threads;
+    for (size_t thread_num = 0; thread_num < 4; thread_num++) {
+      threads.push_back(std::thread([&queue, &produced] {
+        try {
+          while (true) {
+            queue->ProduceOrBlock(std::make_unique<uint64_t>(1));
+            std::atomic_fetch_add(&produced, uint64_t(1));
+          }
+        } catch (std::exception&) {
+        }
+      }));
+
+      threads.push_back(std::thread([&queue, &consumed] {
+        while (queue->ConsumeOrBlock()) {
+          std::atomic_fetch_add(&consumed, uint64_t(1));
+        }
+      }));
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    queue->Close();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    ASSERT_EQ(produced, consumed);
+    ASSERT_EQ(0, queue->size());
+  }
+}
+
+TEST(LockFreeQueue, SingleProducerSingleConsumer) {
+  auto queue = std::make_unique<SpscPtrQueue<uint64_t, 1 << 6>>();
+  const uint64_t kItems = 1 << 20;
+  std::thread producer([&queue, kItems] {
+    for (uint64_t i = 0; i < kItems; i++) {
+      queue->ProduceOrBlock(std::make_unique<uint64_t>(i));
+    }
+
+    queue->Close();
+  });
+
+  uint64_t expected = 0;
+  while (auto result = queue->ConsumeOrBlock()) {
+    ASSERT_EQ(expected++, *result);
+  }
+
+  producer.join();
+  ASSERT_EQ(kItems, expected);
+}
+
 }
 }
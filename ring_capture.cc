@@ -0,0 +1,229 @@
+#include "ring_capture.h"
+
+#include <stdexcept>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+namespace flowparser {
+
+#ifdef __linux__
+
+static std::string ErrnoString() {
+  return std::string(strerror(errno));
+}
+
+RingCapture::RingCapture(const std::string& iface, const RingConfig& config)
+    : fd_(-1),
+      datalink_(DLT_EN10MB),
+      iface_(iface),
+      ifindex_(0),
+      config_(config),
+      ring_(nullptr),
+      ring_size_(0),
+      current_block_(0) {
+  if (config_.block_size % config_.frame_size != 0) {
+    throw std::logic_error("Ring block size not a multiple of frame size");
+  }
+
+  // With protocol 0 no packets are received until Start binds the socket, so
+  // none get into the ring before the filter is attached.
+  fd_ = socket(AF_PACKET, SOCK_RAW, 0);
+  if (fd_ == -1) {
+    throw std::logic_error("Could not open packet socket: " + ErrnoString());
+  }
+
+  try {
+    ifindex_ = if_nametoindex(iface.c_str());
+    if (ifindex_ == 0) {
+      throw std::logic_error("Unknown interface " + iface);
+    }
+
+    ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, iface.c_str(), IFNAMSIZ - 1);
+    if (ioctl(fd_, SIOCGIFHWADDR, &ifr) == -1) {
+      throw std::logic_error(
+          "Could not get link type of " + iface + ": " + ErrnoString());
+    }
+
+    switch (ifr.ifr_hwaddr.sa_family) {
+      case ARPHRD_ETHER:
+      case ARPHRD_LOOPBACK:
+        datalink_ = DLT_EN10MB;
+        break;
+      case ARPHRD_NONE:
+        datalink_ = DLT_RAW;
+        break;
+      default:
+        throw std::logic_error(
+            "Unsupported link type " + std::to_string(ifr.ifr_hwaddr.sa_family)
+                + " on " + iface);
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(fd_, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))
+        == -1) {
+      throw std::logic_error("Could not set TPACKET_V3: " + ErrnoString());
+    }
+
+    tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = config_.block_size;
+    req.tp_block_nr = config_.num_blocks;
+    req.tp_frame_size = config_.frame_size;
+    req.tp_frame_nr = (config_.block_size / config_.frame_size)
+        * config_.num_blocks;
+    req.tp_retire_blk_tov = config_.block_timeout_ms;
+    if (setsockopt(fd_, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+      throw std::logic_error("Could not set up packet ring: " + ErrnoString());
+    }
+
+    ring_size_ = config_.block_size * config_.num_blocks;
+    void* ring = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_LOCKED, fd_, 0);
+    if (ring == MAP_FAILED) {
+      throw std::logic_error("Could not map packet ring: " + ErrnoString());
+    }
+
+    ring_ = static_cast<uint8_t*>(ring);
+
+    packet_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex_;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd_, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq))
+        == -1) {
+      throw std::logic_error(
+          "Could not set " + iface + " to promiscuous mode: " + ErrnoString());
+    }
+  } catch (...) {
+    if (ring_ != nullptr) {
+      munmap(ring_, ring_size_);
+    }
+
+    close(fd_);
+    throw;
+  }
+}
+
+RingCapture::~RingCapture() {
+  if (ring_ != nullptr) {
+    munmap(ring_, ring_size_);
+  }
+
+  close(fd_);
+}
+
+void RingCapture::SetFilter(const bpf_program& program) {
+  // A bpf_insn from libpcap has the same layout as the kernel's sock_filter.
+  sock_fprog fprog;
+  fprog.len = program.bf_len;
+  fprog.filter = reinterpret_cast<sock_filter*>(program.bf_insns);
+
+  if (setsockopt(fd_, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog))
+      == -1) {
+    throw std::logic_error("Could not attach filter: " + ErrnoString());
+  }
+}
+
+void RingCapture::Start() {
+  sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = ifindex_;
+  if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+    throw std::logic_error(
+        "Could not bind to " + iface_ + ": " + ErrnoString());
+  }
+
+  // Only a bound socket can join a fanout group.
+  if (config_.fanout_group != 0) {
+    int fanout = config_.fanout_group
+        | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+    if (setsockopt(fd_, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout))
+        == -1) {
+      throw std::logic_error(
+          "Could not join fanout group " + std::to_string(
+              config_.fanout_group) + ": " + ErrnoString());
+    }
+  }
+}
+
+RingStats RingCapture::GetStats() {
+  tpacket_stats_v3 kernel_stats;
+  socklen_t len = sizeof(kernel_stats);
+
+  std::lock_guard<std::mutex> lock(stats_mu_);
+  if (getsockopt(fd_, SOL_PACKET, PACKET_STATISTICS, &kernel_stats, &len)
+      == -1) {
+    throw std::logic_error("Could not get ring statistics: " + ErrnoString());
+  }
+
+  // tp_packets includes the dropped packets.
+  stats_.packets += kernel_stats.tp_packets;
+  stats_.drops += kernel_stats.tp_drops;
+  stats_.freeze_queue_count += kernel_stats.tp_freeze_q_cnt;
+  return stats_;
+}
+
+void RingCapture::Poll(int timeout_ms) {
+  pollfd pfd;
+  pfd.fd = fd_;
+  pfd.events = POLLIN | POLLERR;
+  pfd.revents = 0;
+
+  if (poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR) {
+    throw std::logic_error("Bad poll on packet ring: " + ErrnoString());
+  }
+}
+
+#else
+
+RingCapture::RingCapture(const std::string& iface, const RingConfig& config)
+    : fd_(-1),
+      datalink_(DLT_EN10MB),
+      iface_(iface),
+      ifindex_(0),
+      config_(config),
+      ring_(nullptr),
+      ring_size_(0),
+      current_block_(0) {
+  throw std::logic_error(
+      "Cannot open " + iface + ", TPACKET_V3 capture is only supported on "
+      "Linux");
+}
+
+RingCapture::~RingCapture() {
+}
+
+void RingCapture::SetFilter(const bpf_program& program) {
+  Unused(program);
+}
+
+void RingCapture::Start() {
+}
+
+RingStats RingCapture::GetStats() {
+  return stats_;
+}
+
+void RingCapture::Poll(int timeout_ms) {
+  Unused(timeout_ms);
+}
+
+#endif  // __linux__
+
+}  // namespace flowparser
@@ -0,0 +1,185 @@
+// A live capture backend that reads packets from a memory-mapped AF_PACKET
+// TPACKET_V3 block ring. Instead of paying a callback and a copy per packet
+// (as with pcap_dispatch) the kernel fills whole blocks of frames which are
+// then walked in place. Only available on Linux.
+
+#ifndef FLOWPARSER_RING_CAPTURE_H
+#define FLOWPARSER_RING_CAPTURE_H
+
+#include <pcap/bpf.h>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#ifdef __linux__
+#include <linux/if_packet.h>
+#include <poll.h>
+#endif
+
+#include "common.h"
+
+namespace flowparser {
+
+// Configuration of the packet ring. The total memory used by the ring is
+// block_size * num_blocks.
+struct RingConfig {
+  // Size of a single block. Must be a multiple of the page size.
+  size_t block_size = 1 << 22;
+
+  // Number of blocks in the ring.
+  size_t num_blocks = 64;
+
+  // Nominal frame size. TPACKET_V3 frames are variable-length, this is only
+  // used to size the ring.
+  size_t frame_size = 1 << 11;
+
+  // A block is handed to userspace after this many milliseconds even if it is
+  // not full.
+  uint32_t block_timeout_ms = 100;
+
+  // If not 0 the socket joins the PACKET_FANOUT group with this id. Packets
+  // are spread among the sockets in the group by the kernel's flow hash, which
+  // is symmetric, so both directions of a flow reach the same socket. IP
+  // fragments are defragmented before hashing.
+  uint16_t fanout_group = 0;
+};
+
+// Counters reported by the kernel for a packet ring. They are cumulative since
+// the ring was opened.
+struct RingStats {
+  // Packets that were received by the socket.
+  uint64_t packets = 0;
+
+  // Packets that were dropped because there was no room in the ring.
+  uint64_t drops = 0;
+
+  // Number of times the ring was frozen because userspace fell behind.
+  uint64_t freeze_queue_count = 0;
+};
+
+class RingCapture {
+ public:
+  // Opens a ring on the given interface. Throws if the interface cannot be
+  // opened or if the ring cannot be set up (this usually requires
+  // CAP_NET_RAW). No packets are received until Start is called.
+  RingCapture(const std::string& iface, const RingConfig& config);
+
+  ~RingCapture();
+
+  // Attaches a compiled BPF program to the socket. The program should be
+  // compiled for the datalink returned by datalink(). Should be called before
+  // Start, packets received before it are not filtered.
+  void SetFilter(const bpf_program& program);
+
+  // Binds the socket to the interface, after which packets are received into
+  // the ring, and joins the fanout group if there is one. Throws if either
+  // fails.
+  void Start();
+
+  // The pcap DLT_ type of the frames in the ring.
+  int datalink() const {
+    return datalink_;
+  }
+
+  // Returns the kernel counters for this ring.
+  RingStats GetStats();
+
+  // Waits at most timeout_ms for a block to be ready and then hands every
+  // frame of all ready blocks to the callback. The callback is invoked as
+  // callback(timestamp, pkt, caplen, len) with the timestamp in microseconds
+  // and pkt pointing into the ring -- it is only valid during the call.
+  // Returns the number of frames handed to the callback.
+  template<typename Callback>
+  size_t Dispatch(int timeout_ms, Callback callback);
+
+ private:
+  // Polls the socket for at most timeout_ms milliseconds.
+  void Poll(int timeout_ms);
+
+  // The socket.
+  int fd_;
+
+  // The pcap DLT_ type of the interface.
+  int datalink_;
+
+  // The interface and its index.
+  const std::string iface_;
+  unsigned int ifindex_;
+
+  const RingConfig config_;
+
+  // The mapped ring and its size.
+  uint8_t* ring_;
+  size_t ring_size_;
+
+  // Index of the next block to be read.
+  size_t current_block_;
+
+  // The kernel resets its counters on every read, so they are accumulated
+  // here.
+  RingStats stats_;
+
+  // Protects stats_.
+  std::mutex stats_mu_;
+
+  DISALLOW_COPY_AND_ASSIGN(RingCapture);
+};
+
+#ifdef __linux__
+
+template<typename Callback>
+size_t RingCapture::Dispatch(int timeout_ms, Callback callback) {
+  size_t count = 0;
+
+  while (true) {
+    tpacket_block_desc* block = reinterpret_cast<tpacket_block_desc*>(ring_
+        + current_block_ * config_.block_size);
+
+    if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+      if (count != 0 || timeout_ms == 0) {
+        return count;
+      }
+
+      Poll(timeout_ms);
+      timeout_ms = 0;
+      continue;
+    }
+
+    __sync_synchronize();
+
+    const uint32_t num_pkts = block->hdr.bh1.num_pkts;
+    const uint8_t* frame = reinterpret_cast<uint8_t*>(block)
+        + block->hdr.bh1.offset_to_first_pkt;
+
+    for (uint32_t i = 0; i < num_pkts; ++i) {
+      const tpacket3_hdr* hdr = reinterpret_cast<const tpacket3_hdr*>(frame);
+      uint64_t timestamp = static_cast<uint64_t>(hdr->tp_sec) * kMillion
+          + hdr->tp_nsec / 1000;
+
+      callback(timestamp, frame + hdr->tp_mac, hdr->tp_snaplen, hdr->tp_len);
+      frame += hdr->tp_next_offset;
+    }
+
+    count += num_pkts;
+
+    // Hand the block back to the kernel.
+    __sync_synchronize();
+    block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    current_block_ = (current_block_ + 1) % config_.num_blocks;
+  }
+}
+
+#else
+
+template<typename Callback>
+size_t RingCapture::Dispatch(int timeout_ms, Callback callback) {
+  Unused(timeout_ms);
+  Unused(callback);
+  return 0;
+}
+
+#endif  // __linux__
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_RING_CAPTURE_H */
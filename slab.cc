@@ -0,0 +1,166 @@
+#include "slab.h"
+
+#include <cstdlib>
+
+namespace flowparser {
+
+constexpr size_t SlabPool::kSlabSize;
+constexpr size_t SlabPool::kMaxSlabBlockSize;
+constexpr size_t SlabPool::kNumClasses;
+constexpr size_t SlabPool::kHeaderSize;
+
+// Multiples of 16 up to 128, then 4 classes for each doubling, so that no more
+// than a fifth of a block above 128 bytes is wasted.
+static constexpr size_t kClassSizes[] = { 16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536,
+    1792, 2048, 2560, 3072, 3584, 4096 };
+
+
+SlabPool::SlabPool()
+    : carve_offset_(kSlabSize),
+      blocks_in_use_(0),
+      bytes_in_use_(0),
+      bytes_reserved_(0),
+      released_(false) {
+  static_assert(sizeof(kClassSizes) / sizeof(kClassSizes[0]) == kNumClasses
+                    && kClassSizes[kNumClasses - 1] == kMaxSlabBlockSize,
+                "One size per class, up to the largest block");
+  free_lists_.fill(nullptr);
+}
+
+SlabPool::~SlabPool() {
+  for (void* slab : slabs_) {
+    free(slab);
+  }
+}
+
+void SlabPool::Release() {
+  std::unique_lock<std::mutex> lock(mu_);
+  released_ = true;
+  if (blocks_in_use_ != 0) {
+    return;
+  }
+
+  lock.unlock();
+  delete this;
+}
+
+SlabPool* SlabPool::Default() {
+  static SlabPool* pool = new SlabPool();
+  return pool;
+}
+
+size_t SlabPool::ClassOf(size_t size) {
+  // A table of the class of each multiple of 16.
+  static const std::array<uint8_t, kMaxSlabBlockSize / 16 + 1> classes = [] {
+    std::array<uint8_t, kMaxSlabBlockSize / 16 + 1> table;
+    uint8_t size_class = 0;
+    for (size_t i = 0; i < table.size(); ++i) {
+      if (i * 16 > kClassSizes[size_class]) {
+        ++size_class;
+      }
+
+      table[i] = size_class;
+    }
+
+    return table;
+  }();
+
+  return classes[(size + 15) / 16];
+}
+
+size_t SlabPool::RoundUp(size_t size) {
+  if (size > kMaxSlabBlockSize) {
+    return size;
+  }
+
+  return kClassSizes[ClassOf(size)];
+}
+
+void* SlabPool::Carve(size_t size_class) {
+  size_t size = kClassSizes[size_class];
+  if (carve_offset_ + size > kSlabSize) {
+    void* slab;
+    if (posix_memalign(&slab, kSlabSize, kSlabSize) != 0) {
+      throw std::bad_alloc();
+    }
+
+    *static_cast<SlabPool**>(slab) = this;
+    slabs_.push_back(slab);
+    bytes_reserved_ += kSlabSize;
+    carve_offset_ = kHeaderSize;
+  }
+
+  void* block = static_cast<char*>(slabs_.back()) + carve_offset_;
+  carve_offset_ += size;
+  return block;
+}
+
+void* SlabPool::Allocate(size_t size) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (size > kMaxSlabBlockSize) {
+    void* header = malloc(kHeaderSize + size);
+    if (header == nullptr) {
+      throw std::bad_alloc();
+    }
+
+    *static_cast<SlabPool**>(header) = this;
+    blocks_in_use_++;
+    bytes_in_use_ += size;
+    bytes_reserved_ += kHeaderSize + size;
+    return static_cast<char*>(header) + kHeaderSize;
+  }
+
+  size_t size_class = ClassOf(size);
+  void* block;
+  if (free_lists_[size_class] != nullptr) {
+    FreeBlock* free_block = free_lists_[size_class];
+    free_lists_[size_class] = free_block->next;
+    block = free_block;
+  } else {
+    block = Carve(size_class);
+  }
+
+  blocks_in_use_++;
+  bytes_in_use_ += kClassSizes[size_class];
+  return block;
+}
+
+SlabPool* SlabPool::PoolOf(void* ptr, size_t size) {
+  if (size > kMaxSlabBlockSize) {
+    return *reinterpret_cast<SlabPool**>(static_cast<char*>(ptr)
+        - kHeaderSize);
+  }
+
+  uintptr_t slab = reinterpret_cast<uintptr_t>(ptr) & ~(kSlabSize - 1);
+  return *reinterpret_cast<SlabPool**>(slab);
+}
+
+void SlabPool::Free(void* ptr, size_t size) {
+  PoolOf(ptr, size)->FreeBlockOf(ptr, size);
+}
+
+void SlabPool::FreeBlockOf(void* ptr, size_t size) {
+  std::unique_lock<std::mutex> lock(mu_);
+  if (size > kMaxSlabBlockSize) {
+    free(static_cast<char*>(ptr) - kHeaderSize);
+    bytes_in_use_ -= size;
+    bytes_reserved_ -= kHeaderSize + size;
+  } else {
+    size_t size_class = ClassOf(size);
+    FreeBlock* free_block = static_cast<FreeBlock*>(ptr);
+    free_block->next = free_lists_[size_class];
+    free_lists_[size_class] = free_block;
+    bytes_in_use_ -= kClassSizes[size_class];
+  }
+
+  blocks_in_use_--;
+  if (!released_ || blocks_in_use_ != 0) {
+    return;
+  }
+
+  lock.unlock();
+  delete this;
+}
+
+}  // namespace flowparser
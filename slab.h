@@ -0,0 +1,259 @@
+// Size-class slab pools for flows and the sequences that hold their fields.
+
+#ifndef FLOWPARSER_SLAB_H
+#define FLOWPARSER_SLAB_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "common.h"
+
+namespace flowparser {
+
+// Hands out blocks of memory carved from large slabs. Sizes are rounded up to
+// one of a few size classes, and a freed block goes on the free list of its
+// class to be handed out again by the next allocation of that class. Flows
+// that come and go then reuse the same memory instead of fragmenting the heap,
+// and the heap is only asked for a new slab now and then.
+//
+// Slabs are aligned to their size and start with a pointer back to the pool,
+// so a block can be freed without knowing which pool it came from -- flows are
+// released by consumer threads, long after they left the parser. Blocks larger
+// than the largest class come from the heap with a header of their own. Slabs
+// are kept until the pool is deleted. Thread-safe.
+//
+// A pool is not deleted directly, it is released by its owner and deletes
+// itself once the last of its blocks is freed.
+class SlabPool {
+ public:
+  // Size and alignment of a slab.
+  static constexpr size_t kSlabSize = 1 << 16;
+
+  // Larger blocks come from the heap.
+  static constexpr size_t kMaxSlabBlockSize = 4096;
+
+  // Releases a pool instead of deleting it, for use with std::unique_ptr.
+  struct Releaser {
+    void operator()(SlabPool* pool) const {
+      pool->Release();
+    }
+  };
+
+  SlabPool();
+
+  // Deletes the pool now if none of its blocks are in use, or else once the
+  // last one is freed. The pool should not be allocated from after this.
+  void Release();
+
+  // The pool used when none is given. It is never released.
+  static SlabPool* Default();
+
+  // Returns a block of at least the given size, aligned for any type.
+  void* Allocate(size_t size);
+
+  // Frees a block allocated from any pool. The size should be the one it was
+  // allocated with, or any other that rounds up to the same size.
+  static void Free(void* ptr, size_t size);
+
+  // The size a block allocated with the given size really has -- all of it can
+  // be used.
+  static size_t RoundUp(size_t size);
+
+  // Bytes in blocks that have been handed out and not yet freed, rounded up to
+  // their size class.
+  uint64_t bytes_in_use() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return bytes_in_use_;
+  }
+
+  // Bytes taken from the heap -- all slabs, used or not, and large blocks.
+  uint64_t bytes_reserved() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return bytes_reserved_;
+  }
+
+ private:
+  // Number of size classes.
+  static constexpr size_t kNumClasses = 28;
+
+  // Bytes before the first block of a slab, and before a large block.
+  static constexpr size_t kHeaderSize = 16;
+
+  // A free block, on the free list of its class.
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  ~SlabPool();
+
+  // The size class of a size no larger than kMaxSlabBlockSize.
+  static size_t ClassOf(size_t size);
+
+  // The pool a block was allocated from.
+  static SlabPool* PoolOf(void* ptr, size_t size);
+
+  // Frees a block of this pool, and deletes the pool if it was the last one of
+  // a released pool.
+  void FreeBlockOf(void* ptr, size_t size);
+
+  // Returns a block of a size class from the current slab, allocating a new
+  // slab if there is not enough left of it.
+  void* Carve(size_t size_class);
+
+  // Protects everything below.
+  mutable std::mutex mu_;
+
+  std::array<FreeBlock*, kNumClasses> free_lists_;
+
+  // All slabs, the last one is the one blocks are being carved from.
+  std::vector<void*> slabs_;
+
+  // Offset of the next block to carve in the last slab.
+  size_t carve_offset_;
+
+  uint64_t blocks_in_use_;
+  uint64_t bytes_in_use_;
+  uint64_t bytes_reserved_;
+  bool released_;
+
+  DISALLOW_COPY_AND_ASSIGN(SlabPool);
+};
+
+// A sequence of trivially copyable elements in a block of a SlabPool. Blocks are
+// a power of 2 in size, so the vector grows by doubling like a std::vector, and
+// all of the block is used. The memory taken depends only on the number of
+// elements, not on how they were added. Fewer members than a std::vector with
+// an allocator that points to a pool, and no larger than a std::vector. Not
+// thread-safe.
+template<typename T>
+class SlabVector {
+ public:
+  static_assert(std::is_trivially_copyable<T>::value,
+                "SlabVector elements are moved with memcpy");
+
+  // Allocates from the default pool if pool is null.
+  explicit SlabVector(SlabPool* pool = nullptr)
+      : data_(nullptr),
+        pool_(pool != nullptr ? pool : SlabPool::Default()),
+        size_(0),
+        capacity_(0) {
+  }
+
+  ~SlabVector() {
+    if (data_ != nullptr) {
+      SlabPool::Free(data_, AllocatedBytes());
+    }
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  // Size of the block the elements are in.
+  size_t AllocatedBytes() const {
+    return capacity_ == 0 ? 0 : BlockBytes(capacity_);
+  }
+
+  T& operator[](size_t i) {
+    return data_[i];
+  }
+
+  const T& operator[](size_t i) const {
+    return data_[i];
+  }
+
+  T& back() {
+    return data_[size_ - 1];
+  }
+
+  const T* begin() const {
+    return data_;
+  }
+
+  const T* end() const {
+    return data_ + size_;
+  }
+
+  void push_back(const T& value) {
+    if (size_ == capacity_) {
+      Grow(size_ + 1);
+    }
+
+    new (&data_[size_++]) T(value);
+  }
+
+  void pop_back() {
+    --size_;
+  }
+
+  // Appends the elements in [first, last), which should not be in this vector.
+  void Append(const T* first, const T* last) {
+    size_t count = last - first;
+    if (count == 0) {
+      return;
+    }
+
+    if (size_ + count > capacity_) {
+      Grow(size_ + count);
+    }
+
+    memcpy(static_cast<void*>(data_ + size_), first, count * sizeof(T));
+    size_ += count;
+  }
+
+ private:
+  // The smallest power of 2 no smaller than the given number of elements take.
+  // It is also the smallest one no smaller than the number of elements that fit
+  // in it take.
+  static size_t BlockBytes(size_t capacity) {
+    size_t bytes = 16;
+    while (bytes < capacity * sizeof(T)) {
+      bytes *= 2;
+    }
+
+    return bytes;
+  }
+
+  void Grow(size_t min_capacity) {
+    if (min_capacity > std::numeric_limits<uint32_t>::max() / sizeof(T)) {
+      throw std::length_error("SlabVector too long");
+    }
+
+    size_t bytes = BlockBytes(min_capacity);
+    T* new_data = static_cast<T*>(pool_->Allocate(bytes));
+    if (data_ != nullptr) {
+      memcpy(static_cast<void*>(new_data), data_, size_ * sizeof(T));
+      SlabPool::Free(data_, AllocatedBytes());
+    }
+
+    data_ = new_data;
+    capacity_ = bytes / sizeof(T);
+  }
+
+  T* data_;
+  SlabPool* pool_;
+  uint32_t size_;
+  uint32_t capacity_;
+
+  DISALLOW_COPY_AND_ASSIGN(SlabVector<T>);
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_SLAB_H */
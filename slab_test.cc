@@ -0,0 +1,222 @@
+#include "gtest/gtest.h"
+
+#include <cstring>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "flows.h"
+#include "slab.h"
+
+namespace flowparser {
+namespace test {
+
+TEST(SlabPool, RoundUp) {
+  ASSERT_EQ(16, SlabPool::RoundUp(0));
+  ASSERT_EQ(16, SlabPool::RoundUp(1));
+  ASSERT_EQ(16, SlabPool::RoundUp(16));
+  ASSERT_EQ(32, SlabPool::RoundUp(17));
+  ASSERT_EQ(128, SlabPool::RoundUp(128));
+  ASSERT_EQ(160, SlabPool::RoundUp(129));
+  ASSERT_EQ(4096, SlabPool::RoundUp(3585));
+  ASSERT_EQ(4097, SlabPool::RoundUp(4097));
+
+  // Less than a fifth of a block wasted above 128 bytes.
+  for (size_t size = 129; size <= SlabPool::kMaxSlabBlockSize; ++size) {
+    size_t block_size = SlabPool::RoundUp(size);
+    ASSERT_LE(size, block_size);
+    ASSERT_GT(block_size / 5, block_size - size);
+  }
+}
+
+TEST(SlabPool, Reuse) {
+  std::unique_ptr<SlabPool, SlabPool::Releaser> pool(new SlabPool());
+  ASSERT_EQ(0, pool->bytes_in_use());
+  ASSERT_EQ(0, pool->bytes_reserved());
+
+  void* block = pool->Allocate(100);
+  ASSERT_EQ(112, pool->bytes_in_use());
+  ASSERT_EQ(SlabPool::kSlabSize, pool->bytes_reserved());
+  ASSERT_EQ(0, reinterpret_cast<uintptr_t>(block) % 16);
+
+  // A freed block is the next one of its class to be handed out.
+  SlabPool::Free(block, 100);
+  ASSERT_EQ(0, pool->bytes_in_use());
+  ASSERT_EQ(block, pool->Allocate(112));
+  ASSERT_NE(block, pool->Allocate(112));
+  ASSERT_EQ(SlabPool::kSlabSize, pool->bytes_reserved());
+}
+
+TEST(SlabPool, ManyBlocks) {
+  std::unique_ptr<SlabPool, SlabPool::Releaser> pool(new SlabPool());
+
+  // Enough for a few slabs. Blocks do not overlap.
+  std::vector<std::pair<char*, size_t>> blocks;
+  std::set<char*> starts;
+  for (size_t i = 0; i < 10000; ++i) {
+    size_t size = 1 + (i * 37) % 700;
+    char* block = static_cast<char*>(pool->Allocate(size));
+    memset(block, i, SlabPool::RoundUp(size));
+    blocks.push_back( { block, size });
+    ASSERT_TRUE(starts.insert(block).second);
+  }
+
+  ASSERT_LT(SlabPool::kSlabSize, pool->bytes_reserved());
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    size_t size = SlabPool::RoundUp(blocks[i].second);
+    ASSERT_EQ(static_cast<char>(i), blocks[i].first[0]);
+    ASSERT_EQ(static_cast<char>(i), blocks[i].first[size - 1]);
+  }
+
+  uint64_t reserved = pool->bytes_reserved();
+  for (const auto& block : blocks) {
+    SlabPool::Free(block.first, block.second);
+  }
+
+  // Slabs are kept.
+  ASSERT_EQ(0, pool->bytes_in_use());
+  ASSERT_EQ(reserved, pool->bytes_reserved());
+}
+
+TEST(SlabPool, LargeBlocks) {
+  std::unique_ptr<SlabPool, SlabPool::Releaser> pool(new SlabPool());
+  void* block = pool->Allocate(100000);
+  memset(block, 0, 100000);
+  ASSERT_EQ(100000, pool->bytes_in_use());
+  ASSERT_LT(100000, pool->bytes_reserved());
+
+  SlabPool::Free(block, 100000);
+  ASSERT_EQ(0, pool->bytes_in_use());
+  ASSERT_EQ(0, pool->bytes_reserved());
+}
+
+TEST(SlabPool, FreeAfterRelease) {
+  // The pool goes away with its last block, freed by another thread.
+  SlabPool* pool = new SlabPool();
+  void* small_block = pool->Allocate(10);
+  void* large_block = pool->Allocate(10000);
+  pool->Release();
+
+  std::thread thread([small_block, large_block] {
+    SlabPool::Free(small_block, 10);
+    SlabPool::Free(large_block, 10000);
+  });
+  thread.join();
+
+  // No blocks in use.
+  SlabPool* other = new SlabPool();
+  SlabPool::Free(other->Allocate(10), 10);
+  other->Release();
+}
+
+TEST(SlabPool, Threads) {
+  std::unique_ptr<SlabPool, SlabPool::Releaser> pool(new SlabPool());
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < 4; ++i) {
+    threads.emplace_back([&pool, i] {
+      for (size_t j = 0; j < 10000; ++j) {
+        size_t size = 1 + (i * 1000 + j) % 300;
+        char* block = static_cast<char*>(pool->Allocate(size));
+        block[0] = i;
+        SlabPool::Free(block, size);
+      }
+    });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  ASSERT_EQ(0, pool->bytes_in_use());
+}
+
+TEST(SlabVector, PushAndPop) {
+  std::unique_ptr<SlabPool, SlabPool::Releaser> pool(new SlabPool());
+
+  {
+    SlabVector<uint32_t> vector(pool.get());
+    ASSERT_TRUE(vector.empty());
+    ASSERT_EQ(0, pool->bytes_in_use());
+
+    // The whole block is used.
+    vector.push_back(0);
+    ASSERT_EQ(4, vector.capacity());
+    ASSERT_EQ(16, vector.AllocatedBytes());
+    ASSERT_EQ(16, pool->bytes_in_use());
+
+    for (uint32_t i = 1; i < 1000; ++i) {
+      vector.push_back(i);
+    }
+
+    ASSERT_EQ(1000, vector.size());
+    ASSERT_EQ(1024, vector.capacity());
+    ASSERT_EQ(vector.AllocatedBytes(), pool->bytes_in_use());
+    for (uint32_t i = 0; i < 1000; ++i) {
+      ASSERT_EQ(i, vector[i]);
+    }
+
+    vector.pop_back();
+    ASSERT_EQ(998, vector.back());
+
+    SlabVector<uint32_t> other(pool.get());
+    other.Append(vector.begin() + 990, vector.end());
+    ASSERT_EQ(9, other.size());
+    ASSERT_EQ(990, other[0]);
+    ASSERT_EQ(998, other.back());
+  }
+
+  ASSERT_EQ(0, pool->bytes_in_use());
+}
+
+TEST(SlabVector, DefaultPool) {
+  SlabVector<uint8_t> vector;
+  for (size_t i = 0; i < 10000; ++i) {
+    vector.push_back(i);
+  }
+
+  uint8_t sum = 0;
+  for (uint8_t value : vector) {
+    sum += value;
+  }
+
+  ASSERT_EQ(static_cast<uint8_t>(10000 * 9999 / 2), sum);
+}
+
+TEST(SlabPool, Flows) {
+  std::unique_ptr<SlabPool, SlabPool::Releaser> pool(new SlabPool());
+  FlowConfig flow_config;
+  flow_config.SetField(FlowConfig::HF_IP_ID);
+
+  pcap::SniffIp ip_header;
+  memset(&ip_header, 0, sizeof(ip_header));
+  ip_header.ip_hl = 5;
+  ip_header.ip_len = htons(100);
+  FlowKey key(ip_header, 1, 2);
+
+  std::unique_ptr<Flow> flow(new (pool.get()) Flow(0, key, flow_config,
+                                                   pool.get()));
+  ASSERT_EQ(SlabPool::RoundUp(sizeof(Flow)), pool->bytes_in_use());
+
+  // The fields grow in the pool too.
+  size_t bytes = 0;
+  for (uint64_t i = 0; i < 100; ++i) {
+    ip_header.ip_id = htons(i * i);
+    flow->UnknownIpRx(ip_header, i * i, &bytes);
+  }
+
+  ASSERT_LT(SlabPool::RoundUp(sizeof(Flow)), pool->bytes_in_use());
+
+  flow.reset();
+  ASSERT_EQ(0, pool->bytes_in_use());
+
+  // Flows not made with a pool use the default one.
+  std::unique_ptr<Flow> default_flow = std::make_unique<Flow>(0, key,
+                                                              flow_config);
+  default_flow->UnknownIpRx(ip_header, 0, &bytes);
+  ASSERT_EQ(0, pool->bytes_in_use());
+}
+
+}  // namespace test
+}  // namespace flowparser
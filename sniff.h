@@ -6,6 +6,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
@@ -30,6 +31,7 @@ static constexpr size_t kSizeUDP = 6;
 static constexpr size_t kSizeICMP = ICMP_MINLEN;
 
 typedef ip SniffIp;
+typedef ip6_hdr SniffIp6;
 typedef tcphdr SniffTcp;
 typedef udphdr SniffUdp;
 typedef icmp SniffIcmp;
@@ -40,12 +42,18 @@ struct SniffUnknown {
 
 }  // namespace pcap
 
-static std::string IPToString(uint32_t ip) {
+inline std::string IPToString(uint32_t ip) {
   char str[INET_ADDRSTRLEN];
   inet_ntop(AF_INET, &ip, str, INET_ADDRSTRLEN);
   return std::string(str);
 }
 
+inline std::string IPv6ToString(const in6_addr& ip) {
+  char str[INET6_ADDRSTRLEN];
+  inet_ntop(AF_INET6, &ip, str, INET6_ADDRSTRLEN);
+  return std::string(str);
+}
+
 }  // namespace flowparser
 
 #endif	/* FLOWPARSER_SNIFF_H */
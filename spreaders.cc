@@ -0,0 +1,106 @@
+#include "spreaders.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "hyperloglog.h"
+
+namespace flowparser {
+
+constexpr size_t SpreadSketch::kDepth;
+constexpr uint8_t SpreadSketch::kPrecision;
+
+// Checks the width before the buckets are allocated.
+static size_t CheckWidth(size_t width) {
+  if (width == 0) {
+    throw std::logic_error("SpreadSketch cannot have 0 buckets");
+  }
+
+  return width;
+}
+
+SpreadSketch::SpreadSketch(size_t width)
+    : width_(CheckWidth(width)),
+      registers_((kDepth * width) << kPrecision, 0),
+      candidates_(kDepth * width, Candidate{0, 0}) {
+}
+
+uint64_t SpreadSketch::BucketEstimate(size_t bucket) const {
+  const uint8_t* registers = registers_.data() + (bucket << kPrecision);
+  size_t num_registers = size_t(1) << kPrecision;
+
+  double inverse_sum = 0;
+  size_t zeros = 0;
+  for (size_t i = 0; i < num_registers; ++i) {
+    inverse_sum += std::ldexp(1.0, -static_cast<int>(registers[i]));
+    if (registers[i] == 0) {
+      ++zeros;
+    }
+  }
+
+  return HyperLogLog::EstimateOf(num_registers, inverse_sum, zeros);
+}
+
+uint64_t SpreadSketch::Estimate(uint32_t host) const {
+  uint64_t estimate = BucketEstimate(BucketIndex(0, host));
+  for (size_t row = 1; row < kDepth; ++row) {
+    estimate = std::min(estimate, BucketEstimate(BucketIndex(row, host)));
+  }
+
+  return estimate;
+}
+
+std::vector<Spreader> SpreadSketch::Top(size_t k) const {
+  std::vector<uint32_t> hosts;
+  for (const Candidate& candidate : candidates_) {
+    if (candidate.level != 0) {
+      hosts.push_back(candidate.host);
+    }
+  }
+
+  // A host is usually the candidate of several of its buckets.
+  std::sort(hosts.begin(), hosts.end());
+  hosts.erase(std::unique(hosts.begin(), hosts.end()), hosts.end());
+
+  std::vector<Spreader> spreaders;
+  spreaders.reserve(hosts.size());
+  for (uint32_t host : hosts) {
+    spreaders.push_back({host, Estimate(host)});
+  }
+
+  std::sort(spreaders.begin(), spreaders.end(),
+            [](const Spreader& a, const Spreader& b) {
+    return a.distinct > b.distinct || (a.distinct == b.distinct
+        && a.host < b.host);
+  });
+
+  if (spreaders.size() > k) {
+    spreaders.resize(k);
+  }
+
+  return spreaders;
+}
+
+void SpreadSketch::Merge(const SpreadSketch& other) {
+  if (other.width_ != width_) {
+    throw std::logic_error("Cannot merge SpreadSketches of different widths");
+  }
+
+  for (size_t i = 0; i < registers_.size(); ++i) {
+    registers_[i] = std::max(registers_[i], other.registers_[i]);
+  }
+
+  for (size_t i = 0; i < candidates_.size(); ++i) {
+    if (other.candidates_[i].level > candidates_[i].level) {
+      candidates_[i] = other.candidates_[i];
+    }
+  }
+}
+
+void SpreadSketch::Clear() {
+  std::fill(registers_.begin(), registers_.end(), 0);
+  std::fill(candidates_.begin(), candidates_.end(), Candidate{0, 0});
+}
+
+}  // namespace flowparser
@@ -0,0 +1,168 @@
+// Hosts that talk to or are reached from many distinct others, counted in
+// fixed memory.
+
+#ifndef FLOWPARSER_SPREADERS_H
+#define FLOWPARSER_SPREADERS_H
+
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+
+namespace flowparser {
+
+// A host and an estimate of the number of distinct peers it had. Hosts are
+// IPv4 addresses in host byte order, IPv6 addresses are folded to 32 bits the
+// way FlowKey folds them.
+struct Spreader {
+  uint32_t host;
+  uint64_t distinct;
+};
+
+// The SpreadSketch of Tang et al.: depth rows of width buckets. A host hashes
+// to one bucket per row. Each bucket has a small HyperLogLog of the (host,
+// peer) pairs of all hosts that hash to it, and a candidate host -- the one of
+// the pair with the largest rank seen in the bucket, which is likely to be the
+// one with the most peers. Other hosts in a bucket only add to its estimate,
+// so the distinct peers of a host are estimated as the smallest estimate of
+// its buckets. Adding a pair is O(depth) and allocates nothing. Sketches of
+// the same width can be merged. Not thread-safe.
+class SpreadSketch {
+ public:
+  static constexpr size_t kDepth = 4;
+
+  // Each bucket has 2^kPrecision registers, for an error of about 13%.
+  static constexpr uint8_t kPrecision = 6;
+
+  // Throws if width is 0.
+  explicit SpreadSketch(size_t width);
+
+  void Add(uint32_t host, uint32_t peer) {
+    uint64_t hash = Mix64((static_cast<uint64_t>(host) << 32) | peer);
+    uint64_t rest = (hash << kPrecision) | (uint64_t(1) << (kPrecision - 1));
+    uint8_t rank = __builtin_clzll(rest) + 1;
+    size_t reg = hash >> (64 - kPrecision);
+
+    for (size_t row = 0; row < kDepth; ++row) {
+      size_t bucket = BucketIndex(row, host);
+      uint8_t& value = registers_[(bucket << kPrecision) + reg];
+      if (rank > value) {
+        value = rank;
+      }
+
+      Candidate& candidate = candidates_[bucket];
+      if (rank >= candidate.level) {
+        candidate.host = host;
+        candidate.level = rank;
+      }
+    }
+  }
+
+  // The estimated number of distinct peers of a host.
+  uint64_t Estimate(uint32_t host) const;
+
+  // The candidates with the most distinct peers, most first. At most k.
+  std::vector<Spreader> Top(size_t k) const;
+
+  // Adds the pairs of another sketch. Throws if the widths differ.
+  void Merge(const SpreadSketch& other);
+
+  // Forgets all pairs.
+  void Clear();
+
+  size_t width() const {
+    return width_;
+  }
+
+  // Memory allocated for the buckets.
+  size_t SizeBytes() const {
+    return HeapBlockSize(registers_.size())
+        + HeapBlockSize(candidates_.size() * sizeof(Candidate));
+  }
+
+ private:
+  struct Candidate {
+    uint32_t host;
+
+    // 0 if no pair was added to the bucket.
+    uint8_t level;
+  };
+
+  size_t BucketIndex(size_t row, uint32_t host) const {
+    uint64_t hash = Mix64((static_cast<uint64_t>(row + 1) << 32) | host) >> 32;
+    return row * width_ + ((hash * width_) >> 32);
+  }
+
+  // The estimated number of pairs added to a bucket.
+  uint64_t BucketEstimate(size_t bucket) const;
+
+  size_t width_;
+
+  // The registers of each bucket, one after the other.
+  std::vector<uint8_t> registers_;
+  std::vector<Candidate> candidates_;
+};
+
+// The hosts with the most distinct peers.
+struct SpreadInfo {
+  // Sources with the most distinct destinations -- scanners and the like.
+  std::vector<Spreader> superspreaders;
+
+  // Destinations with the most distinct sources -- targets of DDoS attacks,
+  // or popular servers.
+  std::vector<Spreader> fan_in;
+};
+
+// A SpreadSketch of the destinations of each source and one of the sources of
+// each destination.
+class Spreaders {
+ public:
+  explicit Spreaders(size_t width)
+      : by_src_(width),
+        by_dst_(width) {
+  }
+
+  void Add(uint32_t src, uint32_t dst) {
+    by_src_.Add(src, dst);
+    by_dst_.Add(dst, src);
+  }
+
+  // The k sources and the k destinations with the most distinct peers.
+  SpreadInfo Top(size_t k) const {
+    SpreadInfo info;
+    info.superspreaders = by_src_.Top(k);
+    info.fan_in = by_dst_.Top(k);
+    return info;
+  }
+
+  // Adds the packets of another one. Throws if the widths differ.
+  void Merge(const Spreaders& other) {
+    by_src_.Merge(other.by_src_);
+    by_dst_.Merge(other.by_dst_);
+  }
+
+  void Clear() {
+    by_src_.Clear();
+    by_dst_.Clear();
+  }
+
+  const SpreadSketch& by_src() const {
+    return by_src_;
+  }
+
+  const SpreadSketch& by_dst() const {
+    return by_dst_;
+  }
+
+  size_t SizeBytes() const {
+    return by_src_.SizeBytes() + by_dst_.SizeBytes();
+  }
+
+ private:
+  SpreadSketch by_src_;
+  SpreadSketch by_dst_;
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_SPREADERS_H */
@@ -0,0 +1,128 @@
+#include "gtest/gtest.h"
+
+#include <cmath>
+#include <random>
+
+#include "spreaders.h"
+
+namespace flowparser {
+namespace test {
+
+// Checks that an estimate is within 4 standard errors of the real value.
+static void AssertClose(uint64_t expected, uint64_t estimate) {
+  double error = 1.04 / std::sqrt(double(1 << SpreadSketch::kPrecision));
+  ASSERT_NEAR(expected, estimate, 4 * error * expected + 1);
+}
+
+TEST(SpreadSketch, Init) {
+  ASSERT_THROW(SpreadSketch(0), std::logic_error);
+
+  SpreadSketch sketch(100);
+  ASSERT_EQ(100, sketch.width());
+  ASSERT_EQ(0, sketch.Estimate(1));
+  ASSERT_TRUE(sketch.Top(10).empty());
+  ASSERT_LE(SpreadSketch::kDepth * 100 * 64, sketch.SizeBytes());
+}
+
+TEST(SpreadSketch, Estimate) {
+  SpreadSketch sketch(100);
+  for (uint32_t peer = 0; peer < 10000; ++peer) {
+    // Repeated pairs do not count.
+    sketch.Add(1, peer);
+    sketch.Add(1, peer);
+  }
+
+  AssertClose(10000, sketch.Estimate(1));
+
+  std::vector<Spreader> top = sketch.Top(10);
+  ASSERT_EQ(1, top.size());
+  ASSERT_EQ(1, top[0].host);
+  ASSERT_EQ(sketch.Estimate(1), top[0].distinct);
+}
+
+TEST(SpreadSketch, Top) {
+  // A few hosts with many peers among many with a few.
+  SpreadSketch sketch(256);
+  std::mt19937 rnd(1);
+  for (size_t i = 0; i < 500000; ++i) {
+    if (i % 2 == 0) {
+      uint32_t host = 1 + rnd() % 5;
+      sketch.Add(host, rnd() % (host * 5000));
+    } else {
+      sketch.Add(100 + rnd() % 50000, rnd() % 4);
+    }
+  }
+
+  std::vector<Spreader> top = sketch.Top(5);
+  ASSERT_EQ(5, top.size());
+  for (size_t i = 0; i < top.size(); ++i) {
+    ASSERT_EQ(5 - i, top[i].host);
+    AssertClose((5 - i) * 5000, top[i].distinct);
+  }
+
+  // The others are far behind.
+  ASSERT_GT(5000, sketch.Top(6).back().distinct);
+}
+
+TEST(SpreadSketch, Merge) {
+  SpreadSketch first(100);
+  SpreadSketch second(100);
+  SpreadSketch both(100);
+  for (uint32_t peer = 0; peer < 10000; ++peer) {
+    first.Add(1, peer);
+    both.Add(1, peer);
+  }
+
+  // Half of them are the same.
+  for (uint32_t peer = 5000; peer < 15000; ++peer) {
+    second.Add(1, peer);
+    second.Add(2, peer);
+    both.Add(1, peer);
+    both.Add(2, peer);
+  }
+
+  first.Merge(second);
+  ASSERT_EQ(both.Estimate(1), first.Estimate(1));
+  ASSERT_EQ(both.Estimate(2), first.Estimate(2));
+  AssertClose(15000, first.Estimate(1));
+
+  std::vector<Spreader> top = first.Top(2);
+  ASSERT_EQ(2, top.size());
+  ASSERT_EQ(1, top[0].host);
+  ASSERT_EQ(2, top[1].host);
+
+  ASSERT_THROW(first.Merge(SpreadSketch(10)), std::logic_error);
+
+  first.Clear();
+  ASSERT_EQ(0, first.Estimate(1));
+  ASSERT_TRUE(first.Top(10).empty());
+}
+
+TEST(Spreaders, BothDirections) {
+  Spreaders spreaders(100);
+
+  // Host 1 scans 1000 hosts, 2000 hosts hit host 2.
+  for (uint32_t i = 0; i < 1000; ++i) {
+    spreaders.Add(1, 1000 + i);
+  }
+
+  for (uint32_t i = 0; i < 2000; ++i) {
+    spreaders.Add(10000 + i, 2);
+  }
+
+  SpreadInfo info = spreaders.Top(1);
+  ASSERT_EQ(1, info.superspreaders.size());
+  ASSERT_EQ(1, info.superspreaders[0].host);
+  AssertClose(1000, info.superspreaders[0].distinct);
+  ASSERT_EQ(1, info.fan_in.size());
+  ASSERT_EQ(2, info.fan_in[0].host);
+  AssertClose(2000, info.fan_in[0].distinct);
+
+  ASSERT_EQ(spreaders.by_src().SizeBytes() + spreaders.by_dst().SizeBytes(),
+            spreaders.SizeBytes());
+  spreaders.Clear();
+  ASSERT_TRUE(spreaders.Top(1).superspreaders.empty());
+}
+
+}  // namespace test
+}  // namespace flowparser
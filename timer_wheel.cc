@@ -0,0 +1,167 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace flowparser {
+
+constexpr size_t TimerWheel::kLevels;
+constexpr size_t TimerWheel::kSlotBits;
+constexpr size_t TimerWheel::kSlots;
+
+// Number of ticks a slot of a level covers.
+static constexpr uint64_t TicksPerSlot(size_t level) {
+  return uint64_t(1) << (TimerWheel::kSlotBits * level);
+}
+
+TimerWheel::TimerWheel(uint64_t tick)
+    : tick_(tick),
+      current_tick_(0),
+      size_(0) {
+  if (tick_ == 0) {
+    throw std::logic_error("Timer wheel tick cannot be 0");
+  }
+
+  level_sizes_.fill(0);
+  slots_.fill(kNone);
+}
+
+void TimerWheel::Link(uint32_t id, uint32_t slot) {
+  Timer& timer = timers_[id];
+  timer.slot = slot;
+  timer.prev = kNone;
+  timer.next = slots_[slot];
+  if (timer.next != kNone) {
+    timers_[timer.next].prev = id;
+  }
+
+  slots_[slot] = id;
+  if (slot != kPendingSlot) {
+    ++level_sizes_[slot / kSlots];
+  }
+}
+
+void TimerWheel::Unlink(uint32_t id) {
+  Timer& timer = timers_[id];
+  if (timer.prev != kNone) {
+    timers_[timer.prev].next = timer.next;
+  } else {
+    slots_[timer.slot] = timer.next;
+  }
+
+  if (timer.next != kNone) {
+    timers_[timer.next].prev = timer.prev;
+  }
+
+  if (timer.slot != kPendingSlot) {
+    --level_sizes_[timer.slot / kSlots];
+  }
+  timer.slot = kNone;
+}
+
+void TimerWheel::MoveToPending(uint32_t slot) {
+  while (slots_[slot] != kNone) {
+    uint32_t id = slots_[slot];
+    Unlink(id);
+    Link(id, kPendingSlot);
+  }
+}
+
+void TimerWheel::Place(uint32_t id, uint64_t earliest_tick) {
+  uint64_t tick = std::max(TickOf(timers_[id].deadline), earliest_tick);
+
+  // Timers beyond the reach of the top level are parked where its reach ends.
+  uint64_t reach = TicksPerSlot(kLevels) - 1;
+  tick = std::min(tick, current_tick_ + reach);
+
+  uint64_t delta = tick - current_tick_;
+  size_t level = 0;
+  while (level < kLevels - 1 && delta >= TicksPerSlot(level + 1)) {
+    ++level;
+  }
+
+  size_t index = (tick >> (kSlotBits * level)) & (kSlots - 1);
+  Link(id, level * kSlots + index);
+}
+
+void TimerWheel::Schedule(uint32_t id, uint64_t deadline) {
+  if (id >= timers_.size()) {
+    timers_.resize(id + 1);
+  }
+
+  if (Scheduled(id)) {
+    Unlink(id);
+  } else {
+    ++size_;
+  }
+
+  timers_[id].deadline = deadline;
+  Place(id, current_tick_ + 1);
+}
+
+void TimerWheel::Cancel(uint32_t id) {
+  if (!Scheduled(id)) {
+    return;
+  }
+
+  Unlink(id);
+  --size_;
+}
+
+void TimerWheel::Turn(uint64_t tick, const ExpiredCallback& callback) {
+  current_tick_ = tick;
+
+  // Top down, so that timers moved down from a level are not moved again from
+  // the level below in the same tick.
+  for (size_t level = kLevels - 1; level > 0; --level) {
+    if ((tick & (TicksPerSlot(level) - 1)) != 0) {
+      continue;
+    }
+
+    size_t index = (tick >> (kSlotBits * level)) & (kSlots - 1);
+    MoveToPending(level * kSlots + index);
+    while (slots_[kPendingSlot] != kNone) {
+      uint32_t id = slots_[kPendingSlot];
+      Unlink(id);
+      Place(id, tick);
+    }
+  }
+
+  MoveToPending(tick & (kSlots - 1));
+  while (slots_[kPendingSlot] != kNone) {
+    uint32_t id = slots_[kPendingSlot];
+    Unlink(id);
+
+    // Parked timers can end up here before they are due.
+    if (TickOf(timers_[id].deadline) > tick) {
+      Place(id, tick + 1);
+      continue;
+    }
+
+    --size_;
+    callback(id);
+  }
+}
+
+void TimerWheel::Advance(uint64_t now, const ExpiredCallback& callback) {
+  uint64_t target = TickOf(now);
+  while (current_tick_ < target) {
+    if (size_ == 0) {
+      current_tick_ = target;
+      return;
+    }
+
+    // If a level and all levels below it are empty nothing happens until the
+    // level above turns.
+    uint64_t next = current_tick_ + 1;
+    for (size_t level = 0; level < kLevels - 1 && level_sizes_[level] == 0;
+        ++level) {
+      uint64_t span = TicksPerSlot(level + 1);
+      next = (current_tick_ / span + 1) * span;
+    }
+
+    Turn(std::min(next, target), callback);
+  }
+}
+
+}  // namespace flowparser
@@ -0,0 +1,124 @@
+// A hierarchical timer wheel.
+
+#ifndef FLOWPARSER_TIMER_WHEEL_H
+#define FLOWPARSER_TIMER_WHEEL_H
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <vector>
+
+#include "common.h"
+
+namespace flowparser {
+
+// Timers identified by small integer ids, at most one per id. Time is split in
+// ticks and timers are kept in 4 levels of 64 slots: level 0 has a slot per
+// tick, each slot of level 1 covers 64 ticks, and so on. A timer goes in the
+// lowest level whose range reaches its deadline and is moved down a level each
+// time the wheel turns past the start of its slot, so scheduling, cancelling
+// and expiring a timer are all O(1) amortized no matter how many timers there
+// are. Timers further away than the top level reaches are parked in the top
+// level and moved again when it turns. Stretches of time with no timers due
+// are skipped a level at a time. Time starts at 0. Not thread-safe.
+class TimerWheel {
+ public:
+  typedef std::function<void(uint32_t id)> ExpiredCallback;
+
+  static constexpr size_t kLevels = 4;
+  static constexpr size_t kSlotBits = 6;
+  static constexpr size_t kSlots = 1 << kSlotBits;
+
+  // Time is in the same units as tick, which should not be 0.
+  explicit TimerWheel(uint64_t tick);
+
+  // Sets the timer of an id to fire once time reaches the tick the deadline is
+  // in, replacing any timer the id already has. Deadlines in the current tick
+  // or before it fire once time reaches the next tick.
+  void Schedule(uint32_t id, uint64_t deadline);
+
+  // Cancels the timer of an id, if it has one.
+  void Cancel(uint32_t id);
+
+  bool Scheduled(uint32_t id) const {
+    return id < timers_.size() && timers_[id].slot != kNone;
+  }
+
+  // Advances time to now and calls the callback with the id of each timer
+  // whose deadline is at or before now, in order of their ticks. The timer is
+  // no longer scheduled when the callback is called, so the callback can
+  // schedule it again. It may also schedule and cancel other timers. Time never
+  // goes backwards -- if now is before the current time nothing happens.
+  void Advance(uint64_t now, const ExpiredCallback& callback);
+
+  // Number of scheduled timers.
+  size_t size() const {
+    return size_;
+  }
+
+  // Memory allocated for the timers of all ids, not counting the wheel itself.
+  size_t SizeBytes() const {
+    return timers_.capacity() == 0 ? 0
+        : HeapBlockSize(timers_.capacity() * sizeof(Timer));
+  }
+
+ private:
+  static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+  // All slots of all levels, and one more for timers that are about to fire.
+  static constexpr uint32_t kPendingSlot = kLevels * kSlots;
+
+  struct Timer {
+    uint64_t deadline = 0;
+
+    // Neighbors in the slot's list, by id.
+    uint32_t prev = kNone;
+    uint32_t next = kNone;
+
+    // kNone if the id has no timer.
+    uint32_t slot = kNone;
+  };
+
+  // Tick a deadline is in.
+  uint64_t TickOf(uint64_t time) const {
+    return time / tick_;
+  }
+
+  // Puts a timer that is not in any slot in the slot its deadline falls in,
+  // or the slot of the earliest tick if the deadline is before it.
+  void Place(uint32_t id, uint64_t earliest_tick);
+
+  void Link(uint32_t id, uint32_t slot);
+  void Unlink(uint32_t id);
+
+  // Moves all timers from a slot to the pending slot.
+  void MoveToPending(uint32_t slot);
+
+  // Moves time to the given tick, turning the levels above level 0 if it is
+  // the start of their slots, and fires the timers of the tick.
+  void Turn(uint64_t tick, const ExpiredCallback& callback);
+
+  const uint64_t tick_;
+
+  // The last tick that has been expired. Timers in level 0 are for the next
+  // kSlots ticks.
+  uint64_t current_tick_;
+
+  size_t size_;
+
+  // Number of timers in each level.
+  std::array<size_t, kLevels> level_sizes_;
+
+  // First timer in each slot.
+  std::array<uint32_t, kLevels * kSlots + 1> slots_;
+
+  // Indexed by id.
+  std::vector<Timer> timers_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_TIMER_WHEEL_H */
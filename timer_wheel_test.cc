@@ -0,0 +1,176 @@
+#include "gtest/gtest.h"
+
+#include <map>
+#include <random>
+#include <vector>
+
+#include "timer_wheel.h"
+
+namespace flowparser {
+namespace test {
+
+class TimerWheelFixture : public ::testing::Test {
+ protected:
+  static constexpr uint64_t kTick = 10;
+
+  TimerWheelFixture()
+      : wheel_(kTick) {
+  }
+
+  // Advances the wheel and returns the ids that fired, in order.
+  std::vector<uint32_t> Advance(uint64_t now) {
+    std::vector<uint32_t> fired;
+    wheel_.Advance(now, [&fired](uint32_t id) {
+      fired.push_back(id);
+    });
+
+    return fired;
+  }
+
+  TimerWheel wheel_;
+};
+
+constexpr uint64_t TimerWheelFixture::kTick;
+
+TEST_F(TimerWheelFixture, Empty) {
+  ASSERT_EQ(0, wheel_.size());
+  ASSERT_FALSE(wheel_.Scheduled(0));
+  ASSERT_TRUE(Advance(1000).empty());
+  ASSERT_THROW(TimerWheel(0), std::logic_error);
+}
+
+TEST_F(TimerWheelFixture, FiresAtDeadline) {
+  wheel_.Schedule(1, 100);
+  ASSERT_TRUE(wheel_.Scheduled(1));
+  ASSERT_EQ(1, wheel_.size());
+
+  ASSERT_TRUE(Advance(99).empty());
+  ASSERT_EQ(std::vector<uint32_t>( { 1 }), Advance(100));
+  ASSERT_FALSE(wheel_.Scheduled(1));
+  ASSERT_EQ(0, wheel_.size());
+  ASSERT_TRUE(Advance(1000).empty());
+}
+
+TEST_F(TimerWheelFixture, InTickOrder) {
+  // Deadlines in all levels.
+  wheel_.Schedule(3, 50000000);
+  wheel_.Schedule(2, 300000);
+  wheel_.Schedule(1, 5000);
+  wheel_.Schedule(0, 50);
+
+  ASSERT_EQ(std::vector<uint32_t>( { 0, 1, 2, 3 }), Advance(100000000));
+}
+
+TEST_F(TimerWheelFixture, NotEarly) {
+  // Moved down through each level, but fired only once due.
+  wheel_.Schedule(0, 12345678);
+  for (uint64_t now = 0; now < 12345670; now += 1000) {
+    ASSERT_TRUE(Advance(now).empty());
+  }
+
+  ASSERT_TRUE(Advance(12345679).size() == 1);
+}
+
+TEST_F(TimerWheelFixture, BeyondReach) {
+  uint64_t reach = kTick << (TimerWheel::kSlotBits * TimerWheel::kLevels);
+  wheel_.Schedule(0, 3 * reach);
+  ASSERT_TRUE(Advance(3 * reach - kTick).empty());
+  ASSERT_EQ(std::vector<uint32_t>( { 0 }), Advance(3 * reach));
+}
+
+TEST_F(TimerWheelFixture, LongJump) {
+  // As when the first packet of a trace sets the time.
+  uint64_t now = 1500000000ULL * kMillion;
+  ASSERT_TRUE(Advance(now).empty());
+
+  wheel_.Schedule(0, now + 100);
+  ASSERT_TRUE(Advance(now + 50).empty());
+  ASSERT_EQ(std::vector<uint32_t>( { 0 }), Advance(now + 100));
+}
+
+TEST_F(TimerWheelFixture, InThePast) {
+  Advance(1000);
+  wheel_.Schedule(0, 10);
+
+  // Not until time moves to the next tick.
+  ASSERT_TRUE(Advance(1000).empty());
+  ASSERT_EQ(std::vector<uint32_t>( { 0 }), Advance(1010));
+}
+
+TEST_F(TimerWheelFixture, RescheduleAndCancel) {
+  wheel_.Schedule(0, 100);
+  wheel_.Schedule(1, 100);
+  wheel_.Schedule(0, 200);
+  ASSERT_EQ(2, wheel_.size());
+
+  wheel_.Cancel(1);
+  wheel_.Cancel(1);
+  ASSERT_EQ(1, wheel_.size());
+  ASSERT_TRUE(Advance(150).empty());
+  ASSERT_EQ(std::vector<uint32_t>( { 0 }), Advance(200));
+}
+
+TEST_F(TimerWheelFixture, ScheduleFromCallback) {
+  // A timer that sets itself again every 100, and cancels another timer.
+  wheel_.Schedule(0, 100);
+  wheel_.Schedule(1, 250);
+  size_t fired = 0;
+  wheel_.Advance(1000, [this, &fired](uint32_t id) {
+    ASSERT_EQ(0, id);
+    ++fired;
+    wheel_.Schedule(0, (fired + 1) * 100);
+    wheel_.Cancel(1);
+  });
+
+  ASSERT_EQ(10, fired);
+  ASSERT_TRUE(wheel_.Scheduled(0));
+  ASSERT_FALSE(wheel_.Scheduled(1));
+}
+
+// Random operations, checked against a map of deadlines.
+TEST_F(TimerWheelFixture, Random) {
+  std::map<uint32_t, uint64_t> model;
+
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<uint32_t> id_dist(0, 999);
+  std::uniform_int_distribution<uint64_t> delay_dist(0, 20000000);
+  std::uniform_int_distribution<uint64_t> step_dist(0, 2000);
+  std::uniform_int_distribution<int> op_dist(0, 9);
+
+  uint64_t now = 0;
+  for (size_t i = 0; i < 100000; ++i) {
+    uint32_t id = id_dist(rnd);
+    int op = op_dist(rnd);
+    if (op < 5) {
+      // Never in the current tick, those fire a tick late.
+      uint64_t deadline = (now / kTick + 1) * kTick + delay_dist(rnd);
+      wheel_.Schedule(id, deadline);
+      model[id] = deadline;
+    } else if (op < 6) {
+      wheel_.Cancel(id);
+      model.erase(id);
+    } else {
+      now += step_dist(rnd);
+      std::vector<uint32_t> fired = Advance(now);
+
+      uint64_t last_deadline = 0;
+      for (uint32_t fired_id : fired) {
+        ASSERT_TRUE(model.count(fired_id));
+        uint64_t deadline = model[fired_id];
+        ASSERT_LE(deadline / kTick, now / kTick);
+        ASSERT_LE(last_deadline / kTick, deadline / kTick);
+        last_deadline = deadline;
+        model.erase(fired_id);
+      }
+
+      for (const auto& id_and_deadline : model) {
+        ASSERT_GT(id_and_deadline.second / kTick, now / kTick);
+      }
+    }
+
+    ASSERT_EQ(model.size(), wheel_.size());
+  }
+}
+
+}  // namespace test
+}  // namespace flowparser
@@ -0,0 +1,101 @@
+#include "traffic_sketch.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace flowparser {
+
+constexpr size_t CountMin::kDepth;
+
+// Checks the width before the cells are allocated.
+static size_t CheckWidth(size_t width) {
+  if (width == 0) {
+    throw std::logic_error("CountMin cannot have 0 cells");
+  }
+
+  return width;
+}
+
+CountMin::CountMin(size_t width)
+    : width_(CheckWidth(width)),
+      cells_(kDepth * width) {
+}
+
+TrafficCounts CountMin::Estimate(uint64_t hash) const {
+  TrafficCounts estimate = cells_[CellIndex(0, hash)];
+  for (size_t row = 1; row < kDepth; ++row) {
+    const TrafficCounts& cell = cells_[CellIndex(row, hash)];
+    estimate.pkts = std::min(estimate.pkts, cell.pkts);
+    estimate.bytes = std::min(estimate.bytes, cell.bytes);
+  }
+
+  return estimate;
+}
+
+void CountMin::Merge(const CountMin& other) {
+  if (other.width_ != width_) {
+    throw std::logic_error("Cannot merge CountMins of different widths");
+  }
+
+  for (size_t i = 0; i < cells_.size(); ++i) {
+    cells_[i].Add(other.cells_[i]);
+  }
+}
+
+void CountMin::Clear() {
+  std::fill(cells_.begin(), cells_.end(), TrafficCounts());
+}
+
+TrafficSketch::TrafficSketch(size_t flows_width)
+    : protocols_(1 << 8),
+      tcp_ports_(1 << 16),
+      udp_ports_(1 << 16),
+      flows_(flows_width) {
+}
+
+std::vector<PortCounts> TrafficSketch::TopPorts(bool tcp, size_t k) const {
+  const std::vector<TrafficCounts>& ports = tcp ? tcp_ports_ : udp_ports_;
+  std::vector<PortCounts> top;
+  for (size_t port = 0; port < ports.size(); ++port) {
+    if (ports[port].pkts != 0) {
+      top.push_back({static_cast<uint16_t>(port), ports[port]});
+    }
+  }
+
+  auto more_bytes = [](const PortCounts& a, const PortCounts& b) {
+    return a.counts.bytes > b.counts.bytes
+        || (a.counts.bytes == b.counts.bytes && a.port < b.port);
+  };
+
+  if (top.size() > k) {
+    std::partial_sort(top.begin(), top.begin() + k, top.end(), more_bytes);
+    top.resize(k);
+  } else {
+    std::sort(top.begin(), top.end(), more_bytes);
+  }
+
+  return top;
+}
+
+void TrafficSketch::Merge(const TrafficSketch& other) {
+  flows_.Merge(other.flows_);
+  total_.Add(other.total_);
+  for (size_t i = 0; i < protocols_.size(); ++i) {
+    protocols_[i].Add(other.protocols_[i]);
+  }
+
+  for (size_t i = 0; i < tcp_ports_.size(); ++i) {
+    tcp_ports_[i].Add(other.tcp_ports_[i]);
+    udp_ports_[i].Add(other.udp_ports_[i]);
+  }
+}
+
+void TrafficSketch::Clear() {
+  total_ = TrafficCounts();
+  std::fill(protocols_.begin(), protocols_.end(), TrafficCounts());
+  std::fill(tcp_ports_.begin(), tcp_ports_.end(), TrafficCounts());
+  std::fill(udp_ports_.begin(), udp_ports_.end(), TrafficCounts());
+  flows_.Clear();
+}
+
+}  // namespace flowparser
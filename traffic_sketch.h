@@ -0,0 +1,160 @@
+// Packet and byte counts of traffic by protocol, port and flow, in fixed
+// memory, for when there are too many packets to track flows.
+
+#ifndef FLOWPARSER_TRAFFIC_SKETCH_H
+#define FLOWPARSER_TRAFFIC_SKETCH_H
+
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+#include "flows.h"
+
+namespace flowparser {
+
+struct TrafficCounts {
+  uint64_t pkts = 0;
+  uint64_t bytes = 0;
+
+  void Add(uint64_t bytes_to_add) {
+    ++pkts;
+    bytes += bytes_to_add;
+  }
+
+  void Add(const TrafficCounts& other) {
+    pkts += other.pkts;
+    bytes += other.bytes;
+  }
+};
+
+// The counts of a destination port.
+struct PortCounts {
+  uint16_t port;
+  TrafficCounts counts;
+};
+
+// A Count-Min sketch of packets and bytes by 64 bit hash: depth rows of width
+// cells. A hash adds to one cell of each row, and its counts are estimated as
+// the smallest of its cells -- never below the real ones, and above them by at
+// most e / width of the total with probability 1 - e^-depth. Sketches of the
+// same width can be merged. Not thread-safe.
+class CountMin {
+ public:
+  static constexpr size_t kDepth = 4;
+
+  // Throws if width is 0.
+  explicit CountMin(size_t width);
+
+  // Hashes should be well mixed, all their bits are used.
+  void Add(uint64_t hash, uint64_t bytes) {
+    for (size_t row = 0; row < kDepth; ++row) {
+      cells_[CellIndex(row, hash)].Add(bytes);
+    }
+  }
+
+  TrafficCounts Estimate(uint64_t hash) const;
+
+  // Adds the counts of another sketch. Throws if the widths differ.
+  void Merge(const CountMin& other);
+
+  void Clear();
+
+  size_t width() const {
+    return width_;
+  }
+
+  // Memory allocated for the cells.
+  size_t SizeBytes() const {
+    return HeapBlockSize(cells_.size() * sizeof(TrafficCounts));
+  }
+
+ private:
+  size_t CellIndex(size_t row, uint64_t hash) const {
+    uint64_t row_hash = Mix64(hash + row) >> 32;
+    return row * width_ + ((row_hash * width_) >> 32);
+  }
+
+  size_t width_;
+  std::vector<TrafficCounts> cells_;
+};
+
+// Counts of all packets, of the packets of each IP protocol, of the TCP and UDP
+// packets to each destination port, and a CountMin of the packets of each
+// flow. Counts are of ip_len bytes. The port counters take 2MB, the CountMin
+// 64 bytes per unit of width. Not thread-safe.
+class TrafficSketch {
+ public:
+  // Throws if flows_width is 0.
+  explicit TrafficSketch(size_t flows_width);
+
+  void Add(const FlowKey& key, uint16_t ip_len) {
+    total_.Add(ip_len);
+    protocols_[key.protocol()].Add(ip_len);
+    if (key.protocol() == IPPROTO_TCP) {
+      tcp_ports_[key.dst_port()].Add(ip_len);
+    } else if (key.protocol() == IPPROTO_UDP) {
+      udp_ports_[key.dst_port()].Add(ip_len);
+    }
+
+    flows_.Add(key.hash64(), ip_len);
+  }
+
+  const TrafficCounts& total() const {
+    return total_;
+  }
+
+  const TrafficCounts& protocol(uint8_t protocol) const {
+    return protocols_[protocol];
+  }
+
+  // Counts of TCP or UDP packets to a destination port.
+  const TrafficCounts& tcp_port(uint16_t port) const {
+    return tcp_ports_[port];
+  }
+
+  const TrafficCounts& udp_port(uint16_t port) const {
+    return udp_ports_[port];
+  }
+
+  // The k destination ports of TCP (or, if tcp is false, UDP) packets with the
+  // most bytes, most first.
+  std::vector<PortCounts> TopPorts(bool tcp, size_t k) const;
+
+  // The estimated counts of a flow, at least its real ones.
+  TrafficCounts EstimateFlow(const FlowKey& key) const {
+    return flows_.Estimate(key.hash64());
+  }
+
+  const CountMin& flows() const {
+    return flows_;
+  }
+
+  // Adds the counts of another sketch. Throws if the widths of their
+  // CountMins differ.
+  void Merge(const TrafficSketch& other);
+
+  void Clear();
+
+  size_t SizeBytes() const {
+    return HeapBlockSize(protocols_.size() * sizeof(TrafficCounts))
+        + HeapBlockSize(tcp_ports_.size() * sizeof(TrafficCounts))
+        + HeapBlockSize(udp_ports_.size() * sizeof(TrafficCounts))
+        + flows_.SizeBytes();
+  }
+
+ private:
+  TrafficCounts total_;
+
+  // By protocol.
+  std::vector<TrafficCounts> protocols_;
+
+  // By destination port.
+  std::vector<TrafficCounts> tcp_ports_;
+  std::vector<TrafficCounts> udp_ports_;
+
+  CountMin flows_;
+};
+
+}  // namespace flowparser
+
+#endif  /* FLOWPARSER_TRAFFIC_SKETCH_H */
@@ -0,0 +1,137 @@
+#include "gtest/gtest.h"
+
+#include <cstring>
+#include <map>
+#include <random>
+
+#include "traffic_sketch.h"
+
+namespace flowparser {
+namespace test {
+
+// A flow key of a protocol, different for each id.
+static FlowKey Key(uint32_t id, uint8_t protocol = IPPROTO_TCP,
+                   uint16_t dst_port = 80) {
+  pcap::SniffIp ip_header;
+  memset(&ip_header, 0, sizeof(ip_header));
+  ip_header.ip_p = protocol;
+  ip_header.ip_src.s_addr = htonl(id);
+  ip_header.ip_dst.s_addr = htonl(1);
+  return FlowKey(ip_header, htons(1000), htons(dst_port));
+}
+
+TEST(CountMin, Init) {
+  ASSERT_THROW(CountMin(0), std::logic_error);
+
+  CountMin count_min(100);
+  ASSERT_EQ(100, count_min.width());
+  ASSERT_EQ(0, count_min.Estimate(Mix64(1)).pkts);
+  ASSERT_LE(CountMin::kDepth * 100 * sizeof(TrafficCounts),
+            count_min.SizeBytes());
+}
+
+TEST(CountMin, Estimate) {
+  // Many more hashes than cells.
+  CountMin count_min(1000);
+  std::mt19937 rnd(1);
+  std::map<uint64_t, TrafficCounts> counts;
+  uint64_t total_bytes = 0;
+  for (size_t i = 0; i < 200000; ++i) {
+    uint64_t id = i % 2 == 0 ? rnd() % 10 : rnd() % 100000;
+    uint64_t bytes = 40 + rnd() % 1460;
+    count_min.Add(Mix64(id), bytes);
+    counts[id].Add(bytes);
+    total_bytes += bytes;
+  }
+
+  for (const auto& id_and_counts : counts) {
+    TrafficCounts estimate = count_min.Estimate(Mix64(id_and_counts.first));
+    ASSERT_LE(id_and_counts.second.pkts, estimate.pkts);
+    ASSERT_LE(id_and_counts.second.bytes, estimate.bytes);
+  }
+
+  // The large ones are close.
+  for (uint64_t id = 0; id < 10; ++id) {
+    ASSERT_NEAR(counts[id].bytes, count_min.Estimate(Mix64(id)).bytes,
+                total_bytes / 100);
+  }
+}
+
+TEST(CountMin, Merge) {
+  CountMin first(100);
+  CountMin second(100);
+  first.Add(Mix64(1), 100);
+  second.Add(Mix64(1), 50);
+  second.Add(Mix64(2), 10);
+
+  first.Merge(second);
+  ASSERT_EQ(2, first.Estimate(Mix64(1)).pkts);
+  ASSERT_EQ(150, first.Estimate(Mix64(1)).bytes);
+  ASSERT_EQ(10, first.Estimate(Mix64(2)).bytes);
+  ASSERT_THROW(first.Merge(CountMin(10)), std::logic_error);
+
+  first.Clear();
+  ASSERT_EQ(0, first.Estimate(Mix64(1)).pkts);
+}
+
+TEST(TrafficSketch, Counts) {
+  TrafficSketch sketch(1000);
+  for (uint32_t i = 0; i < 10; ++i) {
+    sketch.Add(Key(i, IPPROTO_TCP, 80), 100);
+  }
+
+  for (uint32_t i = 0; i < 5; ++i) {
+    sketch.Add(Key(i, IPPROTO_TCP, 443), 1000);
+    sketch.Add(Key(i, IPPROTO_UDP, 53), 60);
+  }
+
+  sketch.Add(Key(1, IPPROTO_ICMP, 0), 84);
+
+  ASSERT_EQ(21, sketch.total().pkts);
+  ASSERT_EQ(1000 + 5000 + 300 + 84, sketch.total().bytes);
+  ASSERT_EQ(15, sketch.protocol(IPPROTO_TCP).pkts);
+  ASSERT_EQ(6000, sketch.protocol(IPPROTO_TCP).bytes);
+  ASSERT_EQ(5, sketch.protocol(IPPROTO_UDP).pkts);
+  ASSERT_EQ(1, sketch.protocol(IPPROTO_ICMP).pkts);
+  ASSERT_EQ(10, sketch.tcp_port(80).pkts);
+  ASSERT_EQ(0, sketch.tcp_port(53).pkts);
+  ASSERT_EQ(300, sketch.udp_port(53).bytes);
+
+  std::vector<PortCounts> top = sketch.TopPorts(true, 1);
+  ASSERT_EQ(1, top.size());
+  ASSERT_EQ(443, top[0].port);
+  ASSERT_EQ(5000, top[0].counts.bytes);
+  top = sketch.TopPorts(true, 10);
+  ASSERT_EQ(2, top.size());
+  ASSERT_EQ(80, top[1].port);
+
+  // Few flows, so the estimates are exact.
+  ASSERT_EQ(1, sketch.EstimateFlow(Key(1, IPPROTO_TCP, 443)).pkts);
+  ASSERT_EQ(1000, sketch.EstimateFlow(Key(1, IPPROTO_TCP, 443)).bytes);
+  ASSERT_EQ(0, sketch.EstimateFlow(Key(1, IPPROTO_UDP, 443)).pkts);
+}
+
+TEST(TrafficSketch, Merge) {
+  TrafficSketch first(100);
+  TrafficSketch second(100);
+  first.Add(Key(1), 100);
+  second.Add(Key(1), 100);
+  second.Add(Key(2, IPPROTO_UDP, 53), 60);
+
+  first.Merge(second);
+  ASSERT_EQ(3, first.total().pkts);
+  ASSERT_EQ(2, first.tcp_port(80).pkts);
+  ASSERT_EQ(1, first.udp_port(53).pkts);
+  ASSERT_EQ(200, first.EstimateFlow(Key(1)).bytes);
+  ASSERT_THROW(first.Merge(TrafficSketch(10)), std::logic_error);
+
+  size_t size_bytes = first.SizeBytes();
+  first.Clear();
+  ASSERT_EQ(0, first.total().pkts);
+  ASSERT_EQ(0, first.tcp_port(80).pkts);
+  ASSERT_EQ(0, first.EstimateFlow(Key(1)).pkts);
+  ASSERT_EQ(size_bytes, first.SizeBytes());
+}
+
+}  // namespace test
+}  // namespace flowparser